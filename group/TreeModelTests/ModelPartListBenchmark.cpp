@@ -0,0 +1,191 @@
+/**		@file ModelPartListBenchmark.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Times importing parts into a ModelPartList.
+  *
+  *		Each case adds 1000 to 100000 parts to an empty tree, with a sorting proxy
+  *		model attached to stand in for a view (like a view, it keeps a mapping of
+  *		every row and has to rebuild it when told the layout has changed). If
+  *		import is linear the time per part stays about the same as the number of
+  *		parts goes up:
+  *
+  *			ModelPartListBenchmark
+  *			ModelPartListBenchmark appendChildren
+  *
+  *		The "layoutChanged" case adds parts the way appendChild() used to, with a
+  *		layout change after every part, for comparison. It is quadratic so only
+  *		goes up to 10000 parts.
+  *
+  *		P Evans 2022
+  */
+
+#include "ModelPartList.h"
+#include "ModelPart.h"
+
+/* Qt headers */
+#include <QtTest>
+#include <QElapsedTimer>
+#include <QSortFilterProxyModel>
+
+/* Standard headers */
+#include <algorithm>
+
+
+class ModelPartListBenchmark : public QObject {
+	Q_OBJECT
+
+private slots:
+	void appendChild_data();
+	void appendChild();
+
+	void appendChildLayoutChanged_data();
+	void appendChildLayoutChanged();
+
+	void appendChildren_data();
+	void appendChildren();
+
+	void appendSubtree_data();
+	void appendSubtree();
+
+private:
+	/* Attach the stand-in view and have it map the (empty) top level */
+	void attach( QSortFilterProxyModel& view, ModelPartList& list );
+
+	/* Record the time taken and print it per part */
+	void report( const QElapsedTimer& timer, int parts );
+};
+
+
+static QList<QVariant> partData( int i ) {
+	return { QString("Part %1").arg(i), QString("true") };
+}
+
+
+static void addSizes( int largest ) {
+	QTest::addColumn<int>("parts");
+	for (int parts = 1000; parts <= largest; parts *= 10)
+		QTest::newRow(qPrintable(QString::number(parts))) << parts;
+}
+
+
+void ModelPartListBenchmark::attach( QSortFilterProxyModel& view, ModelPartList& list ) {
+	view.setSourceModel(&list);
+	view.sort(0);
+	QCOMPARE( view.rowCount(), 0 );
+}
+
+
+void ModelPartListBenchmark::report( const QElapsedTimer& timer, int parts ) {
+	qint64 ns = timer.nsecsElapsed();
+	QTest::setBenchmarkResult( ns / 1e6, QTest::WalltimeMilliseconds );
+	qInfo( "%6d parts: %8.1f ms, %6.2f us per part", parts, ns / 1e6, ns / 1e3 / parts );
+}
+
+
+void ModelPartListBenchmark::appendChild_data() {
+	addSizes(100000);
+}
+
+
+void ModelPartListBenchmark::appendChild() {
+	QFETCH(int, parts);
+	ModelPartList list("PartsList");
+	QSortFilterProxyModel view;
+	attach(view, list);
+
+	QModelIndex root;
+	QElapsedTimer timer;
+	timer.start();
+	for (int i = 0; i < parts; i++)
+		list.appendChild(root, partData(i));
+	report(timer, parts);
+
+	QCOMPARE( view.rowCount(), parts );
+}
+
+
+void ModelPartListBenchmark::appendChildLayoutChanged_data() {
+	addSizes(10000);
+}
+
+
+void ModelPartListBenchmark::appendChildLayoutChanged() {
+	QFETCH(int, parts);
+	ModelPartList list("PartsList");
+	QSortFilterProxyModel view;
+	attach(view, list);
+
+	QModelIndex root;
+	QElapsedTimer timer;
+	timer.start();
+	for (int i = 0; i < parts; i++) {
+		emit list.layoutAboutToBeChanged();
+		list.appendChild(root, partData(i));
+		emit list.layoutChanged();
+	}
+	report(timer, parts);
+
+	QCOMPARE( view.rowCount(), parts );
+}
+
+
+void ModelPartListBenchmark::appendChildren_data() {
+	addSizes(100000);
+}
+
+
+void ModelPartListBenchmark::appendChildren() {
+	QFETCH(int, parts);
+	ModelPartList list("PartsList");
+	QSortFilterProxyModel view;
+	attach(view, list);
+
+	/* In batches, as the loader adds them */
+	const int batch = 500;
+	QElapsedTimer timer;
+	timer.start();
+	for (int first = 0; first < parts; first += batch) {
+		QList<QList<QVariant>> rows;
+		for (int i = first; i < std::min(first + batch, parts); i++)
+			rows.append( partData(i) );
+		list.appendChildren(QModelIndex(), rows);
+	}
+	report(timer, parts);
+
+	QCOMPARE( view.rowCount(), parts );
+}
+
+
+void ModelPartListBenchmark::appendSubtree_data() {
+	addSizes(100000);
+}
+
+
+void ModelPartListBenchmark::appendSubtree() {
+	QFETCH(int, parts);
+	ModelPartList list("PartsList");
+	QSortFilterProxyModel view;
+	attach(view, list);
+
+	/* An assembly of sub-assemblies of 100 parts each, built and then added in one go */
+	QElapsedTimer timer;
+	timer.start();
+	ModelPart* assembly = list.newPart( partData(-1) );
+	for (int first = 0; first < parts; first += 100) {
+		ModelPart* sub = list.newPart( partData(first) );
+		for (int i = first; i < std::min(first + 100, parts); i++)
+			sub->appendChild( list.newPart(partData(i)) );
+		assembly->appendChild(sub);
+	}
+	QModelIndex top = list.appendSubtree(QModelIndex(), assembly);
+	report(timer, parts);
+
+	QCOMPARE( view.rowCount(), 1 );
+	QCOMPARE( list.rowCount(top), (parts + 99) / 100 );
+}
+
+
+QTEST_GUILESS_MAIN(ModelPartListBenchmark)
+
+#include "ModelPartListBenchmark.moc"
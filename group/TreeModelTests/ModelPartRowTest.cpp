@@ -0,0 +1,307 @@
+/**		@file ModelPartRowTest.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Checks that the row each ModelPart stores (so row() and parent() don't
+  *		have to search the parent's list) is still right after the tree is edited,
+  *		both directly on ModelPart and through ModelPartList.
+  *
+  *		P Evans 2022
+  */
+
+#include "ModelPartList.h"
+#include "ModelPart.h"
+
+/* Qt headers */
+#include <QtTest>
+
+
+class ModelPartRowTest : public QObject {
+	Q_OBJECT
+
+private slots:
+	void appendChildren();
+	void insertChild_data();
+	void insertChild();
+	void insertChildren();
+	void takeChildren_data();
+	void takeChildren();
+	void moveChildren_data();
+	void moveChildren();
+
+	void removeRows_data();
+	void removeRows();
+	void moveRowsWithinParent_data();
+	void moveRowsWithinParent();
+	void moveRowsBetweenParents();
+	void moveRowsKeepsPendingState();
+
+private:
+	/* Check every child of parent reports its position and parent, and the
+	 * children are in the expected order (by name)
+	 */
+	void checkRows( ModelPart* parent, const QStringList& expected );
+
+	/* As checkRows(), also checking the indexes the model gives for them */
+	void checkModelRows( ModelPartList& list, const QModelIndex& parent, const QStringList& expected );
+};
+
+
+/* A part named n, with children named "0" to "count-1" */
+static ModelPart* makeParent( int count, const QString& n = QString("parent") ) {
+	ModelPart* parent = new ModelPart( { n, QString("true") } );
+	for (int i = 0; i < count; i++)
+		parent->appendChild( new ModelPart({ QString::number(i), QString("true") }) );
+	return parent;
+}
+
+
+/* "0" to "count-1" */
+static QStringList names( int count ) {
+	QStringList n;
+	for (int i = 0; i < count; i++)
+		n << QString::number(i);
+	return n;
+}
+
+
+void ModelPartRowTest::checkRows( ModelPart* parent, const QStringList& expected ) {
+	QCOMPARE( parent->childCount(), expected.size() );
+	for (int i = 0; i < parent->childCount(); i++) {
+		ModelPart* c = parent->child(i);
+		QCOMPARE( c->name(), expected[i] );
+		QCOMPARE( c->row(), i );
+		QCOMPARE( c->parentItem(), parent );
+	}
+}
+
+
+void ModelPartRowTest::checkModelRows( ModelPartList& list, const QModelIndex& parent, const QStringList& expected ) {
+	ModelPart* parentPart = parent.isValid() ? static_cast<ModelPart*>(parent.internalPointer()) : list.getRootItem();
+	checkRows(parentPart, expected);
+
+	QCOMPARE( list.rowCount(parent), expected.size() );
+	for (int i = 0; i < expected.size(); i++) {
+		QModelIndex index = list.index(i, 0, parent);
+		QCOMPARE( index.row(), i );
+		QCOMPARE( index.data().toString(), expected[i] );
+
+		/* parent() makes its index from the parent's stored row */
+		QCOMPARE( list.parent(index), parent );
+	}
+}
+
+
+void ModelPartRowTest::appendChildren() {
+	ModelPart* parent = makeParent(3);
+	QList<ModelPart*> more;
+	for (int i = 3; i < 6; i++)
+		more << new ModelPart({ QString::number(i), QString("true") });
+	parent->appendChildren(more);
+
+	checkRows(parent, names(6));
+	ModelPart::destroy(parent);
+}
+
+
+void ModelPartRowTest::insertChild_data() {
+	QTest::addColumn<int>("row");
+	QTest::addColumn<QStringList>("expected");
+
+	QTest::newRow("first")  << 0 << (QStringList() << "new" << "0" << "1" << "2" << "3");
+	QTest::newRow("middle") << 2 << (QStringList() << "0" << "1" << "new" << "2" << "3");
+	QTest::newRow("last")   << 3 << (QStringList() << "0" << "1" << "2" << "new" << "3");
+	QTest::newRow("end")    << 4 << (QStringList() << "0" << "1" << "2" << "3" << "new");
+}
+
+
+void ModelPartRowTest::insertChild() {
+	QFETCH(int, row);
+	QFETCH(QStringList, expected);
+
+	ModelPart* parent = makeParent(4);
+	parent->insertChild( row, new ModelPart({ QString("new"), QString("true") }) );
+
+	checkRows(parent, expected);
+	ModelPart::destroy(parent);
+}
+
+
+void ModelPartRowTest::insertChildren() {
+	ModelPart* parent = makeParent(4);
+	parent->insertChildren( 1, QList<ModelPart*>()
+		<< new ModelPart({ QString("a"), QString("true") })
+		<< new ModelPart({ QString("b"), QString("true") }) );
+
+	checkRows(parent, QStringList() << "0" << "a" << "b" << "1" << "2" << "3");
+	ModelPart::destroy(parent);
+}
+
+
+void ModelPartRowTest::takeChildren_data() {
+	QTest::addColumn<int>("row");
+	QTest::addColumn<int>("count");
+	QTest::addColumn<QStringList>("expected");
+
+	QTest::newRow("first")  << 0 << 1 << (QStringList() << "1" << "2" << "3" << "4");
+	QTest::newRow("middle") << 1 << 3 << (QStringList() << "0" << "4");
+	QTest::newRow("last")   << 4 << 1 << (QStringList() << "0" << "1" << "2" << "3");
+	QTest::newRow("all")    << 0 << 5 << QStringList();
+}
+
+
+void ModelPartRowTest::takeChildren() {
+	QFETCH(int, row);
+	QFETCH(int, count);
+	QFETCH(QStringList, expected);
+
+	ModelPart* parent = makeParent(5);
+	QList<ModelPart*> taken = parent->takeChildren(row, count);
+
+	QCOMPARE( taken.size(), count );
+	for (int i = 0; i < taken.size(); i++) {
+		QCOMPARE( taken[i]->name(), QString::number(row + i) );
+		QCOMPARE( taken[i]->parentItem(), static_cast<ModelPart*>(nullptr) );
+		QCOMPARE( taken[i]->row(), 0 );
+		ModelPart::destroy(taken[i]);
+	}
+
+	checkRows(parent, expected);
+	ModelPart::destroy(parent);
+}
+
+
+void ModelPartRowTest::moveChildren_data() {
+	QTest::addColumn<int>("row");
+	QTest::addColumn<int>("count");
+	QTest::addColumn<int>("destination");
+	QTest::addColumn<QStringList>("expected");
+
+	/* Destination is counted before the move, as QAbstractItemModel::beginMoveRows() */
+	QTest::newRow("first to end")      << 0 << 1 << 5 << (QStringList() << "1" << "2" << "3" << "4" << "0");
+	QTest::newRow("last to front")     << 4 << 1 << 0 << (QStringList() << "4" << "0" << "1" << "2" << "3");
+	QTest::newRow("down one")          << 1 << 1 << 3 << (QStringList() << "0" << "2" << "1" << "3" << "4");
+	QTest::newRow("up one")            << 2 << 1 << 1 << (QStringList() << "0" << "2" << "1" << "3" << "4");
+	QTest::newRow("block down")        << 0 << 2 << 4 << (QStringList() << "2" << "3" << "0" << "1" << "4");
+	QTest::newRow("block up")          << 3 << 2 << 1 << (QStringList() << "0" << "3" << "4" << "1" << "2");
+	QTest::newRow("onto itself")       << 1 << 2 << 2 << names(5);
+	QTest::newRow("just after itself") << 1 << 2 << 3 << names(5);
+}
+
+
+void ModelPartRowTest::moveChildren() {
+	QFETCH(int, row);
+	QFETCH(int, count);
+	QFETCH(int, destination);
+	QFETCH(QStringList, expected);
+
+	ModelPart* parent = makeParent(5);
+	parent->moveChildren(row, count, destination);
+
+	checkRows(parent, expected);
+	ModelPart::destroy(parent);
+}
+
+
+void ModelPartRowTest::removeRows_data() {
+	takeChildren_data();
+}
+
+
+void ModelPartRowTest::removeRows() {
+	QFETCH(int, row);
+	QFETCH(int, count);
+	QFETCH(QStringList, expected);
+
+	/* A level down, where parent() is used */
+	ModelPartList list("PartsList");
+	QModelIndex parent = list.appendSubtree( QModelIndex(), makeParent(5) );
+	QVERIFY( list.removeRows(row, count, parent) );
+	checkModelRows(list, parent, expected);
+
+	/* At the top level */
+	ModelPartList topList("PartsList");
+	QList<QList<QVariant>> top;
+	for (const QString& n : names(5))
+		top << QList<QVariant>{ n, QString("true") };
+	topList.appendChildren( QModelIndex(), top );
+	QVERIFY( topList.removeRows(row, count, QModelIndex()) );
+	checkModelRows(topList, QModelIndex(), expected);
+}
+
+
+void ModelPartRowTest::moveRowsWithinParent_data() {
+	moveChildren_data();
+}
+
+
+void ModelPartRowTest::moveRowsWithinParent() {
+	QFETCH(int, row);
+	QFETCH(int, count);
+	QFETCH(int, destination);
+	QFETCH(QStringList, expected);
+
+	ModelPartList list("PartsList");
+	QModelIndex parent = list.appendSubtree( QModelIndex(), makeParent(5) );
+
+	/* Moves that change nothing are refused, the rows stay as they are */
+	bool changes = (expected != names(5));
+	QCOMPARE( list.moveRows(parent, row, count, parent, destination), changes );
+	checkModelRows(list, parent, expected);
+}
+
+
+void ModelPartRowTest::moveRowsBetweenParents() {
+	ModelPartList list("PartsList");
+	QModelIndex a = list.appendSubtree( QModelIndex(), makeParent(4, "a") );
+	QModelIndex b = list.appendSubtree( QModelIndex(), makeParent(3, "b") );
+
+	/* Middle of a to the front of b */
+	QVERIFY( list.moveRows(a, 1, 2, b, 0) );
+	checkModelRows(list, a, QStringList() << "0" << "3");
+	checkModelRows(list, b, QStringList() << "1" << "2" << "0" << "1" << "2");
+
+	/* Last of b to the end of a */
+	QVERIFY( list.moveRows(b, 4, 1, a, 2) );
+	checkModelRows(list, a, QStringList() << "0" << "3" << "2");
+	checkModelRows(list, b, QStringList() << "1" << "2" << "0" << "1");
+
+	/* First of b to the front of a */
+	QVERIFY( list.moveRows(b, 0, 1, a, 0) );
+	checkModelRows(list, a, QStringList() << "1" << "0" << "3" << "2");
+	checkModelRows(list, b, QStringList() << "2" << "0" << "1");
+
+	/* A whole branch, with its children, to the top level in front of a */
+	QVERIFY( list.moveRows(QModelIndex(), 1, 1, QModelIndex(), 0) );
+	checkModelRows(list, QModelIndex(), QStringList() << "b" << "a");
+	checkModelRows(list, list.index(0, 0, QModelIndex()), QStringList() << "2" << "0" << "1");
+	checkModelRows(list, list.index(1, 0, QModelIndex()), QStringList() << "1" << "0" << "3" << "2");
+
+	/* A part can't be moved into itself */
+	QModelIndex top = list.index(0, 0, QModelIndex());
+	QVERIFY( !list.moveRows(QModelIndex(), 0, 1, top, 0) );
+}
+
+
+void ModelPartRowTest::moveRowsKeepsPendingState() {
+	ModelPartList list("PartsList");
+	QModelIndex a = list.appendSubtree( QModelIndex(), makeParent(2, "a") );
+	QModelIndex b = list.appendSubtree( QModelIndex(), makeParent(2, "b") );
+	list.syncState();
+
+	/* Change a part, then move it to a branch that has nothing waiting to be synced */
+	ModelPart* moved = static_cast<ModelPart*>( list.index(1, 0, a).internalPointer() );
+	moved->setColour(10, 20, 30);
+	QVERIFY( list.moveRows(a, 1, 1, b, 0) );
+
+	/* The sync must still find it under its new parent */
+	QList<ModelPart*> changed = list.syncState();
+	QCOMPARE( changed.size(), 1 );
+	QCOMPARE( changed.first(), moved );
+	QVERIFY( !moved->stateDirty() );
+}
+
+
+QTEST_GUILESS_MAIN(ModelPartRowTest)
+
+#include "ModelPartRowTest.moc"
@@ -0,0 +1,413 @@
+/**		@file PartBVHTest.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Checks picking, box queries and nearest part searches through the
+  *		spatial index (PartBVH, MeshBVH and SceneBVH) against testing every
+  *		triangle and every part one by one, before and after parts are moved.
+  *
+  *		P Evans 2022
+  */
+
+#include "ModelPartList.h"
+#include "ModelPart.h"
+#include "BVH.h"
+
+/* Qt headers */
+#include <QtTest>
+#include <QRandomGenerator>
+
+/* Vtk headers */
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+#include <vtkCellArray.h>
+#include <vtkIdList.h>
+#include <vtkMatrix4x4.h>
+#include <vtkTransform.h>
+#include <vtkSphereSource.h>
+#include <vtkCubeSource.h>
+
+/* Standard headers */
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+class PartBVHTest : public QObject {
+	Q_OBJECT
+
+private slots:
+	void init();
+
+	void quadsSplitIntoTriangles();
+	void pick();
+	void partsInBox();
+	void nearestPart();
+	void refitAfterMove();
+
+private:
+	/* Ten assemblies of twenty parts, each part a sphere or a cube (made of
+	 * squares, so picking has to split them into triangles), all randomly placed
+	 */
+	void makeScene( ModelPartList& list );
+
+	/* Move every other assembly, and a few parts inside the others */
+	void moveParts( ModelPartList& list );
+
+	/* Compare the index with brute force */
+	void checkPicks( ModelPartList& list );
+	void checkBoxes( ModelPartList& list );
+	void checkNearest( ModelPartList& list );
+
+	QRandomGenerator						m_random;
+	vtkSmartPointer<vtkPolyData>			m_sphere;
+	vtkSmartPointer<vtkPolyData>			m_cube;
+};
+
+
+/* ------------------------------------------------------------------------------
+ * Brute force
+ * ------------------------------------------------------------------------------ */
+
+/* Every part with geometry, depth first */
+static void collectParts( ModelPart* part, QList<ModelPart*>& parts ) {
+	if (part->hasGeometry())
+		parts.append(part);
+	for (int i = 0; i < part->childCount(); i++)
+		collectParts( part->child(i), parts );
+}
+
+
+/* Möller-Trumbore, written out again so the test doesn't share the code it checks */
+static double rayTriangle( const double a[3], const double b[3], const double c[3], const double o[3], const double d[3] ) {
+	double e1[3], e2[3];
+	for (int j = 0; j < 3; j++) {
+		e1[j] = b[j] - a[j];
+		e2[j] = c[j] - a[j];
+	}
+	double p[3] = { d[1]*e2[2] - d[2]*e2[1], d[2]*e2[0] - d[0]*e2[2], d[0]*e2[1] - d[1]*e2[0] };
+	double det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+	if (det == 0.)
+		return -1.;
+
+	double s[3] = { o[0] - a[0], o[1] - a[1], o[2] - a[2] };
+	double u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) / det;
+	if (u < 0. || u > 1.)
+		return -1.;
+
+	double q[3] = { s[1]*e1[2] - s[2]*e1[1], s[2]*e1[0] - s[0]*e1[2], s[0]*e1[1] - s[1]*e1[0] };
+	double v = (d[0]*q[0] + d[1]*q[1] + d[2]*q[2]) / det;
+	if (v < 0. || u + v > 1.)
+		return -1.;
+
+	return (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) / det;
+}
+
+
+/* Closest hit of a ray (in the mesh's coordinates) on any triangle of a mesh, negative if none */
+static double rayMesh( vtkPolyData* mesh, const double o[3], const double d[3] ) {
+	double best = -1.;
+	vtkCellArray* polys = mesh->GetPolys();
+	vtkSmartPointer<vtkIdList> ids = vtkSmartPointer<vtkIdList>::New();
+	for (vtkIdType c = 0; c < polys->GetNumberOfCells(); c++) {
+		polys->GetCellAtId(c, ids);
+		double a[3], b[3], e[3];
+		mesh->GetPoint(ids->GetId(0), a);
+		for (vtkIdType i = 1; i + 1 < ids->GetNumberOfIds(); i++) {
+			mesh->GetPoint(ids->GetId(i), b);
+			mesh->GetPoint(ids->GetId(i+1), e);
+			double t = rayTriangle(a, b, e, o, d);
+			if (t >= 0. && (best < 0. || t < best))
+				best = t;
+		}
+	}
+	return best;
+}
+
+
+/* Closest part a world ray hits, testing every triangle of every part */
+static ModelPart* brutePick( const QList<ModelPart*>& parts, const double o[3], const double d[3], double& distance ) {
+	ModelPart* found = nullptr;
+	distance = std::numeric_limits<double>::max();
+	for (ModelPart* part : parts) {
+		double toLocal[16];
+		vtkMatrix4x4::Invert( part->worldTransform()->GetData(), toLocal );
+		double wo[4] = { o[0], o[1], o[2], 1. }, wd[4] = { d[0], d[1], d[2], 0. };
+		double lo[4], ld[4];
+		vtkMatrix4x4::MultiplyPoint(toLocal, wo, lo);
+		vtkMatrix4x4::MultiplyPoint(toLocal, wd, ld);
+
+		double t = rayMesh( part->levelsOfDetail()[0], lo, ld );
+		if (t >= 0. && t < distance) {
+			distance = t;
+			found = part;
+		}
+	}
+	return found;
+}
+
+
+/* World bounding box of a part - the box around its transformed local box */
+static void worldBox( ModelPart* part, double box[6] ) {
+	double local[6];
+	part->levelsOfDetail()[0]->GetBounds(local);
+	for (int j = 0; j < 3; j++) {
+		box[2*j] = std::numeric_limits<double>::max();
+		box[2*j+1] = -std::numeric_limits<double>::max();
+	}
+	for (int c = 0; c < 8; c++) {
+		double p[4] = { local[(c & 1) ? 1 : 0], local[(c & 2) ? 3 : 2], local[(c & 4) ? 5 : 4], 1. };
+		double w[4];
+		vtkMatrix4x4::MultiplyPoint( part->worldTransform()->GetData(), p, w );
+		for (int j = 0; j < 3; j++) {
+			box[2*j] = std::min(box[2*j], w[j]);
+			box[2*j+1] = std::max(box[2*j+1], w[j]);
+		}
+	}
+}
+
+
+static double boxDistance( const double box[6], const double p[3] ) {
+	double d2 = 0.;
+	for (int j = 0; j < 3; j++) {
+		double d = std::max( { box[2*j] - p[j], 0., p[j] - box[2*j+1] } );
+		d2 += d * d;
+	}
+	return std::sqrt(d2);
+}
+
+
+/* ------------------------------------------------------------------------------
+ * Tests
+ * ------------------------------------------------------------------------------ */
+
+void PartBVHTest::init() {
+	/* The same scene and rays every run */
+	m_random.seed(2022);
+
+	vtkSmartPointer<vtkSphereSource> sphere = vtkSmartPointer<vtkSphereSource>::New();
+	sphere->SetRadius(1.);
+	sphere->SetThetaResolution(16);
+	sphere->SetPhiResolution(12);
+	sphere->Update();
+	m_sphere = sphere->GetOutput();
+
+	vtkSmartPointer<vtkCubeSource> cube = vtkSmartPointer<vtkCubeSource>::New();
+	cube->SetXLength(2.);
+	cube->SetYLength(1.);
+	cube->SetZLength(0.5);
+	cube->Update();
+	m_cube = cube->GetOutput();
+}
+
+
+static void randomTransform( QRandomGenerator& random, double spread, vtkMatrix4x4* m ) {
+	vtkSmartPointer<vtkTransform> t = vtkSmartPointer<vtkTransform>::New();
+	t->Translate( spread * (random.generateDouble() - 0.5), spread * (random.generateDouble() - 0.5), spread * (random.generateDouble() - 0.5) );
+	t->RotateWXYZ( 360. * random.generateDouble(), random.generateDouble() - 0.5, random.generateDouble() - 0.5, random.generateDouble() - 0.5 );
+	t->Scale( 0.5 + random.generateDouble(), 0.5 + random.generateDouble(), 0.5 + random.generateDouble() );
+	m->DeepCopy( t->GetMatrix() );
+}
+
+
+void PartBVHTest::makeScene( ModelPartList& list ) {
+	vtkSmartPointer<vtkMatrix4x4> m = vtkSmartPointer<vtkMatrix4x4>::New();
+	for (int a = 0; a < 10; a++) {
+		ModelPart* assembly = list.newPart( { QString("Assembly %1").arg(a), QString("true") } );
+		randomTransform(m_random, 40., m);
+		assembly->setLocalTransform(m);
+
+		for (int i = 0; i < 20; i++) {
+			ModelPart* part = list.newPart( { QString("Part %1").arg(i), QString("true") } );
+			part->setGeometry( (i % 3 == 0) ? m_cube : m_sphere );
+			randomTransform(m_random, 20., m);
+			part->setLocalTransform(m);
+			assembly->appendChild(part);
+		}
+		list.appendSubtree( QModelIndex(), assembly );
+	}
+}
+
+
+void PartBVHTest::moveParts( ModelPartList& list ) {
+	vtkSmartPointer<vtkMatrix4x4> m = vtkSmartPointer<vtkMatrix4x4>::New();
+	ModelPart* root = list.getRootItem();
+	for (int a = 0; a < root->childCount(); a++) {
+		ModelPart* assembly = root->child(a);
+		if (a % 2 == 0) {
+			randomTransform(m_random, 40., m);
+			assembly->setLocalTransform(m);
+		}
+		else {
+			randomTransform(m_random, 20., m);
+			assembly->child(a % assembly->childCount())->setLocalTransform(m);
+		}
+	}
+}
+
+
+void PartBVHTest::checkPicks( ModelPartList& list ) {
+	list.updateTransforms();
+	QList<ModelPart*> parts;
+	collectParts( list.getRootItem(), parts );
+
+	/* Rays from all around the scene towards points near a part, so most of
+	 * them hit something and some only just miss
+	 */
+	int hits = 0;
+	for (int r = 0; r < 500; r++) {
+		ModelPart* aim = parts[ m_random.bounded(parts.size()) ];
+		double o[3], d[3];
+		for (int j = 0; j < 3; j++) {
+			o[j] = 200. * (m_random.generateDouble() - 0.5);
+			double target = aim->worldTransform()->GetElement(j, 3) + 4. * (m_random.generateDouble() - 0.5);
+			d[j] = target - o[j];
+		}
+
+		double expectedDistance;
+		ModelPart* expected = brutePick(parts, o, d, expectedDistance);
+
+		double distance = -1., point[3];
+		ModelPart* picked = list.pick(o, d, &distance, point);
+		QCOMPARE( picked, expected );
+		if (expected) {
+			hits++;
+			QVERIFY( std::fabs(distance - expectedDistance) <= 1e-9 * (1. + expectedDistance) );
+			for (int j = 0; j < 3; j++)
+				QVERIFY( std::fabs(point[j] - (o[j] + distance * d[j])) <= 1e-6 * (1. + std::fabs(point[j])) );
+		}
+	}
+
+	/* Make sure the rays actually tested something */
+	QVERIFY( hits > 100 );
+}
+
+
+void PartBVHTest::checkBoxes( ModelPartList& list ) {
+	list.updateTransforms();
+	QList<ModelPart*> parts;
+	collectParts( list.getRootItem(), parts );
+
+	for (int q = 0; q < 100; q++) {
+		double box[6];
+		for (int j = 0; j < 3; j++) {
+			double c = 60. * (m_random.generateDouble() - 0.5);
+			double h = 10. * m_random.generateDouble();
+			box[2*j] = c - h;
+			box[2*j+1] = c + h;
+		}
+
+		QList<ModelPart*> expected;
+		for (ModelPart* part : parts) {
+			double b[6];
+			worldBox(part, b);
+			if (b[0] <= box[1] && b[1] >= box[0] && b[2] <= box[3] && b[3] >= box[2] && b[4] <= box[5] && b[5] >= box[4])
+				expected.append(part);
+		}
+
+		QList<ModelPart*> found = list.partsInBox(box);
+		std::sort(expected.begin(), expected.end());
+		std::sort(found.begin(), found.end());
+		QCOMPARE( found, expected );
+	}
+}
+
+
+void PartBVHTest::checkNearest( ModelPartList& list ) {
+	list.updateTransforms();
+	QList<ModelPart*> parts;
+	collectParts( list.getRootItem(), parts );
+
+	for (int q = 0; q < 200; q++) {
+		double p[3];
+		for (int j = 0; j < 3; j++)
+			p[j] = 100. * (m_random.generateDouble() - 0.5);
+
+		double expected = std::numeric_limits<double>::max();
+		for (ModelPart* part : parts) {
+			double b[6];
+			worldBox(part, b);
+			expected = std::min(expected, boxDistance(b, p));
+		}
+
+		/* Several parts can be the same distance away (e.g. 0 inside overlapping
+		 * boxes), so check the distance rather than which part it is
+		 */
+		double distance = -1.;
+		ModelPart* nearest = list.nearestPart(p, &distance);
+		QVERIFY( nearest );
+		QVERIFY( std::fabs(distance - expected) <= 1e-9 * (1. + expected) );
+
+		double b[6];
+		worldBox(nearest, b);
+		QVERIFY( std::fabs(boxDistance(b, p) - expected) <= 1e-9 * (1. + expected) );
+	}
+}
+
+
+void PartBVHTest::quadsSplitIntoTriangles() {
+	/* Six squares, two triangles each */
+	std::shared_ptr<const MeshBVH> bvh = MeshBVH::build(m_cube);
+	QVERIFY( bvh );
+	QCOMPARE( bvh->triangleCount(), vtkIdType(12) );
+
+	double b[6], expected[6];
+	bvh->bounds(b);
+	m_cube->GetBounds(expected);
+	for (int j = 0; j < 6; j++)
+		QCOMPARE( b[j], expected[j] );
+
+	/* Straight down onto the top face, the hit must be on the square facing up */
+	const double o[3] = { 0.3, 5., -0.1 }, d[3] = { 0., -1., 0. };
+	double t = std::numeric_limits<double>::max();
+	vtkIdType cellId = -1;
+	QVERIFY( bvh->intersect(o, d, t, cellId) );
+	QCOMPARE( t, 4.5 );
+
+	vtkSmartPointer<vtkIdList> ids = vtkSmartPointer<vtkIdList>::New();
+	m_cube->GetCellPoints(cellId, ids);
+	QCOMPARE( ids->GetNumberOfIds(), vtkIdType(4) );
+	for (vtkIdType i = 0; i < ids->GetNumberOfIds(); i++)
+		QCOMPARE( m_cube->GetPoint(ids->GetId(i))[1], 0.5 );
+}
+
+
+void PartBVHTest::pick() {
+	ModelPartList list("PartsList");
+	makeScene(list);
+	checkPicks(list);
+}
+
+
+void PartBVHTest::partsInBox() {
+	ModelPartList list("PartsList");
+	makeScene(list);
+	checkBoxes(list);
+}
+
+
+void PartBVHTest::nearestPart() {
+	ModelPartList list("PartsList");
+	makeScene(list);
+	checkNearest(list);
+}
+
+
+void PartBVHTest::refitAfterMove() {
+	ModelPartList list("PartsList");
+	makeScene(list);
+	checkPicks(list);
+
+	/* Moves only refit the index, which must still match brute force */
+	for (int round = 0; round < 3; round++) {
+		moveParts(list);
+		checkPicks(list);
+		checkBoxes(list);
+		checkNearest(list);
+	}
+}
+
+
+QTEST_GUILESS_MAIN(PartBVHTest)
+
+#include "PartBVHTest.moc"
@@ -0,0 +1,308 @@
+/**		@file VRBenchmark.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Times the VR render loop without a headset.
+  *
+  *		The VR render thread is started in headless mode (offscreen window in
+  *		place of the headset) with a number of synthetic parts, or parts loaded
+  *		from STL files. A script of commands is then replayed to it, exactly as
+  *		the GUI would issue them, and the frame timing statistics are printed
+  *		when it finishes. Use this to check whether a change makes the render
+  *		loop faster or slower:
+  *
+  *			VRBenchmark --parts 2000 --triangles 5000 --script scripts/rotate.vrscript
+  *			VRBenchmark --stl ../parts --script session.log --csv frames.csv
+  *
+  *		P Evans 2022
+  */
+
+#include "VRRenderThread.h"
+
+/* Qt headers */
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+
+/* Vtk headers */
+#include <vtkActor.h>
+#include <vtkPolyDataMapper.h>
+#include <vtkProperty.h>
+#include <vtkSphereSource.h>
+#include <vtkSTLReader.h>
+#include <vtkMatrix4x4.h>
+
+/* Standard headers */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+
+/* How long a replayed command may wait for room in a full queue before it is
+ * counted as dropped - several frames, even at a low frame rate
+ */
+static const int commandWaitMs = 100;
+
+
+/** One line of a command script */
+struct ScriptCommand {
+	double	timeMs;		/**< Time after rendering starts */
+	int		command;
+	double	value;
+};
+
+
+/* Read a command script: "time_ms command value" per line, # starts a comment.
+ * The same format as VRRenderThread::setCommandLog() writes.
+ */
+static bool readScript( const QString& fileName, std::vector<ScriptCommand>& script ) {
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		fprintf(stderr, "Cannot open script %s\n", qPrintable(fileName));
+		return false;
+	}
+
+	QTextStream in(&file);
+	int lineNumber = 0;
+	while (!in.atEnd()) {
+		QString line = in.readLine();
+		lineNumber++;
+
+		int comment = line.indexOf('#');
+		if (comment >= 0)
+			line.truncate(comment);
+		line = line.simplified();
+		if (line.isEmpty())
+			continue;
+
+		QStringList fields = line.split(' ');
+		bool timeOk = false, valueOk = (fields.size() < 3);
+		ScriptCommand c;
+		c.timeMs = fields.value(0).toDouble(&timeOk);
+		c.command = VRRenderThread::commandFromName(fields.value(1));
+		c.value = (fields.size() >= 3) ? fields.value(2).toDouble(&valueOk) : 0.;
+
+		if (!timeOk || !valueOk || c.command < 0) {
+			fprintf(stderr, "%s:%d: not understood: %s\n", qPrintable(fileName), lineNumber, qPrintable(line));
+			return false;
+		}
+		script.push_back(c);
+	}
+
+	/* Logs are in time order already, but hand written scripts may not be */
+	std::stable_sort(script.begin(), script.end(),
+		[]( const ScriptCommand& a, const ScriptCommand& b ) { return a.timeMs < b.timeMs; });
+	return true;
+}
+
+
+/* Make an actor for a mesh, in the same way the GUI does (own mapper, own property) */
+static vtkSmartPointer<vtkActor> makeActor( vtkPolyData* data, const double position[3], int index ) {
+	vtkSmartPointer<vtkPolyDataMapper> mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
+	mapper->SetInputData(data);
+
+	vtkSmartPointer<vtkActor> actor = vtkSmartPointer<vtkActor>::New();
+	actor->SetMapper(mapper);
+
+	/* A handful of different colours, so batching has more than one material to group by */
+	static const double colours[4][3] = { {0.8, 0.2, 0.2}, {0.2, 0.8, 0.2}, {0.2, 0.2, 0.8}, {0.8, 0.8, 0.2} };
+	actor->GetProperty()->SetColor(colours[index % 4]);
+
+	vtkSmartPointer<vtkMatrix4x4> m = vtkSmartPointer<vtkMatrix4x4>::New();
+	m->SetElement(0, 3, position[0]);
+	m->SetElement(1, 3, position[1]);
+	m->SetElement(2, 3, position[2]);
+	actor->SetUserMatrix(m);
+	return actor;
+}
+
+
+/* Synthetic parts - spheres with roughly the requested number of triangles, laid
+ * out on a cube shaped grid. With shared set, every part uses the same mesh (so
+ * the instancer groups them), otherwise each part gets its own copy.
+ */
+static std::vector<vtkSmartPointer<vtkActor>> makeParts( int count, int triangles, bool shared ) {
+	/* A sphere with resolution r has about 2r^2 triangles */
+	int resolution = std::max(3, int(std::sqrt(triangles / 2.)));
+
+	vtkSmartPointer<vtkSphereSource> sphere = vtkSmartPointer<vtkSphereSource>::New();
+	sphere->SetRadius(4.);
+	sphere->SetThetaResolution(resolution);
+	sphere->SetPhiResolution(resolution);
+	sphere->Update();
+
+	int side = std::max(1, int(std::ceil(std::cbrt(double(count)))));
+	const double spacing = 10.;
+
+	std::vector<vtkSmartPointer<vtkActor>> parts;
+	parts.reserve(count);
+	for (int i = 0; i < count; i++) {
+		vtkSmartPointer<vtkPolyData> data;
+		if (shared)
+			data = sphere->GetOutput();
+		else {
+			data = vtkSmartPointer<vtkPolyData>::New();
+			data->DeepCopy(sphere->GetOutput());
+		}
+
+		double position[3] = {
+			((i % side) - side / 2.) * spacing,
+			(((i / side) % side) - side / 2.) * spacing,
+			((i / (side * side)) - side / 2.) * spacing };
+		parts.push_back(makeActor(data, position, i));
+	}
+	return parts;
+}
+
+
+/* Parts from STL files - a single file, or every STL file in a folder. Each part
+ * is placed where the file puts it, as the GUI does.
+ */
+static std::vector<vtkSmartPointer<vtkActor>> loadParts( const QString& path ) {
+	QStringList files;
+	QFileInfo info(path);
+	if (info.isDir()) {
+		QDir dir(path);
+		for (const QString& name : dir.entryList(QStringList() << "*.stl" << "*.STL", QDir::Files, QDir::Name))
+			files << dir.filePath(name);
+	}
+	else
+		files << path;
+
+	std::vector<vtkSmartPointer<vtkActor>> parts;
+	const double origin[3] = { 0., 0., 0. };
+	for (const QString& file : files) {
+		vtkSmartPointer<vtkSTLReader> reader = vtkSmartPointer<vtkSTLReader>::New();
+		reader->SetFileName(file.toLocal8Bit().constData());
+		reader->Update();
+		if (reader->GetErrorCode() != 0 || reader->GetOutput()->GetNumberOfPoints() == 0) {
+			fprintf(stderr, "Cannot read %s, skipped\n", qPrintable(file));
+			continue;
+		}
+
+		vtkSmartPointer<vtkPolyData> data = vtkSmartPointer<vtkPolyData>::New();
+		data->ShallowCopy(reader->GetOutput());
+		parts.push_back(makeActor(data, origin, int(parts.size())));
+	}
+	return parts;
+}
+
+
+static void printReport( const VRFrameReport& r, double seconds ) {
+	printf("\n%-14s %10s %10s %10s\n", "phase (ms)", "p50", "p99", "max");
+	for (int p = 0; p < VRFrameReport::PHASE_COUNT; p++)
+		printf("%-14s %10.3f %10.3f %10.3f\n", VRFrameReport::phaseName(p), r.p50[p], r.p99[p], r.max[p]);
+
+	printf("\nframes         %10llu\n", r.totalFrames);
+	printf("missed         %10llu (%.1f%%, deadline %.2f ms)\n", r.totalMissed,
+		r.totalFrames ? 100. * r.totalMissed / r.totalFrames : 0., r.targetMs);
+	printf("frames/s       %10.1f\n", seconds > 0. ? r.totalFrames / seconds : 0.);
+	printf("commands       %10llu (%llu dropped, latency max %.2f ms)\n", r.totalCommands,
+		r.droppedCommands, r.commandLatencyMax);
+}
+
+
+int main( int argc, char* argv[] ) {
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("VRBenchmark");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Times the VR render loop offscreen, without a headset.");
+	parser.addHelpOption();
+	QCommandLineOption partsOption("parts", "Number of synthetic parts (default 500).", "N", "500");
+	QCommandLineOption trianglesOption("triangles", "Triangles per synthetic part (default 2000).", "N", "2000");
+	QCommandLineOption sharedOption("shared", "Synthetic parts all share one mesh (tests instancing).");
+	QCommandLineOption stlOption("stl", "Load parts from an STL file, or all STL files in a folder, instead.", "path");
+	QCommandLineOption scriptOption("script", "Command script to replay (see scripts/rotate.vrscript).", "file");
+	QCommandLineOption durationOption("duration", "Time to run if the script doesn't end it (default 10).", "seconds", "10");
+	QCommandLineOption csvOption("csv", "Write every frame's timings to a CSV file.", "file");
+	QCommandLineOption sizeOption("size", "Eye image size (default 1440x1600).", "WxH", "1440x1600");
+	QCommandLineOption refreshOption("refresh", "Display refresh rate to time frames against (default 90).", "Hz", "90");
+	parser.addOptions({ partsOption, trianglesOption, sharedOption, stlOption, scriptOption,
+		durationOption, csvOption, sizeOption, refreshOption });
+	parser.process(app);
+
+	/* Load the command script first, so a typo doesn't waste a long load */
+	std::vector<ScriptCommand> script;
+	if (parser.isSet(scriptOption) && !readScript(parser.value(scriptOption), script))
+		return 1;
+
+	QStringList size = parser.value(sizeOption).split('x');
+	int width = size.value(0).toInt(), height = size.value(1).toInt();
+	if (width <= 0 || height <= 0) {
+		fprintf(stderr, "Bad --size, expected WxH\n");
+		return 1;
+	}
+
+	std::chrono::time_point<std::chrono::steady_clock> t_load = std::chrono::steady_clock::now();
+	std::vector<vtkSmartPointer<vtkActor>> parts = parser.isSet(stlOption)
+		? loadParts(parser.value(stlOption))
+		: makeParts(parser.value(partsOption).toInt(), parser.value(trianglesOption).toInt(), parser.isSet(sharedOption));
+	if (parts.empty()) {
+		fprintf(stderr, "No parts to render\n");
+		return 1;
+	}
+
+	vtkIdType triangles = 0;
+	for (vtkActor* a : parts)
+		triangles += vtkPolyData::SafeDownCast(a->GetMapper()->GetInput())->GetNumberOfPolys();
+	printf("%d parts, %lld triangles (%.0f ms to prepare)\n", int(parts.size()), (long long)triangles,
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_load).count());
+
+	/* Actors are handed to the thread before it starts, as the GUI does */
+	VRRenderThread* thread = new VRRenderThread();
+	for (vtkActor* a : parts)
+		thread->addActorOffline(a);
+
+	double duration = parser.value(durationOption).toDouble() * 1000.;
+	if (!script.empty())
+		duration = std::max(duration, script.back().timeMs);
+
+	/* Offscreen frames aren't held back by a headset, so allow for up to 240 a second */
+	thread->setHeadless(true, width, height);
+	thread->setFrameStatsWindow( std::max(1000, int(duration / 1000. * 240.)) );
+	if (parser.isSet(csvOption))
+		thread->setFrameStatsFile(parser.value(csvOption));
+
+	/* Make the override the first thing the thread sees, ahead of anything in the script */
+	thread->issueCommand(VRRenderThread::REFRESH_RATE, parser.value(refreshOption).toDouble());
+
+	std::chrono::time_point<std::chrono::steady_clock> t_start = std::chrono::steady_clock::now();
+	thread->start();
+
+	/* Replay the script with the original timing */
+	bool ended = false;
+	for (const ScriptCommand& c : script) {
+		std::this_thread::sleep_until(t_start + std::chrono::duration<double, std::milli>(c.timeMs));
+		if (thread->isFinished())
+			break;
+
+		/* If the queue is full, wait for the render thread to catch up. A command that
+		 * still doesn't fit is counted as dropped once, in the report.
+		 */
+		thread->issueCommand(c.command, c.value, commandWaitMs);
+
+		if (c.command == VRRenderThread::END_RENDER) {
+			ended = true;
+			break;
+		}
+	}
+
+	if (!ended) {
+		std::this_thread::sleep_until(t_start + std::chrono::duration<double, std::milli>(duration));
+		thread->issueCommand(VRRenderThread::END_RENDER, 0.);
+	}
+	thread->wait();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+	printReport(thread->frameStats(), seconds);
+
+	delete thread;
+	return 0;
+}
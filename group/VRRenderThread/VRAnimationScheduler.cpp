@@ -0,0 +1,115 @@
+/**		@file VRAnimationScheduler.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Fixed time-step scheduler for animations in the VR thread.
+  *
+  *		P Evans 2022
+  */
+
+#include "VRAnimationScheduler.h"
+
+#include <algorithm>
+
+
+/* Fraction of each display frame that can be used for animation */
+static const double budgetFraction = 0.25;
+
+/* Limit on how far behind the animation can get. After a long stall (e.g. headset
+ * removed, window dragged) any time beyond this many ticks is dropped rather than
+ * being run in a burst.
+ */
+static const int maxCatchUpTicks = 5;
+
+/* Convert a time in seconds to the clock's own units */
+static VRAnimationScheduler::Clock::duration toDuration( double seconds ) {
+	return std::chrono::duration_cast<VRAnimationScheduler::Clock::duration>( std::chrono::duration<double>(seconds) );
+}
+
+
+VRAnimationScheduler::VRAnimationScheduler( double tickRate, double refreshRate ) {
+	m_tickRate = 50.;
+	m_refreshRate = 90.;
+	m_tick = toDuration(1. / m_tickRate);
+	m_budget = toDuration(budgetFraction / m_refreshRate);
+	m_accumulator = Clock::duration::zero();
+	m_frameTicks = 0;
+
+	setTickRate(tickRate);
+	setRefreshRate(refreshRate);
+	reset(Clock::now());
+}
+
+
+void VRAnimationScheduler::setTickRate( double hz ) {
+	if (hz <= 0.)
+		return;
+
+	m_tickRate = hz;
+	m_tick = toDuration(1. / hz);
+}
+
+
+double VRAnimationScheduler::tickRate() const {
+	return m_tickRate;
+}
+
+
+void VRAnimationScheduler::setRefreshRate( double hz ) {
+	if (hz <= 0.)
+		return;
+
+	m_refreshRate = hz;
+	m_budget = toDuration(budgetFraction / hz);
+}
+
+
+double VRAnimationScheduler::refreshRate() const {
+	return m_refreshRate;
+}
+
+
+void VRAnimationScheduler::reset( Clock::time_point now ) {
+	m_lastFrame = now;
+	m_frameStart = now;
+	m_accumulator = Clock::duration::zero();
+	m_frameTicks = 0;
+}
+
+
+void VRAnimationScheduler::beginFrame( Clock::time_point now ) {
+	m_accumulator += now - m_lastFrame;
+	m_lastFrame = now;
+	m_frameStart = now;
+	m_frameTicks = 0;
+
+	/* If the thread has stalled don't try to run hundreds of ticks to catch up, this
+	 * would make the next frame late too and the problem would snowball. Excess time
+	 * is simply forgotten, the animation pauses for the length of the stall.
+	 */
+	Clock::duration limit = m_tick * maxCatchUpTicks;
+	if (m_accumulator > limit)
+		m_accumulator = limit;
+}
+
+
+bool VRAnimationScheduler::nextTick() {
+	if (m_accumulator < m_tick)
+		return false;
+
+	/* Out of time for this frame, remaining ticks stay in the accumulator and are run
+	 * next frame (the first tick is always allowed so the animation can't stop completely)
+	 */
+	if (m_frameTicks > 0 && Clock::now() - m_frameStart > m_budget)
+		return false;
+
+	m_accumulator -= m_tick;
+	m_frameTicks++;
+	return true;
+}
+
+
+double VRAnimationScheduler::alpha() const {
+	double a = std::chrono::duration<double>(m_accumulator).count() * m_tickRate;
+	return std::min(std::max(a, 0.), 1.);
+}
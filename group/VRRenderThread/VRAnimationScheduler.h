@@ -0,0 +1,87 @@
+/**		@file VRAnimationScheduler.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Fixed time-step scheduler for animations in the VR thread.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_ANIMATION_SCHEDULER_H
+#define VR_ANIMATION_SCHEDULER_H
+
+#include <chrono>
+
+
+/** Splits real time into fixed size animation ticks.
+  *
+  * Each frame the time since the previous frame is added to an accumulator, and
+  * whole ticks are taken out of it. The animation is therefore always stepped by
+  * exactly the same amount no matter how irregular the frame rate is, and the
+  * result after N ticks doesn't depend on how they were spread over frames. The
+  * fraction of a tick left in the accumulator is returned by alpha() so the
+  * renderer can interpolate between the last two animation states.
+  *
+  * Typical use, once per frame:
+  * @code
+  *     scheduler.beginFrame( std::chrono::steady_clock::now() );
+  *     while( scheduler.nextTick() )
+  *         stepAnimation();
+  *     drawAnimation( scheduler.alpha() );
+  * @endcode
+  */
+class VRAnimationScheduler {
+public:
+    typedef std::chrono::steady_clock                   Clock;
+
+    /** Constructor
+      * @param tickRate is the number of animation steps per second
+      * @param refreshRate is the display refresh rate (Hz), used to set the time budget
+      */
+    VRAnimationScheduler( double tickRate = 50., double refreshRate = 90. );
+
+    /** Set number of animation steps per second
+      */
+    void setTickRate( double hz );
+    double tickRate() const;
+
+    /** Set the display refresh rate. The animation is allowed a quarter of one
+      * display frame, if the ticks take longer than that the rest are left in
+      * the accumulator for the next frame.
+      */
+    void setRefreshRate( double hz );
+    double refreshRate() const;
+
+    /** Restart timing - call before the first frame
+      */
+    void reset( Clock::time_point now );
+
+    /** Add the time since the last frame to the accumulator
+      * @param now is the time at the start of this frame
+      */
+    void beginFrame( Clock::time_point now );
+
+    /** Check whether another tick should be run this frame, and if so remove
+      * it from the accumulator.
+      * @return true if the caller should step the animation once
+      */
+    bool nextTick();
+
+    /** How far between the previous and current animation state the display
+      * should be drawn
+      * @return interpolation factor 0-1
+      */
+    double alpha() const;
+
+private:
+    Clock::duration                                     m_tick;         /**< Length of one tick */
+    Clock::duration                                     m_budget;       /**< Maximum time per frame for ticks */
+    Clock::duration                                     m_accumulator;  /**< Time not yet used by ticks */
+    Clock::time_point                                   m_lastFrame;    /**< Time of last beginFrame() */
+    Clock::time_point                                   m_frameStart;   /**< Time that ticks started this frame */
+    double                                              m_tickRate;     /**< Ticks per second */
+    double                                              m_refreshRate;  /**< Display refresh rate (Hz) */
+    int                                                 m_frameTicks;   /**< Ticks run since beginFrame() */
+};
+
+
+#endif
@@ -0,0 +1,585 @@
+/**		@file VRBatcher.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Merges static parts with the same material into a few large meshes.
+  *
+  *		P Evans 2022
+  */
+
+#include "VRBatcher.h"
+
+#include <vtkProperty.h>
+#include <vtkPoints.h>
+#include <vtkPointData.h>
+#include <vtkCellData.h>
+#include <vtkCellArray.h>
+#include <vtkDataSetAttributes.h>
+#include <vtkFloatArray.h>
+#include <vtkTypeInt32Array.h>
+#include <vtkTypeInt64Array.h>
+#include <vtkSMPTools.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+
+/* A part must be still for this many frames (about a second) before it is batched */
+static const int stillFramesToBatch = 90;
+
+/* Don't bother making a batch for fewer parts than this */
+static const std::size_t minBatchParts = 8;
+
+/* Parts that are big enough to be worth a draw call of their own are left alone.
+ * Batches are sized so one can be rebuilt within the per-frame budget (see
+ * batchLimit()), but never smaller than one part or larger than maxBatchCells.
+ */
+static const vtkIdType maxBatchCells = 1 << 20;
+static const vtkIdType maxPartCells = 1 << 16;
+
+/* Merge speed assumed until a build has been timed, cells per microsecond */
+static const double initialCellsPerUs = 50.;
+
+/* New batches are looked for every this many frames */
+static const int formInterval = 30;
+
+
+/* Copy one member's cells into a batch, renumbered to follow the members before
+ * it. The source arrays are read through their raw pointers: GetTuple1() writes a
+ * buffer inside the array, which isn't safe while other threads read the same mesh
+ * (identical parts share one mesh, see GeometryStore).
+ */
+template <typename T>
+static void copyCells( const T* srcOffsets, const T* srcConn, vtkIdType cells, vtkIdType connCount,
+					   vtkIdType connStart, vtkIdType pointStart, vtkTypeInt32* off, vtkTypeInt32* conn ) {
+	const vtkIdType base = vtkIdType(srcOffsets[0]);
+	for (vtkIdType c = 0; c < cells; c++)
+		off[c] = vtkTypeInt32( connStart + vtkIdType(srcOffsets[c]) - base );
+	for (vtkIdType c = 0; c < connCount; c++)
+		conn[c] = vtkTypeInt32( pointStart + vtkIdType(srcConn[base + c]) );
+}
+
+
+VRBatcher::VRBatcher() {
+	m_renderer = nullptr;
+	m_enabled = false;
+	m_budgetUs = 2000;
+	m_cellsPerUs = initialCellsPerUs;
+	m_nextBatch = 0;
+	m_frame = 0;
+	m_root = vtkSmartPointer<vtkMatrix4x4>::New();
+	m_rootInverse = vtkSmartPointer<vtkMatrix4x4>::New();
+}
+
+
+void VRBatcher::setRenderer( vtkRenderer* renderer ) {
+	m_renderer = renderer;
+}
+
+
+void VRBatcher::setEnabled( bool enabled ) {
+	if (enabled == m_enabled)
+		return;
+
+	m_enabled = enabled;
+	if (enabled)
+		return;
+
+	/* Put everything back the way it was */
+	for (auto& it : m_members) {
+		Member& m = it.second;
+		m.batch = -1;
+		m.stillFrames = 0;
+		if (!m.alone && m_renderer)
+			m_renderer->AddActor(m.actor);
+		m.alone = true;
+	}
+
+	for (auto& it : m_batches) {
+		if (it.second.actor && m_renderer)
+			m_renderer->RemoveActor(it.second.actor);
+	}
+	m_batches.clear();
+	m_batchActors.clear();
+}
+
+
+bool VRBatcher::isEnabled() const {
+	return m_enabled;
+}
+
+
+void VRBatcher::setRoot( const vtkMatrix4x4* m ) {
+	m_root->DeepCopy(m);
+	vtkMatrix4x4::Invert(m_root, m_rootInverse);
+}
+
+
+void VRBatcher::setBudget( double ms ) {
+	m_budgetUs = (long long)(ms * 1000.);
+}
+
+
+vtkIdType VRBatcher::batchLimit() const {
+	double cells = m_cellsPerUs * double(m_budgetUs);
+	return vtkIdType( std::max( double(maxPartCells), std::min(double(maxBatchCells), cells) ) );
+}
+
+
+std::string VRBatcher::materialKey( vtkActor* actor ) {
+	vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(actor->GetMapper());
+	vtkPolyData* data = mapper ? mapper->GetInput() : nullptr;
+	vtkProperty* p = actor->GetProperty();
+	if (!data || !p || actor->GetTexture())
+		return std::string();
+
+	/* Only plain polygon meshes of a modest size, drawn in the property colour
+	 * (not coloured by scalars) and opaque (transparent parts must be sorted)
+	 */
+	if (data->GetNumberOfPolys() == 0 || data->GetNumberOfPolys() > maxPartCells ||
+		data->GetNumberOfVerts() || data->GetNumberOfLines() || data->GetNumberOfStrips())
+		return std::string();
+	if (mapper->GetScalarVisibility() && (data->GetPointData()->GetScalars() || data->GetCellData()->GetScalars()))
+		return std::string();
+	if (p->GetOpacity() < 1.)
+		return std::string();
+
+	double c[3];
+	p->GetColor(c);
+
+	char key[256];
+	std::snprintf( key, sizeof(key), "%d %d %d|%.3f %.3f %.3f %.1f|%d %d %d %d",
+		int(c[0] * 255. + 0.5), int(c[1] * 255. + 0.5), int(c[2] * 255. + 0.5),
+		p->GetAmbient(), p->GetDiffuse(), p->GetSpecular(), p->GetSpecularPower(),
+		p->GetRepresentation(), p->GetInterpolation(), p->GetBackfaceCulling(), p->GetLighting() );
+	return std::string(key);
+}
+
+
+void VRBatcher::add( vtkActor* actor ) {
+	if (m_members.count(actor))
+		return;
+
+	Member& m = m_members[actor];
+	m.actor = actor;
+
+	vtkMatrix4x4* matrix = actor->GetMatrix();
+	vtkMatrix4x4::Multiply4x4( m_rootInverse->GetData(), matrix->GetData(), m.rel );
+	m.matrixTime = matrix->GetMTime();
+	m.propertyTime = actor->GetProperty()->GetMTime();
+	m.key = materialKey(actor);
+	m.visible = actor->GetVisibility() != 0;
+}
+
+
+bool VRBatcher::remove( vtkActor* actor ) {
+	auto it = m_members.find(actor);
+	if (it == m_members.end())
+		return false;
+
+	Member& m = it->second;
+	const bool batched = !m.alone;
+
+	if (m.batch >= 0) {
+		setHidden(m, true);
+		Batch& b = m_batches[m.batch];
+		b.current.erase(actor);
+		b.dirty = true;
+	}
+
+	m_members.erase(it);
+	return batched;
+}
+
+
+void VRBatcher::clear() {
+	for (auto& it : m_batches) {
+		if (it.second.actor && m_renderer)
+			m_renderer->RemoveActor(it.second.actor);
+	}
+	m_batches.clear();
+	m_batchActors.clear();
+	m_members.clear();
+}
+
+
+bool VRBatcher::isBatched( vtkActor* actor ) const {
+	auto it = m_members.find(actor);
+	return it != m_members.end() && !it->second.alone;
+}
+
+
+vtkActor* VRBatcher::partAt( vtkProp* prop, vtkIdType cellId ) const {
+	auto it = m_batchActors.find(prop);
+	if (it == m_batchActors.end())
+		return nullptr;
+
+	const Batch& b = m_batches.at(it->second);
+	if (b.firstCells.empty() || cellId < 0)
+		return nullptr;
+
+	/* Last member starting at or before the cell */
+	auto pos = std::upper_bound( b.firstCells.begin(), b.firstCells.end(), cellId );
+	if (pos == b.firstCells.begin())
+		return nullptr;
+
+	return b.built[ (pos - b.firstCells.begin()) - 1 ];
+}
+
+
+void VRBatcher::unbatch( Member& m ) {
+	if (m.batch < 0)
+		return;
+
+	/* Hide it in the batch straight away, the batch itself is rebuilt later */
+	setHidden(m, true);
+
+	Batch& b = m_batches[m.batch];
+	b.current.erase(m.actor);
+	b.dirty = true;
+
+	m.batch = -1;
+	m.stillFrames = 0;
+	if (!m.alone && m_renderer)
+		m_renderer->AddActor(m.actor);
+	m.alone = true;
+}
+
+
+void VRBatcher::setHidden( Member& m, bool hidden ) {
+	auto it = m_batches.find(m.batch);
+	if (it == m_batches.end() || m.alone || !it->second.ghosts)
+		return;
+
+	Batch& b = it->second;
+	unsigned char value = hidden ? vtkDataSetAttributes::HIDDENCELL : 0;
+	unsigned char* g = b.ghosts->GetPointer(0);
+	std::fill( g + m.firstCell, g + m.firstCell + m.numCells, value );
+
+	b.ghosts->Modified();
+	b.mapper->GetInput()->Modified();
+}
+
+
+void VRBatcher::dissolve( int id ) {
+	Batch& b = m_batches[id];
+
+	/* Members keep their still frame count, so formBatches() can regroup them */
+	for (vtkActor* a : b.current) {
+		Member& m = m_members[a];
+		m.batch = -1;
+		if (!m.alone && m_renderer)
+			m_renderer->AddActor(m.actor);
+		m.alone = true;
+	}
+	if (b.actor) {
+		if (m_renderer)
+			m_renderer->RemoveActor(b.actor);
+		m_batchActors.erase(b.actor.Get());
+	}
+	m_batches.erase(id);
+}
+
+
+void VRBatcher::build( int id ) {
+	Batch& b = m_batches[id];
+	b.dirty = false;
+
+	/* A batch that has lost most of its parts is split up again */
+	if (b.current.size() < 2) {
+		dissolve(id);
+		return;
+	}
+
+	std::chrono::time_point<std::chrono::steady_clock> t_start = std::chrono::steady_clock::now();
+
+	/* Gather the members */
+	std::vector<Member*> members;
+	for (vtkActor* a : b.current)
+		members.push_back(&m_members[a]);
+
+	/* Work out where each member goes in the merged arrays */
+	const std::size_t n = members.size();
+	std::vector<vtkIdType> pointStart(n + 1, 0), cellStart(n + 1, 0), connStart(n + 1, 0);
+	bool normals = true;
+	for (std::size_t i = 0; i < n; i++) {
+		vtkPolyData* data = vtkPolyDataMapper::SafeDownCast(members[i]->actor->GetMapper())->GetInput();
+		pointStart[i+1] = pointStart[i] + data->GetNumberOfPoints();
+		cellStart[i+1] = cellStart[i] + data->GetNumberOfPolys();
+		connStart[i+1] = connStart[i] + data->GetPolys()->GetNumberOfConnectivityIds();
+		normals = normals && data->GetPointData()->GetNormals();
+	}
+
+	vtkSmartPointer<vtkFloatArray> points = vtkSmartPointer<vtkFloatArray>::New();
+	points->SetNumberOfComponents(3);
+	points->SetNumberOfTuples(pointStart[n]);
+
+	vtkSmartPointer<vtkFloatArray> pointNormals;
+	if (normals) {
+		pointNormals = vtkSmartPointer<vtkFloatArray>::New();
+		pointNormals->SetName("Normals");
+		pointNormals->SetNumberOfComponents(3);
+		pointNormals->SetNumberOfTuples(pointStart[n]);
+	}
+
+	/* Batch and part size limits keep everything well within 32 bit indices */
+	vtkSmartPointer<vtkTypeInt32Array> offsets = vtkSmartPointer<vtkTypeInt32Array>::New();
+	vtkSmartPointer<vtkTypeInt32Array> connectivity = vtkSmartPointer<vtkTypeInt32Array>::New();
+	offsets->SetNumberOfValues(cellStart[n] + 1);
+	connectivity->SetNumberOfValues(connStart[n]);
+
+	b.ghosts = vtkSmartPointer<vtkUnsignedCharArray>::New();
+	b.ghosts->SetName(vtkDataSetAttributes::GhostArrayName());
+	b.ghosts->SetNumberOfValues(cellStart[n]);
+
+	float* xyz = points->GetPointer(0);
+	float* nxyz = normals ? pointNormals->GetPointer(0) : nullptr;
+	vtkTypeInt32* off = offsets->GetPointer(0);
+	vtkTypeInt32* conn = connectivity->GetPointer(0);
+	unsigned char* ghosts = b.ghosts->GetPointer(0);
+
+	/* Copy each member into place, transformed into scene coordinates. Members are
+	 * independent so they are copied in parallel. Member data may be shared with
+	 * other actors, so it is only read with calls that don't touch the array's own
+	 * state - GetTuple() into a local buffer, and raw pointers for the cells.
+	 */
+	vtkSMPTools::For( 0, vtkIdType(n), [&]( vtkIdType first, vtkIdType last ) {
+		for (vtkIdType i = first; i < last; i++) {
+			Member& m = *members[i];
+			vtkPolyData* data = vtkPolyDataMapper::SafeDownCast(m.actor->GetMapper())->GetInput();
+			const double* r = m.rel;
+
+			/* Normals transform by the inverse transpose, which is the cofactor matrix up to scale */
+			double nm[9] = {
+				r[5]*r[10] - r[6]*r[9],  r[6]*r[8] - r[4]*r[10],  r[4]*r[9] - r[5]*r[8],
+				r[2]*r[9] - r[1]*r[10],  r[0]*r[10] - r[2]*r[8],  r[1]*r[8] - r[0]*r[9],
+				r[1]*r[6] - r[2]*r[5],   r[2]*r[4] - r[0]*r[6],   r[0]*r[5] - r[1]*r[4]
+			};
+
+			vtkDataArray* srcPoints = data->GetPoints()->GetData();
+			vtkDataArray* srcNormals = nxyz ? data->GetPointData()->GetNormals() : nullptr;
+			for (vtkIdType j = 0; j < data->GetNumberOfPoints(); j++) {
+				double p[3];
+				srcPoints->GetTuple(j, p);
+				float* out = xyz + 3 * (pointStart[i] + j);
+				out[0] = float(r[0]*p[0] + r[1]*p[1] + r[2]*p[2] + r[3]);
+				out[1] = float(r[4]*p[0] + r[5]*p[1] + r[6]*p[2] + r[7]);
+				out[2] = float(r[8]*p[0] + r[9]*p[1] + r[10]*p[2] + r[11]);
+
+				if (srcNormals) {
+					srcNormals->GetTuple(j, p);
+					double v[3] = {
+						nm[0]*p[0] + nm[1]*p[1] + nm[2]*p[2],
+						nm[3]*p[0] + nm[4]*p[1] + nm[5]*p[2],
+						nm[6]*p[0] + nm[7]*p[1] + nm[8]*p[2]
+					};
+					double len = std::sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+					double k = (len > 0.) ? 1. / len : 0.;
+					float* nout = nxyz + 3 * (pointStart[i] + j);
+					nout[0] = float(v[0] * k);
+					nout[1] = float(v[1] * k);
+					nout[2] = float(v[2] * k);
+				}
+			}
+
+			vtkCellArray* srcPolys = data->GetPolys();
+			const vtkIdType cells = cellStart[i+1] - cellStart[i];
+			const vtkIdType connCount = connStart[i+1] - connStart[i];
+			if (srcPolys->IsStorage64Bit())
+				copyCells( srcPolys->GetOffsetsArray64()->GetPointer(0), srcPolys->GetConnectivityArray64()->GetPointer(0),
+						   cells, connCount, connStart[i], pointStart[i], off + cellStart[i], conn + connStart[i] );
+			else
+				copyCells( srcPolys->GetOffsetsArray32()->GetPointer(0), srcPolys->GetConnectivityArray32()->GetPointer(0),
+						   cells, connCount, connStart[i], pointStart[i], off + cellStart[i], conn + connStart[i] );
+
+			std::fill( ghosts + cellStart[i], ghosts + cellStart[i+1], m.visible ? 0 : vtkDataSetAttributes::HIDDENCELL );
+		}
+	} );
+	off[cellStart[n]] = vtkTypeInt32(connStart[n]);
+
+	vtkSmartPointer<vtkPoints> pts = vtkSmartPointer<vtkPoints>::New();
+	pts->SetData(points);
+
+	vtkSmartPointer<vtkCellArray> polys = vtkSmartPointer<vtkCellArray>::New();
+	polys->SetData(offsets, connectivity);
+
+	vtkSmartPointer<vtkPolyData> merged = vtkSmartPointer<vtkPolyData>::New();
+	merged->SetPoints(pts);
+	merged->SetPolys(polys);
+	if (normals)
+		merged->GetPointData()->SetNormals(pointNormals);
+	merged->GetCellData()->AddArray(b.ghosts);
+
+	/* First build - create the batch actor. It shares the scene transform so it moves with the scene. */
+	if (!b.actor) {
+		b.mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
+		b.actor = vtkSmartPointer<vtkActor>::New();
+		b.actor->SetMapper(b.mapper);
+		b.actor->GetProperty()->DeepCopy( members.front()->actor->GetProperty() );
+		b.actor->SetUserMatrix(m_root);
+		m_batchActors[b.actor.Get()] = id;
+		if (m_renderer)
+			m_renderer->AddActor(b.actor);
+	}
+	b.mapper->SetInputData(merged);
+	b.cells = cellStart[n];
+
+	/* Members now drawn by the batch come out of the renderer */
+	b.built.clear();
+	b.firstCells.clear();
+	for (std::size_t i = 0; i < n; i++) {
+		Member& m = *members[i];
+		m.firstCell = cellStart[i];
+		m.numCells = cellStart[i+1] - cellStart[i];
+		if (m.alone && m_renderer)
+			m_renderer->RemoveActor(m.actor);
+		m.alone = false;
+
+		b.built.push_back(m.actor);
+		b.firstCells.push_back(m.firstCell);
+	}
+
+	/* Keep track of how fast merging goes on this machine, for batchLimit(). Small
+	 * batches are mostly overhead so don't say much about the rate.
+	 */
+	long long us = std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - t_start ).count();
+	if (cellStart[n] >= 4096 && us > 0)
+		m_cellsPerUs = 0.75 * m_cellsPerUs + 0.25 * double(cellStart[n]) / double(us);
+}
+
+
+void VRBatcher::formBatches() {
+	/* Still, batchable, unbatched parts grouped by material */
+	std::unordered_map<std::string, std::vector<Member*>> candidates;
+	for (auto& it : m_members) {
+		Member& m = it.second;
+		if (m.batch < 0 && !m.key.empty() && m.stillFrames >= stillFramesToBatch)
+			candidates[m.key].push_back(&m);
+	}
+
+	const vtkIdType limit = batchLimit();
+
+	for (auto& it : candidates) {
+		std::vector<Member*>& list = it.second;
+		std::size_t next = 0;
+
+		auto cellsOf = []( Member* m ) {
+			return vtkPolyDataMapper::SafeDownCast(m->actor->GetMapper())->GetInput()->GetNumberOfPolys();
+		};
+		auto join = []( Member* m, int id, Batch& b, vtkIdType cells ) {
+			m->batch = id;
+			b.current.insert(m->actor);
+			b.cells += cells;
+			b.dirty = true;
+		};
+
+		/* Top up existing batches of the same material first */
+		for (auto& bit : m_batches) {
+			Batch& b = bit.second;
+			if (b.key != it.first)
+				continue;
+			while (next < list.size() && b.cells + cellsOf(list[next]) <= limit) {
+				join(list[next], bit.first, b, cellsOf(list[next]));
+				next++;
+			}
+		}
+
+		/* Then start new ones, if there are enough parts left to be worth it */
+		while (list.size() - next >= minBatchParts) {
+			int id = m_nextBatch++;
+			Batch& b = m_batches[id];
+			b.key = it.first;
+			while (next < list.size() && b.cells + cellsOf(list[next]) <= limit) {
+				join(list[next], id, b, cellsOf(list[next]));
+				next++;
+			}
+		}
+	}
+}
+
+
+void VRBatcher::update() {
+	if (!m_enabled)
+		return;
+
+	/* 1. Look for parts that have moved, changed material or been hidden */
+	for (auto& it : m_members) {
+		Member& m = it.second;
+
+		vtkMatrix4x4* matrix = m.actor->GetMatrix();
+		if (matrix->GetMTime() != m.matrixTime) {
+			m.matrixTime = matrix->GetMTime();
+
+			/* The actor matrix changes whenever the scene transform does, only a change
+			 * relative to the scene counts as the part moving
+			 */
+			double rel[16];
+			vtkMatrix4x4::Multiply4x4( m_rootInverse->GetData(), matrix->GetData(), rel );
+			bool moved = false;
+			for (int k = 0; k < 16; k++)
+				moved = moved || std::fabs(rel[k] - m.rel[k]) > 1e-6 * (1. + std::fabs(m.rel[k]));
+			std::copy( rel, rel + 16, m.rel );
+
+			if (moved) {
+				m.stillFrames = 0;
+				unbatch(m);
+			}
+		}
+
+		vtkMTimeType propertyTime = m.actor->GetProperty()->GetMTime();
+		if (propertyTime != m.propertyTime) {
+			m.propertyTime = propertyTime;
+			std::string key = materialKey(m.actor);
+			if (key != m.key) {
+				m.key = key;
+				unbatch(m);
+			}
+		}
+
+		bool visible = m.actor->GetVisibility() != 0;
+		if (visible != m.visible) {
+			m.visible = visible;
+			setHidden(m, !visible);
+		}
+
+		if (m.batch < 0 && m.stillFrames < stillFramesToBatch)
+			m.stillFrames++;
+	}
+
+	/* 2. Every so often, collect still parts into batches */
+	if (++m_frame % formInterval == 0)
+		formBatches();
+
+	/* 3. Rebuild changed batches while the expected time fits in what is left of
+	 * the budget. Batches are sized to fit the budget when they are formed; one that
+	 * no longer does (the budget was cut, or merging is slower than it looked) is
+	 * split up and its parts regrouped into smaller batches later.
+	 */
+	std::chrono::time_point<std::chrono::steady_clock> t_start = std::chrono::steady_clock::now();
+	const vtkIdType limit = batchLimit();
+
+	std::vector<int> dirty;
+	for (auto& it : m_batches) {
+		if (it.second.dirty)
+			dirty.push_back(it.first);
+	}
+
+	bool built = false;
+	for (int id : dirty) {
+		const Batch& b = m_batches[id];
+		if (b.cells > limit) {
+			dissolve(id);
+			continue;
+		}
+
+		/* The first always goes ahead, as a batch of a single large part may not fit a very small budget */
+		long long spent = std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - t_start ).count();
+		if (built && spent + (long long)(double(b.cells) / m_cellsPerUs) > m_budgetUs)
+			break;
+
+		build(id);
+		built = true;
+	}
+}
@@ -0,0 +1,158 @@
+/**		@file VRBatcher.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Merges static parts with the same material into a few large meshes.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_BATCHER_H
+#define VR_BATCHER_H
+
+/* Vtk headers */
+#include <vtkSmartPointer.h>
+#include <vtkActor.h>
+#include <vtkRenderer.h>
+#include <vtkPolyData.h>
+#include <vtkPolyDataMapper.h>
+#include <vtkMatrix4x4.h>
+#include <vtkUnsignedCharArray.h>
+
+/* Standard headers */
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+
+/** Every actor costs a draw call, and the CPU time to set each one up. With a
+  * few thousand parts this, rather than the graphics card, limits the frame rate.
+  * This class (optionally) merges parts that look the same (same colour and
+  * material) and have not moved for a while into batches - a single mesh, and so
+  * a single actor and draw call, per batch.
+  *
+  * Parts are merged in scene coordinates, i.e. before the scene transform is
+  * applied, so moving the whole scene doesn't break up the batches - the batch
+  * actors just use the scene transform as their user matrix.
+  *
+  * Batched actors are taken out of the renderer but are still watched every frame:
+  *   - If a part is hidden its triangles are marked as hidden cells in the batch
+  *     (vtkGhostType array), nothing is rebuilt.
+  *   - If a part moves or its material changes it is taken out of its batch and put
+  *     back in the renderer. Its triangles are hidden straight away and the batch is
+  *     rebuilt without it, spread over the following frames to stay within budget.
+  *     Batches are kept small enough that each one can be rebuilt within the budget.
+  * partAt() maps a cell of a batch back to the part it came from, for picking.
+  *
+  * Only used by the render thread.
+  */
+class VRBatcher {
+public:
+	VRBatcher();
+
+	/** Set the renderer that actors are moved out of and batch actors added to */
+	void setRenderer( vtkRenderer* renderer );
+
+	/** Turn batching on/off (off by default). Turning it off puts every part back in the renderer. */
+	void setEnabled( bool enabled );
+	bool isEnabled() const;
+
+	/** Set the scene transform, batches are built in the coordinates before this transform */
+	void setRoot( const vtkMatrix4x4* m );
+
+	/** Set the time per frame that can be spent rebuilding batches (default 2ms). This
+	  * also limits the size of new batches, so that any one can be rebuilt in time.
+	  */
+	void setBudget( double ms );
+
+	/** Start watching an actor, it may be batched once it has been still for a while */
+	void add( vtkActor* actor );
+
+	/** Stop watching an actor
+	  * @return true if the actor was batched, i.e. it is not in the renderer
+	  */
+	bool remove( vtkActor* actor );
+
+	/** Stop watching all actors and remove batch actors from the renderer (actors are not put back) */
+	void clear();
+
+	/** Check whether an actor is currently drawn as part of a batch */
+	bool isBatched( vtkActor* actor ) const;
+
+	/** Find the part a cell of a batch came from
+	  * @param prop is the picked prop
+	  * @param cellId is the picked cell
+	  * @return the original actor, or nullptr if prop isn't a batch
+	  */
+	vtkActor* partAt( vtkProp* prop, vtkIdType cellId ) const;
+
+	/** Check for changes, rebuild batches and form new ones. Call once per frame
+	  * after actor transforms have been updated.
+	  */
+	void update();
+
+private:
+	/** A watched actor */
+	struct Member {
+		vtkSmartPointer<vtkActor>			actor;
+		int									batch = -1;			/**< Batch id, -1 if drawn on its own */
+		vtkIdType							firstCell = 0;		/**< Cells used in the batch */
+		vtkIdType							numCells = 0;
+		double								rel[16];			/**< Transform in scene coordinates (root inverse * actor matrix) */
+		vtkMTimeType						matrixTime = 0;		/**< Actor matrix time when rel was calculated */
+		vtkMTimeType						propertyTime = 0;	/**< Property time when key was calculated */
+		std::string							key;				/**< Material, empty if the actor can't be batched */
+		bool								visible = true;
+		bool								alone = true;		/**< Actor is in the renderer (not yet, or no longer, drawn by a batch) */
+		int									stillFrames = 0;	/**< Frames without moving */
+	};
+
+	/** A merged mesh */
+	struct Batch {
+		std::string							key;
+		std::unordered_set<vtkActor*>		current;			/**< Actors that belong in the batch */
+		std::vector<vtkSmartPointer<vtkActor>> built;			/**< Actors in the mesh as last built, in cell order */
+		std::vector<vtkIdType>				firstCells;			/**< First cell of each built actor, for partAt() */
+		vtkSmartPointer<vtkActor>			actor;
+		vtkSmartPointer<vtkPolyDataMapper>	mapper;
+		vtkSmartPointer<vtkUnsignedCharArray> ghosts;			/**< Hidden cells */
+		vtkIdType							cells = 0;			/**< Number of cells (estimate until built) */
+		bool								dirty = true;		/**< Needs (re)building */
+	};
+
+	/** Work out the material key of an actor, empty if it can't be batched */
+	static std::string materialKey( vtkActor* actor );
+
+	/** Take a member out of its batch and put its actor back in the renderer */
+	void unbatch( Member& m );
+
+	/** Hide/show a member's cells in its batch */
+	void setHidden( Member& m, bool hidden );
+
+	/** Build a batch's mesh from its members */
+	void build( int id );
+
+	/** Put a batch's members back in the renderer and delete the batch */
+	void dissolve( int id );
+
+	/** Group still, unbatched actors into batches */
+	void formBatches();
+
+	/** Largest batch (in cells) expected to rebuild within the budget */
+	vtkIdType batchLimit() const;
+
+	vtkRenderer*									m_renderer;
+	bool											m_enabled;
+	long long										m_budgetUs;
+	double											m_cellsPerUs;	/**< Measured merge speed */
+	vtkSmartPointer<vtkMatrix4x4>					m_root;			/**< Shared by all batch actors as user matrix */
+	vtkSmartPointer<vtkMatrix4x4>					m_rootInverse;
+	std::unordered_map<vtkActor*, Member>			m_members;
+	std::unordered_map<int, Batch>					m_batches;
+	std::unordered_map<vtkProp*, int>				m_batchActors;	/**< Batch id of each batch actor */
+	int												m_nextBatch;
+	int												m_frame;
+};
+
+
+#endif
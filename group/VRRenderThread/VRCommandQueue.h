@@ -0,0 +1,94 @@
+/**		@file VRCommandQueue.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Lock-free queue used to pass commands from the GUI thread to the VR thread.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_COMMAND_QUEUE_H
+#define VR_COMMAND_QUEUE_H
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <utility>
+
+
+/** A single command sent from the GUI to the VR thread. The time the command
+  * was issued is recorded so the render thread can merge several updates of
+  * the same type (keeping the newest) and measure command latency.
+  */
+struct VRCommand {
+    int                                                 type  = 0;      /**< One of VRRenderThread's command names */
+    double                                              value = 0.;     /**< Argument for the command (e.g. degrees per time-step) */
+    std::chrono::steady_clock::time_point               issued;         /**< Time that issueCommand() was called */
+};
+
+
+/** Bounded single-producer / single-consumer ring buffer.
+  *
+  * Exactly one thread (the GUI) may call push() and exactly one thread (the VR
+  * thread) may call pop(). Under that rule no locks are needed: the producer only
+  * writes the tail index and the consumer only writes the head index, and each
+  * side publishes its index with release ordering after touching the slot.
+  *
+  * The two indices are kept on separate cache lines so the threads don't fight
+  * over the same line every time one of them moves.
+  *
+  * @tparam T is the element type, must be default constructible and movable
+  * @tparam Capacity is the number of slots, must be a power of two
+  */
+template <typename T, std::size_t Capacity>
+class SPSCQueue {
+    static_assert( Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "SPSCQueue capacity must be a power of two" );
+
+public:
+    /** Add an item to the back of the queue (producer thread only)
+      * @param item is the value to add
+      * @return false if the queue is full, in which case the item is not added
+      */
+    bool push( T item ) {
+        const std::size_t tail = m_tail.load( std::memory_order_relaxed );
+        if( tail - m_head.load( std::memory_order_acquire ) == Capacity )
+            return false;
+
+        m_buffer[tail & (Capacity - 1)] = std::move(item);
+        m_tail.store( tail + 1, std::memory_order_release );
+        return true;
+    }
+
+    /** Remove the item at the front of the queue (consumer thread only)
+      * @param item receives the value removed
+      * @return false if the queue was empty
+      */
+    bool pop( T& item ) {
+        const std::size_t head = m_head.load( std::memory_order_relaxed );
+        if( head == m_tail.load( std::memory_order_acquire ) )
+            return false;
+
+        item = std::move( m_buffer[head & (Capacity - 1)] );
+        m_buffer[head & (Capacity - 1)] = T();
+        m_head.store( head + 1, std::memory_order_release );
+        return true;
+    }
+
+    /** Approximate number of queued items, exact only when called from the
+      * consumer thread with the producer idle.
+      */
+    std::size_t size() const {
+        return m_tail.load( std::memory_order_acquire ) - m_head.load( std::memory_order_acquire );
+    }
+
+    /** Maximum number of items the queue can hold */
+    static constexpr std::size_t capacity() { return Capacity; }
+
+private:
+    alignas(64) std::atomic<std::size_t>                m_head{ 0 };    /**< Next slot to read, written by consumer */
+    alignas(64) std::atomic<std::size_t>                m_tail{ 0 };    /**< Next slot to write, written by producer */
+    alignas(64) std::array<T, Capacity>                 m_buffer;       /**< Slot storage */
+};
+
+
+#endif
@@ -0,0 +1,311 @@
+/**		@file VRCuller.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Hides actors that are out of view or too small to see, before they are rendered.
+  *
+  *		P Evans 2022
+  */
+
+#include "VRCuller.h"
+
+#include <vtkPolyDataMapper.h>
+#include <vtkSMPTools.h>
+
+#include <algorithm>
+#include <cmath>
+
+
+static const double degToRad = 3.14159265358979323846 / 180.;
+
+/* Extra angle added around the edge of the view. The cull uses the head position
+ * from the previous frame, so this covers head movement during one frame.
+ */
+static const double marginDegrees = 5.;
+
+
+VRCuller::VRCuller() {
+	m_slotsDirty = true;
+	m_instancer = nullptr;
+	m_enabled = true;
+	m_halfSeparation = 0.;
+	m_minimumSize = 1.;
+	m_culled = 0;
+	setViewport(1600., 0.9, 110.);
+}
+
+
+void VRCuller::localBounds( vtkActor* actor, vtkPolyData* data, double bounds[6] ) {
+	if (!data) {
+		vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(actor->GetMapper());
+		data = mapper ? mapper->GetInput() : nullptr;
+	}
+
+	/* No data - an empty box that is never culled, in case the data arrives later */
+	if (!data || data->GetNumberOfPoints() == 0) {
+		std::fill(bounds, bounds + 6, 0.);
+		return;
+	}
+	data->GetBounds(bounds);
+}
+
+
+void VRCuller::setInstancer( VRInstancer* instancer ) {
+	m_instancer = instancer;
+}
+
+
+void VRCuller::apply( Entry& e ) {
+	/* An instanced actor keeps the user's visibility, culling only masks its instance */
+	if (m_instancer && m_instancer->setCulled(e.actor, e.culled)) {
+		if ((e.actor->GetVisibility() != 0) != e.user)
+			e.actor->SetVisibility(e.user);
+		return;
+	}
+
+	bool visible = e.user && !e.culled;
+	if ((e.actor->GetVisibility() != 0) != visible)
+		e.actor->SetVisibility(visible);
+}
+
+
+void VRCuller::add( vtkActor* actor ) {
+	if (!actor || m_index.count(actor))
+		return;
+
+	Entry e;
+	e.actor = actor;
+	e.user = actor->GetVisibility() != 0;
+	localBounds(actor, nullptr, e.bounds);
+
+	m_index[actor] = (int)m_entries.size();
+	m_entries.push_back(e);
+	m_slotsDirty = true;
+}
+
+
+void VRCuller::setInput( vtkActor* actor, vtkPolyData* input ) {
+	auto it = m_index.find(actor);
+	if (it == m_index.end())
+		return;
+
+	/* The actor has also left its instance group, so if it is culled it now has to be hidden itself */
+	Entry& e = m_entries[it->second];
+	localBounds(actor, input, e.bounds);
+	apply(e);
+}
+
+
+void VRCuller::remove( vtkActor* actor ) {
+	auto it = m_index.find(actor);
+	if (it == m_index.end())
+		return;
+
+	int i = it->second;
+	Entry& e = m_entries[i];
+	if (e.culled) {
+		e.culled = false;
+		apply(e);
+		m_culled--;
+	}
+
+	/* Move the last entry into the gap */
+	m_index.erase(it);
+	if (i != (int)m_entries.size() - 1) {
+		m_entries[i] = m_entries.back();
+		m_index[m_entries[i].actor] = i;
+	}
+	m_entries.pop_back();
+	m_slotsDirty = true;
+}
+
+
+void VRCuller::clear() {
+	for (Entry& e : m_entries) {
+		if (e.culled) {
+			e.culled = false;
+			apply(e);
+		}
+	}
+	m_entries.clear();
+	m_index.clear();
+	m_slots.clear();
+	m_result.clear();
+	m_slotsDirty = true;
+	m_culled = 0;
+}
+
+
+bool VRCuller::setVisible( vtkActor* actor, bool visible ) {
+	auto it = m_index.find(actor);
+	if (it == m_index.end())
+		return false;
+
+	Entry& e = m_entries[it->second];
+	e.user = visible;
+	apply(e);
+	return true;
+}
+
+
+void VRCuller::setEnabled( bool enabled ) {
+	if (enabled == m_enabled)
+		return;
+	m_enabled = enabled;
+
+	if (!enabled) {
+		for (Entry& e : m_entries) {
+			if (e.culled) {
+				e.culled = false;
+				apply(e);
+			}
+		}
+		m_culled = 0;
+	}
+}
+
+
+bool VRCuller::isEnabled() const {
+	return m_enabled;
+}
+
+
+void VRCuller::setViewport( double heightPixels, double aspect, double fieldOfView ) {
+	double half = 0.5 * fieldOfView * degToRad;
+	m_pixelsPerRadian = 0.5 * heightPixels / std::tan(half);
+
+	double margin = marginDegrees * degToRad;
+	m_tanHalfHeight = std::tan( std::min(half + margin, 89. * degToRad) );
+	double halfWidth = std::atan( std::tan(half) * aspect );
+	m_tanHalfWidth = std::tan( std::min(halfWidth + margin, 89. * degToRad) );
+}
+
+
+void VRCuller::setEyeSeparation( double distance ) {
+	m_halfSeparation = 0.5 * std::max(distance, 0.);
+}
+
+
+void VRCuller::setMinimumSize( double pixels ) {
+	m_minimumSize = std::max(pixels, 0.);
+}
+
+
+int VRCuller::cull( vtkCamera* camera, const VRTransformStore& transforms, const VRBatcher& batches ) {
+	if (!m_enabled || m_entries.empty())
+		return m_culled;
+
+	/* Slots in the transform store move when actors are removed, so look them up
+	 * again after any change (a hash lookup per actor, only when something changed)
+	 */
+	const int n = (int)m_entries.size();
+	if (m_slotsDirty) {
+		m_slots.resize(n);
+		for (int i = 0; i < n; i++)
+			m_slots[i] = transforms.find(m_entries[i].actor);
+		m_slotsDirty = false;
+	}
+	m_result.resize(n);
+
+	/* Head position and view directions */
+	double eye[3], dop[3], up[3], right[3];
+	camera->GetPosition(eye);
+	camera->GetDirectionOfProjection(dop);
+	camera->GetViewUp(up);
+
+	double d = std::sqrt(dop[0]*dop[0] + dop[1]*dop[1] + dop[2]*dop[2]);
+	for (int j = 0; j < 3; j++) dop[j] /= d;
+	double k = up[0]*dop[0] + up[1]*dop[1] + up[2]*dop[2];
+	for (int j = 0; j < 3; j++) up[j] -= k * dop[j];
+	double u = std::sqrt(up[0]*up[0] + up[1]*up[1] + up[2]*up[2]);
+	for (int j = 0; j < 3; j++) up[j] /= u;
+	right[0] = dop[1]*up[2] - dop[2]*up[1];
+	right[1] = dop[2]*up[0] - dop[0]*up[2];
+	right[2] = dop[0]*up[1] - dop[1]*up[0];
+
+	/* Inward facing normals of the side planes of the view frustum, and the near
+	 * plane. Both eyes look the same way, so they share these normals - only the
+	 * point each plane passes through (the eye) is different.
+	 */
+	double planes[5][3];
+	for (int j = 0; j < 3; j++) {
+		planes[0][j] = m_tanHalfWidth * dop[j] + right[j];
+		planes[1][j] = m_tanHalfWidth * dop[j] - right[j];
+		planes[2][j] = m_tanHalfHeight * dop[j] + up[j];
+		planes[3][j] = m_tanHalfHeight * dop[j] - up[j];
+		planes[4][j] = dop[j];
+	}
+	double eyeShift[5];
+	for (int p = 0; p < 5; p++)
+		eyeShift[p] = m_halfSeparation * (planes[p][0]*right[0] + planes[p][1]*right[1] + planes[p][2]*right[2]);
+
+	const double minimumSize = m_minimumSize;
+	const double pixelsPerRadian = m_pixelsPerRadian;
+
+	/* Each actor only reads its own data and writes its own result, so the actors
+	 * can be split between threads without any locking
+	 */
+	vtkSMPTools::For( 0, n, [&]( vtkIdType first, vtkIdType last ) {
+		for (vtkIdType i = first; i < last; i++) {
+			const Entry& e = m_entries[i];
+			const int slot = m_slots[i];
+			const double* b = e.bounds;
+
+			if (slot < 0 || (b[0] == b[1] && b[2] == b[3] && b[4] == b[5])) {
+				m_result[i] = 0;
+				continue;
+			}
+
+			/* World bounding box: transform the centre, and find how far the
+			 * transformed box extends along each axis
+			 */
+			const double* m = transforms.matrix(slot);
+			double lc[3] = { 0.5*(b[0] + b[1]), 0.5*(b[2] + b[3]), 0.5*(b[4] + b[5]) };
+			double le[3] = { 0.5*(b[1] - b[0]), 0.5*(b[3] - b[2]), 0.5*(b[5] - b[4]) };
+			double c[3], ext[3];
+			for (int r = 0; r < 3; r++) {
+				c[r] = m[4*r]*lc[0] + m[4*r + 1]*lc[1] + m[4*r + 2]*lc[2] + m[4*r + 3] - eye[r];
+				ext[r] = std::fabs(m[4*r])*le[0] + std::fabs(m[4*r + 1])*le[1] + std::fabs(m[4*r + 2])*le[2];
+			}
+
+			/* Outside if the whole box is behind any one plane, for both eyes */
+			bool outside = false;
+			for (int p = 0; p < 5 && !outside; p++) {
+				const double* pn = planes[p];
+				double dist = pn[0]*c[0] + pn[1]*c[1] + pn[2]*c[2];
+				double reach = std::fabs(pn[0])*ext[0] + std::fabs(pn[1])*ext[1] + std::fabs(pn[2])*ext[2];
+				/* Left eye is at -right, right eye at +right */
+				outside = (dist + eyeShift[p] + reach < 0.) && (dist - eyeShift[p] + reach < 0.);
+			}
+
+			/* Too small to see - same size measure as level of detail selection */
+			if (!outside && minimumSize > 0.) {
+				double radius = std::sqrt(ext[0]*ext[0] + ext[1]*ext[1] + ext[2]*ext[2]);
+				double distance = std::sqrt(c[0]*c[0] + c[1]*c[1] + c[2]*c[2]);
+				if (distance > radius)
+					outside = 2. * radius / distance * pixelsPerRadian < minimumSize;
+			}
+
+			m_result[i] = outside ? 1 : 0;
+		}
+	} );
+
+	/* Apply the changes. Most frames very few actors change, and untouched actors
+	 * keep their modification times, so the renderer has no extra work. Instanced
+	 * actors aren't changed at all, only their instance's mask bit.
+	 */
+	for (int i = 0; i < n; i++) {
+		bool culled = m_result[i] != 0;
+		Entry& e = m_entries[i];
+		if (culled == e.culled)
+			continue;
+		if (culled && batches.isBatched(e.actor))
+			continue;
+
+		e.culled = culled;
+		m_culled += culled ? 1 : -1;
+		apply(e);
+	}
+
+	return m_culled;
+}
@@ -0,0 +1,132 @@
+/**		@file VRCuller.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Hides actors that are out of view or too small to see, before they are rendered.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_CULLER_H
+#define VR_CULLER_H
+
+/* Project headers */
+#include "VRTransformStore.h"
+#include "VRBatcher.h"
+#include "VRInstancer.h"
+
+/* Vtk headers */
+#include <vtkSmartPointer.h>
+#include <vtkActor.h>
+#include <vtkCamera.h>
+#include <vtkPolyData.h>
+
+/* Standard headers */
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+/** Every visible actor in the renderer costs CPU time to set up and a draw call
+  * every frame, even if it is behind the user or smaller than a pixel. With a large
+  * assembly most parts are one or the other, so the frame time ends up following
+  * the size of the assembly rather than what is actually on screen.
+  *
+  * Once per frame cull() tests every actor's world bounding box against both eyes'
+  * view frusta, and its projected size against a minimum number of pixels. Each
+  * actor is tested on its own, so the actors are split between threads
+  * (vtkSMPTools). Only actors whose result has changed since the last frame are
+  * touched afterwards, so a still view costs no VTK calls at all.
+  *
+  * Culled actors are hidden with SetVisibility(), apart from instanced ones which
+  * are masked out of their group (VRInstancer::setCulled()) instead, so a group
+  * isn't copied again each time one of its members is culled. The visibility the user asked for is kept
+  * separately (setVisible()) - an actor is shown if the user wants it shown and it
+  * isn't culled, and the user's choice is never lost. Batched actors are not
+  * culled one by one, hiding a part in a batch means editing the batch's mesh.
+  *
+  * Only used by the render thread.
+  */
+class VRCuller {
+public:
+	VRCuller();
+
+	/** Set the instancer that instanced actors are hidden through (none by default) */
+	void setInstancer( VRInstancer* instancer );
+
+	/** Start tracking an actor. Its current visibility is taken to be what the user wants. */
+	void add( vtkActor* actor );
+
+	/** Actor's data has been replaced, its bounds have changed (call after it is taken out of its instance group) */
+	void setInput( vtkActor* actor, vtkPolyData* input );
+
+	/** Stop tracking an actor, it is shown again if it was culled (and the user wants it shown) */
+	void remove( vtkActor* actor );
+
+	/** Stop tracking all actors, showing any that were culled */
+	void clear();
+
+	/** Set the visibility the user wants for an actor
+	  * @return false if the actor isn't tracked (so nothing was done)
+	  */
+	bool setVisible( vtkActor* actor, bool visible );
+
+	/** Turn culling on/off (on by default). Turning it off shows every culled actor. */
+	void setEnabled( bool enabled );
+	bool isEnabled() const;
+
+	/** Set the size of each eye's view
+	  * @param heightPixels is the vertical resolution of each eye
+	  * @param aspect is each eye's width / height
+	  * @param fieldOfView is the vertical field of view in degrees
+	  */
+	void setViewport( double heightPixels, double aspect, double fieldOfView );
+
+	/** Set the distance between the eyes, in world units (0 tests a single view) */
+	void setEyeSeparation( double distance );
+
+	/** Set the projected size (pixels) below which actors are culled, 0 to keep
+	  * all actors in view however small (default 1 pixel)
+	  */
+	void setMinimumSize( double pixels );
+
+	/** Cull actors for the next frame
+	  * @param camera is the user's view (the head, between the two eyes)
+	  * @param transforms holds the actors' matrices (after its own update())
+	  * @param batches is checked so batched actors aren't culled
+	  * @return number of actors culled
+	  */
+	int cull( vtkCamera* camera, const VRTransformStore& transforms, const VRBatcher& batches );
+
+private:
+	/** A tracked actor */
+	struct Entry {
+		vtkSmartPointer<vtkActor>			actor;
+		double								bounds[6];			/**< Local bounds of its data */
+		bool								user = true;		/**< Visibility the user wants */
+		bool								culled = false;		/**< Hidden by culling */
+	};
+
+	/** Show or hide an entry's actor to match its user and culled flags */
+	void apply( Entry& e );
+
+	/** Read an actor's local bounds from its mapper */
+	static void localBounds( vtkActor* actor, vtkPolyData* data, double bounds[6] );
+
+	std::vector<Entry>								m_entries;
+	std::unordered_map<vtkActor*, int>				m_index;		/**< Position of each actor in m_entries */
+	std::vector<int>								m_slots;		/**< Transform store slot of each entry */
+	std::vector<std::uint8_t>						m_result;		/**< 1 if entry should be culled, written by the parallel sweep */
+	bool											m_slotsDirty;	/**< Actors added or removed since m_slots was filled */
+	VRInstancer*									m_instancer;
+
+	bool											m_enabled;
+	double											m_pixelsPerRadian;	/**< Projection scale, see VRLODSelector */
+	double											m_tanHalfHeight;	/**< Tangent of half the vertical field of view */
+	double											m_tanHalfWidth;		/**< Tangent of half the horizontal field of view */
+	double											m_halfSeparation;	/**< Half the eye separation */
+	double											m_minimumSize;		/**< Pixels */
+	int												m_culled;
+};
+
+
+#endif
@@ -0,0 +1,219 @@
+/**		@file VRFrameStats.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Per-frame timing of the VR render loop.
+  *
+  *		P Evans 2022
+  */
+
+#include "VRFrameStats.h"
+
+#include <QFile>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <cstdio>
+
+
+/* A frame counts as missed if it takes more than 5% longer than the deadline */
+static const double missedFrameMargin = 1.05;
+
+
+const char* VRFrameReport::phaseName( int phase ) {
+	static const char* names[PHASE_COUNT] = {
+		"commands", "scene_changes", "events", "render", "animation", "culling", "scene_update", "frame"
+	};
+	return (phase >= 0 && phase < PHASE_COUNT) ? names[phase] : "";
+}
+
+
+VRFrameStats::VRFrameStats( int window ) {
+	m_window = std::max(window, 1);
+	m_targetMs = 1000. / 90.;
+	m_csvChanged = false;
+	reset();
+}
+
+
+void VRFrameStats::reset() {
+	m_current.fill(0.);
+	m_ring.assign(m_window, std::array<float, VRFrameReport::PHASE_COUNT>());
+	m_ringMissed.assign(m_window, 0);
+	m_histogram.assign(VRFrameReport::PHASE_COUNT, std::array<int, bins + 1>());
+	for (std::array<int, bins + 1>& h : m_histogram)
+		h.fill(0);
+
+	m_next = 0;
+	m_count = 0;
+	m_missed = 0;
+	m_totalFrames = 0;
+	m_totalMissed = 0;
+	m_totalCommands = 0;
+	m_commandLatencyMax = 0.;
+	m_start = std::chrono::steady_clock::now();
+}
+
+
+void VRFrameStats::setWindow( int window ) {
+	m_window = std::max(window, 1);
+	reset();
+}
+
+
+void VRFrameStats::setTarget( double ms ) {
+	if (ms > 0.)
+		m_targetMs = ms;
+}
+
+
+void VRFrameStats::record( VRFrameReport::Phase phase, double ms ) {
+	m_current[phase] += ms;
+}
+
+
+double VRFrameStats::recorded( VRFrameReport::Phase phase ) const {
+	return m_current[phase];
+}
+
+
+void VRFrameStats::recordCommand( double latencyMs ) {
+	m_totalCommands++;
+	m_commandLatencyMax = std::max(m_commandLatencyMax, latencyMs);
+}
+
+
+int VRFrameStats::bin( double ms ) {
+	int b = int(ms / binWidth);
+	return std::min(std::max(b, 0), bins);
+}
+
+
+void VRFrameStats::endFrame() {
+	const bool missed = m_current[VRFrameReport::FRAME] > m_targetMs * missedFrameMargin;
+
+	/* Take the oldest frame out of the histograms once the window is full */
+	if (m_count == m_window) {
+		for (int p = 0; p < VRFrameReport::PHASE_COUNT; p++)
+			m_histogram[p][ bin(m_ring[m_next][p]) ]--;
+		m_missed -= m_ringMissed[m_next];
+	}
+	else {
+		m_count++;
+	}
+
+	for (int p = 0; p < VRFrameReport::PHASE_COUNT; p++) {
+		m_ring[m_next][p] = float(m_current[p]);
+		m_histogram[p][ bin(m_current[p]) ]++;
+	}
+	m_ringMissed[m_next] = missed ? 1 : 0;
+	m_missed += missed ? 1 : 0;
+	m_next = (m_next + 1) % m_window;
+
+	m_totalFrames++;
+	m_totalMissed += missed ? 1 : 0;
+
+	/* One CSV line per frame, only if a file is being written */
+	if (!m_csvOpen.isEmpty()) {
+		char line[256];
+		int n = std::snprintf( line, sizeof(line), "%llu,%.3f", m_totalFrames,
+			std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count() );
+		for (int p = 0; p < VRFrameReport::PHASE_COUNT && n < int(sizeof(line)); p++)
+			n += std::snprintf( line + n, sizeof(line) - n, ",%.3f", m_current[p] );
+		if (n < int(sizeof(line)))
+			n += std::snprintf( line + n, sizeof(line) - n, ",%d\n", missed ? 1 : 0 );
+		m_csvLines.append( line, std::min(n, int(sizeof(line)) - 1) );
+	}
+
+	m_current.fill(0.);
+}
+
+
+double VRFrameStats::percentile( int phase, double f ) const {
+	if (m_count == 0)
+		return 0.;
+
+	/* Walk the histogram until the required number of frames have been passed */
+	const int target = std::max( 1, int(f * m_count + 0.5) );
+	int seen = 0;
+	for (int b = 0; b <= bins; b++) {
+		seen += m_histogram[phase][b];
+		if (seen >= target)
+			return (b + 0.5) * binWidth;
+	}
+	return bins * binWidth;
+}
+
+
+VRFrameReport VRFrameStats::report() const {
+	VRFrameReport r;
+	r.frames = m_count;
+	r.missed = m_missed;
+	r.totalFrames = m_totalFrames;
+	r.totalMissed = m_totalMissed;
+	r.targetMs = m_targetMs;
+	r.totalCommands = m_totalCommands;
+	r.commandLatencyMax = m_commandLatencyMax;
+
+	for (int p = 0; p < VRFrameReport::PHASE_COUNT; p++) {
+		/* Max is taken from the ring rather than the histogram so it is exact, even past 100ms */
+		double m = 0.;
+		for (int i = 0; i < m_count; i++)
+			m = std::max(m, double(m_ring[i][p]));
+		r.max[p] = m;
+
+		/* Percentiles are bin centres, which can be a little over the true max */
+		r.p50[p] = std::min( percentile(p, 0.50), m );
+		r.p99[p] = std::min( percentile(p, 0.99), m );
+	}
+
+	return r;
+}
+
+
+void VRFrameStats::setCsvFile( const QString& fileName ) {
+	QMutexLocker lock(&m_csvMutex);
+	m_csvName = fileName;
+	m_csvChanged = true;
+}
+
+
+void VRFrameStats::flush() {
+	/* Pick up a change of file, the GUI may be holding the lock so don't wait for it */
+	QString name;
+	bool changed = false;
+	if (m_csvMutex.tryLock()) {
+		name = m_csvName;
+		changed = m_csvChanged;
+		m_csvChanged = false;
+		m_csvMutex.unlock();
+	}
+
+	/* Lines collected so far belong to the current file */
+	if (!m_csvOpen.isEmpty() && !m_csvLines.isEmpty()) {
+		QFile file(m_csvOpen);
+		if (file.open(QIODevice::WriteOnly | QIODevice::Append))
+			file.write(m_csvLines);
+	}
+	m_csvLines.clear();
+
+	if (!changed)
+		return;
+
+	/* Start the new file with a heading line */
+	m_csvOpen = name;
+	if (m_csvOpen.isEmpty())
+		return;
+
+	QFile file(m_csvOpen);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		m_csvOpen.clear();
+		return;
+	}
+
+	QByteArray heading("frame,time_ms");
+	for (int p = 0; p < VRFrameReport::PHASE_COUNT; p++)
+		heading += QByteArray(",") + VRFrameReport::phaseName(p) + "_ms";
+	heading += ",missed\n";
+	file.write(heading);
+}
@@ -0,0 +1,152 @@
+/**		@file VRFrameStats.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Per-frame timing of the VR render loop.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_FRAME_STATS_H
+#define VR_FRAME_STATS_H
+
+/* Qt headers */
+#include <QString>
+#include <QByteArray>
+#include <QMutex>
+#include <QMetaType>
+
+/* Standard headers */
+#include <array>
+#include <chrono>
+#include <vector>
+
+
+/** Timing summary sent from the render thread to the GUI. All times are in
+  * milliseconds and cover the most recent frames (see VRFrameStats).
+  */
+struct VRFrameReport {
+	/** Parts of the frame that are timed */
+	enum Phase {
+		COMMANDS,			/**< Handling GUI commands */
+		SCENE_CHANGES,		/**< Applying queued scene changes (add/remove actors etc) */
+		EVENTS,				/**< Interactor event pump (DoOneEvent, excluding rendering) */
+		RENDER,				/**< Rendering (window StartEvent to EndEvent) */
+		ANIMATION,			/**< Animation time-steps and actor transforms */
+		CULLING,			/**< Hiding actors that are out of view or too small to see */
+		SCENE_UPDATE,		/**< Instancing, batching and level of detail */
+		FRAME,				/**< Whole frame, start to start (includes waiting for the headset) */
+		PHASE_COUNT
+	};
+
+	int					frames = 0;			/**< Frames covered by this report */
+	int					missed = 0;			/**< Frames that took longer than the deadline */
+	unsigned long long	totalFrames = 0;	/**< Frames since rendering started */
+	unsigned long long	totalMissed = 0;	/**< Missed frames since rendering started */
+	double				targetMs = 0.;		/**< Frame deadline */
+
+	unsigned long long	totalCommands = 0;	/**< GUI commands handled since rendering started */
+	unsigned long long	droppedCommands = 0;/**< GUI commands dropped because the queue was full */
+	double				commandLatencyMax = 0.;	/**< Longest a command waited between issueCommand() and being handled, since rendering started */
+
+	std::array<double, PHASE_COUNT>	p50 = {};	/**< Median time of each phase */
+	std::array<double, PHASE_COUNT>	p99 = {};	/**< 99th percentile time of each phase */
+	std::array<double, PHASE_COUNT>	max = {};	/**< Longest time of each phase */
+
+	/** Name of a phase, e.g. for labels or CSV headings */
+	static const char* phaseName( int phase );
+};
+
+Q_DECLARE_METATYPE(VRFrameReport)
+
+
+/** Records how long each part of every frame takes, so stutter can be tracked
+  * down without a profiler.
+  *
+  * The last few seconds of frames (900 by default, 10s at 90Hz) are kept in a
+  * ring buffer, along with a histogram of each phase (0.05ms bins up to 100ms).
+  * Adding a frame updates the histograms incrementally - the new frame is added
+  * and the one leaving the window is removed - so percentiles can be read at any
+  * time without sorting.
+  *
+  * Optionally each frame is also written to a CSV file. Lines are collected in
+  * memory and written when flush() is called (once per report), so the render
+  * thread isn't doing file writes every frame.
+  *
+  * Only used by the render thread, except setCsvFile() which can be called from any thread.
+  */
+class VRFrameStats {
+public:
+	/** Constructor
+	  * @param window is the number of frames used for the statistics
+	  */
+	VRFrameStats( int window = 900 );
+
+	/** Clear all recorded frames */
+	void reset();
+
+	/** Change the number of frames used for the statistics (clears recorded frames) */
+	void setWindow( int window );
+
+	/** Set frame deadline, frames longer than this (plus 5%) count as missed */
+	void setTarget( double ms );
+
+	/** Set the time of one phase of the current frame (added to any time already recorded for it) */
+	void record( VRFrameReport::Phase phase, double ms );
+
+	/** Get the time recorded so far for one phase of the current frame */
+	double recorded( VRFrameReport::Phase phase ) const;
+
+	/** Count a handled GUI command
+	  * @param latencyMs is the time from it being issued to being handled
+	  */
+	void recordCommand( double latencyMs );
+
+	/** Finish the current frame and add it to the statistics */
+	void endFrame();
+
+	/** Get a summary of the frames in the window */
+	VRFrameReport report() const;
+
+	/** Start writing every frame to a CSV file, an empty name stops writing
+	  * (the file is opened by the render thread at the next flush)
+	  */
+	void setCsvFile( const QString& fileName );
+
+	/** Write any collected CSV lines */
+	void flush();
+
+private:
+	static constexpr int		bins = 2000;			/**< Histogram bins, plus one for anything longer */
+	static constexpr double		binWidth = 0.05;		/**< Histogram bin width (ms) */
+
+	static int bin( double ms );
+
+	/** Value at fraction f (0-1) of the way through a phase's histogram */
+	double percentile( int phase, double f ) const;
+
+	int														m_window;
+	double													m_targetMs;
+
+	std::array<double, VRFrameReport::PHASE_COUNT>			m_current;		/**< Frame being recorded */
+	std::vector<std::array<float, VRFrameReport::PHASE_COUNT>>	m_ring;		/**< Recent frames */
+	std::vector<unsigned char>								m_ringMissed;
+	int														m_next;			/**< Next slot in the ring */
+	int														m_count;		/**< Frames in the ring */
+	std::vector<std::array<int, bins + 1>>					m_histogram;	/**< One histogram per phase */
+	int														m_missed;		/**< Missed frames in the ring */
+	unsigned long long										m_totalFrames;
+	unsigned long long										m_totalMissed;
+	unsigned long long										m_totalCommands;
+	double													m_commandLatencyMax;
+
+	/* CSV output */
+	QMutex													m_csvMutex;		/**< Protects m_csvName / m_csvChanged */
+	QString													m_csvName;
+	bool													m_csvChanged;
+	QString													m_csvOpen;		/**< File being written (render thread) */
+	QByteArray												m_csvLines;		/**< Lines not yet written */
+	std::chrono::steady_clock::time_point					m_start;		/**< Time of reset(), for CSV timestamps */
+};
+
+
+#endif
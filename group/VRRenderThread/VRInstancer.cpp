@@ -0,0 +1,342 @@
+/**		@file VRInstancer.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Draws actors that share the same geometry as a single instanced actor.
+  *
+  *		P Evans 2022
+  */
+
+#include "VRInstancer.h"
+
+#include <vtkPolyDataMapper.h>
+#include <vtkPoints.h>
+#include <vtkPointData.h>
+#include <vtkProperty.h>
+#include <vtkMatrix4x4.h>
+
+#include <algorithm>
+#include <cmath>
+
+
+/* Split a matrix into translation, rotation (unit quaternion w, x, y, z) and scale.
+ * Actor matrices are built from these three parts so there is no shear to lose.
+ */
+static void decompose( vtkMatrix4x4* m, float p[3], float q[4], float s[3] ) {
+	double r[3][3];
+	double scale[3];
+
+	for (int j = 0; j < 3; j++) {
+		p[j] = float(m->GetElement(j, 3));
+
+		scale[j] = std::sqrt( m->GetElement(0, j)*m->GetElement(0, j) + m->GetElement(1, j)*m->GetElement(1, j) + m->GetElement(2, j)*m->GetElement(2, j) );
+		double inv = (scale[j] > 0.) ? 1. / scale[j] : 0.;
+		for (int i = 0; i < 3; i++)
+			r[i][j] = m->GetElement(i, j) * inv;
+	}
+
+	/* A mirror image has a negative determinant - put the reflection in the scale so the rotation is proper */
+	double det = r[0][0]*(r[1][1]*r[2][2] - r[1][2]*r[2][1]) - r[0][1]*(r[1][0]*r[2][2] - r[1][2]*r[2][0]) + r[0][2]*(r[1][0]*r[2][1] - r[1][1]*r[2][0]);
+	if (det < 0.) {
+		scale[0] = -scale[0];
+		for (int i = 0; i < 3; i++)
+			r[i][0] = -r[i][0];
+	}
+
+	/* Rotation matrix to quaternion, choosing the largest term to divide by for accuracy */
+	double trace = r[0][0] + r[1][1] + r[2][2];
+	double w, x, y, z;
+	if (trace > 0.) {
+		double k = 0.5 / std::sqrt(trace + 1.);
+		w = 0.25 / k;
+		x = (r[2][1] - r[1][2]) * k;
+		y = (r[0][2] - r[2][0]) * k;
+		z = (r[1][0] - r[0][1]) * k;
+	}
+	else if (r[0][0] > r[1][1] && r[0][0] > r[2][2]) {
+		double k = 2. * std::sqrt(1. + r[0][0] - r[1][1] - r[2][2]);
+		w = (r[2][1] - r[1][2]) / k;
+		x = 0.25 * k;
+		y = (r[0][1] + r[1][0]) / k;
+		z = (r[0][2] + r[2][0]) / k;
+	}
+	else if (r[1][1] > r[2][2]) {
+		double k = 2. * std::sqrt(1. + r[1][1] - r[0][0] - r[2][2]);
+		w = (r[0][2] - r[2][0]) / k;
+		x = (r[0][1] + r[1][0]) / k;
+		y = 0.25 * k;
+		z = (r[1][2] + r[2][1]) / k;
+	}
+	else {
+		double k = 2. * std::sqrt(1. + r[2][2] - r[0][0] - r[1][1]);
+		w = (r[1][0] - r[0][1]) / k;
+		x = (r[0][2] + r[2][0]) / k;
+		y = (r[1][2] + r[2][1]) / k;
+		z = 0.25 * k;
+	}
+
+	q[0] = float(w); q[1] = float(x); q[2] = float(y); q[3] = float(z);
+	s[0] = float(scale[0]); s[1] = float(scale[1]); s[2] = float(scale[2]);
+}
+
+
+/* Newest change to anything about an actor that the instanced copy shows */
+static vtkMTimeType memberMTime( vtkActor* a ) {
+	vtkMTimeType t = a->GetMTime();
+	if (a->GetUserMatrix())
+		t = std::max(t, a->GetUserMatrix()->GetMTime());
+	if (a->GetProperty())
+		t = std::max(t, a->GetProperty()->GetMTime());
+	return t;
+}
+
+
+VRInstancer::VRInstancer() {
+	m_renderer = nullptr;
+	m_threshold = 4;
+}
+
+
+void VRInstancer::setRenderer( vtkRenderer* renderer ) {
+	m_renderer = renderer;
+}
+
+
+void VRInstancer::setThreshold( int n ) {
+	m_threshold = std::max(n, 2);
+}
+
+
+std::vector<vtkActor*> VRInstancer::add( vtkActor* actor ) {
+	std::vector<vtkActor*> absorbed;
+
+	/* Actors are grouped by the data their mapper draws, only plain polydata mappers can be instanced */
+	vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(actor->GetMapper());
+	vtkPolyData* source = mapper ? mapper->GetInput() : nullptr;
+	if (!source || m_index.count(actor))
+		return absorbed;
+
+	Group& g = m_groups[source];
+	g.source = source;
+	Member m;
+	m.source = source;
+	m.position = (int)g.members.size();
+	g.members.push_back(actor);
+	g.dirty = true;
+	m_index[actor] = m;
+
+	if (g.actor) {
+		/* Group is already instanced, just hide the new member's own actor */
+		if (m_renderer)
+			m_renderer->RemoveActor(actor);
+		absorbed.push_back(actor);
+	}
+	else if (int(g.members.size()) >= m_threshold && m_renderer) {
+		instance(g);
+		for (vtkActor* a : g.members)
+			absorbed.push_back(a);
+	}
+
+	return absorbed;
+}
+
+
+bool VRInstancer::remove( vtkActor* actor ) {
+	auto it = m_index.find(actor);
+	if (it == m_index.end())
+		return false;
+
+	auto git = m_groups.find(it->second.source);
+	const int i = it->second.position;
+	m_index.erase(it);
+	if (git == m_groups.end())
+		return false;
+
+	/* Move the last member into the gap, the instances are copied again in update() */
+	Group& g = git->second;
+	if (i != (int)g.members.size() - 1) {
+		g.members[i] = g.members.back();
+		m_index[g.members[i]].position = i;
+	}
+	g.members.pop_back();
+	g.dirty = true;
+	const bool instanced = bool(g.actor);
+
+	/* Once a group is instanced it stays that way until it is empty, so parts don't
+	 * jump between the two ways of drawing as the scene is edited
+	 */
+	if (g.members.empty()) {
+		if (g.actor && m_renderer)
+			m_renderer->RemoveActor(g.actor);
+		m_groups.erase(git);
+	}
+
+	return instanced;
+}
+
+
+void VRInstancer::clear() {
+	for (auto& it : m_groups) {
+		if (it.second.actor && m_renderer)
+			m_renderer->RemoveActor(it.second.actor);
+	}
+	m_groups.clear();
+	m_index.clear();
+}
+
+
+bool VRInstancer::isInstanced( vtkActor* actor ) const {
+	auto it = m_index.find(actor);
+	if (it == m_index.end())
+		return false;
+
+	auto git = m_groups.find(it->second.source);
+	return git != m_groups.end() && git->second.actor;
+}
+
+
+bool VRInstancer::setCulled( vtkActor* actor, bool culled ) {
+	auto it = m_index.find(actor);
+	if (it == m_index.end())
+		return false;
+
+	auto git = m_groups.find(it->second.source);
+	if (git == m_groups.end() || !git->second.actor)
+		return false;
+
+	Member& m = it->second;
+	if (m.culled == culled)
+		return true;
+	m.culled = culled;
+
+	/* Just flip this instance's mask bit. If members have been added or removed the
+	 * whole group is copied in update() anyway, and picks up the new flag there.
+	 */
+	Group& g = git->second;
+	if (!g.dirty && m.position < g.mask->GetNumberOfTuples()) {
+		const bool shown = !culled && actor->GetVisibility();
+		if ((g.mask->GetValue(m.position) != 0) != shown) {
+			g.mask->SetValue(m.position, shown);
+			g.mask->Modified();
+			g.shown += shown ? 1 : -1;
+			g.actor->SetVisibility( g.shown > 0 );
+		}
+	}
+	return true;
+}
+
+
+void VRInstancer::instance( Group& g ) {
+	g.instances = vtkSmartPointer<vtkPolyData>::New();
+	g.instances->SetPoints( vtkSmartPointer<vtkPoints>::New() );
+
+	g.orientation = vtkSmartPointer<vtkFloatArray>::New();
+	g.orientation->SetName("Orientation");
+	g.orientation->SetNumberOfComponents(4);
+
+	g.scale = vtkSmartPointer<vtkFloatArray>::New();
+	g.scale->SetName("Scale");
+	g.scale->SetNumberOfComponents(3);
+
+	g.colour = vtkSmartPointer<vtkUnsignedCharArray>::New();
+	g.colour->SetName("Colour");
+	g.colour->SetNumberOfComponents(4);
+
+	g.mask = vtkSmartPointer<vtkBitArray>::New();
+	g.mask->SetName("Mask");
+	g.mask->SetNumberOfComponents(1);
+
+	g.instances->GetPointData()->AddArray(g.orientation);
+	g.instances->GetPointData()->AddArray(g.scale);
+	g.instances->GetPointData()->AddArray(g.mask);
+	g.instances->GetPointData()->SetScalars(g.colour);
+
+	/* The glyph mapper draws the shared mesh once at each point, using the
+	 * per-point arrays for each copy's transform and colour
+	 */
+	g.mapper = vtkSmartPointer<vtkGlyph3DMapper>::New();
+	g.mapper->SetSourceData(g.source);
+	g.mapper->SetInputData(g.instances);
+	g.mapper->SetOrientationModeToQuaternion();
+	g.mapper->SetOrientationArray("Orientation");
+	g.mapper->SetScaleModeToScaleByVectorComponents();
+	g.mapper->SetScaleArray("Scale");
+	g.mapper->ScalingOn();
+	g.mapper->SetScalarModeToUsePointData();
+	g.mapper->SetColorModeToDirectScalars();
+	g.mapper->ScalarVisibilityOn();
+	g.mapper->MaskingOn();
+	g.mapper->SetMaskArray("Mask");
+
+	/* Lighting etc come from the first member, colour comes from the per-instance array */
+	g.actor = vtkSmartPointer<vtkActor>::New();
+	g.actor->SetMapper(g.mapper);
+	g.actor->GetProperty()->DeepCopy( g.members.front()->GetProperty() );
+
+	for (vtkActor* a : g.members)
+		m_renderer->RemoveActor(a);
+	m_renderer->AddActor(g.actor);
+
+	g.dirty = true;
+}
+
+
+void VRInstancer::update() {
+	for (auto& it : m_groups) {
+		Group& g = it.second;
+		if (!g.actor)
+			continue;
+
+		/* Only rebuild the arrays if a member has moved or changed. Culling doesn't
+		 * touch the members (see setCulled()), so doesn't cause a rebuild.
+		 */
+		vtkMTimeType newest = 0;
+		for (vtkActor* a : g.members)
+			newest = std::max(newest, memberMTime(a));
+		if (!g.dirty && newest <= g.updated)
+			continue;
+
+		vtkPoints* points = g.instances->GetPoints();
+		points->SetNumberOfPoints(0);
+		g.orientation->SetNumberOfTuples(0);
+		g.scale->SetNumberOfTuples(0);
+		g.colour->SetNumberOfTuples(0);
+		g.mask->SetNumberOfTuples(0);
+		g.shown = 0;
+
+		/* Every member gets an instance, so each keeps its position for setCulled() */
+		for (vtkActor* a : g.members) {
+			const bool shown = a->GetVisibility() && !m_index[a].culled;
+			g.shown += shown ? 1 : 0;
+
+			float p[3], q[4], s[3];
+			decompose( a->GetMatrix(), p, q, s );
+
+			double rgb[3];
+			a->GetProperty()->GetColor(rgb);
+			unsigned char c[4] = {
+				(unsigned char)(std::min(std::max(rgb[0], 0.), 1.) * 255.),
+				(unsigned char)(std::min(std::max(rgb[1], 0.), 1.) * 255.),
+				(unsigned char)(std::min(std::max(rgb[2], 0.), 1.) * 255.),
+				(unsigned char)(std::min(std::max(a->GetProperty()->GetOpacity(), 0.), 1.) * 255.)
+			};
+
+			points->InsertNextPoint(p);
+			g.orientation->InsertNextTypedTuple(q);
+			g.scale->InsertNextTypedTuple(s);
+			g.colour->InsertNextTypedTuple(c);
+			g.mask->InsertNextValue(shown);
+		}
+
+		points->Modified();
+		g.orientation->Modified();
+		g.scale->Modified();
+		g.colour->Modified();
+		g.mask->Modified();
+		g.instances->Modified();
+
+		g.actor->SetVisibility( g.shown > 0 );
+		g.updated = newest;
+		g.dirty = false;
+	}
+}
@@ -0,0 +1,114 @@
+/**		@file VRInstancer.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Draws actors that share the same geometry as a single instanced actor.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_INSTANCER_H
+#define VR_INSTANCER_H
+
+/* Vtk headers */
+#include <vtkSmartPointer.h>
+#include <vtkActor.h>
+#include <vtkRenderer.h>
+#include <vtkPolyData.h>
+#include <vtkGlyph3DMapper.h>
+#include <vtkFloatArray.h>
+#include <vtkUnsignedCharArray.h>
+#include <vtkBitArray.h>
+
+/* Standard headers */
+#include <unordered_map>
+#include <vector>
+
+
+/** Repeated parts (bolts, brackets, etc) all share one vtkPolyData (see GeometryStore
+  * in the tree model). Drawing them as separate actors still costs one draw call,
+  * and one copy of the mesh on the graphics card, per part. Once there are enough
+  * copies of a mesh this class replaces them with a single actor using a
+  * vtkGlyph3DMapper, which uploads the mesh once and draws every copy in one
+  * instanced draw call.
+  *
+  * The original actors are kept (and still hold each copy's transform, colour and
+  * visibility, e.g. from VRTransformStore) but are taken out of the renderer. Each
+  * frame update() copies their position, orientation, scale and colour into the
+  * per-instance arrays of the glyph mapper.
+  *
+  * Every member has an instance, hidden members are masked out (vtkGlyph3DMapper
+  * masking). Culling changes every frame as the user looks around, so it only
+  * changes the mask (setCulled()) and leaves the member actors alone - changing
+  * a member's visibility would make the whole group be copied again.
+  *
+  * Only used by the render thread.
+  */
+class VRInstancer {
+public:
+	VRInstancer();
+
+	/** Set the renderer that actors are moved out of and instanced actors added to */
+	void setRenderer( vtkRenderer* renderer );
+
+	/** Set the number of actors that must share a mesh before they are instanced (default 4) */
+	void setThreshold( int n );
+
+	/** Start tracking an actor, which must already be in the renderer
+	  * @return actors that have just been moved into an instanced group (empty if none)
+	  */
+	std::vector<vtkActor*> add( vtkActor* actor );
+
+	/** Stop tracking an actor
+	  * @return true if the actor was being drawn as an instance, i.e. it is not in the renderer
+	  */
+	bool remove( vtkActor* actor );
+
+	/** Stop tracking all actors, and remove instanced actors from the renderer */
+	void clear();
+
+	/** Check whether an actor is being drawn as an instance */
+	bool isInstanced( vtkActor* actor ) const;
+
+	/** Hide or show an instanced actor's copy for culling, without changing the actor
+	  * @return false if the actor isn't drawn as an instance (so nothing was done)
+	  */
+	bool setCulled( vtkActor* actor, bool culled );
+
+	/** Copy member transforms and colours into the instanced actors */
+	void update();
+
+private:
+	/** All actors sharing one mesh */
+	struct Group {
+		vtkSmartPointer<vtkPolyData>				source;			/**< Shared mesh */
+		std::vector<vtkSmartPointer<vtkActor>>		members;
+		vtkSmartPointer<vtkActor>					actor;			/**< Instanced actor, nullptr until threshold reached */
+		vtkSmartPointer<vtkGlyph3DMapper>			mapper;
+		vtkSmartPointer<vtkPolyData>				instances;		/**< One point per member, in member order */
+		vtkSmartPointer<vtkFloatArray>				orientation;	/**< Quaternion (w, x, y, z) per instance */
+		vtkSmartPointer<vtkFloatArray>				scale;			/**< Scale (x, y, z) per instance */
+		vtkSmartPointer<vtkUnsignedCharArray>		colour;			/**< RGBA per instance */
+		vtkSmartPointer<vtkBitArray>				mask;			/**< 1 per instance that is drawn */
+		int											shown = 0;		/**< Number of 1s in mask */
+		vtkMTimeType								updated = 0;	/**< Newest member change copied */
+		bool										dirty = true;	/**< Members added/removed */
+	};
+
+	/** A tracked actor */
+	struct Member {
+		vtkPolyData*								source;			/**< Group it is in */
+		int											position;		/**< Position in the group's members (and instances) */
+		bool										culled = false;	/**< Masked out by setCulled() */
+	};
+
+	/** Replace a group's actors with one instanced actor */
+	void instance( Group& g );
+
+	vtkRenderer*											m_renderer;
+	int														m_threshold;
+	std::unordered_map<vtkPolyData*, Group>					m_groups;		/**< Groups by shared mesh */
+	std::unordered_map<vtkActor*, Member>					m_index;		/**< Group and position of each tracked actor */
+};
+
+
+#endif
@@ -0,0 +1,186 @@
+/**		@file VRLODSelector.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Chooses which level of detail to draw for each actor in the VR scene.
+  *
+  *		P Evans 2022
+  */
+
+#include "VRLODSelector.h"
+
+#include <vtkPolyDataMapper.h>
+#include <vtkMatrix4x4.h>
+
+#include <algorithm>
+#include <cmath>
+
+
+static const double degToRad = 3.14159265358979323846 / 180.;
+
+/* Frame time feedback - a frame more than 5% over the deadline counts as missed and
+ * cuts the quality straight away, it is then raised gently once frames have been
+ * on time for about half a second
+ */
+static const double missedFrameMargin	= 1.05;
+static const double qualityDrop			= 0.85;
+static const double qualityRise			= 1.05;
+static const int    recoveryFrames		= 45;
+static const double minimumQuality		= 0.1;
+
+/* How far (in levels) the ideal level must move past a boundary before an actor switches */
+static const double hysteresis = 0.15;
+
+
+VRLODSelector::VRLODSelector() {
+	m_threshold = 300.;
+	m_targetMs = 1000. / 90.;
+	m_quality = 1.;
+	m_onTimeFrames = 0;
+	setViewport(1600., 110.);
+}
+
+
+void VRLODSelector::setLevels( vtkActor* actor, const std::vector<vtkSmartPointer<vtkPolyData>>& levels ) {
+	vtkPolyDataMapper* original = vtkPolyDataMapper::SafeDownCast(actor->GetMapper());
+	if (!original || levels.empty())
+		return;
+
+	/* Replacing existing levels - go back to the actor's own mapper first */
+	remove(actor);
+	original = vtkPolyDataMapper::SafeDownCast(actor->GetMapper());
+
+	Entry e;
+	e.actor = actor;
+	e.current = 0;
+	e.mappers.push_back(original);
+
+	/* The extra mappers copy the original's settings (scalar colouring etc) but draw the simplified data */
+	for (std::size_t i = 1; i < levels.size(); i++) {
+		vtkSmartPointer<vtkPolyDataMapper> m = vtkSmartPointer<vtkPolyDataMapper>::New();
+		m->ShallowCopy(original);
+		m->SetInputData(levels[i]);
+		e.mappers.push_back(m);
+	}
+
+	double b[6];
+	levels[0]->GetBounds(b);
+	e.center[0] = 0.5 * (b[0] + b[1]);
+	e.center[1] = 0.5 * (b[2] + b[3]);
+	e.center[2] = 0.5 * (b[4] + b[5]);
+	e.radius = 0.5 * std::sqrt( (b[1]-b[0])*(b[1]-b[0]) + (b[3]-b[2])*(b[3]-b[2]) + (b[5]-b[4])*(b[5]-b[4]) );
+
+	m_index[actor] = m_entries.size();
+	m_entries.push_back(e);
+}
+
+
+void VRLODSelector::remove( vtkActor* actor ) {
+	auto it = m_index.find(actor);
+	if (it == m_index.end())
+		return;
+
+	std::size_t i = it->second;
+	setLevel(m_entries[i], 0);
+	m_index.erase(it);
+
+	/* Move the last entry into the gap */
+	if (i != m_entries.size() - 1) {
+		m_entries[i] = std::move(m_entries.back());
+		m_index[m_entries[i].actor] = i;
+	}
+	m_entries.pop_back();
+}
+
+
+void VRLODSelector::clear() {
+	for (Entry& e : m_entries)
+		setLevel(e, 0);
+
+	m_entries.clear();
+	m_index.clear();
+}
+
+
+void VRLODSelector::setViewport( double heightPixels, double fieldOfView ) {
+	m_pixelsPerRadian = 0.5 * heightPixels / std::tan(0.5 * fieldOfView * degToRad);
+}
+
+
+void VRLODSelector::setDetailThreshold( double pixels ) {
+	m_threshold = std::max(pixels, 1.);
+}
+
+
+void VRLODSelector::setFrameTarget( double ms ) {
+	if (ms > 0.)
+		m_targetMs = ms;
+}
+
+
+void VRLODSelector::frameFinished( double ms ) {
+	if (ms > m_targetMs * missedFrameMargin) {
+		m_quality = std::max(m_quality * qualityDrop, minimumQuality);
+		m_onTimeFrames = 0;
+	}
+	else if (++m_onTimeFrames >= recoveryFrames) {
+		m_quality = std::min(m_quality * qualityRise, 1.);
+		m_onTimeFrames = 0;
+	}
+}
+
+
+void VRLODSelector::select( const double eye[3] ) {
+	for (Entry& e : m_entries) {
+		const int levels = int(e.mappers.size());
+		if (levels < 2)
+			continue;
+
+		/* Bounding sphere in world coordinates (the actor matrix includes the VR
+		 * scene transform and any animation)
+		 */
+		vtkMatrix4x4* m = e.actor->GetMatrix();
+		double c[4] = { e.center[0], e.center[1], e.center[2], 1. };
+		m->MultiplyPoint(c, c);
+
+		double scale = 0.;
+		for (int j = 0; j < 3; j++) {
+			double s = m->GetElement(0, j)*m->GetElement(0, j) + m->GetElement(1, j)*m->GetElement(1, j) + m->GetElement(2, j)*m->GetElement(2, j);
+			scale = std::max(scale, s);
+		}
+		const double radius = e.radius * std::sqrt(scale);
+
+		/* Projected diameter in pixels, reduced by the quality factor if frames are running late */
+		const double dx = c[0] - eye[0], dy = c[1] - eye[1], dz = c[2] - eye[2];
+		const double distance = std::max( std::sqrt(dx*dx + dy*dy + dz*dz), radius );
+		const double pixels = (distance > 0.) ? 2. * radius / distance * m_pixelsPerRadian * m_quality : m_threshold;
+
+		/* Ideal level on a continuous scale - 1 at the threshold, +1 for every halving in size */
+		double ideal = std::max( 0., 1. + std::log2(m_threshold / std::max(pixels, 1e-6)) );
+		ideal = std::min(ideal, double(levels - 1) + 0.999);
+
+		/* Only switch once the ideal level is clearly outside the current one */
+		if (ideal < e.current - hysteresis || ideal > e.current + 1. + hysteresis)
+			setLevel(e, std::min(int(ideal), levels - 1));
+	}
+}
+
+
+double VRLODSelector::quality() const {
+	return m_quality;
+}
+
+
+int VRLODSelector::level( vtkActor* actor ) const {
+	auto it = m_index.find(actor);
+	return (it == m_index.end()) ? -1 : m_entries[it->second].current;
+}
+
+
+void VRLODSelector::setLevel( Entry& e, int level ) {
+	if (level == e.current || level < 0 || level >= int(e.mappers.size()))
+		return;
+
+	e.actor->SetMapper(e.mappers[level]);
+	e.current = level;
+}
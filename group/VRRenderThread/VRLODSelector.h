@@ -0,0 +1,109 @@
+/**		@file VRLODSelector.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Chooses which level of detail to draw for each actor in the VR scene.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_LOD_SELECTOR_H
+#define VR_LOD_SELECTOR_H
+
+/* Vtk headers */
+#include <vtkSmartPointer.h>
+#include <vtkActor.h>
+#include <vtkMapper.h>
+#include <vtkPolyData.h>
+
+/* Standard headers */
+#include <unordered_map>
+#include <vector>
+
+
+/** Switches each actor between a set of simplified versions of its geometry
+  * (levels of detail) so that the headset frame rate can be kept up as the model
+  * gets bigger.
+  *
+  * Two things decide which level is drawn:
+  *   - How big the actor appears - its bounding sphere is projected onto the
+  *     headset display. Full detail is used when it covers more than the detail
+  *     threshold (in pixels), the next level when it covers more than half that,
+  *     and so on.
+  *   - How long frames are taking - if frames miss the headset's deadline a
+  *     quality factor is reduced, which makes every actor look smaller and so
+  *     switch to a coarser level. Once frames are back on time the factor slowly
+  *     recovers.
+  * A little hysteresis stops actors flickering between two levels.
+  *
+  * Each level gets its own mapper, created when the levels are set. Switching level
+  * only swaps the actor's mapper, so the graphics card keeps a copy of every level
+  * and nothing is uploaded again when the level changes.
+  *
+  * Only used by the render thread.
+  */
+class VRLODSelector {
+public:
+	VRLODSelector();
+
+	/** Set the levels of detail for an actor, replacing any it already has
+	  * @param actor is the actor, it must have a vtkPolyDataMapper
+	  * @param levels is the list of levels, level 0 should be the full geometry
+	  */
+	void setLevels( vtkActor* actor, const std::vector<vtkSmartPointer<vtkPolyData>>& levels );
+
+	/** Stop managing an actor, it is put back to its full geometry */
+	void remove( vtkActor* actor );
+
+	/** Stop managing all actors */
+	void clear();
+
+	/** Set the display properties used to work out actor sizes
+	  * @param heightPixels is the vertical resolution of each eye
+	  * @param fieldOfView is the vertical field of view in degrees
+	  */
+	void setViewport( double heightPixels, double fieldOfView );
+
+	/** Set projected size at which the full detail level is used (default 300 pixels) */
+	void setDetailThreshold( double pixels );
+
+	/** Set the time available for each frame (i.e. 1/refresh rate) */
+	void setFrameTarget( double ms );
+
+	/** Report how long the last frame took, adjusts the quality factor */
+	void frameFinished( double ms );
+
+	/** Choose a level for every actor
+	  * @param eye is the viewer position in world coordinates
+	  */
+	void select( const double eye[3] );
+
+	/** Current quality factor (0-1), 1 means frames are on time */
+	double quality() const;
+
+	/** Level currently drawn for an actor, -1 if the actor isn't managed */
+	int level( vtkActor* actor ) const;
+
+private:
+	/** Levels of detail for one actor */
+	struct Entry {
+		vtkSmartPointer<vtkActor>					actor;
+		std::vector<vtkSmartPointer<vtkMapper>>		mappers;	/**< One per level, [0] is the actor's own mapper */
+		double										center[3];	/**< Bounding sphere of level 0, actor coordinates */
+		double										radius;
+		int											current;	/**< Level being drawn */
+	};
+
+	void setLevel( Entry& e, int level );
+
+	std::vector<Entry>								m_entries;
+	std::unordered_map<vtkActor*, std::size_t>		m_index;		/**< Position of each actor in m_entries */
+
+	double											m_pixelsPerRadian;	/**< Approximate display resolution */
+	double											m_threshold;		/**< Projected size for full detail */
+	double											m_targetMs;			/**< Frame deadline */
+	double											m_quality;			/**< Frame time feedback factor */
+	int												m_onTimeFrames;		/**< Frames on time since the last miss */
+};
+
+
+#endif
@@ -0,0 +1,71 @@
+/**		@file VRModelLink.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Passes changes made to the model tree in the GUI on to the VR thread.
+  *
+  *		P Evans 2022
+  */
+
+#include "VRModelLink.h"
+#include "VRRenderThread.h"
+#include "ModelPartList.h"
+#include "ModelPart.h"
+
+/* Standard headers */
+#include <algorithm>
+
+
+VRModelLink::VRModelLink( ModelPartList* model, VRRenderThread* thread, QObject* parent )
+	: QObject(parent), m_thread(thread) {
+
+	connect(model, &ModelPartList::stateSynced, this, &VRModelLink::sendStates);
+	connect(model, &ModelPartList::transformsUpdated, this, &VRModelLink::sendTransforms);
+}
+
+
+void VRModelLink::sendStates( const QList<ModelPart*>& parts ) {
+	if (!m_thread)
+		return;
+
+	std::vector<VRActorState> states;
+	states.reserve(parts.size());
+	for (ModelPart* part : parts) {
+		if (!part->vrActor())
+			continue;
+
+		VRActorState s;
+		s.actor = part->vrActor();
+		s.visible = part->visible();
+		s.colour[0] = part->getColourR();
+		s.colour[1] = part->getColourG();
+		s.colour[2] = part->getColourB();
+		states.push_back(s);
+	}
+
+	if (!states.empty())
+		m_thread->setActorStates(states);
+}
+
+
+void VRModelLink::sendTransforms( const QList<ModelPart*>& parts ) {
+	if (!m_thread)
+		return;
+
+	std::vector<VRActorTransform> transforms;
+	transforms.reserve(parts.size());
+	for (ModelPart* part : parts) {
+		if (!part->vrActor())
+			continue;
+
+		/* Copied - the part's own matrix keeps changing in the GUI thread */
+		VRActorTransform t;
+		t.actor = part->vrActor();
+		const double* m = part->worldTransform()->GetData();
+		std::copy(m, m + 16, t.matrix);
+		transforms.push_back(t);
+	}
+
+	if (!transforms.empty())
+		m_thread->setActorTransforms(transforms);
+}
@@ -0,0 +1,54 @@
+/**		@file VRModelLink.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Passes changes made to the model tree in the GUI on to the VR thread.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_MODEL_LINK_H
+#define VR_MODEL_LINK_H
+
+/* Qt headers */
+#include <QObject>
+#include <QList>
+#include <QPointer>
+
+class ModelPart;
+class ModelPartList;
+class VRRenderThread;
+
+
+/** Connects a ModelPartList to a VRRenderThread, so parts whose actors have been
+  * sent to VR (ModelPart::getNewActor()) follow changes made in the GUI. The
+  * list already collects the changes into batches, each batch is sent to the
+  * render thread as a single scene change:
+  *
+  *		VRModelLink* link = new VRModelLink(partList, vrThread, this);
+  *
+  * Lives in the GUI thread, like the list.
+  */
+class VRModelLink : public QObject {
+	Q_OBJECT
+
+public:
+	/** Start passing changes on
+	  * @param model is the tree
+	  * @param thread is the render thread the parts' VR actors were added to
+	  * @param parent is the usual QObject parent
+	  */
+	VRModelLink( ModelPartList* model, VRRenderThread* thread, QObject* parent = nullptr );
+
+private slots:
+	/** Send the visibility and colour of parts that have changed (ModelPartList::stateSynced) */
+	void sendStates( const QList<ModelPart*>& parts );
+
+	/** Send the world transforms of parts that have moved (ModelPartList::transformsUpdated) */
+	void sendTransforms( const QList<ModelPart*>& parts );
+
+private:
+	QPointer<VRRenderThread>			m_thread;
+};
+
+
+#endif
@@ -0,0 +1,210 @@
+/**		@file VRPicker.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Finds the actor under a ray (e.g. the user's gaze) every frame.
+  *
+  *		P Evans 2022
+  */
+
+#include "VRPicker.h"
+
+#include <vtkPolyDataMapper.h>
+
+#include <algorithm>
+#include <limits>
+
+
+VRPicker::VRPicker() {
+	m_rebuild = true;
+	m_version = 0;
+	m_generation = 0;
+}
+
+
+void VRPicker::add( vtkActor* actor ) {
+	if (!actor || m_index.count(actor))
+		return;
+
+	vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(actor->GetMapper());
+
+	Entry e;
+	e.actor = actor;
+	e.input = mapper ? mapper->GetInput() : nullptr;
+	e.visible = actor->GetVisibility() != 0;
+
+	m_index[actor] = (int)m_entries.size();
+	m_entries.push_back(e);
+	findMesh( (int)m_entries.size() - 1 );
+	m_rebuild = true;
+}
+
+
+void VRPicker::setInput( vtkActor* actor, vtkPolyData* input ) {
+	auto it = m_index.find(actor);
+	if (it == m_index.end())
+		return;
+
+	m_entries[it->second].input = input;
+	findMesh(it->second);
+	m_rebuild = true;
+}
+
+
+void VRPicker::findMesh( int i ) {
+	/* Already built by the loader for anything it loaded. Building a tree for a big
+	 * mesh here would stall the headset, so anything else is built in the background
+	 * and the actor can't be picked until it is ready.
+	 */
+	Entry& e = m_entries[i];
+	e.mesh = nullptr;
+	if (!e.input || e.input->GetNumberOfPolys() == 0)
+		return;
+
+	e.mesh = MeshBVH::request(e.input);
+	if (!e.mesh)
+		m_waiting.push_back(e.actor);
+}
+
+
+void VRPicker::checkWaiting() {
+	/* Only worth looking once another tree has been finished */
+	unsigned long generation = MeshBVH::generation();
+	if (m_waiting.empty() || generation == m_generation)
+		return;
+	m_generation = generation;
+
+	std::vector<vtkActor*> still;
+	for (vtkActor* actor : m_waiting) {
+		/* Removed, or given new data that is already waiting again, meanwhile */
+		auto it = m_index.find(actor);
+		if (it == m_index.end())
+			continue;
+		Entry& e = m_entries[it->second];
+		if (e.mesh || std::find(still.begin(), still.end(), actor) != still.end())
+			continue;
+
+		e.mesh = MeshBVH::request(e.input);
+		if (e.mesh)
+			m_rebuild = true;
+		else
+			still.push_back(actor);
+	}
+	m_waiting.swap(still);
+}
+
+
+void VRPicker::remove( vtkActor* actor ) {
+	auto it = m_index.find(actor);
+	if (it == m_index.end())
+		return;
+
+	/* Move the last entry into the gap */
+	int i = it->second;
+	m_index.erase(it);
+	if (i != (int)m_entries.size() - 1) {
+		m_entries[i] = m_entries.back();
+		m_index[m_entries[i].actor] = i;
+	}
+	m_entries.pop_back();
+	m_rebuild = true;
+}
+
+
+void VRPicker::clear() {
+	m_entries.clear();
+	m_index.clear();
+	m_waiting.clear();
+	m_items.clear();
+	m_slots.clear();
+	m_scene.build( {} );
+	m_rebuild = true;
+}
+
+
+void VRPicker::setVisible( vtkActor* actor, bool visible ) {
+	auto it = m_index.find(actor);
+	if (it == m_index.end() || m_entries[it->second].visible == visible)
+		return;
+
+	m_entries[it->second].visible = visible;
+	m_rebuild = true;
+}
+
+
+void VRPicker::rebuild( const VRTransformStore& transforms ) {
+	std::vector<SceneBVH::Item> items;
+	items.reserve(m_entries.size());
+	m_items.clear();
+	m_slots.clear();
+
+	/* Hidden actors are left out altogether, so a ray goes straight through them */
+	for (const Entry& e : m_entries) {
+		int slot = transforms.find(e.actor);
+		if (!e.mesh || slot < 0 || !e.visible)
+			continue;
+
+		SceneBVH::Item item;
+		item.mesh = e.mesh;
+		std::copy_n(transforms.matrix(slot), 16, item.toWorld);
+		items.push_back(item);
+		m_items.push_back(e.actor);
+		m_slots.push_back(slot);
+	}
+
+	m_scene.build(items);
+	m_rebuild = false;
+}
+
+
+void VRPicker::update( const VRTransformStore& transforms ) {
+	checkWaiting();
+
+	if (m_rebuild) {
+		rebuild(transforms);
+		m_version = transforms.version();
+		return;
+	}
+
+	if (transforms.version() == m_version)
+		return;
+	m_version = transforms.version();
+
+	/* Actors have moved (e.g. animation). Their meshes haven't changed, so only
+	 * the top level boxes need updating - no triangle is touched.
+	 */
+	for (int i = 0; i < (int)m_slots.size(); i++)
+		m_scene.setTransform(i, transforms.matrix(m_slots[i]));
+	m_scene.refit();
+}
+
+
+vtkActor* VRPicker::pick( const double origin[3], const double dir[3], double* distance, double point[3] ) const {
+	SceneBVH::Hit hit;
+	if (!m_scene.pick(origin, dir, std::numeric_limits<double>::max(), hit))
+		return nullptr;
+
+	if (distance)
+		*distance = hit.t;
+	if (point)
+		std::copy_n(hit.point, 3, point);
+	return m_items[hit.item];
+}
+
+
+std::vector<vtkActor*> VRPicker::inBox( const double box[6] ) const {
+	std::vector<int> items;
+	m_scene.query(box, items);
+
+	std::vector<vtkActor*> found;
+	found.reserve(items.size());
+	for (int i : items)
+		found.push_back(m_items[i]);
+	return found;
+}
+
+
+vtkActor* VRPicker::nearest( const double p[3], double* distance ) const {
+	int item = m_scene.nearest(p, std::numeric_limits<double>::max(), distance);
+	return (item < 0) ? nullptr : m_items[item];
+}
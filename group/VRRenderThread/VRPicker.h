@@ -0,0 +1,124 @@
+/**		@file VRPicker.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Finds the actor under a ray (e.g. the user's gaze) every frame.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_PICKER_H
+#define VR_PICKER_H
+
+/* Project headers */
+#include "VRTransformStore.h"
+#include "BVH.h"
+
+/* Vtk headers */
+#include <vtkSmartPointer.h>
+#include <vtkActor.h>
+#include <vtkPolyData.h>
+
+/* Standard headers */
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+
+/** vtkPropPicker and friends render the scene again (or test every cell of every
+  * actor) to find what is under a ray, far too slow to do every frame in the
+  * headset. This class keeps a two level bounding volume hierarchy (see BVH.h in
+  * the tree model) over the actors instead: a tree of actor bounds on top, and
+  * one tree of triangles per mesh underneath, shared by every actor using it.
+  *
+  * The triangle trees never change (they are in the mesh's own coordinates) and
+  * are built by the loader's worker threads as each mesh is loaded. The render
+  * thread never builds one itself: an actor whose mesh has no tree yet (e.g. data
+  * that didn't come from the loader) has one built on a background thread, and
+  * can't be picked until it is ready. When actors move - every frame,
+  * while the scene is animating - only the top tree's boxes are refitted from the
+  * matrices in VRTransformStore, which is a single pass over the actors. The top
+  * tree is rebuilt when actors are added, removed or hidden.
+  *
+  * Works with the original actors, so instanced and batched parts can still be
+  * picked individually. Only used by the render thread.
+  */
+class VRPicker {
+public:
+	VRPicker();
+
+	/** Start tracking an actor. Its mesh is taken from its vtkPolyDataMapper, so
+	  * call this before any levels of detail are set up.
+	  */
+	void add( vtkActor* actor );
+
+	/** Actor's data has been replaced. Can't be picked until its tree is ready. */
+	void setInput( vtkActor* actor, vtkPolyData* input );
+
+	/** Stop tracking an actor */
+	void remove( vtkActor* actor );
+
+	/** Stop tracking all actors */
+	void clear();
+
+	/** Set whether an actor can be picked, i.e. the visibility the user asked for.
+	  * This isn't read from the actor, which may also be hidden by culling (VRCuller)
+	  * while it is out of view.
+	  */
+	void setVisible( vtkActor* actor, bool visible );
+
+	/** Bring the tree up to date with the actors' current transforms, and add
+	  * actors whose triangle trees have become ready. Cheap if nothing has moved.
+	  * @param transforms holds the actors' matrices (after its own update())
+	  */
+	void update( const VRTransformStore& transforms );
+
+	/** Find the first visible actor hit by a ray
+	  * @param origin is the start of the ray (world coordinates)
+	  * @param dir is the ray direction
+	  * @param distance if not null receives the distance to the hit, in multiples of dir
+	  * @param point if not null receives the world position of the hit
+	  * @return the actor, nullptr if nothing is hit
+	  */
+	vtkActor* pick( const double origin[3], const double dir[3], double* distance = nullptr, double point[3] = nullptr ) const;
+
+	/** Find the visible actors whose bounds overlap a box (xmin, xmax, ymin, ymax, zmin, zmax) */
+	std::vector<vtkActor*> inBox( const double box[6] ) const;
+
+	/** Find the visible actor nearest a point, measured to its bounding box
+	  * @return the actor, nullptr if there are none
+	  */
+	vtkActor* nearest( const double p[3], double* distance = nullptr ) const;
+
+private:
+	/** Rebuild the top level tree */
+	void rebuild( const VRTransformStore& transforms );
+
+	/** Look for the triangle tree of an entry's input, asking for it to be built if there isn't one */
+	void findMesh( int i );
+
+	/** Pick up trees that have been built for waiting actors */
+	void checkWaiting();
+
+	/** A tracked actor */
+	struct Entry {
+		vtkSmartPointer<vtkActor>					actor;
+		vtkSmartPointer<vtkPolyData>				input;			/**< Mapper input */
+		std::shared_ptr<const MeshBVH>				mesh;			/**< nullptr if the actor has no triangles, or its tree isn't ready */
+		bool										visible = true;
+	};
+
+	std::vector<Entry>									m_entries;
+	std::unordered_map<vtkActor*, int>					m_index;		/**< Position of each actor in m_entries */
+	std::vector<vtkActor*>								m_waiting;		/**< Actors whose tree is being built */
+	unsigned long										m_generation;	/**< MeshBVH::generation() when m_waiting was last checked */
+
+	SceneBVH											m_scene;
+	std::vector<vtkActor*>								m_items;		/**< Actor for each scene item */
+	std::vector<int>									m_slots;		/**< Transform store slot for each scene item */
+
+	bool												m_rebuild;		/**< Actors added, removed, shown or hidden */
+	unsigned long										m_version;		/**< Transform store version last refitted to */
+};
+
+
+#endif
@@ -12,10 +12,12 @@
 
 /* Vtk headers */
 #include <vtkActor.h>
+#ifndef VR_NO_OPENVR
 #include <vtkOpenVRRenderWindow.h>				
 #include <vtkOpenVRRenderWindowInteractor.h>	
 #include <vtkOpenVRRenderer.h>					
 #include <vtkOpenVRCamera.h>	
+#endif
 
 #include <vtkNew.h>
 #include <vtkSmartPointer.h>
@@ -26,6 +28,23 @@
 #include <vtkSTLReader.h>
 #include <vtkDataSetmapper.h>
 #include <vtkCallbackCommand.h>
+#include <vtkTransform.h>
+
+/* Qt headers */
+#include <QTextStream>
+
+/* Standard headers */
+#include <algorithm>
+
+
+/* While suspended the loop wakes this often (ms) to service the headset */
+static const unsigned long idlePollMs = 100;
+
+
+/* Milliseconds from a to b */
+static inline double msBetween( std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b ) {
+	return std::chrono::duration<double, std::milli>(b - a).count();
+}
 
 
 /* The class constructor is called by MainWindow and runs in the primary program thread, this thread
@@ -33,62 +52,634 @@
  * in the constructor, as it will take control of the main thread to handle the VR interaction (headset 
  * rotation etc. This means that a second thread is needed to handle the VR.
  */
-VRRenderThread::VRRenderThread( QObject* parent ) {
-	/* Initialise actor list */
-	actors = vtkActorCollection::New();
+VRRenderThread::VRRenderThread( QObject* parent ) : QThread(parent) {
+	/* Initialise actor list. VTK's New() returns an object that already has one
+	 * reference, assigning it to a smart pointer would add another and it would never
+	 * be freed - the smart pointer's own New() takes over the first reference instead.
+	 */
+	actors = vtkSmartPointer<vtkActorCollection>::New();
 
 	/* Initialise command variables */
 	rotateX = 0.;
 	rotateY = 0.;
 	rotateZ = 0.;
+	picking = false;
+	gazeActor = nullptr;
+	endRender = false;
+	suspended = false;
+	idling = false;
+	running = false;
+	droppedCommands = 0;
+
+	/* Default scene transform - rotate the model so that it is the right way up in VR
+	 * and move it in front of the user
+	 */
+	vtkNew<vtkTransform> t;
+	t->Translate(0., -100., -200.);
+	t->RotateX(-90.);
+	sceneTransform = vtkSmartPointer<vtkMatrix4x4>::New();
+	sceneTransform->DeepCopy(t->GetMatrix());
+
+	/* Allow 2ms per frame for scene changes, leaves plenty of the 11ms (90Hz) frame for rendering */
+	deltaBudgetUs = 2000;
+
+	/* Render to the headset unless setHeadless() is called */
+#ifdef VR_NO_OPENVR
+	headless = true;
+#else
+	headless = false;
+#endif
+	headlessWidth = 1440;
+	headlessHeight = 1600;
+
+	/* Frame timing summaries are sent to the GUI once a second */
+	statsIntervalMs = 1000.;
+	qRegisterMetaType<VRFrameReport>("VRFrameReport");
+	qRegisterMetaType<vtkActor*>("vtkActor*");
 }
 
 
-/* Standard destructor - this is important here as the class will be destroyed when the user
- * stops the VR thread, and recreated when the user starts it again. If class variables are 
- * not deallocated properly then there will be a memory leak, where the program's total memory
- * usage will increase for each start/stop thread cycle.
+/* Standard destructor. The VR objects belong to the render thread and are released
+ * there when run() finishes, so all that is needed here is to make sure it has
+ * finished. Rather than destroying the thread when the user turns VR off and creating
+ * a new one when they turn it back on, keep one thread for the whole session and use
+ * setSuspended() - nothing then has to be rebuilt or uploaded again.
  */
 VRRenderThread::~VRRenderThread() {
 
+	if (this->isRunning()) {
+		issueCommand(END_RENDER, 0.);
+		wait();
+	}
+}
+
+
+void VRRenderThread::start( Priority priority ) {
+
+	/* From here on scene changes are queued for the render thread rather than
+	 * applied to the offline list, see queueSceneDelta()
+	 */
+	QMutexLocker locker(&mutex);
+	if (running)
+		return;
+	running = true;
+	locker.unlock();
+
+	/* The last run may have handed everything back but not quite returned from run() */
+	wait();
+
+	/* The render thread isn't running, so for now this thread can take its place as
+	 * the queue's consumer. Commands that ended or paused the last run don't apply
+	 * to this one, everything else is put back in the order it was sent.
+	 */
+	std::vector<VRCommand> keep;
+	VRCommand c;
+	while (commands.pop(c)) {
+		if (c.type != END_RENDER && c.type != SUSPEND)
+			keep.push_back(c);
+	}
+
+	/* They were waiting for the thread to start rather than for a frame, so don't
+	 * count the time before now as command latency
+	 */
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	for (VRCommand& k : keep) {
+		k.issued = now;
+		commands.push(k);
+	}
+
+	this->endRender = false;
+	this->suspended = false;
+
+	QThread::start(priority);
+}
+
+
+void VRRenderThread::setSuspended( bool suspend ) {
+	issueCommand(SUSPEND, suspend ? 1. : 0.);
+}
+
+
+bool VRRenderThread::isSuspended() const {
+	return suspended;
 }
 
 
 void VRRenderThread::addActorOffline( vtkActor* actor ) {
 
-	/* Check to see if render thread is running */
-	if (!this->isRunning()) {
-		double* ac = actor->GetOrigin();
+	/* If the thread is already running it is too late to add it to the initial list,
+	 * addActor() sends it as a scene change instead
+	 */
+	addActor(actor);
+}
+
+
+void VRRenderThread::addActor( vtkActor* actor ) {
+
+	VRSceneDelta d;
+	d.type = VRSceneDelta::ADD_ACTOR;
+	d.actor = actor;
+	if (!queueSceneDelta(d))
+		applySceneDeltaOffline(d);
+}
+
+
+void VRRenderThread::removeActor( vtkActor* actor ) {
+
+	VRSceneDelta d;
+	d.type = VRSceneDelta::REMOVE_ACTOR;
+	d.actor = actor;
+	if (!queueSceneDelta(d))
+		applySceneDeltaOffline(d);
+}
+
+
+void VRRenderThread::setActorInput( vtkActor* actor, vtkPolyData* input ) {
+
+	VRSceneDelta d;
+	d.type = VRSceneDelta::SET_ACTOR_INPUT;
+	d.actor = actor;
+	d.input = input;
+	if (!queueSceneDelta(d))
+		applySceneDeltaOffline(d);
+}
+
+
+void VRRenderThread::setActorLevelsOfDetail( vtkActor* actor, const std::vector<vtkSmartPointer<vtkPolyData>>& levels ) {
+
+	VRSceneDelta d;
+	d.type = VRSceneDelta::SET_ACTOR_LODS;
+	d.actor = actor;
+	d.levels = levels;
+	if (!queueSceneDelta(d))
+		applySceneDeltaOffline(d);
+}
+
+
+void VRRenderThread::setActorStates( const std::vector<VRActorState>& states ) {
+
+	VRSceneDelta d;
+	d.type = VRSceneDelta::SET_ACTOR_STATES;
+	d.states = states;
+	if (!queueSceneDelta(d))
+		applySceneDeltaOffline(d);
+}
+
+
+void VRRenderThread::applyActorState( const VRActorState& s ) {
+
+	/* Only touch what has changed - the batcher and instancer watch the actor and
+	 * property modification times, so a needless Modified() would make them redo work.
+	 * While rendering, the culler combines the user's choice with its own.
+	 */
+	if (!culler.setVisible(s.actor, s.visible) && (s.actor->GetVisibility() != 0) != s.visible)
+		s.actor->SetVisibility(s.visible);
+	picker.setVisible(s.actor, s.visible);
+
+	double rgb[3] = { s.colour[0] / 255., s.colour[1] / 255., s.colour[2] / 255. };
+	double current[3];
+	s.actor->GetProperty()->GetColor(current);
+	if (current[0] != rgb[0] || current[1] != rgb[1] || current[2] != rgb[2])
+		s.actor->GetProperty()->SetColor(rgb);
+}
 
-		actors->AddItem(actor);
+
+void VRRenderThread::setActorTransforms( const std::vector<VRActorTransform>& actorTransforms ) {
+
+	VRSceneDelta d;
+	d.type = VRSceneDelta::SET_ACTOR_TRANSFORMS;
+	d.transforms = actorTransforms;
+	if (!queueSceneDelta(d))
+		applySceneDeltaOffline(d);
+}
+
+
+void VRRenderThread::setSceneTransform( vtkMatrix4x4* m ) {
+
+	vtkSmartPointer<vtkMatrix4x4> copy = vtkSmartPointer<vtkMatrix4x4>::New();
+	copy->DeepCopy(m);
+
+	VRSceneDelta d;
+	d.type = VRSceneDelta::SET_SCENE_TRANSFORM;
+	d.matrix = copy;
+	if (!queueSceneDelta(d))
+		applySceneDeltaOffline(d);
+}
+
+
+void VRRenderThread::setFrameStatsInterval( double ms ) {
+	statsIntervalMs = std::max(ms, 100.);
+}
+
+
+void VRRenderThread::setFrameStatsFile( const QString& fileName ) {
+	stats.setCsvFile(fileName);
+}
+
+
+void VRRenderThread::setHeadless( bool enable, int width, int height ) {
+#ifdef VR_NO_OPENVR
+	/* Built without OpenVR, there is no headset to render to */
+	enable = true;
+#endif
+	headless = enable;
+	headlessWidth = width;
+	headlessHeight = height;
+}
+
+
+void VRRenderThread::setFrameStatsWindow( int frames ) {
+	QMutexLocker locker(&mutex);
+	if (!running)
+		stats.setWindow(frames);
+}
+
+
+VRFrameReport VRRenderThread::frameStats() const {
+	VRFrameReport r = stats.report();
+	r.droppedCommands = droppedCommands;
+	return r;
+}
+
+
+void VRRenderThread::setCommandLog( const QString& fileName ) {
+	if (commandLog.isOpen())
+		commandLog.close();
+
+	if (fileName.isEmpty())
+		return;
+
+	commandLog.setFileName(fileName);
+	if (commandLog.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+		t_logStart = std::chrono::steady_clock::now();
+}
+
+
+const char* VRRenderThread::commandName( int cmd ) {
+	static const char* names[] = {
+		"END_RENDER", "ROTATE_X", "ROTATE_Y", "ROTATE_Z", "ANIMATION_RATE", "REFRESH_RATE", "LOD_THRESHOLD", "BATCHING", "PICKING",
+		"CULLING", "CULL_SIZE", "SUSPEND"
+	};
+	return (cmd >= 0 && cmd < int(sizeof(names) / sizeof(names[0]))) ? names[cmd] : "";
+}
+
+
+int VRRenderThread::commandFromName( const QString& name ) {
+	for (int cmd = 0; *commandName(cmd); cmd++) {
+		if (name == QLatin1String(commandName(cmd)))
+			return cmd;
 	}
+
+	/* Also accept the number itself */
+	bool ok = false;
+	int cmd = name.toInt(&ok);
+	return ok ? cmd : -1;
+}
+
+
+void VRRenderThread::setSceneDeltaBudget( double ms ) {
+	deltaBudgetUs = (long long)(ms * 1000.);
+}
+
+
+bool VRRenderThread::queueSceneDelta( const VRSceneDelta& delta ) {
+
+	/* While rendering, the render thread only ever tryLock()s this mutex, so the GUI
+	 * can hold it briefly without ever making the VR thread wait. (It only waits on
+	 * the mutex while suspended, see idle(), and at the end of run().) Checking the
+	 * running flag under the same lock means a change is either queued before run()
+	 * hands the queue back, or applied offline after it has.
+	 */
+	QMutexLocker locker(&mutex);
+	if (!running)
+		return false;
+	queuedDeltas.push_back(delta);
+	condition.wakeAll();
+	return true;
 }
 
 
+void VRRenderThread::applySceneDeltaOffline( const VRSceneDelta& d ) {
+
+	/* Not rendering - change the offline state directly, run() picks it up when it starts */
+	switch (d.type) {
+		case VRSceneDelta::ADD_ACTOR:
+			if (!actors->IsItemPresent(d.actor))
+				actors->AddItem(d.actor);
+			break;
 
-void VRRenderThread::issueCommand( int cmd, double value ) {
+		case VRSceneDelta::REMOVE_ACTOR:
+			lods.remove(d.actor);
+			actors->RemoveItem(d.actor);
+			break;
 
-	/* Update class variables according to command */
-	switch (cmd) {
-		/* These are just a few basic examples */
-		case END_RENDER:
-			this->endRender = true;
+		case VRSceneDelta::SET_ACTOR_INPUT: {
+			lods.remove(d.actor);
+			vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(d.actor->GetMapper());
+			if (mapper)
+				mapper->SetInputData(d.input);
 			break;
+		}
 
-		case ROTATE_X:
-			this->rotateX = value;
+		case VRSceneDelta::SET_SCENE_TRANSFORM:
+			sceneTransform = d.matrix;
 			break;
 
-		case ROTATE_Y:
-			this->rotateY = value;
+		case VRSceneDelta::SET_ACTOR_LODS:
+			lods.setLevels(d.actor, d.levels);
 			break;
 
-		case ROTATE_Z:
-			this->rotateZ = value;
+		case VRSceneDelta::SET_ACTOR_STATES:
+			for (const VRActorState& s : d.states)
+				applyActorState(s);
+			break;
+
+		case VRSceneDelta::SET_ACTOR_TRANSFORMS:
+			/* The transform store captures each actor's matrix when it starts */
+			for (const VRActorTransform& t : d.transforms) {
+				if (!t.actor->GetUserMatrix()) {
+					vtkSmartPointer<vtkMatrix4x4> m = vtkSmartPointer<vtkMatrix4x4>::New();
+					t.actor->SetUserMatrix(m);
+				}
+				t.actor->GetUserMatrix()->DeepCopy(t.matrix);
+			}
+			break;
+	}
+}
+
+
+void VRRenderThread::applySceneDeltas() {
+
+	/* Move anything the GUI has queued into our own list. If the GUI happens to be
+	 * adding something right now, don't wait for it - just try again next frame.
+	 */
+	if (mutex.tryLock()) {
+		for (VRSceneDelta& d : queuedDeltas)
+			pendingDeltas.push_back(std::move(d));
+		queuedDeltas.clear();
+		mutex.unlock();
+	}
+
+	/* Apply changes until the time budget runs out. Adding a large batch of actors
+	 * in one frame would cause a visible stutter in the headset, so any that don't
+	 * fit are left for the following frames. At least one change is always applied
+	 * so the queue can't stall.
+	 */
+	std::chrono::time_point<std::chrono::steady_clock> t_start = std::chrono::steady_clock::now();
+	std::chrono::microseconds budget(deltaBudgetUs.load());
+
+	while (!pendingDeltas.empty()) {
+		VRSceneDelta d = std::move(pendingDeltas.front());
+		pendingDeltas.pop_front();
+
+		switch (d.type) {
+			case VRSceneDelta::ADD_ACTOR:
+				/* The offline list is kept in step, it is what the next start() shows */
+				if (!actors->IsItemPresent(d.actor))
+					actors->AddItem(d.actor);
+				renderer->AddActor(d.actor);
+				transforms.add(d.actor);
+				picker.add(d.actor);
+				culler.add(d.actor);
+				trackActor(d.actor);
+				break;
+
+			case VRSceneDelta::REMOVE_ACTOR:
+				lods.remove(d.actor);
+				instances.remove(d.actor);
+				batches.remove(d.actor);
+				culler.remove(d.actor);
+				renderer->RemoveActor(d.actor);
+				actors->RemoveItem(d.actor);
+				transforms.remove(d.actor);
+				picker.remove(d.actor);
+				if (gazeActor == d.actor) {
+					gazeActor = nullptr;
+					emit gazeChanged(nullptr);
+				}
+				break;
+
+			case VRSceneDelta::SET_ACTOR_INPUT: {
+				/* Old levels of detail don't match the new data, go back to the actor's own mapper.
+				 * The actor no longer shares its old mesh either, so take it out of its instance
+				 * group and regroup it by the new data.
+				 */
+				lods.remove(d.actor);
+				bool hidden = instances.remove(d.actor);
+				hidden = batches.remove(d.actor) || hidden;
+				if (hidden)
+					renderer->AddActor(d.actor);
+				vtkPolyDataMapper* mapper = vtkPolyDataMapper::SafeDownCast(d.actor->GetMapper());
+				if (mapper)
+					mapper->SetInputData(d.input);
+				picker.setInput(d.actor, d.input);
+				culler.setInput(d.actor, d.input);
+				trackActor(d.actor);
+				break;
+			}
+
+			case VRSceneDelta::SET_SCENE_TRANSFORM:
+				sceneTransform = d.matrix;
+				transforms.setRoot(sceneTransform);
+				batches.setRoot(sceneTransform);
+				break;
+
+			case VRSceneDelta::SET_ACTOR_LODS:
+				/* Instanced actors are drawn by the group's mapper, so their own levels aren't used */
+				if (!instances.isInstanced(d.actor)) {
+					/* Switching levels swaps the actor's mapper, which a batch can't follow */
+					if (batches.remove(d.actor))
+						renderer->AddActor(d.actor);
+					lods.setLevels(d.actor, d.levels);
+				}
+				break;
+
+			case VRSceneDelta::SET_ACTOR_STATES:
+				/* Applied all at once, even if it goes over budget - it is cheap per actor,
+				 * and hiding half a selection one frame and the rest the next looks wrong
+				 */
+				for (const VRActorState& s : d.states)
+					applyActorState(s);
+				break;
+
+			case VRSceneDelta::SET_ACTOR_TRANSFORMS: {
+				/* Also all at once, so a moved sub-assembly doesn't come apart for a frame.
+				 * The store rewrites the user matrices at the next update(), which the
+				 * instancer, batcher, culler and picker then follow.
+				 */
+				vtkNew<vtkMatrix4x4> m;
+				for (const VRActorTransform& t : d.transforms) {
+					int i = transforms.find(t.actor);
+					if (i < 0)
+						continue;
+					m->DeepCopy(t.matrix);
+					transforms.setMatrix(i, m);
+				}
+				break;
+			}
+		}
+
+		if (std::chrono::steady_clock::now() - t_start > budget)
 			break;
 	}
 }
 
+
+bool VRRenderThread::issueCommand( int cmd, double value, int waitMs ) {
+
+	/* Package the command up with the time it was issued and add it to the queue, the
+	 * render thread will pick it up at the start of its next frame. The queue is lock
+	 * free, the mutex is only taken to wake the render thread when it is idling.
+	 */
+	VRCommand c;
+	c.type = cmd;
+	c.value = value;
+	c.issued = std::chrono::steady_clock::now();
+
+	/* Record the command so the session can be replayed later (e.g. by the benchmark) */
+	if (commandLog.isOpen()) {
+		QTextStream log(&commandLog);
+		log << std::chrono::duration<double, std::milli>(c.issued - t_logStart).count()
+			<< '\t' << commandName(cmd) << '\t' << value << '\n';
+	}
+
+	/* If asked to, give a stalled render thread a little time to make room. The
+	 * command is only logged, and counted as dropped, once however many tries it takes.
+	 */
+	bool pushed = commands.push(c);
+	for (int waited = 0; !pushed && waited < waitMs; waited++) {
+		msleep(1);
+		pushed = commands.push(c);
+	}
+
+	if (pushed) {
+		/* Wake the render thread if it is suspended and may be asleep in idle(). The
+		 * fences pair with the ones in idle(): either it sees this command when it
+		 * checks the queue, or we see the idling flag and take the mutex to wake it -
+		 * which can't happen until it is actually waiting. While rendering, the flag
+		 * is never set and the mutex is left alone.
+		 */
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (this->idling) {
+			QMutexLocker locker(&mutex);
+			condition.wakeAll();
+		}
+		return true;
+	}
+
+	/* Queue is full - this only happens if the render thread has stalled. Ending the
+	 * render must never be lost so set the (atomic) flag directly, anything else is dropped.
+	 */
+	if (cmd == END_RENDER) {
+		this->endRender = true;
+		QMutexLocker locker(&mutex);
+		condition.wakeAll();
+		return true;
+	}
+
+	droppedCommands++;
+	return false;
+}
+
+
+void VRRenderThread::processCommands() {
+
+	/* Empty the whole queue in one go. If the user drags a slider the GUI may have sent
+	 * many ROTATE_Y commands since the last frame - only the newest one matters, so 
+	 * each type of command is merged into a single pending value before anything is applied.
+	 */
+	VRCommand c;
+	bool   haveX = false, haveY = false, haveZ = false;
+	double newX = 0., newY = 0., newZ = 0.;
+	std::chrono::steady_clock::time_point t_handled = std::chrono::steady_clock::now();
+
+	while (commands.pop(c)) {
+		/* Time from the GUI sending it to now, reported in the frame stats */
+		stats.recordCommand( msBetween(c.issued, t_handled) );
+
+		switch (c.type) {
+			case END_RENDER:
+				this->endRender = true;
+				break;
+
+			case ROTATE_X:
+				newX = c.value;
+				haveX = true;
+				break;
+
+			case ROTATE_Y:
+				newY = c.value;
+				haveY = true;
+				break;
+
+			case ROTATE_Z:
+				newZ = c.value;
+				haveZ = true;
+				break;
+
+			case ANIMATION_RATE:
+				animation.setTickRate(c.value);
+				break;
+
+			case REFRESH_RATE:
+				animation.setRefreshRate(c.value);
+				lods.setFrameTarget(1000. / animation.refreshRate());
+				stats.setTarget(1000. / animation.refreshRate());
+				break;
+
+			case LOD_THRESHOLD:
+				lods.setDetailThreshold(c.value);
+				break;
+
+			case BATCHING:
+				batches.setEnabled(c.value != 0.);
+				break;
+
+			case PICKING:
+				picking = (c.value != 0.);
+				if (!picking && gazeActor) {
+					gazeActor = nullptr;
+					emit gazeChanged(nullptr);
+				}
+				break;
+
+			case CULLING:
+				culler.setEnabled(c.value != 0.);
+				break;
+
+			case CULL_SIZE:
+				culler.setMinimumSize(c.value);
+				break;
+
+			case SUSPEND:
+				this->suspended = (c.value != 0.);
+				break;
+		}
+	}
+
+	/* Update class variables according to merged commands */
+	if (haveX) this->rotateX = newX;
+	if (haveY) this->rotateY = newY;
+	if (haveZ) this->rotateZ = newZ;
+}
+
+
+void VRRenderThread::idle() {
+
+	/* Checked with the mutex held, and the GUI signals the condition with it held,
+	 * so nothing sent after the check can be missed. Scene changes always signal,
+	 * commands only once the idling flag is seen (see issueCommand()). wait()
+	 * releases the mutex while asleep so the GUI isn't blocked. The wait is limited
+	 * so the loop still comes round every so often to service the headset.
+	 */
+	QMutexLocker locker(&mutex);
+	this->idling = true;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (this->suspended && !this->endRender && commands.size() == 0 && queuedDeltas.empty())
+		condition.wait(&mutex, idlePollMs);
+	this->idling = false;
+}
+
 /* This function runs in a separate thread. This means that the program 
  * can fork into two separate execution paths. This thread is triggered by
  * calling VRRenderThread::start()
@@ -110,7 +701,12 @@ void VRRenderThread::run() {
 	// The renderer generates the image
 	// which is then displayed on the render window.
 	// It can be thought of as a scene to which the actor is added
-	renderer = vtkOpenVRRenderer::New();	
+	if (headless)
+		renderer = vtkSmartPointer<vtkRenderer>::New();
+#ifndef VR_NO_OPENVR
+	else
+		renderer = vtkSmartPointer<vtkOpenVRRenderer>::New();	
+#endif
 	
 	renderer->SetBackground(colors->GetColor3d("BkgColor").GetData());
 	
@@ -121,85 +717,359 @@ void VRRenderThread::run() {
 		renderer->AddActor(a);
 	}
 
-	/* The render window is the actual GUI window
-	 * that appears on the computer screen
-	 */
-	window = vtkOpenVRRenderWindow::New();
+	if (headless) {
+		/* No headset - render to an offscreen window of the same size as one eye's image.
+		 * Split viewport stereo draws the scene twice per frame, like the headset does.
+		 * There is no interactor, the camera stays where the user's head would start.
+		 */
+		window = vtkSmartPointer<vtkRenderWindow>::New();
+		window->SetOffScreenRendering(1);
+		window->SetSize(headlessWidth, headlessHeight);
+		window->SetStereoTypeToSplitViewportHorizontal();
+		window->StereoRenderOn();
+		window->AddRenderer(renderer);
+
+		camera = vtkSmartPointer<vtkCamera>::New();
+		camera->SetViewAngle(110.);
+		camera->SetClippingRange(0.1, 10000.);
+		renderer->SetActiveCamera(camera);
 
-	window->Initialize();
-	window->AddRenderer(renderer);
+		window->Render();
+	}
+#ifndef VR_NO_OPENVR
+	else {
+		/* The render window is the actual GUI window
+		 * that appears on the computer screen
+		 */
+		window = vtkSmartPointer<vtkOpenVRRenderWindow>::New();
+
+		window->Initialize();
+		window->AddRenderer(renderer);
 	
-	/* Create Open VR Camera */
-	camera = vtkOpenVRCamera::New();				
-	renderer->SetActiveCamera(camera);			
-
-	/* The render window interactor captures mouse events
-	 * and will perform appropriate camera or actor manipulation
-	 * depending on the nature of the events.
-	 */
-	interactor = vtkOpenVRRenderWindowInteractor::New();									
-	interactor->SetRenderWindow(window);													
-	interactor->Initialize();
-	window->Render();
+		/* Create Open VR Camera */
+		camera = vtkSmartPointer<vtkOpenVRCamera>::New();				
+		renderer->SetActiveCamera(camera);			
+
+		/* The render window interactor captures mouse events
+		 * and will perform appropriate camera or actor manipulation
+		 * depending on the nature of the events.
+		 */
+		interactor = vtkSmartPointer<vtkOpenVRRenderWindowInteractor>::New();									
+		interactor->SetRenderWindow(window);													
+		interactor->Initialize();
+		window->Render();
+	}
+
+	vtkOpenVRRenderWindow* vrWindow = vtkOpenVRRenderWindow::SafeDownCast(window);
+	vtkOpenVRRenderWindowInteractor* vrInteractor = vtkOpenVRRenderWindowInteractor::SafeDownCast(interactor);
+	vtkOpenVRRenderer* vrRenderer = vtkOpenVRRenderer::SafeDownCast(renderer);
+#endif
 	
+	/* Hand each actor's transform to the transform store. The actors are left where
+	 * the GUI put them, the whole scene is then rotated and moved into view in one go by
+	 * the scene transform (rather than editing every actor), so parts keep their positions
+	 * relative to each other.
+	 */
 	vtkActorCollection* actorList = renderer->GetActors();
 	actorList->InitTraversal();
+	transforms.clear();
+	transforms.setRoot(sceneTransform);
+	picker.clear();
+	culler.clear();
+	gazeActor = nullptr;
+	std::vector<vtkActor*> initial;
 	while ((a = (vtkActor*)actorList->GetNextActor())) {
-		double* ac = a->GetOrigin();
-		a->RotateX(-90);
-		a->AddPosition(-ac[0]+0, -ac[1]-100, -ac[2]-200);
+		transforms.add(a);
+		picker.add(a);
+		culler.add(a);
+		initial.push_back(a);
 	}
 
+	/* Repeated parts that share a mesh are drawn as instances (done after the
+	 * traversal, as instancing removes actors from the renderer's list)
+	 */
+	instances.clear();
+	instances.setRenderer(renderer);
+	culler.setInstancer(&instances);
+	batches.clear();
+	batches.setRenderer(renderer);
+	batches.setRoot(sceneTransform);
+	for (vtkActor* actor : initial)
+		trackActor(actor);
+
 	/* Now start the VR - we will implement the command loop manually
 	 * so it can be interrupted to make modifications to the actors
 	 * (i.e. to implement animation)
 	 */
-	endRender = false;
-	t_last = std::chrono::steady_clock::now();
-
-	while( !interactor->GetDone() && !this->endRender ) {
-		interactor->DoOneEvent( window, renderer );
-
-		/* Check to see if enough time has elapsed since last update 
-		 * This looks overcomplicated (and it is, C++ loves to make things unecessarily complicated!) but
-		 * is really just checking if more than 20ms have elaspsed since the last animation step. The 
-		 * complications comes from the fact that numbers representing time on computers don't usually have
-		 * standard second/millisecond units. Because everything is a class in C++, the converion from
-		 * computer units to seconds/milliseconds ends up looking like what you see below.
-		 * 
-		 * My choice of 20ms is arbitrary, if this value is too small the animation calculations could begin to
-		 * interfere with the interator processes and make the simulation unresponsive. If it is too large
-		 * the animations will be jerky. Play with the value to see what works best.
-		 */
-		if (std::chrono::duration_cast <std::chrono::milliseconds> (std::chrono::steady_clock::now() - t_last).count() > 20) {
+#ifndef VR_NO_OPENVR
+	/* Use the headset's own refresh rate to set the animation time budget */
+	vr::IVRSystem* hmd = vrWindow ? vrWindow->GetHMD() : nullptr;
+	if (hmd) {
+		float hz = hmd->GetFloatTrackedDeviceProperty(vr::k_unTrackedDeviceIndex_Hmd, vr::Prop_DisplayFrequency_Float);
+		if (hz > 0.f)
+			animation.setRefreshRate(hz);
+	}
+#endif
 
-			/* Do things that might need doing ... */
-			vtkActorCollection* actorList = renderer->GetActors();
-			vtkActor* a;
+	/* Level of detail selection needs to know the frame deadline and the size of
+	 * each eye's image (the window size is the per-eye render size in VR)
+	 */
+	lods.setFrameTarget(1000. / animation.refreshRate());
+	int* eyeSize = window->GetSize();
+	if (eyeSize && eyeSize[1] > 0) {
+		lods.setViewport(eyeSize[1], 110.);
 
-			/* X Rotation */
-			actorList->InitTraversal();
-			while ((a = (vtkActor*)actorList->GetNextActor())) {
-				a->RotateX(rotateX);
-			}
+		/* Offscreen, the window is split between the two eyes */
+		double eyeWidth = headless ? 0.5 * eyeSize[0] : eyeSize[0];
+		culler.setViewport(eyeSize[1], eyeWidth / eyeSize[1], 110.);
+	}
+
+#ifndef VR_NO_OPENVR
+	/* Eyes are about 64mm apart, the physical scale converts that to world units */
+	culler.setEyeSeparation( vrWindow ? 0.064 * vrWindow->GetPhysicalScale() : 0. );
+#else
+	culler.setEyeSeparation(0.);
+#endif
+
+	animPrevious = animCurrent = VRQuat();
+	animation.reset( std::chrono::steady_clock::now() );
+
+	/* Time each part of every frame. Rendering happens inside DoOneEvent(), so it is
+	 * timed separately by watching the window's start/end of render events.
+	 */
+	stats.reset();
+	stats.setTarget(1000. / animation.refreshRate());
+
+	vtkNew<vtkCallbackCommand> renderStart, renderEnd;
+	renderStart->SetClientData(this);
+	renderStart->SetCallback( []( vtkObject*, unsigned long, void* self, void* ) {
+		static_cast<VRRenderThread*>(self)->t_renderStart = std::chrono::steady_clock::now();
+	} );
+	renderEnd->SetClientData(this);
+	renderEnd->SetCallback( []( vtkObject*, unsigned long, void* self, void* ) {
+		VRRenderThread* t = static_cast<VRRenderThread*>(self);
+		t->stats.record( VRFrameReport::RENDER, msBetween(t->t_renderStart, std::chrono::steady_clock::now()) );
+	} );
+	unsigned long startTag = window->AddObserver(vtkCommand::StartEvent, renderStart);
+	unsigned long endTag = window->AddObserver(vtkCommand::EndEvent, renderEnd);
+
+	std::chrono::time_point<std::chrono::steady_clock> t_frame = std::chrono::steady_clock::now();
+	std::chrono::time_point<std::chrono::steady_clock> t_report = t_frame;
+	double renderBefore = 0.;
+	bool wasSuspended = false;
+
+	while( (!interactor || !interactor->GetDone()) && !this->endRender ) {
+		std::chrono::time_point<std::chrono::steady_clock> t_start = std::chrono::steady_clock::now();
 
-			/* Y Rotation */
-			actorList->InitTraversal();
-			while ((a = (vtkActor*)actorList->GetNextActor())) {
-				a->RotateY(rotateY);
+		/* Pick up anything the GUI has asked for since the last frame */
+		processCommands();
+		if (this->endRender)
+			break;
+
+		/* Suspended - draw nothing, but keep everything (window, graphics context,
+		 * actors and their uploaded geometry) and keep applying scene changes, so
+		 * resuming is immediate and shows the scene as it is now
+		 */
+		if (this->suspended) {
+#ifndef VR_NO_OPENVR
+			/* The compositor is told, so it shows its own scene in the headset rather
+			 * than treating the missing frames as the application having hung
+			 */
+			if (!wasSuspended && vrWindow)
+				vr::VRCompositor()->SuspendRendering(true);
+
+			/* The interactor isn't run while suspended, so handle the headset's events
+			 * here - in particular SteamVR asking the application to quit
+			 */
+			vr::VREvent_t event;
+			while (hmd && hmd->PollNextEvent(&event, sizeof(event))) {
+				if (event.eventType == vr::VREvent_Quit) {
+					hmd->AcknowledgeQuit_Exiting();
+					this->endRender = true;
+				}
 			}
+#endif
+			wasSuspended = true;
+			if (this->endRender)
+				break;
+
+			applySceneDeltas();
+			if (pendingDeltas.empty())
+				idle();
+			continue;
+		}
+
+		if (wasSuspended) {
+			/* The pause mustn't count as one very long frame, or make the animation jump */
+			wasSuspended = false;
+#ifndef VR_NO_OPENVR
+			if (vrWindow)
+				vr::VRCompositor()->SuspendRendering(false);
+#endif
+			t_frame = std::chrono::steady_clock::now();
+			animation.reset(t_frame);
+			t_start = t_frame;
+		}
+
+		std::chrono::time_point<std::chrono::steady_clock> t_commands = std::chrono::steady_clock::now();
+		stats.record( VRFrameReport::COMMANDS, msBetween(t_start, t_commands) );
+
+		/* Add/remove/modify actors requested since the last frame */
+		applySceneDeltas();
+
+		std::chrono::time_point<std::chrono::steady_clock> t_deltas = std::chrono::steady_clock::now();
+		stats.record( VRFrameReport::SCENE_CHANGES, msBetween(t_commands, t_deltas) );
+
+		renderBefore = stats.recorded(VRFrameReport::RENDER);
+#ifndef VR_NO_OPENVR
+		if (vrInteractor)
+			vrInteractor->DoOneEvent( vrWindow, vrRenderer );
+		else
+#endif
+			window->Render();
+
+		/* Frame time includes waiting for the headset, so a frame that takes longer
+		 * than one refresh period has missed its deadline
+		 */
+		std::chrono::time_point<std::chrono::steady_clock> t_now = std::chrono::steady_clock::now();
+		double rendered = stats.recorded(VRFrameReport::RENDER) - renderBefore;
+		stats.record( VRFrameReport::EVENTS, std::max(msBetween(t_deltas, t_now) - rendered, 0.) );
+		stats.record( VRFrameReport::FRAME, msBetween(t_frame, t_now) );
+		lods.frameFinished( msBetween(t_frame, t_now) );
+		t_frame = t_now;
+
+		/* Advance the animation. Rather than moving things by a fixed amount whenever "enough"
+		 * time has passed (which makes the speed depend on how busy the interactor is), real
+		 * time is chopped up into fixed length ticks by the scheduler - if two ticks worth of
+		 * time have passed since the last frame, the animation is stepped twice. Whatever is
+		 * left over (less than one tick) is used to draw the actors part way between the last
+		 * two animation states, so motion stays smooth even though the tick rate (50Hz by
+		 * default) is lower than the headset refresh rate.
+		 */
+		animation.beginFrame( std::chrono::steady_clock::now() );
+		while (animation.nextTick()) {
+			stepAnimation();
+		}
+		drawAnimation( animation.alpha() );
+
+		std::chrono::time_point<std::chrono::steady_clock> t_animated = std::chrono::steady_clock::now();
+		stats.record( VRFrameReport::ANIMATION, msBetween(t_now, t_animated) );
+
+		/* Hide anything that won't be seen in the next frame, before the instancer
+		 * and batcher look at which actors are visible
+		 */
+		culler.cull( renderer->GetActiveCamera(), transforms, batches );
+
+		std::chrono::time_point<std::chrono::steady_clock> t_culled = std::chrono::steady_clock::now();
+		stats.record( VRFrameReport::CULLING, msBetween(t_animated, t_culled) );
+
+		instances.update();
+		batches.update();
+
+		/* Now everything is in place for the next frame, pick each actor's level of detail */
+		lods.select( renderer->GetActiveCamera()->GetPosition() );
 
-			/* Z Rotation */
-			actorList->InitTraversal();
-			while ((a = (vtkActor*)actorList->GetNextActor())) {
-				a->RotateZ(rotateZ);
+		/* Find what the user is looking at - a ray from the centre of their view */
+		if (picking) {
+			picker.update(transforms);
+			vtkCamera* cam = renderer->GetActiveCamera();
+			vtkActor* looking = picker.pick( cam->GetPosition(), cam->GetDirectionOfProjection() );
+			if (looking != gazeActor) {
+				gazeActor = looking;
+				emit gazeChanged(looking);
 			}
-			
-			/* Remember time now */
-			t_last = std::chrono::steady_clock::now();
+		}
+
+		std::chrono::time_point<std::chrono::steady_clock> t_end = std::chrono::steady_clock::now();
+		stats.record( VRFrameReport::SCENE_UPDATE, msBetween(t_culled, t_end) );
+		stats.endFrame();
+
+		/* Send a summary to the GUI every so often (the signal is queued to the GUI thread) */
+		if (msBetween(t_report, t_end) >= statsIntervalMs) {
+			emit frameStatsReady( frameStats() );
+			stats.flush();
+			t_report = t_end;
 		}
 	}
+
+#ifndef VR_NO_OPENVR
+	/* Don't leave the compositor suspended if the loop ended while paused */
+	if (wasSuspended && vrWindow)
+		vr::VRCompositor()->SuspendRendering(false);
+#endif
+
+	/* Don't leave parts hidden by culling, the actors may be shown elsewhere */
+	culler.clear();
+
+	stats.flush();
+	window->RemoveObserver(startTag);
+	window->RemoveObserver(endTag);
+
+	/* Release the VR objects here rather than in the destructor - the graphics
+	 * context belongs to this thread. The actors themselves belong to the GUI and
+	 * are handed back at full detail, each with its own transform as its user matrix
+	 * (the transform store takes the scene transform and animation back off), so
+	 * starting again doesn't apply the scene transform twice.
+	 */
+	window->Finalize();
+	transforms.clear();
+	lods.clear();
+	instances.clear();
+	batches.clear();
+	picker.clear();
+	interactor = nullptr;
+	camera = nullptr;
+	renderer = nullptr;
+	window = nullptr;
+	suspended = false;
+
+	/* Scene changes the loop didn't get to (still queued, or over the last frame's
+	 * budget) are applied to the offline state rather than lost, so the next start()
+	 * shows the scene as the GUI last left it. The lock is held until running is
+	 * cleared, so anything the GUI sends meanwhile waits and is then applied offline.
+	 */
+	QMutexLocker locker(&mutex);
+	for (VRSceneDelta& d : queuedDeltas)
+		pendingDeltas.push_back(std::move(d));
+	queuedDeltas.clear();
+	for (const VRSceneDelta& d : pendingDeltas)
+		applySceneDeltaOffline(d);
+	pendingDeltas.clear();
+	running = false;
+}
+
+
+void VRRenderThread::trackActor( vtkActor* actor ) {
+
+	/* Actors moved into an instanced group are drawn by the group */
+	for (vtkActor* a : instances.add(actor)) {
+		lods.remove(a);
+		batches.remove(a);
+	}
+
+	if (!instances.isInstanced(actor) && lods.level(actor) < 0)
+		batches.add(actor);
 }
 
 
+void VRRenderThread::stepAnimation() {
 
+	/* One fixed time-step: remember the previous state (for interpolation) and
+	 * advance the rotation by the amount requested by the GUI. Rotations are kept
+	 * as a quaternion so that combined X/Y/Z rotations build up in the same way
+	 * as repeated RotateX/Y/Z calls on the actors would.
+	 */
+	animPrevious = animCurrent;
+	animCurrent = animCurrent * VRQuat::fromXYZ(rotateX, rotateY, rotateZ);
+	animCurrent.normalise();
+}
+
+
+void VRRenderThread::drawAnimation( double alpha ) {
+
+	/* Find where the animation should be drawn this frame, between the last two ticks,
+	 * then let the transform store rebuild every actor's matrix in one pass
+	 */
+	transforms.setAnimation( VRQuat::slerp(animPrevious, animCurrent, alpha) );
+	transforms.update();
+}
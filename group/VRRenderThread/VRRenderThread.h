@@ -10,22 +10,38 @@
 #define VR_RENDER_THREAD_H
 
 /* Project headers */
+#include "VRCommandQueue.h"
+#include "VRSceneDelta.h"
+#include "VRAnimationScheduler.h"
+#include "VRTransformStore.h"
+#include "VRLODSelector.h"
+#include "VRInstancer.h"
+#include "VRBatcher.h"
+#include "VRFrameStats.h"
+#include "VRPicker.h"
+#include "VRCuller.h"
 
 /* Qt headers */
 #include <QThread>
 #include <QMutex>
 #include <QWaitCondition>
+#include <QFile>
 
 /* Vtk headers */
 #include <vtkActor.h>
 #include <vtkPolyDataMapper.h>
-#include <vtkOpenVRRenderWindow.h>				
-#include <vtkOpenVRRenderWindowInteractor.h>	
-#include <vtkOpenVRRenderer.h>					
-#include <vtkOpenVRCamera.h>	
+#include <vtkRenderWindow.h>
+#include <vtkRenderWindowInteractor.h>
+#include <vtkRenderer.h>
+#include <vtkCamera.h>
 #include <vtkActorCollection.h>
 #include <vtkCommand.h>
 
+/* Standard headers */
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <vector>
 
 
 /* Note that this class inherits from the Qt class QThread which allows it to be a parallel thread
@@ -43,7 +59,15 @@ public:
         END_RENDER,
         ROTATE_X,
         ROTATE_Y,
-        ROTATE_Z
+        ROTATE_Z,
+        ANIMATION_RATE,         /**< Set animation time-steps per second */
+        REFRESH_RATE,           /**< Override display refresh rate used for animation time budget */
+        LOD_THRESHOLD,          /**< Projected size (pixels) below which simplified levels of detail are used */
+        BATCHING,               /**< Non-zero merges still parts with the same material to reduce draw calls */
+        PICKING,                /**< Non-zero finds the part the user is looking at every frame (gazeChanged signal) */
+        CULLING,                /**< Non-zero (default) hides parts that are out of view or too small to see before rendering */
+        CULL_SIZE,              /**< Projected size (pixels) below which parts are culled, 0 keeps small parts */
+        SUSPEND                 /**< Non-zero pauses rendering without tearing anything down, zero resumes */
     } Command;
 
 
@@ -51,21 +75,168 @@ public:
       */
     VRRenderThread(QObject* parent = nullptr);
 
-    /**  Denstructor
+    /**  Denstructor. Ends rendering (if it is running) and waits for the thread to finish.
       */
     ~VRRenderThread();
 
+    /** Start the render thread. This hides QThread::start() so the thread can be
+      * started again after it has been ended: anything left over from the last
+      * run - the end flag, a pause, or an END_RENDER or SUSPEND that arrived after
+      * its loop had finished - is cleared first. Other commands sent before start()
+      * (e.g. a REFRESH_RATE override) are kept and handled in the first frame.
+      * Does nothing if the thread is already running. GUI thread only.
+      * Scene changes sent after this are queued for the render thread, any it
+      * hasn't applied when it ends are applied to the offline state instead.
+      */
+    void start( Priority priority = InheritPriority );
+
+    /** Pause or resume VR without ending the thread (sends the SUSPEND command).
+      * While suspended the render loop mostly sleeps - nothing is drawn and the
+      * compositor shows its own scene in the headset, though headset events (e.g.
+      * SteamVR quitting) are still handled - but the window, renderer, graphics
+      * context and every actor (with its geometry already on the graphics card)
+      * are kept, and scene changes are still applied. Resuming is then immediate,
+      * rather than starting a new thread and re-adding the whole model.
+      * @param suspend is true to pause, false to resume
+      */
+    void setSuspended( bool suspend );
+
+    /** True if rendering is paused (may lag setSuspended() by one frame) */
+    bool isSuspended() const;
+
     /** This allows actors to be added to the VR renderer BEFORE the VR
-      * interactor has been started 
+      * interactor has been started. If the thread is already running the
+      * actor is passed on to addActor().
      */
     void addActorOffline(vtkActor* actor);
 
+    /** Add an actor to the VR scene. If the render thread is running the change
+      * is queued and applied between frames, otherwise it is added to the
+      * offline list. The GUI must not modify the actor after this call.
+      * @param actor is the actor to add
+      */
+    void addActor(vtkActor* actor);
+
+    /** Remove an actor from the VR scene (queued if the render thread is running)
+      * @param actor is the actor to remove
+      */
+    void removeActor(vtkActor* actor);
+
+    /** Swap the data displayed by an actor, i.e. replace its mapper input
+      * (queued if the render thread is running)
+      * @param actor is the actor to modify, it must have a vtkPolyDataMapper
+      * @param input is the new data to display
+      */
+    void setActorInput(vtkActor* actor, vtkPolyData* input);
+
+    /** Give an actor simplified versions of its data (levels of detail). The render
+      * thread then chooses a level each frame according to how big the actor
+      * appears and how long frames are taking (queued if the render thread is running)
+      * @param actor is the actor, it must have a vtkPolyDataMapper
+      * @param levels is the list of levels, level 0 should be the actor's current data
+      */
+    void setActorLevelsOfDetail(vtkActor* actor, const std::vector<vtkSmartPointer<vtkPolyData>>& levels);
+
+    /** Change the visibility and colour of any number of actors. This is sent to
+      * the render thread as a single change and applied in one frame, so e.g.
+      * hiding thousands of parts costs one update (queued if the render thread is
+      * running). Instanced and batched parts follow at the end of that frame.
+      * @param states is the new state of each actor
+      */
+    void setActorStates(const std::vector<VRActorState>& states);
+
+    /** Move any number of actors, e.g. after parts of the model have been moved
+      * in the GUI (ModelPart world transforms). Each actor's own transform is
+      * replaced, the scene transform and animation still apply on top. Sent as a
+      * single change and applied in one frame (queued if the render thread is running).
+      * @param actorTransforms is the new transform of each actor
+      */
+    void setActorTransforms(const std::vector<VRActorTransform>& actorTransforms);
+
+    /** Set the transform applied to the whole VR scene (on top of each actor's
+      * own transform). By default the scene is rotated so that Z is up and moved
+      * in front of the user. This is a single matrix change however many actors
+      * there are. (queued if the render thread is running)
+      * @param m is the new scene transform, it is copied
+      */
+    void setSceneTransform(vtkMatrix4x4* m);
+
+    /** Set the maximum time per frame the render thread can spend applying
+      * scene changes, anything left over is applied on the next frame.
+      * @param ms is the budget in milliseconds
+      */
+    void setSceneDeltaBudget(double ms);
+
 
     /** This allows commands to be issued to the VR thread in a thread safe way. 
-      * Function will set variables within the class to indicate the type of
-      * action / animation / etc to perform. The rendering thread will then impelement this.
+      * The command is timestamped and placed in a lock-free queue, the rendering
+      * thread empties the queue once per frame and implements the commands.
+      * Must only be called from one thread (the GUI thread).
+      * @param waitMs is how long to keep retrying if the queue is full, in milliseconds.
+      *        The GUI doesn't wait (the default); the benchmark does, so a replayed
+      *        script isn't cut short by a slow frame.
+      * @return false if the queue was still full and the command was dropped
       */
-    void issueCommand( int cmd, double value );
+    bool issueCommand( int cmd, double value, int waitMs = 0 );
+
+    /** Set how often frame timing summaries are sent (frameStatsReady signal)
+      * @param ms is the time between summaries, minimum 100ms (default 1000ms)
+      */
+    void setFrameStatsInterval( double ms );
+
+    /** Write the time taken by each part of every frame to a CSV file, for finding
+      * the cause of stutter. Can be called while rendering.
+      * @param fileName is the file to write, an empty name stops writing
+      */
+    void setFrameStatsFile( const QString& fileName );
+
+    /** Render to an offscreen window instead of the headset, so the render loop
+      * can be run (e.g. benchmarked) on a machine with no headset. Must be called
+      * before start(). When built with VR_NO_OPENVR defined (no VTK OpenVR module)
+      * there is no headset window and rendering is always offscreen.
+      * @param enable turns offscreen rendering on
+      * @param width, height are the size of the image, normally the size of one eye's image
+      */
+    void setHeadless( bool enable, int width = 1440, int height = 1600 );
+
+    /** Set the number of frames covered by frame timing statistics (default 900).
+      * Must be called before start().
+      */
+    void setFrameStatsWindow( int frames );
+
+    /** Get frame timing statistics, including command latency and the number of
+      * commands dropped because the queue was full. Only safe once the thread has
+      * finished (e.g. after wait()), while running use the frameStatsReady signal.
+      */
+    VRFrameReport frameStats() const;
+
+    /** Record every issued command, with the time it was issued, to a text file
+      * (one "time_ms<tab>COMMAND<tab>value" line per command) so a session can be
+      * replayed later. An empty name stops recording. GUI thread only.
+      */
+    void setCommandLog( const QString& fileName );
+
+    /** Name of a command, e.g. "ROTATE_X" (empty if cmd isn't a command) */
+    static const char* commandName( int cmd );
+
+    /** Command from its name (or number)
+      * @return the command, or -1 if the name isn't recognised
+      */
+    static int commandFromName( const QString& name );
+
+signals:
+    /** Sent by the render thread every second or so with frame timing statistics
+      * (typically received on the GUI thread, the signal is queued)
+      */
+    void frameStatsReady( const VRFrameReport& report );
+
+    /** Sent by the render thread when picking is on (PICKING command) and the
+      * actor in the centre of the user's view changes. The actor must only be
+      * used to look up the part it belongs to (e.g. with ModelPart::vrActor()),
+      * not modified.
+      * @param actor is the actor now being looked at, nullptr if none
+      */
+    void gazeChanged( vtkActor* actor );
 
 
 protected:
@@ -74,29 +245,151 @@ protected:
     void run() override;
 
 private:
+    /** Sleep until the loop is resumed, something arrives that must be handled
+      * (a command, or a scene change), or it is time to poll the headset's events
+      * again. Called by run() while suspended.
+      */
+    void idle();
+
+    /** Empty the command queue and apply the commands to the class variables.
+      * Called once per frame by run(). Repeated commands of the same type are
+      * merged so only the newest value is used.
+      */
+    void processCommands();
+
+    /** Apply a new visibility/colour to an actor (render thread, or before it starts) */
+    void applyActorState(const VRActorState& s);
+
+    /** Apply queued scene changes, stopping once the per-frame budget is used up.
+      * Called once per frame by run().
+      */
+    void applySceneDeltas();
+
+    /** Queue a scene change for the render thread (GUI thread)
+      * @return false if the render thread isn't running, nothing is queued
+      */
+    bool queueSceneDelta(const VRSceneDelta& delta);
+
+    /** Apply a scene change to the offline actor list and settings, used when the
+      * render thread isn't running and for changes left over when it ends
+      */
+    void applySceneDeltaOffline(const VRSceneDelta& delta);
+
+    /** Start tracking an actor that has just been added to the renderer for
+      * instancing and batching. Actors that are moved into an instanced group stop
+      * using their own levels of detail, actors with levels of detail aren't batched.
+      */
+    void trackActor(vtkActor* actor);
+
+    /** Advance the animation by one fixed time-step
+      */
+    void stepAnimation();
+
+    /** Update actors to show the animation part way between the last two time-steps
+      * @param alpha is the interpolation factor (0-1) from the scheduler
+      */
+    void drawAnimation(double alpha);
+
+    /** Number of commands that can be waiting for the render thread. The queue is
+      * emptied every frame, so it will only fill if the render thread stalls.
+      */
+    static constexpr std::size_t                        commandQueueSize = 1024;
+
     /* Standard VTK VR Classes */
-    vtkSmartPointer<vtkOpenVRRenderWindow>              window;
-    vtkSmartPointer<vtkOpenVRRenderWindowInteractor>    interactor;
-    vtkSmartPointer<vtkOpenVRRenderer>                  renderer;
-    vtkSmartPointer<vtkOpenVRCamera>                    camera;
+    vtkSmartPointer<vtkRenderWindow>                    window;         /*< vtkOpenVRRenderWindow unless headless */
+    vtkSmartPointer<vtkRenderWindowInteractor>          interactor;     /*< nullptr if headless */
+    vtkSmartPointer<vtkRenderer>                        renderer;
+    vtkSmartPointer<vtkCamera>                          camera;
+
+    /* Offscreen rendering in place of the headset, see setHeadless() */
+    bool                                                headless;
+    int                                                 headlessWidth;
+    int                                                 headlessHeight;
+
+    /* Record of issued commands, see setCommandLog() (GUI thread only) */
+    QFile                                               commandLog;
+    std::chrono::steady_clock::time_point               t_logStart;
 
-    /* Use to synchronise passing of data to VR thread */
+    /* Use to synchronise passing of data to VR thread. condition is signalled
+     * whenever a command or scene change is sent, to wake a suspended loop.
+     */
     QMutex                                              mutex;      
     QWaitCondition                                      condition;
 
-    /** List of actors that will need to be added to the VR scene */
+    /** Rendering paused, see setSuspended(). Written by the render thread. */
+    std::atomic<bool>                                   suspended;
+
+    /** Set by idle() (with mutex held) while it may wait on condition, so
+      * issueCommand() only takes the mutex when there is someone to wake
+      */
+    std::atomic<bool>                                   idling;
+
+    /** Scene changes sent by the GUI, protected by mutex */
+    std::vector<VRSceneDelta>                           queuedDeltas;
+
+    /** Scene changes taken from queuedDeltas but not yet applied (render thread only) */
+    std::deque<VRSceneDelta>                            pendingDeltas;
+
+    /** Maximum time per frame spent in applySceneDeltas(), in microseconds */
+    std::atomic<long long>                              deltaBudgetUs;
+
+    /** Commands waiting to be handled by the render thread */
+    SPSCQueue<VRCommand, commandQueueSize>              commands;
+
+    /** Number of commands dropped because the queue was full (reported in VRFrameReport) */
+    std::atomic<unsigned int>                           droppedCommands;
+
+    /** True from start() until run() has applied the last scene changes, protected by mutex */
+    bool                                                running;
+
+    /** List of actors that will need to be added to the VR scene. Kept in step
+      * with live adds and removes by the render thread while it runs.
+      */
     vtkSmartPointer<vtkActorCollection>                 actors;
 
-    /** A timer to help implement animations and visual effects */
-    std::chrono::time_point<std::chrono::steady_clock>  t_last;
+    /** Splits time into fixed animation time-steps */
+    VRAnimationScheduler                                animation;
+
+    /* Animation state (render thread only) */
+    VRQuat                                              animPrevious;       /*< Scene rotation at previous time-step */
+    VRQuat                                              animCurrent;        /*< Scene rotation at latest time-step */
+
+    /** Position/orientation/scale of every actor in the scene (render thread only) */
+    VRTransformStore                                    transforms;
+
+    /** Chooses level of detail for each actor (render thread only while running) */
+    VRLODSelector                                       lods;
+
+    /** Draws actors that share a mesh in a single instanced draw (render thread only) */
+    VRInstancer                                         instances;
+
+    /** Merges still parts into batches (render thread only) */
+    VRBatcher                                           batches;
+
+    /** Hides actors that can't be seen (render thread only while running) */
+    VRCuller                                            culler;
+
+    /** Finds the actor the user is looking at (render thread only) */
+    VRPicker                                            picker;
+    bool                                                picking;            /*< Set by the PICKING command */
+    vtkActor*                                           gazeActor;          /*< Actor last sent by gazeChanged */
+
+    /** Time taken by each part of the frame (render thread only, apart from the CSV file name) */
+    VRFrameStats                                        stats;
+    std::atomic<double>                                 statsIntervalMs;    /*< Time between frameStatsReady signals */
+    std::chrono::steady_clock::time_point               t_renderStart;      /*< Time the current render started */
+
+    /** Transform applied to the whole scene, protected by mutex while running */
+    vtkSmartPointer<vtkMatrix4x4>                       sceneTransform;
 
     /** This will be set to false by the constructor, if it is set to true
-      * by the GUI then the rendering will end 
+      * by the GUI then the rendering will end. Normally set by processCommands(), the
+      * GUI thread only writes it directly if END_RENDER could not be queued.
       */
-    bool                                                endRender;
+    std::atomic<bool>                                   endRender;
 
     /* Some variables to indicate animation actions to apply.
-     *
+     * These are only accessed by the render thread.
      */
     double rotateX;         /*< Degrees to rotate around X axis (per time-step) */
     double rotateY;         /*< Degrees to rotate around Y axis (per time-step) */
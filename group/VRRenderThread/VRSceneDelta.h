@@ -0,0 +1,66 @@
+/**		@file VRSceneDelta.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Description of a change to the VR scene, passed from the GUI thread to the VR thread.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_SCENE_DELTA_H
+#define VR_SCENE_DELTA_H
+
+/* Vtk headers */
+#include <vtkSmartPointer.h>
+#include <vtkActor.h>
+#include <vtkPolyData.h>
+#include <vtkMatrix4x4.h>
+
+/* Standard headers */
+#include <vector>
+
+
+/** New visibility and colour for one actor (see VRSceneDelta::SET_ACTOR_STATES) */
+struct VRActorState {
+    vtkSmartPointer<vtkActor>                           actor;
+    bool                                                visible = true;
+    unsigned char                                       colour[3] = { 255, 255, 255 };  /**< RGB */
+};
+
+
+/** New transform for one actor (see VRSceneDelta::SET_ACTOR_TRANSFORMS) */
+struct VRActorTransform {
+    vtkSmartPointer<vtkActor>                           actor;
+    double                                              matrix[16];     /**< Actor's own transform (row major, as vtkMatrix4x4), the scene transform is applied on top */
+};
+
+
+/** A single change to the contents of the VR scene. Smart pointers are used so
+  * the actor / data stay alive while the delta waits in the queue, even if the GUI
+  * has already let go of its own copy.
+  *
+  * Once an actor has been passed to the VR thread the GUI must not modify it
+  * directly, VTK is not thread safe.
+  */
+struct VRSceneDelta {
+    /** List of delta types */
+    enum Type {
+        ADD_ACTOR,          /**< Add actor to the renderer */
+        REMOVE_ACTOR,       /**< Remove actor from the renderer */
+        SET_ACTOR_INPUT,    /**< Replace the input data of the actor's mapper */
+        SET_SCENE_TRANSFORM,/**< Move/rotate the whole scene */
+        SET_ACTOR_LODS,     /**< Give the actor simplified versions of its data */
+        SET_ACTOR_STATES,   /**< Change visibility/colour of many actors in one go */
+        SET_ACTOR_TRANSFORMS/**< Move many actors in one go */
+    };
+
+    Type                                                type = ADD_ACTOR;   /**< What to do */
+    vtkSmartPointer<vtkActor>                           actor;              /**< Actor the change applies to */
+    vtkSmartPointer<vtkPolyData>                        input;              /**< New mapper input (SET_ACTOR_INPUT only) */
+    vtkSmartPointer<vtkMatrix4x4>                       matrix;             /**< New transform (SET_SCENE_TRANSFORM only) */
+    std::vector<vtkSmartPointer<vtkPolyData>>           levels;             /**< Levels of detail (SET_ACTOR_LODS only) */
+    std::vector<VRActorState>                           states;             /**< New actor states (SET_ACTOR_STATES only) */
+    std::vector<VRActorTransform>                       transforms;         /**< New actor transforms (SET_ACTOR_TRANSFORMS only) */
+};
+
+
+#endif
@@ -0,0 +1,419 @@
+/**		@file VRTransformStore.cpp
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Structure-of-arrays store of actor transforms for the VR thread.
+  *
+  *		P Evans 2022
+  */
+
+#include "VRTransformStore.h"
+
+#include <cmath>
+
+
+static const double degToRad = 3.14159265358979323846 / 180.;
+
+
+VRQuat VRQuat::fromAxisAngle( double angle, double ax, double ay, double az ) {
+	VRQuat q;
+	double len = std::sqrt(ax*ax + ay*ay + az*az);
+	if (len == 0.)
+		return q;
+
+	double h = 0.5 * angle * degToRad;
+	double s = std::sin(h) / len;
+	q.w = std::cos(h);
+	q.x = ax * s;
+	q.y = ay * s;
+	q.z = az * s;
+	return q;
+}
+
+
+VRQuat VRQuat::fromXYZ( double rx, double ry, double rz ) {
+	/* vtkProp3D::RotateX/Y/Z pre-multiply, so each rotation is about the
+	 * actor's own (already rotated) axes
+	 */
+	return fromAxisAngle(rx, 1., 0., 0.) * fromAxisAngle(ry, 0., 1., 0.) * fromAxisAngle(rz, 0., 0., 1.);
+}
+
+
+VRQuat VRQuat::slerp( const VRQuat& a, const VRQuat& b, double t ) {
+	VRQuat c = b;
+	double d = a.w*b.w + a.x*b.x + a.y*b.y + a.z*b.z;
+
+	/* Take the short way round */
+	if (d < 0.) {
+		d = -d;
+		c.w = -c.w; c.x = -c.x; c.y = -c.y; c.z = -c.z;
+	}
+
+	double ka, kb;
+	if (d > 0.9995) {
+		/* Nearly identical, linear interpolation is accurate enough and avoids dividing by ~0 */
+		ka = 1. - t;
+		kb = t;
+	}
+	else {
+		double theta = std::acos(d);
+		double s = std::sin(theta);
+		ka = std::sin((1. - t) * theta) / s;
+		kb = std::sin(t * theta) / s;
+	}
+
+	VRQuat r;
+	r.w = ka*a.w + kb*c.w;
+	r.x = ka*a.x + kb*c.x;
+	r.y = ka*a.y + kb*c.y;
+	r.z = ka*a.z + kb*c.z;
+	r.normalise();
+	return r;
+}
+
+
+VRQuat VRQuat::operator*( const VRQuat& b ) const {
+	VRQuat r;
+	r.w = w*b.w - x*b.x - y*b.y - z*b.z;
+	r.x = w*b.x + x*b.w + y*b.z - z*b.y;
+	r.y = w*b.y - x*b.z + y*b.w + z*b.x;
+	r.z = w*b.z + x*b.y - y*b.x + z*b.w;
+	return r;
+}
+
+
+void VRQuat::normalise() {
+	double n = std::sqrt(w*w + x*x + y*y + z*z);
+	if (n == 0.) {
+		w = 1.; x = y = z = 0.;
+		return;
+	}
+	w /= n; x /= n; y /= n; z /= n;
+}
+
+
+/* Split a matrix into translation, rotation and scale. Assumes there is no shear,
+ * which is true for anything built from VTK's position/orientation/scale.
+ */
+static void decompose( const vtkMatrix4x4* m, double p[3], VRQuat& q, double s[3] ) {
+	double r[3][3];
+
+	for (int i = 0; i < 3; i++)
+		p[i] = m->GetElement(i, 3);
+
+	for (int c = 0; c < 3; c++) {
+		s[c] = std::sqrt( m->GetElement(0, c) * m->GetElement(0, c) +
+		                  m->GetElement(1, c) * m->GetElement(1, c) +
+		                  m->GetElement(2, c) * m->GetElement(2, c) );
+		for (int row = 0; row < 3; row++)
+			r[row][c] = (s[c] != 0.) ? m->GetElement(row, c) / s[c] : 0.;
+	}
+
+	/* A mirror image (negative determinant) can't be a rotation, put the sign in the scale */
+	double det = r[0][0] * (r[1][1]*r[2][2] - r[1][2]*r[2][1])
+	           - r[0][1] * (r[1][0]*r[2][2] - r[1][2]*r[2][0])
+	           + r[0][2] * (r[1][0]*r[2][1] - r[1][1]*r[2][0]);
+	if (det < 0.) {
+		s[0] = -s[0];
+		for (int row = 0; row < 3; row++)
+			r[row][0] = -r[row][0];
+	}
+
+	/* Rotation matrix -> quaternion, choosing the largest component to divide by */
+	double t = r[0][0] + r[1][1] + r[2][2];
+	if (t > 0.) {
+		double k = 0.5 / std::sqrt(t + 1.);
+		q.w = 0.25 / k;
+		q.x = (r[2][1] - r[1][2]) * k;
+		q.y = (r[0][2] - r[2][0]) * k;
+		q.z = (r[1][0] - r[0][1]) * k;
+	}
+	else if (r[0][0] > r[1][1] && r[0][0] > r[2][2]) {
+		double k = 2. * std::sqrt(1. + r[0][0] - r[1][1] - r[2][2]);
+		q.w = (r[2][1] - r[1][2]) / k;
+		q.x = 0.25 * k;
+		q.y = (r[0][1] + r[1][0]) / k;
+		q.z = (r[0][2] + r[2][0]) / k;
+	}
+	else if (r[1][1] > r[2][2]) {
+		double k = 2. * std::sqrt(1. + r[1][1] - r[0][0] - r[2][2]);
+		q.w = (r[0][2] - r[2][0]) / k;
+		q.x = (r[0][1] + r[1][0]) / k;
+		q.y = 0.25 * k;
+		q.z = (r[1][2] + r[2][1]) / k;
+	}
+	else {
+		double k = 2. * std::sqrt(1. + r[2][2] - r[0][0] - r[1][1]);
+		q.w = (r[1][0] - r[0][1]) / k;
+		q.x = (r[0][2] + r[2][0]) / k;
+		q.y = (r[1][2] + r[2][1]) / k;
+		q.z = 0.25 * k;
+	}
+	q.normalise();
+}
+
+
+VRTransformStore::VRTransformStore() {
+	m_allDirty = false;
+	m_version = 0;
+
+	for (int i = 0; i < 16; i++)
+		m_root[i] = (i % 5 == 0) ? 1. : 0.;
+}
+
+
+int VRTransformStore::add( vtkActor* actor ) {
+	int i = find(actor);
+	if (i >= 0)
+		return i;
+
+	/* Capture everything that currently positions the actor (position, orientation,
+	 * scale, origin and any user matrix) as one matrix, then hand control of it to the store.
+	 */
+	vtkSmartPointer<vtkMatrix4x4> m = vtkSmartPointer<vtkMatrix4x4>::New();
+	m->DeepCopy(actor->GetMatrix());
+
+	double p[3], s[3];
+	VRQuat q;
+	decompose(m, p, q, s);
+
+	m_px.push_back(p[0]); m_py.push_back(p[1]); m_pz.push_back(p[2]);
+	m_qw.push_back(q.w);  m_qx.push_back(q.x);  m_qy.push_back(q.y);  m_qz.push_back(q.z);
+	m_sx.push_back(s[0]); m_sy.push_back(s[1]); m_sz.push_back(s[2]);
+
+	m_dx.push_back(0.); m_dy.push_back(0.); m_dz.push_back(0.);
+	m_dw.push_back(1.); m_di.push_back(0.); m_dj.push_back(0.); m_dk.push_back(0.);
+	m_dirty.push_back(1);
+
+	m_out.resize(m_out.size() + 16, 0.);
+
+	actor->SetPosition(0., 0., 0.);
+	actor->SetOrientation(0., 0., 0.);
+	actor->SetScale(1., 1., 1.);
+	actor->SetOrigin(0., 0., 0.);
+	actor->SetUserTransform(nullptr);
+	actor->SetUserMatrix(m);
+
+	m_actors.push_back(actor);
+	m_matrices.push_back(m);
+
+	i = (int)m_actors.size() - 1;
+	m_index[actor] = i;
+	return i;
+}
+
+
+void VRTransformStore::release( int i ) {
+	VRQuat q, d;
+	q.w = m_qw[i]; q.x = m_qx[i]; q.y = m_qy[i]; q.z = m_qz[i];
+	d.w = m_dw[i]; d.x = m_di[i]; d.y = m_dj[i]; d.z = m_dk[i];
+	q = q * d;
+	q.normalise();
+
+	const double s[3] = { m_sx[i], m_sy[i], m_sz[i] };
+	const double p[3] = { m_px[i] + m_dx[i], m_py[i] + m_dy[i], m_pz[i] + m_dz[i] };
+
+	/* Translate * Rotate * Scale, as in update() */
+	double r[9] = {
+		1. - 2.*(q.y*q.y + q.z*q.z),  2.*(q.x*q.y - q.w*q.z),       2.*(q.x*q.z + q.w*q.y),
+		2.*(q.x*q.y + q.w*q.z),       1. - 2.*(q.x*q.x + q.z*q.z),  2.*(q.y*q.z - q.w*q.x),
+		2.*(q.x*q.z - q.w*q.y),       2.*(q.y*q.z + q.w*q.x),       1. - 2.*(q.x*q.x + q.y*q.y)
+	};
+	double m[16];
+	for (int row = 0; row < 3; row++) {
+		for (int c = 0; c < 3; c++)
+			m[4*row + c] = r[3*row + c] * s[c];
+		m[4*row + 3] = p[row];
+	}
+	m[12] = 0.; m[13] = 0.; m[14] = 0.; m[15] = 1.;
+
+	m_matrices[i]->DeepCopy(m);
+}
+
+
+void VRTransformStore::remove( vtkActor* actor ) {
+	int i = find(actor);
+	if (i < 0)
+		return;
+	release(i);
+
+	/* Fill the gap with the last slot so the arrays stay contiguous */
+	int last = (int)m_actors.size() - 1;
+
+	std::vector<double>* fields[] = { &m_px, &m_py, &m_pz, &m_qw, &m_qx, &m_qy, &m_qz, &m_sx, &m_sy, &m_sz,
+	                                  &m_dx, &m_dy, &m_dz, &m_dw, &m_di, &m_dj, &m_dk };
+	for (std::vector<double>* f : fields) {
+		(*f)[i] = (*f)[last];
+		f->pop_back();
+	}
+	m_dirty[i] = 1;
+	m_dirty.pop_back();
+	m_out.resize(m_out.size() - 16);
+
+	m_index.erase(actor);
+	if (i != last) {
+		m_actors[i] = m_actors[last];
+		m_matrices[i] = m_matrices[last];
+		m_index[m_actors[i]] = i;
+	}
+	m_actors.pop_back();
+	m_matrices.pop_back();
+}
+
+
+void VRTransformStore::clear() {
+	for (int i = 0; i < size(); i++)
+		release(i);
+
+	std::vector<double>* fields[] = { &m_px, &m_py, &m_pz, &m_qw, &m_qx, &m_qy, &m_qz, &m_sx, &m_sy, &m_sz,
+	                                  &m_dx, &m_dy, &m_dz, &m_dw, &m_di, &m_dj, &m_dk, &m_out };
+	for (std::vector<double>* f : fields)
+		f->clear();
+
+	m_dirty.clear();
+	m_actors.clear();
+	m_matrices.clear();
+	m_index.clear();
+	m_version++;
+}
+
+
+int VRTransformStore::find( vtkActor* actor ) const {
+	std::unordered_map<vtkActor*, int>::const_iterator it = m_index.find(actor);
+	return (it == m_index.end()) ? -1 : it->second;
+}
+
+
+int VRTransformStore::size() const {
+	return (int)m_actors.size();
+}
+
+
+void VRTransformStore::setAnimation( const VRQuat& q ) {
+	m_animation = q;
+	m_allDirty = true;
+}
+
+
+void VRTransformStore::setRoot( const vtkMatrix4x4* m ) {
+	for (int i = 0; i < 16; i++)
+		m_root[i] = m->GetElement(i / 4, i % 4);
+	m_allDirty = true;
+}
+
+
+void VRTransformStore::translate( int i, double dx, double dy, double dz ) {
+	m_dx[i] += dx;
+	m_dy[i] += dy;
+	m_dz[i] += dz;
+	m_dirty[i] = 1;
+}
+
+
+void VRTransformStore::rotate( int i, const VRQuat& q ) {
+	VRQuat d;
+	d.w = m_dw[i]; d.x = m_di[i]; d.y = m_dj[i]; d.z = m_dk[i];
+	d = d * q;
+	m_dw[i] = d.w; m_di[i] = d.x; m_dj[i] = d.y; m_dk[i] = d.z;
+	m_dirty[i] = 1;
+}
+
+
+void VRTransformStore::setMatrix( int i, const vtkMatrix4x4* m ) {
+	double p[3], s[3];
+	VRQuat q;
+	decompose(m, p, q, s);
+
+	m_px[i] = p[0]; m_py[i] = p[1]; m_pz[i] = p[2];
+	m_qw[i] = q.w;  m_qx[i] = q.x;  m_qy[i] = q.y;  m_qz[i] = q.z;
+	m_sx[i] = s[0]; m_sy[i] = s[1]; m_sz[i] = s[2];
+	m_dirty[i] = 1;
+}
+
+
+void VRTransformStore::update() {
+	const int n = size();
+
+	bool any = m_allDirty;
+	for (int i = 0; i < n && !any; i++)
+		any = m_dirty[i] != 0;
+	if (!any)
+		return;
+
+	/* Raw pointers into the arrays - makes it obvious to the compiler that
+	 * nothing else is touched inside the loop, so it can be vectorised
+	 */
+	double* px = m_px.data(); double* py = m_py.data(); double* pz = m_pz.data();
+	double* qw = m_qw.data(); double* qx = m_qx.data(); double* qy = m_qy.data(); double* qz = m_qz.data();
+	const double* sx = m_sx.data(); const double* sy = m_sy.data(); const double* sz = m_sz.data();
+	double* dx = m_dx.data(); double* dy = m_dy.data(); double* dz = m_dz.data();
+	double* dw = m_dw.data(); double* di = m_di.data(); double* dj = m_dj.data(); double* dk = m_dk.data();
+	double* out = m_out.data();
+
+	const double* r0 = m_root;
+	const double aw = m_animation.w, ax = m_animation.x, ay = m_animation.y, az = m_animation.z;
+
+	for (int i = 0; i < n; i++) {
+		/* 1. Fold queued changes into the base transform (no change = identity, so
+		 *    this is safe to do for every slot and avoids a branch)
+		 */
+		px[i] += dx[i]; py[i] += dy[i]; pz[i] += dz[i];
+		dx[i] = 0.; dy[i] = 0.; dz[i] = 0.;
+
+		double w = qw[i]*dw[i] - qx[i]*di[i] - qy[i]*dj[i] - qz[i]*dk[i];
+		double x = qw[i]*di[i] + qx[i]*dw[i] + qy[i]*dk[i] - qz[i]*dj[i];
+		double y = qw[i]*dj[i] - qx[i]*dk[i] + qy[i]*dw[i] + qz[i]*di[i];
+		double z = qw[i]*dk[i] + qx[i]*dj[i] - qy[i]*di[i] + qz[i]*dw[i];
+		double k = 1. / std::sqrt(w*w + x*x + y*y + z*z);
+		qw[i] = w*k; qx[i] = x*k; qy[i] = y*k; qz[i] = z*k;
+		dw[i] = 1.; di[i] = 0.; dj[i] = 0.; dk[i] = 0.;
+
+		/* 2. Add the scene animation, in the actor's own frame */
+		double fw = qw[i]*aw - qx[i]*ax - qy[i]*ay - qz[i]*az;
+		double fx = qw[i]*ax + qx[i]*aw + qy[i]*az - qz[i]*ay;
+		double fy = qw[i]*ay - qx[i]*az + qy[i]*aw + qz[i]*ax;
+		double fz = qw[i]*az + qx[i]*ay - qy[i]*ax + qz[i]*aw;
+
+		/* 3. Local matrix = Translate * Rotate * Scale (top three rows) */
+		double l0  = (1. - 2.*(fy*fy + fz*fz)) * sx[i];
+		double l1  = (2.*(fx*fy - fw*fz))      * sy[i];
+		double l2  = (2.*(fx*fz + fw*fy))      * sz[i];
+		double l4  = (2.*(fx*fy + fw*fz))      * sx[i];
+		double l5  = (1. - 2.*(fx*fx + fz*fz)) * sy[i];
+		double l6  = (2.*(fy*fz - fw*fx))      * sz[i];
+		double l8  = (2.*(fx*fz - fw*fy))      * sx[i];
+		double l9  = (2.*(fy*fz + fw*fx))      * sy[i];
+		double l10 = (1. - 2.*(fx*fx + fy*fy)) * sz[i];
+
+		/* 4. Final matrix = Root * Local */
+		double* m = out + 16*i;
+		for (int r = 0; r < 3; r++) {
+			const double* R = r0 + 4*r;
+			m[4*r + 0] = R[0]*l0 + R[1]*l4 + R[2]*l8;
+			m[4*r + 1] = R[0]*l1 + R[1]*l5 + R[2]*l9;
+			m[4*r + 2] = R[0]*l2 + R[1]*l6 + R[2]*l10;
+			m[4*r + 3] = R[0]*px[i] + R[1]*py[i] + R[2]*pz[i] + R[3];
+		}
+		m[12] = 0.; m[13] = 0.; m[14] = 0.; m[15] = 1.;
+	}
+
+	/* Hand the finished matrices to the actors, one write each */
+	for (int i = 0; i < n; i++) {
+		if (m_allDirty || m_dirty[i]) {
+			m_matrices[i]->DeepCopy(out + 16*i);
+			m_dirty[i] = 0;
+		}
+	}
+	m_allDirty = false;
+	m_version++;
+}
+
+
+const double* VRTransformStore::matrix( int i ) const {
+	return m_out.data() + 16*i;
+}
+
+
+unsigned long VRTransformStore::version() const {
+	return m_version;
+}
@@ -0,0 +1,162 @@
+/**		@file VRTransformStore.h
+  *
+  *		EEEE2046 - Software Engineering & VR Project
+  *
+  *		Structure-of-arrays store of actor transforms for the VR thread.
+  *
+  *		P Evans 2022
+  */
+#ifndef VR_TRANSFORM_STORE_H
+#define VR_TRANSFORM_STORE_H
+
+/* Vtk headers */
+#include <vtkSmartPointer.h>
+#include <vtkActor.h>
+#include <vtkMatrix4x4.h>
+
+/* Standard headers */
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+/** Unit quaternion (w + xi + yj + zk) used to represent rotations.
+  */
+struct VRQuat {
+    double w = 1., x = 0., y = 0., z = 0.;
+
+    /** Rotation of angle degrees about axis (ax, ay, az), axis need not be normalised */
+    static VRQuat fromAxisAngle( double angle, double ax, double ay, double az );
+
+    /** Rotation equivalent to RotateX(rx), RotateY(ry), RotateZ(rz) applied in turn to a vtkProp3D */
+    static VRQuat fromXYZ( double rx, double ry, double rz );
+
+    /** Spherical interpolation between a (t=0) and b (t=1) */
+    static VRQuat slerp( const VRQuat& a, const VRQuat& b, double t );
+
+    /** Quaternion product, i.e. rotation b followed by rotation a (in a's frame) */
+    VRQuat operator*( const VRQuat& b ) const;
+
+    /** Rescale to unit length (stops rounding errors building up over many products) */
+    void normalise();
+};
+
+
+/** Holds the position, orientation and scale of every actor in the VR scene in
+  * separate contiguous arrays (structure of arrays) rather than inside each
+  * actor object.
+  *
+  * Once per frame update() combines each actor's own transform with the per-frame
+  * changes (the scene animation and any per-actor moves) in a single loop over the
+  * arrays. The loop body has no branches or virtual calls, so the compiler can
+  * vectorise it. Finished matrices are then copied to each actor's user matrix,
+  * one write per actor per frame, rather than the actor rebuilding its matrix after
+  * every RotateX/Y/Z call.
+  *
+  * When an actor is added its current matrix is captured and the actor's own
+  * position/orientation/scale are reset, from then on the store owns its transform.
+  * When it is removed (or the store is cleared) it gets its own transform back as
+  * its user matrix - without the scene transform or animation - so adding it again
+  * later doesn't apply those twice.
+  */
+class VRTransformStore {
+public:
+    VRTransformStore();
+
+    /** Add actor to the store
+      * @param actor is the actor to manage
+      * @return slot index of the actor
+      */
+    int add( vtkActor* actor );
+
+    /** Remove actor from the store, giving it back its own transform. The last slot
+      * is moved into the gap, so slot indices of other actors can change.
+      */
+    void remove( vtkActor* actor );
+
+    /** Remove all actors, giving each back its own transform */
+    void clear();
+
+    /** Get the slot index for an actor
+      * @return slot index or -1 if actor is not in the store
+      */
+    int find( vtkActor* actor ) const;
+
+    /** Number of actors in the store */
+    int size() const;
+
+    /** Set the rotation applied to every actor (about its own origin) on top of
+      * its own orientation, e.g. from the scene animation
+      */
+    void setAnimation( const VRQuat& q );
+
+    /** Set the transform of the whole scene. This is applied after each actor's
+      * own transform, i.e. it moves/rotates the scene as a single rigid body.
+      */
+    void setRoot( const vtkMatrix4x4* m );
+
+    /** Move actor in slot i by (dx, dy, dz) at the next update() */
+    void translate( int i, double dx, double dy, double dz );
+
+    /** Rotate actor in slot i (in its own frame) at the next update() */
+    void rotate( int i, const VRQuat& q );
+
+    /** Set the actor's base position/orientation/scale from a matrix (any shear is lost) */
+    void setMatrix( int i, const vtkMatrix4x4* m );
+
+    /** Compose all changes since the last update and write the resulting
+      * matrices to the actors. Does nothing if nothing has changed.
+      */
+    void update();
+
+    /** Final matrix (row major, including the scene transform) of the actor in slot i,
+      * as written to its user matrix by the last update()
+      */
+    const double* matrix( int i ) const;
+
+    /** Number of update() calls that changed any matrix, so other parts of the
+      * render loop can tell cheaply whether anything has moved since they last looked
+      */
+    unsigned long version() const;
+
+private:
+    /** Write the base transform of slot i (with any queued changes, but not the
+      * scene transform or animation) to its actor's user matrix
+      */
+    void release( int i );
+
+    /* Base transform of each actor, one entry per slot */
+    std::vector<double>                                 m_px, m_py, m_pz;           /**< Position */
+    std::vector<double>                                 m_qw, m_qx, m_qy, m_qz;     /**< Orientation (unit quaternion) */
+    std::vector<double>                                 m_sx, m_sy, m_sz;           /**< Scale */
+
+    /* Changes queued for the next update() */
+    std::vector<double>                                 m_dx, m_dy, m_dz;           /**< Translation */
+    std::vector<double>                                 m_dw, m_di, m_dj, m_dk;     /**< Rotation (unit quaternion) */
+    std::vector<std::uint8_t>                           m_dirty;                    /**< Non-zero if slot changed */
+
+    /** Finished matrices, 16 values (row major) per slot */
+    std::vector<double>                                 m_out;
+
+    /** Actor and the user matrix it reads from, per slot */
+    std::vector<vtkSmartPointer<vtkActor>>              m_actors;
+    std::vector<vtkSmartPointer<vtkMatrix4x4>>          m_matrices;
+
+    /** Lookup from actor to slot */
+    std::unordered_map<vtkActor*, int>                  m_index;
+
+    /** Rotation applied to all actors */
+    VRQuat                                              m_animation;
+
+    /** Scene transform (row major) applied after each actor's own transform */
+    double                                              m_root[16];
+
+    /** True if every slot needs rewriting (e.g. animation changed) */
+    bool                                                m_allDirty;
+
+    /** Incremented by update() whenever matrices change */
+    unsigned long                                       m_version;
+};
+
+
+#endif
@@ -0,0 +1,199 @@
+/**     @file ASCIISTLReader.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Fast multithreaded reader for ASCII STL files.
+  *
+  *     P Evans 2022
+  */
+
+#include "ASCIISTLReader.h"
+#include "BinarySTLReader.h"
+
+#include <QFile>
+
+#include <vtkFloatArray.h>
+#include <vtkSMPTools.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+
+/* Aim for chunks of about this size - big enough that the per-chunk overhead is
+ * negligible, small enough that there are several chunks per thread to balance load
+ */
+static const qint64 targetChunkSize = 1 << 20;
+
+
+static inline bool isSpace( char c ) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v';
+}
+
+
+/* Find the end of the first facet that ends at or after pos, i.e. the character
+ * after the next "endfacet" keyword. Returns end if there isn't one.
+ */
+static const char* nextFacetEnd( const char* pos, const char* end ) {
+    static const char keyword[] = "endfacet";
+    static const size_t length = sizeof(keyword) - 1;
+
+    const char* p = std::search( pos, end, keyword, keyword + length );
+    return (p == end) ? end : p + length;
+}
+
+
+/* Read one number, skipping leading whitespace and an optional '+' sign
+ * (std::from_chars accepts '-' but not '+')
+ */
+static inline bool readFloat( const char*& p, const char* end, float& value ) {
+    while (p < end && isSpace(*p))
+        p++;
+    if (p < end && *p == '+')
+        p++;
+
+    std::from_chars_result r = std::from_chars( p, end, value );
+    if (r.ec != std::errc())
+        return false;
+
+    p = r.ptr;
+    return true;
+}
+
+
+/* Parse all facets between begin and end, appending the coordinates of their
+ * vertices to out (9 floats per triangle). Only "vertex x y z" lines are read,
+ * everything else (facet normal, outer loop, etc) is skipped. A facet is only
+ * kept once its "endfacet" is reached with exactly three good vertices, so a
+ * damaged facet is dropped as a whole and the facets after it stay aligned.
+ */
+static void parseChunk( const char* begin, const char* end, std::vector<float>& out ) {
+    static const char vertexKeyword[] = "vertex";
+    static const size_t vertexLength = sizeof(vertexKeyword) - 1;
+    static const char endKeyword[] = "endfacet";
+    static const size_t endLength = sizeof(endKeyword) - 1;
+
+    float facet[9];
+    int vertices = 0;
+    bool damaged = false;
+
+    const char* p = begin;
+    while (p < end) {
+        /* Skip to the start of the next word */
+        while (p < end && isSpace(*p))
+            p++;
+        if (p >= end)
+            break;
+
+        const char* word = p;
+        while (p < end && !isSpace(*p))
+            p++;
+
+        const size_t length = size_t(p - word);
+        if (length == vertexLength && std::memcmp(word, vertexKeyword, vertexLength) == 0) {
+            float* v = facet + 3 * std::min(vertices, 2);
+            if (vertices < 3 && readFloat(p, end, v[0]) && readFloat(p, end, v[1]) && readFloat(p, end, v[2]))
+                vertices++;
+            else
+                damaged = true;
+        }
+        else if (length == endLength && std::memcmp(word, endKeyword, endLength) == 0) {
+            if (!damaged && vertices == 3)
+                out.insert(out.end(), facet, facet + 9);
+            vertices = 0;
+            damaged = false;
+        }
+    }
+
+    /* A facet with no "endfacet" (a truncated file) is dropped */
+}
+
+
+bool ASCIISTLReader::isASCIISTL( const uchar* data, qint64 size ) {
+    const char* p = reinterpret_cast<const char*>(data);
+    const char* end = p + size;
+
+    while (p < end && isSpace(*p))
+        p++;
+
+    return (end - p) >= 5 && std::memcmp(p, "solid", 5) == 0;
+}
+
+
+vtkSmartPointer<vtkPolyData> ASCIISTLReader::read( const QString& fileName ) {
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return nullptr;
+
+    qint64 size = file.size();
+    uchar* data = (size > 0) ? file.map(0, size) : nullptr;
+    if (!data)
+        return nullptr;
+
+    vtkSmartPointer<vtkPolyData> polyData;
+    if (isASCIISTL(data, size))
+        polyData = read(reinterpret_cast<const char*>(data), size);
+
+    file.unmap(data);
+    return polyData;
+}
+
+
+vtkSmartPointer<vtkPolyData> ASCIISTLReader::read( const char* data, qint64 size ) {
+    const char* end = data + size;
+
+    /* 1. Split the file into chunks, each ending just after an "endfacet" so no facet
+     *    is split between two chunks. Chunks are found serially but this only
+     *    searches a few hundred bytes per chunk.
+     */
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    qint64 nChunks = std::min<qint64>( std::max<qint64>(size / targetChunkSize, 1), 8 * threads );
+
+    std::vector<const char*> bounds;
+    bounds.push_back(data);
+    for (qint64 i = 1; i < nChunks; i++) {
+        const char* nominal = std::max( data + (size * i) / nChunks, bounds.back() );
+        const char* b = nextFacetEnd( nominal, end );
+        if (b >= end)
+            break;
+        bounds.push_back(b);
+    }
+    bounds.push_back(end);
+
+    /* 2. Parse the chunks in parallel, each into its own array */
+    const vtkIdType chunks = vtkIdType(bounds.size()) - 1;
+    std::vector<std::vector<float>> results(chunks);
+
+    vtkSMPTools::For( 0, chunks, 1, [&bounds, &results]( vtkIdType first, vtkIdType last ) {
+        for (vtkIdType c = first; c < last; c++) {
+            /* Roughly 250 bytes of text per facet, 9 floats per facet */
+            results[c].reserve( size_t(bounds[c+1] - bounds[c]) / 25 );
+            parseChunk( bounds[c], bounds[c+1], results[c] );
+        }
+    } );
+
+    /* 3. Work out where each chunk's results go in the final array */
+    std::vector<vtkIdType> offset(chunks + 1, 0);
+    for (vtkIdType c = 0; c < chunks; c++)
+        offset[c+1] = offset[c] + vtkIdType(results[c].size());
+
+    if (offset[chunks] == 0)
+        return nullptr;
+
+    /* 4. Copy into a single point array, again in parallel */
+    vtkSmartPointer<vtkFloatArray> coords = vtkSmartPointer<vtkFloatArray>::New();
+    coords->SetNumberOfComponents(3);
+    coords->SetNumberOfTuples(offset[chunks] / 3);
+    float* dst = coords->GetPointer(0);
+
+    vtkSMPTools::For( 0, chunks, 1, [&offset, &results, dst]( vtkIdType first, vtkIdType last ) {
+        for (vtkIdType c = first; c < last; c++) {
+            std::copy( results[c].begin(), results[c].end(), dst + offset[c] );
+            std::vector<float>().swap(results[c]);
+        }
+    } );
+
+    return BinarySTLReader::trianglesFromPoints(coords);
+}
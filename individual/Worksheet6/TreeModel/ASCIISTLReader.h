@@ -0,0 +1,54 @@
+/**     @file ASCIISTLReader.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Fast multithreaded reader for ASCII STL files.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_ASCIISTLREADER_H
+#define VIEWER_ASCIISTLREADER_H
+
+#include <QString>
+#include <QtGlobal>
+
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+
+
+/** Reads ASCII STL files using several threads.
+  *
+  * The file is memory mapped and split into roughly equal chunks, each chunk
+  * boundary is moved forward to the end of a facet ("endfacet") so that every
+  * facet lies entirely inside one chunk. The chunks are then parsed at the same
+  * time on different threads (vtkSMPTools). Only the "vertex" lines are needed,
+  * their numbers are converted with std::from_chars, which is much faster than
+  * stream input and always uses '.' as the decimal point whatever the system
+  * locale is set to. Finally the vertices from each chunk are copied into a
+  * single vtkPolyData.
+  *
+  * As with BinarySTLReader, each triangle gets its own three points.
+  */
+class ASCIISTLReader {
+public:
+    /** Check whether a block of data looks like an ASCII STL file
+      * @param data is the start of the file
+      * @param size is the length of the file in bytes
+      */
+    static bool isASCIISTL( const uchar* data, qint64 size );
+
+    /** Read an ASCII STL file
+      * @param fileName is the file to read
+      * @return the triangles, or nullptr if the file couldn't be opened or isn't an ASCII STL
+      */
+    static vtkSmartPointer<vtkPolyData> read( const QString& fileName );
+
+    /** Build polydata from an ASCII STL file that is already in memory
+      * @param data is the start of the file
+      * @param size is the length of the file in bytes
+      */
+    static vtkSmartPointer<vtkPolyData> read( const char* data, qint64 size );
+};
+
+#endif
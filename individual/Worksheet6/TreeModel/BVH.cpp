@@ -0,0 +1,791 @@
+/**     @file BVH.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Bounding volume hierarchies for picking and spatial queries.
+  *
+  *     P Evans 2022
+  */
+
+#include "BVH.h"
+
+#include <vtkPoints.h>
+#include <vtkCellArray.h>
+#include <vtkCellArrayIterator.h>
+#include <vtkFloatArray.h>
+#include <vtkMatrix4x4.h>
+
+#include <QThreadPool>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
+
+
+/*============================================================================
+ * Table of trees, by mesh
+ *==========================================================================*/
+
+/* The table doesn't hold on to the meshes, so that GeometryStore can still tell
+ * when nothing is using one. If a mesh is freed and another made at the same
+ * address, the new one has a later modified time, so the old entry isn't used.
+ */
+namespace {
+    struct Entry {
+        vtkMTimeType                    meshTime = 0;   /* Mesh modified time when the tree was started */
+        std::shared_ptr<const MeshBVH>  bvh;            /* nullptr while building, or if the mesh has no polygons */
+        bool                            building = false;
+    };
+}
+
+/* Meshes are shared between parts loaded on different threads. Only this table
+ * is locked, the meshes themselves are only ever read.
+ */
+static std::mutex                                       bvhMutex;
+static std::unordered_map<vtkPolyData*, Entry>          bvhTable;
+static std::atomic<unsigned long>                       bvhGeneration(0);
+static int                                              storesSincePurge = 0;
+
+/* Unused entries are swept up every this many stores, as GeometryStore does */
+static const int purgeInterval = 64;
+
+
+/* Remove entries whose mesh has gone (its tree is all that is left using its
+ * points and polygons), and entries for meshes with nothing to build. Must be
+ * called with the mutex locked.
+ */
+static void purgeLocked() {
+    for (auto it = bvhTable.begin(); it != bvhTable.end(); ) {
+        if (!it->second.building && (!it->second.bvh || it->second.bvh->orphaned()))
+            it = bvhTable.erase(it);
+        else
+            ++it;
+    }
+    storesSincePurge = 0;
+}
+
+
+/* Store a finished tree, unless a tree for the same version of the mesh got there first */
+static std::shared_ptr<const MeshBVH> store( vtkPolyData* data, vtkMTimeType meshTime, std::shared_ptr<const MeshBVH> bvh ) {
+    std::lock_guard<std::mutex> lock(bvhMutex);
+    Entry& e = bvhTable[data];
+    if (e.bvh && e.meshTime == meshTime)
+        return e.bvh;
+
+    /* A build started for an older version of the mesh doesn't replace a newer one */
+    if (e.meshTime > meshTime)
+        return bvh;
+
+    e.meshTime = meshTime;
+    e.bvh = bvh;
+    e.building = false;
+    bvhGeneration++;
+
+    if (++storesSincePurge >= purgeInterval)
+        purgeLocked();
+    return bvh;
+}
+
+
+/* Background builds for request(). One thread, so a burst of new meshes doesn't
+ * take every core from the loader or the VR thread.
+ */
+namespace {
+    class BuildPool : public QThreadPool {
+    public:
+        BuildPool() { setMaxThreadCount(1); }
+    };
+}
+
+static QThreadPool& buildPool() {
+    static BuildPool pool;
+    return pool;
+}
+
+
+std::shared_ptr<const MeshBVH> MeshBVH::find( vtkPolyData* data ) {
+    if (!data)
+        return nullptr;
+
+    vtkMTimeType meshTime = data->GetMTime();
+    std::lock_guard<std::mutex> lock(bvhMutex);
+    auto it = bvhTable.find(data);
+
+    /* A tree built before the mesh was changed is no use */
+    if (it == bvhTable.end() || it->second.meshTime != meshTime)
+        return nullptr;
+    return it->second.bvh;
+}
+
+
+std::shared_ptr<const MeshBVH> MeshBVH::attach( vtkPolyData* data ) {
+    std::shared_ptr<const MeshBVH> bvh = find(data);
+    if (bvh || !data)
+        return bvh;
+
+    /* Built without the lock held, so other threads can build their own trees at
+     * the same time. If two threads build one for the same mesh the second is
+     * thrown away.
+     */
+    vtkMTimeType meshTime = data->GetMTime();
+    bvh = build(data);
+    if (!bvh)
+        return nullptr;
+    return store(data, meshTime, bvh);
+}
+
+
+std::shared_ptr<const MeshBVH> MeshBVH::request( vtkPolyData* data ) {
+    if (!data)
+        return nullptr;
+
+    vtkMTimeType meshTime = data->GetMTime();
+    {
+        std::lock_guard<std::mutex> lock(bvhMutex);
+        auto it = bvhTable.find(data);
+        if (it != bvhTable.end() && it->second.meshTime == meshTime)
+            return it->second.bvh;      /* Ready, being built, or nothing to build */
+
+        Entry& e = bvhTable[data];
+        e.meshTime = meshTime;
+        e.bvh = nullptr;
+        e.building = true;
+    }
+
+    vtkSmartPointer<vtkPolyData> mesh(data);
+    buildPool().start( [mesh, meshTime]() {
+        store( mesh, meshTime, build(mesh) );
+    } );
+    return nullptr;
+}
+
+
+unsigned long MeshBVH::generation() {
+    return bvhGeneration;
+}
+
+
+/*============================================================================
+ * MeshBVH
+ *==========================================================================*/
+
+std::shared_ptr<const MeshBVH> MeshBVH::build( vtkPolyData* data ) {
+    if (!data || !data->GetPoints() || !data->GetPolys() || data->GetNumberOfPolys() == 0)
+        return nullptr;
+
+    /* Triangles refer to points by 32 bit ids */
+    vtkPoints* points = data->GetPoints();
+    const vtkIdType n = points->GetNumberOfPoints();
+    if (n == 0 || n > std::numeric_limits<std::int32_t>::max())
+        return nullptr;
+
+    std::shared_ptr<MeshBVH> bvh = std::make_shared<MeshBVH>();
+    bvh->m_points = points;
+    bvh->m_polys = data->GetPolys();
+
+    /* Polys are numbered after any verts and lines in the mesh */
+    bvh->m_firstCell = data->GetNumberOfVerts() + data->GetNumberOfLines();
+
+    vtkFloatArray* xyz = vtkFloatArray::SafeDownCast( points->GetData() );
+    if (xyz && xyz->GetNumberOfComponents() == 3)
+        bvh->m_xyz = xyz->GetPointer(0);
+
+    /* Worked out here rather than with GetBounds(), which caches them in the
+     * points object and so isn't safe if another thread is using the mesh
+     */
+    double* b = bvh->m_bounds;
+    for (int j = 0; j < 3; j++) {
+        b[2*j] = std::numeric_limits<double>::max();
+        b[2*j+1] = -std::numeric_limits<double>::max();
+    }
+    for (vtkIdType i = 0; i < n; i++) {
+        double p[3];
+        bvh->point( std::int32_t(i), p );
+        for (int j = 0; j < 3; j++) {
+            b[2*j] = std::min(b[2*j], p[j]);
+            b[2*j+1] = std::max(b[2*j+1], p[j]);
+        }
+    }
+
+    bvh->buildTree();
+    return bvh;
+}
+
+
+void MeshBVH::point( std::int32_t id, double p[3] ) const {
+    if (m_xyz) {
+        const float* x = m_xyz + size_t(id) * 3;
+        p[0] = x[0]; p[1] = x[1]; p[2] = x[2];
+    }
+    else
+        m_points->GetPoint(id, p);   /* The version that copies is thread safe */
+}
+
+
+void MeshBVH::buildTree() {
+    /* Split every polygon into a fan of triangles. Only point ids are kept, the
+     * coordinates are read from the mesh's own points when a ray is traced.
+     */
+    m_triangles.reserve( size_t(m_polys->GetNumberOfCells()) );
+
+    /* An iterator of our own, so other threads can read the polygons at the same time */
+    std::int32_t cell = 0;
+    vtkSmartPointer<vtkCellArrayIterator> it = vtkSmartPointer<vtkCellArrayIterator>::Take( m_polys->NewIterator() );
+    for (it->GoToFirstCell(); !it->IsDoneWithTraversal(); it->GoToNextCell(), cell++) {
+        vtkIdType n;
+        const vtkIdType* ids;
+        it->GetCurrentCell(n, ids);
+
+        for (vtkIdType i = 1; i + 1 < n; i++) {
+            Triangle tri;
+            tri.v[0] = std::int32_t(ids[0]);
+            tri.v[1] = std::int32_t(ids[i]);
+            tri.v[2] = std::int32_t(ids[i+1]);
+            tri.cell = cell;
+            m_triangles.push_back(tri);
+        }
+    }
+
+    const int triangles = int(m_triangles.size());
+    if (triangles == 0)
+        return;
+
+    /* Centres are only needed while building */
+    std::vector<float> centres( size_t(triangles) * 3 );
+    for (int i = 0; i < triangles; i++) {
+        double p0[3], p1[3], p2[3];
+        point(m_triangles[i].v[0], p0);
+        point(m_triangles[i].v[1], p1);
+        point(m_triangles[i].v[2], p2);
+        for (int j = 0; j < 3; j++)
+            centres[size_t(i) * 3 + j] = float( (p0[j] + p1[j] + p2[j]) * (1. / 3.) );
+    }
+
+    std::vector<std::int32_t> order(triangles);
+    for (int i = 0; i < triangles; i++)
+        order[i] = i;
+
+    /* A tree with leaves of leafSize has fewer than 2n/leafSize nodes, but small
+     * leaves are left where a split fails so allow for some slack
+     */
+    m_nodes.reserve( size_t(2 * triangles / leafSize + 1) );
+    buildNode(order, 0, triangles, centres);
+
+    /* Store the triangles in leaf order, so each leaf's triangles are next to each other in memory */
+    std::vector<Triangle> sorted( size_t(triangles) );
+    for (int i = 0; i < triangles; i++)
+        sorted[i] = m_triangles[ order[i] ];
+    m_triangles.swap(sorted);
+}
+
+
+int MeshBVH::buildNode( std::vector<std::int32_t>& order, int begin, int end, const std::vector<float>& centres ) {
+    int index = int(m_nodes.size());
+    m_nodes.emplace_back();
+
+    /* Box around the triangles, and around their centres (used to choose the split) */
+    float lo[3], hi[3], clo[3], chi[3];
+    for (int j = 0; j < 3; j++) {
+        lo[j] = clo[j] = std::numeric_limits<float>::max();
+        hi[j] = chi[j] = -std::numeric_limits<float>::max();
+    }
+    for (int i = begin; i < end; i++) {
+        const Triangle& tri = m_triangles[ order[i] ];
+        for (int k = 0; k < 3; k++) {
+            double p[3];
+            point(tri.v[k], p);
+            for (int j = 0; j < 3; j++) {
+                lo[j] = std::min(lo[j], float(p[j]));
+                hi[j] = std::max(hi[j], float(p[j]));
+            }
+        }
+        const float* c = &centres[size_t(order[i]) * 3];
+        for (int j = 0; j < 3; j++) {
+            clo[j] = std::min(clo[j], c[j]);
+            chi[j] = std::max(chi[j], c[j]);
+        }
+    }
+
+    /* Split across the longest side of the centre box */
+    int axis = 0;
+    for (int j = 1; j < 3; j++)
+        if (chi[j] - clo[j] > chi[axis] - clo[axis])
+            axis = j;
+
+    Node node;
+    std::copy_n(lo, 3, node.lo);
+    std::copy_n(hi, 3, node.hi);
+    node.first = begin;
+    node.count = end - begin;
+    node.right = -1;
+
+    /* All centres in the same place can't be split, leave them in one leaf */
+    if (end - begin <= leafSize || chi[axis] <= clo[axis]) {
+        m_nodes[index] = node;
+        return index;
+    }
+
+    /* Half the triangles each side of the median centre - a balanced tree, and
+     * nth_element is linear so the whole build is O(n log n)
+     */
+    int mid = (begin + end) / 2;
+    std::nth_element( order.begin() + begin, order.begin() + mid, order.begin() + end,
+        [&centres, axis]( std::int32_t a, std::int32_t b ) {
+            return centres[size_t(a) * 3 + axis] < centres[size_t(b) * 3 + axis];
+        } );
+
+    node.count = 0;
+    buildNode(order, begin, mid, centres);
+    node.right = buildNode(order, mid, end, centres);
+    m_nodes[index] = node;
+    return index;
+}
+
+
+/* Ray against box (slab test). Returns the distance the ray enters the box, or a
+ * negative number if it misses or enters after maxT.
+ */
+template <typename T>
+static inline double rayBox( const T lo[3], const T hi[3], const double origin[3], const double invDir[3], double maxT ) {
+    double t0 = 0., t1 = maxT;
+    for (int j = 0; j < 3; j++) {
+        double a = (double(lo[j]) - origin[j]) * invDir[j];
+        double b = (double(hi[j]) - origin[j]) * invDir[j];
+        if (a > b) std::swap(a, b);
+        /* NaN (0 * inf when the ray lies in the slab's plane) is ignored by these comparisons */
+        if (a > t0) t0 = a;
+        if (b < t1) t1 = b;
+        if (t0 > t1)
+            return -1.;
+    }
+    return t0;
+}
+
+
+/* Möller-Trumbore ray / triangle intersection, returns distance or a negative number */
+static inline double rayTriangle( const double v0[3], const double v1[3], const double v2[3], const double origin[3], const double dir[3] ) {
+    double e1[3], e2[3], p[3], s[3], q[3];
+    for (int j = 0; j < 3; j++) {
+        e1[j] = v1[j] - v0[j];
+        e2[j] = v2[j] - v0[j];
+    }
+    p[0] = dir[1]*e2[2] - dir[2]*e2[1];
+    p[1] = dir[2]*e2[0] - dir[0]*e2[2];
+    p[2] = dir[0]*e2[1] - dir[1]*e2[0];
+
+    double det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+    if (std::fabs(det) < 1e-300)
+        return -1.;
+    double inv = 1. / det;
+
+    for (int j = 0; j < 3; j++)
+        s[j] = origin[j] - v0[j];
+    double u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) * inv;
+    if (u < 0. || u > 1.)
+        return -1.;
+
+    q[0] = s[1]*e1[2] - s[2]*e1[1];
+    q[1] = s[2]*e1[0] - s[0]*e1[2];
+    q[2] = s[0]*e1[1] - s[1]*e1[0];
+    double w = (dir[0]*q[0] + dir[1]*q[1] + dir[2]*q[2]) * inv;
+    if (w < 0. || u + w > 1.)
+        return -1.;
+
+    return (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) * inv;
+}
+
+
+static inline void inverse( const double dir[3], double inv[3] ) {
+    for (int j = 0; j < 3; j++)
+        inv[j] = 1. / dir[j];   /* +-inf for 0, handled by the slab test */
+}
+
+
+bool MeshBVH::intersect( const double origin[3], const double dir[3], double& t, vtkIdType& cellId ) const {
+    if (m_nodes.empty())
+        return false;
+
+    double invDir[3];
+    inverse(dir, invDir);
+
+    bool hit = false;
+    /* Depth is log2(n / leafSize) for a median split, 64 is plenty */
+    int stack[64];
+    int top = 0;
+    if (rayBox(m_nodes[0].lo, m_nodes[0].hi, origin, invDir, t) >= 0.)
+        stack[top++] = 0;
+
+    while (top > 0) {
+        const Node& node = m_nodes[ stack[--top] ];
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                const Triangle& tri = m_triangles[i];
+                double v0[3], v1[3], v2[3];
+                point(tri.v[0], v0);
+                point(tri.v[1], v1);
+                point(tri.v[2], v2);
+                double d = rayTriangle( v0, v1, v2, origin, dir );
+                if (d >= 0. && d < t) {
+                    t = d;
+                    cellId = m_firstCell + tri.cell;
+                    hit = true;
+                }
+            }
+            continue;
+        }
+
+        /* Visit the nearer child first, once something is hit the further one
+         * is often skipped because the hit is closer than its box
+         */
+        int a = int(&node - m_nodes.data()) + 1, b = node.right;
+        double ta = rayBox(m_nodes[a].lo, m_nodes[a].hi, origin, invDir, t);
+        double tb = rayBox(m_nodes[b].lo, m_nodes[b].hi, origin, invDir, t);
+        if (ta >= 0. && tb >= 0.) {
+            if (ta < tb) std::swap(a, b);
+            stack[top++] = a;
+            stack[top++] = b;
+        }
+        else if (ta >= 0.)
+            stack[top++] = a;
+        else if (tb >= 0.)
+            stack[top++] = b;
+    }
+    return hit;
+}
+
+
+bool MeshBVH::orphaned() const {
+    return m_points->GetReferenceCount() <= 1 && m_polys->GetReferenceCount() <= 1;
+}
+
+
+void MeshBVH::bounds( double b[6] ) const {
+    std::copy_n(m_bounds, 6, b);
+}
+
+
+vtkIdType MeshBVH::triangleCount() const {
+    return vtkIdType(m_triangles.size());
+}
+
+
+/*============================================================================
+ * SceneBVH
+ *==========================================================================*/
+
+/* Items per scene leaf */
+static const int sceneLeafSize = 2;
+
+
+void SceneBVH::place( Entry& e, const double toWorld[16] ) {
+    vtkMatrix4x4::Invert(toWorld, e.toLocal);
+
+    /* World box is the box around the transformed corners of the local box */
+    double local[6];
+    e.mesh->bounds(local);
+    for (int j = 0; j < 3; j++) {
+        e.box[2*j] = std::numeric_limits<double>::max();
+        e.box[2*j+1] = -std::numeric_limits<double>::max();
+    }
+    for (int c = 0; c < 8; c++) {
+        double p[4] = { local[(c & 1) ? 1 : 0], local[(c & 2) ? 3 : 2], local[(c & 4) ? 5 : 4], 1. };
+        double w[4];
+        vtkMatrix4x4::MultiplyPoint(toWorld, p, w);
+        for (int j = 0; j < 3; j++) {
+            e.box[2*j] = std::min(e.box[2*j], w[j]);
+            e.box[2*j+1] = std::max(e.box[2*j+1], w[j]);
+        }
+    }
+}
+
+
+void SceneBVH::build( const std::vector<Item>& items ) {
+    m_items.clear();
+    m_order.clear();
+    m_nodes.clear();
+
+    m_items.resize( items.size() );
+    for (size_t i = 0; i < items.size(); i++) {
+        m_items[i].mesh = items[i].mesh;
+        if (m_items[i].mesh)
+            place(m_items[i], items[i].toWorld);
+        else {
+            /* Nothing to hit - an empty box that never overlaps anything */
+            for (int j = 0; j < 3; j++) {
+                m_items[i].box[2*j] = std::numeric_limits<double>::max();
+                m_items[i].box[2*j+1] = -std::numeric_limits<double>::max();
+            }
+            continue;
+        }
+        m_order.push_back( int(i) );
+    }
+
+    if (!m_order.empty()) {
+        m_nodes.reserve( m_order.size() * 2 );
+        buildNode(0, int(m_order.size()));
+    }
+}
+
+
+int SceneBVH::buildNode( int begin, int end ) {
+    int index = int(m_nodes.size());
+    m_nodes.emplace_back();
+
+    double lo[3], hi[3], clo[3], chi[3];
+    for (int j = 0; j < 3; j++) {
+        lo[j] = clo[j] = std::numeric_limits<double>::max();
+        hi[j] = chi[j] = -std::numeric_limits<double>::max();
+    }
+    for (int i = begin; i < end; i++) {
+        const double* b = m_items[ m_order[i] ].box;
+        for (int j = 0; j < 3; j++) {
+            double c = 0.5 * (b[2*j] + b[2*j+1]);
+            lo[j] = std::min(lo[j], b[2*j]);
+            hi[j] = std::max(hi[j], b[2*j+1]);
+            clo[j] = std::min(clo[j], c);
+            chi[j] = std::max(chi[j], c);
+        }
+    }
+
+    int axis = 0;
+    for (int j = 1; j < 3; j++)
+        if (chi[j] - clo[j] > chi[axis] - clo[axis])
+            axis = j;
+
+    Node node;
+    std::copy_n(lo, 3, node.lo);
+    std::copy_n(hi, 3, node.hi);
+    node.first = begin;
+    node.count = end - begin;
+    node.right = -1;
+
+    if (end - begin <= sceneLeafSize || chi[axis] <= clo[axis]) {
+        m_nodes[index] = node;
+        return index;
+    }
+
+    int mid = (begin + end) / 2;
+    std::nth_element( m_order.begin() + begin, m_order.begin() + mid, m_order.begin() + end,
+        [this, axis]( int a, int b ) {
+            return m_items[a].box[2*axis] + m_items[a].box[2*axis+1] < m_items[b].box[2*axis] + m_items[b].box[2*axis+1];
+        } );
+
+    node.count = 0;
+    buildNode(begin, mid);
+    node.right = buildNode(mid, end);
+    m_nodes[index] = node;
+    return index;
+}
+
+
+void SceneBVH::setTransform( int item, const double toWorld[16] ) {
+    if (item < 0 || item >= int(m_items.size()) || !m_items[item].mesh)
+        return;
+    place(m_items[item], toWorld);
+}
+
+
+void SceneBVH::refit() {
+    /* Children always come after their parent, so a backwards pass sees both
+     * children of a node before the node itself
+     */
+    for (int n = int(m_nodes.size()) - 1; n >= 0; n--)
+        refitNode(n);
+}
+
+
+void SceneBVH::refitNode( int n ) {
+    Node& node = m_nodes[n];
+    for (int j = 0; j < 3; j++) {
+        node.lo[j] = std::numeric_limits<double>::max();
+        node.hi[j] = -std::numeric_limits<double>::max();
+    }
+
+    if (node.count > 0) {
+        for (int i = node.first; i < node.first + node.count; i++) {
+            const double* b = m_items[ m_order[i] ].box;
+            for (int j = 0; j < 3; j++) {
+                node.lo[j] = std::min(node.lo[j], b[2*j]);
+                node.hi[j] = std::max(node.hi[j], b[2*j+1]);
+            }
+        }
+        return;
+    }
+
+    const Node& a = m_nodes[n + 1];
+    const Node& b = m_nodes[node.right];
+    for (int j = 0; j < 3; j++) {
+        node.lo[j] = std::min(a.lo[j], b.lo[j]);
+        node.hi[j] = std::max(a.hi[j], b.hi[j]);
+    }
+}
+
+
+bool SceneBVH::pick( const double origin[3], const double dir[3], double maxT, Hit& hit ) const {
+    hit = Hit();
+    if (m_nodes.empty())
+        return false;
+
+    double invDir[3];
+    inverse(dir, invDir);
+
+    double best = maxT;
+    int stack[64];
+    int top = 0;
+    if (rayBox(m_nodes[0].lo, m_nodes[0].hi, origin, invDir, best) >= 0.)
+        stack[top++] = 0;
+
+    while (top > 0) {
+        const Node& node = m_nodes[ stack[--top] ];
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                const Entry& e = m_items[ m_order[i] ];
+                const double lo3[3] = { e.box[0], e.box[2], e.box[4] }, hi3[3] = { e.box[1], e.box[3], e.box[5] };
+                if (rayBox(lo3, hi3, origin, invDir, best) < 0.)
+                    continue;
+
+                /* Move the ray into the item's coordinates. The direction is
+                 * transformed without being normalised, so distances along the
+                 * local ray are the same as along the world ray.
+                 */
+                double o[4] = { origin[0], origin[1], origin[2], 1. };
+                double d[4] = { dir[0], dir[1], dir[2], 0. };
+                double lo[4], ld[4];
+                vtkMatrix4x4::MultiplyPoint(e.toLocal, o, lo);
+                vtkMatrix4x4::MultiplyPoint(e.toLocal, d, ld);
+
+                double t = best;
+                vtkIdType cellId;
+                if (e.mesh->intersect(lo, ld, t, cellId)) {
+                    best = t;
+                    hit.item = m_order[i];
+                    hit.t = t;
+                    hit.cellId = cellId;
+                }
+            }
+            continue;
+        }
+
+        int a = int(&node - m_nodes.data()) + 1, b = node.right;
+        double ta = rayBox(m_nodes[a].lo, m_nodes[a].hi, origin, invDir, best);
+        double tb = rayBox(m_nodes[b].lo, m_nodes[b].hi, origin, invDir, best);
+        if (ta >= 0. && tb >= 0.) {
+            if (ta < tb) std::swap(a, b);
+            stack[top++] = a;
+            stack[top++] = b;
+        }
+        else if (ta >= 0.)
+            stack[top++] = a;
+        else if (tb >= 0.)
+            stack[top++] = b;
+    }
+
+    if (hit.item < 0)
+        return false;
+    for (int j = 0; j < 3; j++)
+        hit.point[j] = origin[j] + hit.t * dir[j];
+    return true;
+}
+
+
+static inline bool overlaps( const double lo[3], const double hi[3], const double box[6] ) {
+    return lo[0] <= box[1] && hi[0] >= box[0]
+        && lo[1] <= box[3] && hi[1] >= box[2]
+        && lo[2] <= box[5] && hi[2] >= box[4];
+}
+
+
+void SceneBVH::query( const double box[6], std::vector<int>& items ) const {
+    items.clear();
+    if (m_nodes.empty())
+        return;
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node& node = m_nodes[ stack[--top] ];
+        if (!overlaps(node.lo, node.hi, box))
+            continue;
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                const double* b = m_items[ m_order[i] ].box;
+                const double lo[3] = { b[0], b[2], b[4] }, hi[3] = { b[1], b[3], b[5] };
+                if (overlaps(lo, hi, box))
+                    items.push_back( m_order[i] );
+            }
+            continue;
+        }
+        stack[top++] = int(&node - m_nodes.data()) + 1;
+        stack[top++] = node.right;
+    }
+}
+
+
+/* Squared distance from a point to a box, 0 inside */
+static inline double boxDistance2( const double lo[3], const double hi[3], const double p[3] ) {
+    double d2 = 0.;
+    for (int j = 0; j < 3; j++) {
+        double d = std::max( { lo[j] - p[j], 0., p[j] - hi[j] } );
+        d2 += d * d;
+    }
+    return d2;
+}
+
+
+int SceneBVH::nearest( const double p[3], double maxDistance, double* distance ) const {
+    int found = -1;
+    double best = maxDistance * maxDistance;
+    if (m_nodes.empty())
+        return -1;
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node& node = m_nodes[ stack[--top] ];
+        if (boxDistance2(node.lo, node.hi, p) > best)
+            continue;
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                const double* b = m_items[ m_order[i] ].box;
+                const double lo[3] = { b[0], b[2], b[4] }, hi[3] = { b[1], b[3], b[5] };
+                double d2 = boxDistance2(lo, hi, p);
+                if (d2 <= best) {
+                    best = d2;
+                    found = m_order[i];
+                }
+            }
+            continue;
+        }
+
+        /* Closer child last, so it is searched first and tightens the bound */
+        int a = int(&node - m_nodes.data()) + 1, b = node.right;
+        double da = boxDistance2(m_nodes[a].lo, m_nodes[a].hi, p);
+        double db = boxDistance2(m_nodes[b].lo, m_nodes[b].hi, p);
+        if (da < db) std::swap(a, b);
+        stack[top++] = a;
+        stack[top++] = b;
+    }
+
+    if (found >= 0 && distance)
+        *distance = std::sqrt(best);
+    return found;
+}
+
+
+int SceneBVH::size() const {
+    return int(m_items.size());
+}
+
+
+const double* SceneBVH::itemBounds( int item ) const {
+    return m_items[item].box;
+}
@@ -0,0 +1,220 @@
+/**     @file BVH.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Bounding volume hierarchies for picking and spatial queries.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_BVH_H
+#define VIEWER_BVH_H
+
+#include <vtkPolyData.h>
+#include <vtkPoints.h>
+#include <vtkCellArray.h>
+#include <vtkSmartPointer.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+/** Testing a ray (e.g. from a VR controller) against every triangle of every
+  * part is far too slow for a big assembly. A bounding volume hierarchy is a
+  * tree of boxes - each box contains everything below it - so whole branches
+  * that the ray misses are skipped with a single box test. A pick then only
+  * tests the handful of triangles near the ray.
+  *
+  * Two levels are used:
+  *   - MeshBVH is a tree over the triangles of one mesh, in the mesh's own
+  *     coordinates. It is shared by every part that uses the mesh, and built by
+  *     the loader's worker threads as the mesh is loaded, so the GUI and VR
+  *     threads never have to wait for one.
+  *   - SceneBVH is a tree over parts (their world bounds). It is cheap to build,
+  *     and can be refitted each frame when parts move without being rebuilt.
+  * A ray is traced through the scene tree, then, for each part it reaches, moved
+  * into the part's own coordinates and traced through the part's mesh tree.
+  */
+class MeshBVH {
+public:
+    /** Make a tree over a mesh's triangles (polygons with more than three
+      * points are split into triangles). The tree refers to the mesh's own points
+      * and polygons rather than copying them. Only reads the mesh, so it is safe
+      * to run on worker threads. O(n log n) in the number of triangles.
+      * @param data is the mesh
+      * @return the tree, or nullptr if the mesh has no polygons
+      */
+    static std::shared_ptr<const MeshBVH> build( vtkPolyData* data );
+
+    /** Get the tree for a mesh, building and storing it first (on this thread)
+      * if there isn't one. Trees are kept in a table keyed by the mesh rather than
+      * in the mesh itself, so storing one never touches a mesh that other threads
+      * may be rendering. Thread safe.
+      */
+    static std::shared_ptr<const MeshBVH> attach( vtkPolyData* data );
+
+    /** Get the tree for a mesh, without building one
+      * @return the tree, nullptr if there isn't one yet
+      */
+    static std::shared_ptr<const MeshBVH> find( vtkPolyData* data );
+
+    /** Get the tree for a mesh, or start building it on a background thread if
+      * there isn't one. For threads that mustn't stall (the VR render thread).
+      * @return the tree, nullptr if it isn't ready - ask again once generation() has changed
+      */
+    static std::shared_ptr<const MeshBVH> request( vtkPolyData* data );
+
+    /** Counts up every time a tree is stored, so callers waiting on request() know when to look again */
+    static unsigned long generation();
+
+    /** Trace a ray through the mesh. Thread safe.
+      * @param origin is the start of the ray
+      * @param dir is the ray direction (need not be unit length, distances are in multiples of it)
+      * @param t is the furthest distance to look on input, the distance of the hit on output
+      * @param cellId receives the polygon that was hit
+      * @return true if the ray hit the mesh closer than t
+      */
+    bool intersect( const double origin[3], const double dir[3], double& t, vtkIdType& cellId ) const;
+
+    /** Bounds of the mesh (xmin, xmax, ymin, ymax, zmin, zmax) */
+    void bounds( double b[6] ) const;
+
+    /** True if the tree is all that is still using the mesh's points and
+      * polygons, i.e. the mesh has been freed or given new ones
+      */
+    bool orphaned() const;
+
+    /** Number of triangles in the tree */
+    vtkIdType triangleCount() const;
+
+    /** Triangles in each leaf (at most) */
+    static const int leafSize = 4;
+
+private:
+    /** A box in the tree. Children of node i are i+1 and right. */
+    struct Node {
+        float                                   lo[3], hi[3];   /**< Box */
+        std::int32_t                            first;          /**< Leaf: first triangle */
+        std::int32_t                            count;          /**< Leaf: number of triangles, 0 for an inner node */
+        std::int32_t                            right;          /**< Inner: second child */
+    };
+
+    /** A triangle, as three points of the mesh */
+    struct Triangle {
+        std::int32_t                            v[3];           /**< Point ids */
+        std::int32_t                            cell;           /**< Polygon it is part of, counted from the first polygon */
+    };
+
+    /** Split the polygons into triangles and build the tree (from build()) */
+    void buildTree();
+
+    /** Build the node for triangles begin to end-1 of order (recursive), returns its index */
+    int buildNode( std::vector<std::int32_t>& order, int begin, int end, const std::vector<float>& centres );
+
+    /** Get a point of the mesh */
+    void point( std::int32_t id, double p[3] ) const;
+
+    vtkSmartPointer<vtkPoints>                  m_points;       /**< The mesh's points */
+    vtkSmartPointer<vtkCellArray>               m_polys;        /**< The mesh's polygons */
+    const float*                                m_xyz = nullptr;    /**< Point coordinates, if they are floats (STL files) */
+    vtkIdType                                   m_firstCell = 0;    /**< Cell id of the first polygon */
+    double                                      m_bounds[6];
+    std::vector<Node>                           m_nodes;
+    std::vector<Triangle>                       m_triangles;    /**< In leaf order */
+};
+
+
+/** Tree over a set of items, each of which is a mesh (MeshBVH) placed in the
+  * world by a transform. Items are referred to by their position in the list
+  * given to build(), callers keep their own list of what each item is.
+  */
+class SceneBVH {
+public:
+    /** An item in the scene */
+    struct Item {
+        std::shared_ptr<const MeshBVH>          mesh;           /**< Triangles, in local coordinates */
+        double                                  toWorld[16];    /**< Local to world transform (row major) */
+    };
+
+    /** Result of a pick */
+    struct Hit {
+        int                                     item = -1;      /**< Item hit, -1 if nothing */
+        double                                  t = 0.;         /**< Distance along the ray */
+        double                                  point[3] = { 0., 0., 0. };  /**< World position of the hit */
+        vtkIdType                               cellId = -1;    /**< Polygon hit, in the item's mesh */
+    };
+
+    /** Build the tree
+      * @param items are the items, their order gives the item numbers
+      */
+    void build( const std::vector<Item>& items );
+
+    /** Move an item. Takes effect at the next refit(). */
+    void setTransform( int item, const double toWorld[16] );
+
+    /** Update the boxes after items have moved. Much cheaper than build(), but the
+      * tree gets less efficient if items move a long way - rebuild now and again.
+      */
+    void refit();
+
+    /** Trace a ray through the scene
+      * @param origin is the start of the ray
+      * @param dir is the ray direction (distances are in multiples of it)
+      * @param maxT is the furthest distance to look
+      * @param hit receives the closest hit
+      * @return true if something was hit
+      */
+    bool pick( const double origin[3], const double dir[3], double maxT, Hit& hit ) const;
+
+    /** Find items whose world box overlaps a box
+      * @param box is the box (xmin, xmax, ymin, ymax, zmin, zmax)
+      * @param items receives the item numbers
+      */
+    void query( const double box[6], std::vector<int>& items ) const;
+
+    /** Find the item closest to a point, by distance to its world box (0 if the
+      * point is inside it)
+      * @param p is the point
+      * @param maxDistance is the furthest distance to look
+      * @param distance if not null receives the distance
+      * @return the item, -1 if there is none within maxDistance
+      */
+    int nearest( const double p[3], double maxDistance, double* distance = nullptr ) const;
+
+    /** Number of items */
+    int size() const;
+
+    /** World bounds of an item */
+    const double* itemBounds( int item ) const;
+
+private:
+    struct Node {
+        double                                  lo[3], hi[3];
+        int                                     first;          /**< Leaf: first entry in m_order */
+        int                                     count;          /**< Leaf: number of items, 0 for an inner node */
+        int                                     right;          /**< Inner: second child, the first is the next node */
+    };
+
+    /** Per item data, world box and inverse transform for moving rays into the item */
+    struct Entry {
+        std::shared_ptr<const MeshBVH>          mesh;
+        double                                  toLocal[16];
+        double                                  box[6];
+    };
+
+    /** Set an entry's inverse transform and world box */
+    static void place( Entry& e, const double toWorld[16] );
+
+    /** Build the node for m_order[begin] to m_order[end-1] (recursive) */
+    int buildNode( int begin, int end );
+
+    /** Recalculate the box of a node from its children / items (recursive) */
+    void refitNode( int node );
+
+    std::vector<Entry>                          m_items;
+    std::vector<int>                            m_order;        /**< Item numbers in leaf order */
+    std::vector<Node>                           m_nodes;
+};
+
+#endif
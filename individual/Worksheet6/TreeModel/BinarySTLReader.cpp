@@ -0,0 +1,151 @@
+/**     @file BinarySTLReader.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Fast reader for binary STL files.
+  *
+  *     P Evans 2022
+  */
+
+#include "BinarySTLReader.h"
+
+#include <QFile>
+
+#include <vtkPoints.h>
+#include <vtkFloatArray.h>
+#include <vtkCellArray.h>
+#include <vtkTypeInt32Array.h>
+#include <vtkTypeInt64Array.h>
+#include <vtkSMPTools.h>
+
+#include <cstring>
+#include <limits>
+
+
+/* File layout */
+static const qint64 headerSize   = 80;      /* Free text header */
+static const qint64 countSize    = 4;       /* uint32 triangle count */
+static const qint64 recordSize   = 50;      /* float normal[3], float vertex[3][3], uint16 attributes */
+static const qint64 vertexOffset = 12;      /* Vertices start after the normal */
+
+
+/* Number of triangles from the file header (stored little endian) */
+static quint32 triangleCount( const uchar* data ) {
+    const uchar* c = data + headerSize;
+    return quint32(c[0]) | (quint32(c[1]) << 8) | (quint32(c[2]) << 16) | (quint32(c[3]) << 24);
+}
+
+
+/* Fill offsets/connectivity for n independent triangles: triangle t uses points 3t, 3t+1, 3t+2 */
+template <typename ArrayT>
+static vtkSmartPointer<vtkCellArray> makeTriangles( vtkIdType n ) {
+    typedef typename ArrayT::ValueType T;
+
+    vtkSmartPointer<ArrayT> offsets = vtkSmartPointer<ArrayT>::New();
+    vtkSmartPointer<ArrayT> connectivity = vtkSmartPointer<ArrayT>::New();
+    offsets->SetNumberOfValues(n + 1);
+    connectivity->SetNumberOfValues(3 * n);
+
+    T* o = offsets->GetPointer(0);
+    T* c = connectivity->GetPointer(0);
+
+    vtkSMPTools::For( 0, n + 1, [o, c, n]( vtkIdType begin, vtkIdType end ) {
+        for (vtkIdType t = begin; t < end; t++) {
+            o[t] = T(3 * t);
+            if (t < n) {
+                c[3*t]     = T(3*t);
+                c[3*t + 1] = T(3*t + 1);
+                c[3*t + 2] = T(3*t + 2);
+            }
+        }
+    } );
+
+    vtkSmartPointer<vtkCellArray> cells = vtkSmartPointer<vtkCellArray>::New();
+    cells->SetData(offsets, connectivity);
+    return cells;
+}
+
+
+bool BinarySTLReader::isBinarySTL( const uchar* data, qint64 size ) {
+    if (!data || size < headerSize + countSize)
+        return false;
+
+    /* An ASCII file that happened to pass this check would need its length to
+     * exactly match the number in bytes 80-83, which is very unlikely
+     */
+    return size == headerSize + countSize + recordSize * qint64(triangleCount(data));
+}
+
+
+vtkSmartPointer<vtkPolyData> BinarySTLReader::read( const QString& fileName ) {
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return nullptr;
+
+    qint64 size = file.size();
+    if (size < headerSize + countSize)
+        return nullptr;
+
+    /* Map the file rather than reading it - the operating system pages the
+     * data in as it is touched, and it never needs a heap buffer
+     */
+    uchar* data = file.map(0, size);
+    if (!data)
+        return nullptr;
+
+    vtkSmartPointer<vtkPolyData> polyData;
+    if (isBinarySTL(data, size))
+        polyData = read(data);
+
+    file.unmap(data);
+    return polyData;
+}
+
+
+vtkSmartPointer<vtkPolyData> BinarySTLReader::read( const uchar* data ) {
+    const vtkIdType n = triangleCount(data);
+    const uchar* records = data + headerSize + countSize;
+
+    /* Nothing to show, as for any other file with no triangles */
+    if (n == 0)
+        return nullptr;
+
+    /* Allocate the final arrays once, at their full size */
+    vtkSmartPointer<vtkFloatArray> coords = vtkSmartPointer<vtkFloatArray>::New();
+    coords->SetNumberOfComponents(3);
+    coords->SetNumberOfTuples(3 * n);
+    float* dst = coords->GetPointer(0);
+
+    /* Copy the nine vertex coordinates out of each record. Records are 50 bytes so
+     * the floats aren't aligned, memcpy is the safe (and on x86/ARM, fast) way to
+     * read them. STL is little endian, as are all platforms we build for.
+     */
+    vtkSMPTools::For( 0, n, [dst, records]( vtkIdType begin, vtkIdType end ) {
+        for (vtkIdType t = begin; t < end; t++)
+            std::memcpy( dst + 9*t, records + recordSize*t + vertexOffset, 9 * sizeof(float) );
+    } );
+
+    return trianglesFromPoints(coords);
+}
+
+
+vtkSmartPointer<vtkPolyData> BinarySTLReader::trianglesFromPoints( vtkFloatArray* coords ) {
+    const vtkIdType n = coords->GetNumberOfTuples() / 3;
+
+    vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+    points->SetData(coords);
+
+    /* 32 bit cell indices use half the memory of 64 bit ones, use them whenever
+     * the number of points allows
+     */
+    vtkSmartPointer<vtkCellArray> cells;
+    if (3 * n < vtkIdType(std::numeric_limits<vtkTypeInt32>::max()))
+        cells = makeTriangles<vtkTypeInt32Array>(n);
+    else
+        cells = makeTriangles<vtkTypeInt64Array>(n);
+
+    vtkSmartPointer<vtkPolyData> polyData = vtkSmartPointer<vtkPolyData>::New();
+    polyData->SetPoints(points);
+    polyData->SetPolys(cells);
+    return polyData;
+}
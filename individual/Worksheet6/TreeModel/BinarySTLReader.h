@@ -0,0 +1,64 @@
+/**     @file BinarySTLReader.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Fast reader for binary STL files.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_BINARYSTLREADER_H
+#define VIEWER_BINARYSTLREADER_H
+
+#include <QString>
+#include <QtGlobal>
+
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+#include <vtkFloatArray.h>
+
+
+/** Reads binary STL files directly from a memory mapped copy of the file.
+  *
+  * A binary STL file is an 80 byte header, a 4 byte triangle count and then
+  * a 50 byte record for each triangle (normal, three vertices, 2 spare bytes).
+  * Rather than reading the file through a stream one triangle at a time, the
+  * whole file is mapped into memory and the vertices are copied straight into
+  * the vtkPoints array in one pass (split across threads using vtkSMPTools).
+  * No memory is allocated per triangle and the file data is never copied into
+  * an intermediate buffer, so peak memory is little more than the final
+  * vtkPolyData.
+  *
+  * Each triangle gets its own three points, duplicate points are not merged
+  * here (that is a separate, optional, step).
+  */
+class BinarySTLReader {
+public:
+    /** Check whether a block of data looks like a binary STL file, i.e. the
+      * size matches the triangle count in the header.
+      * @param data is the start of the file
+      * @param size is the length of the file in bytes
+      */
+    static bool isBinarySTL( const uchar* data, qint64 size );
+
+    /** Read a binary STL file
+      * @param fileName is the file to read
+      * @return the triangles, or nullptr if the file couldn't be opened, isn't a binary STL
+      *         or has no triangles
+      */
+    static vtkSmartPointer<vtkPolyData> read( const QString& fileName );
+
+    /** Build polydata from a binary STL file that is already in memory
+      * @param data is the start of the file, must have passed isBinarySTL()
+      * @return the triangles, or nullptr if the file has no triangles
+      */
+    static vtkSmartPointer<vtkPolyData> read( const uchar* data );
+
+    /** Build polydata from a list of points where each three consecutive points
+      * form a triangle (as they do in any STL file). Also used by ASCIISTLReader.
+      * @param coords is the point array (3 components, 3 points per triangle)
+      */
+    static vtkSmartPointer<vtkPolyData> trianglesFromPoints( vtkFloatArray* coords );
+};
+
+#endif
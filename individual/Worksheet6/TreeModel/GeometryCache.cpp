@@ -0,0 +1,427 @@
+/**     @file GeometryCache.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     On-disk cache of processed part geometry.
+  *
+  *     P Evans 2022
+  */
+
+#include "GeometryCache.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QHash>
+
+#include <vtkFloatArray.h>
+#include <vtkTypeInt32Array.h>
+#include <vtkCellArray.h>
+#include <vtkPointData.h>
+#include <vtkPoints.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <type_traits>
+
+
+/* Cache file layout. Each array starts on a 64 byte boundary so the mapped
+ * pointers are suitably aligned for VTK (and for SIMD loads).
+ *
+ *   CacheHeader
+ *   float   points[3 * nPoints]
+ *   float   normals[3 * nPoints]       (only if normalsAt != 0)
+ *   int32   offsets[nCells + 1]
+ *   int32   connectivity[nConnectivity]
+ */
+struct CacheHeader {
+    char    magic[8];
+    quint32 version;
+    quint32 byteOrder;          /* Written as 0x01020304, files from a machine with different endianness are ignored */
+    quint64 sourceSize;
+    qint64  sourceTime;         /* Modification time, ms since epoch */
+    char    hash[16];           /* MD5 of the STL file */
+    double  bounds[6];
+    quint64 nPoints;
+    quint64 nCells;
+    quint64 nConnectivity;
+    quint64 pointsAt;
+    quint64 normalsAt;
+    quint64 offsetsAt;
+    quint64 connectivityAt;
+};
+static_assert( std::is_trivially_copyable<CacheHeader>::value, "CacheHeader is written directly to disk" );
+
+static const char    cacheMagic[8]  = { 'E', 'E', 'G', 'E', 'O', 'M', 0, 0 };
+static const quint32 cacheVersion   = 1;
+static const quint32 cacheByteOrder = 0x01020304;
+static const quint64 cacheAlignment = 64;
+
+static std::atomic<bool> cacheEnabled(true);
+
+
+static inline quint64 alignUp( quint64 x ) {
+    return (x + cacheAlignment - 1) & ~(cacheAlignment - 1);
+}
+
+
+/* ------------------------------------------------------------------------------
+ * Mapped files
+ *
+ * A loaded cache is mapped once and several VTK arrays point into the mapping.
+ * Each array is given a free function that releases its share of the mapping,
+ * the file is unmapped and closed when the last array using it is deleted.
+ * ------------------------------------------------------------------------------ */
+namespace {
+    struct MappedFile {
+        QFile file;
+        uchar* data = nullptr;
+
+        ~MappedFile() {
+            if (data)
+                file.unmap(data);
+        }
+    };
+}
+
+static QMutex mappedMutex;
+static QHash<void*, std::shared_ptr<MappedFile>> mappedArrays;
+
+
+static void releaseMappedArray( void* ptr ) {
+    std::shared_ptr<MappedFile> mapping;
+    {
+        QMutexLocker lock(&mappedMutex);
+        mapping = mappedArrays.take(ptr);
+    }
+    /* mapping goes out of scope here, outside the lock, unmapping the file if this was the last array */
+}
+
+
+/* Wrap part of a mapped file in a VTK array without copying it */
+template <typename ArrayT>
+static vtkSmartPointer<ArrayT> mappedArray( const std::shared_ptr<MappedFile>& mapping, quint64 at, vtkIdType count, int components ) {
+    typedef typename ArrayT::ValueType T;
+    T* ptr = reinterpret_cast<T*>( mapping->data + at );
+
+    {
+        QMutexLocker lock(&mappedMutex);
+        mappedArrays.insert(ptr, mapping);
+    }
+
+    vtkSmartPointer<ArrayT> array = vtkSmartPointer<ArrayT>::New();
+    array->SetNumberOfComponents(components);
+    array->SetArray( ptr, count * components, 0, ArrayT::VTK_DATA_ARRAY_USER_DEFINED );
+    array->SetArrayFreeFunction( releaseMappedArray );
+    return array;
+}
+
+
+/* ------------------------------------------------------------------------------
+ * Validation
+ * ------------------------------------------------------------------------------ */
+
+/* Check a header is from this version, is self consistent and fits in a file of the given size */
+static bool headerIsSane( const CacheHeader& h, qint64 fileSize ) {
+    if (std::memcmp(h.magic, cacheMagic, sizeof(cacheMagic)) != 0 || h.version != cacheVersion || h.byteOrder != cacheByteOrder)
+        return false;
+
+    /* Indices are stored as 32 bit */
+    const quint64 maxIndex = quint64(std::numeric_limits<vtkTypeInt32>::max());
+    if (h.nPoints == 0 || h.nCells == 0 || h.nPoints > maxIndex || h.nConnectivity > maxIndex)
+        return false;
+
+    auto fits = [fileSize]( quint64 at, quint64 bytes ) {
+        return at % cacheAlignment == 0 && at >= sizeof(CacheHeader) && at + bytes <= quint64(fileSize);
+    };
+
+    return fits( h.pointsAt, 3 * h.nPoints * sizeof(float) )
+        && (h.normalsAt == 0 || fits( h.normalsAt, 3 * h.nPoints * sizeof(float) ))
+        && fits( h.offsetsAt, (h.nCells + 1) * sizeof(vtkTypeInt32) )
+        && fits( h.connectivityAt, h.nConnectivity * sizeof(vtkTypeInt32) );
+}
+
+
+/* Check the header still describes the STL file. A size and time match is taken
+ * as good enough, otherwise the STL contents are hashed and compared. If the
+ * contents match the stored size and time are updated so the hash isn't needed
+ * next time.
+ */
+static bool sourceMatches( const CacheHeader& h, const QString& stlFile, const QString& cacheFile ) {
+    QFileInfo source(stlFile);
+    if (!source.exists())
+        return false;
+
+    const quint64 size = quint64(source.size());
+    const qint64 time = source.lastModified().toMSecsSinceEpoch();
+    if (size == h.sourceSize && time == h.sourceTime)
+        return true;
+
+    if (size != h.sourceSize)
+        return false;
+
+    QByteArray hash = GeometryCache::contentHash(stlFile);
+    if (hash.size() != int(sizeof(h.hash)) || std::memcmp(hash.constData(), h.hash, sizeof(h.hash)) != 0)
+        return false;
+
+    /* Same contents, new time. Not being able to update the header doesn't matter. */
+    QFile update(cacheFile);
+    if (update.open(QIODevice::ReadWrite) && update.seek(qint64(offsetof(CacheHeader, sourceTime))))
+        update.write( reinterpret_cast<const char*>(&time), sizeof(time) );
+
+    return true;
+}
+
+
+/* Check the mapped cell arrays describe a valid mesh. headerIsSane() only checks
+ * the sections fit in the file - VTK trusts offsets and connectivity completely,
+ * so a damaged cache would have it reading outside the arrays.
+ */
+static bool cellsAreSane( const CacheHeader& h, const uchar* data ) {
+    const vtkTypeInt32* offsets = reinterpret_cast<const vtkTypeInt32*>( data + h.offsetsAt );
+    const vtkTypeInt32* connectivity = reinterpret_cast<const vtkTypeInt32*>( data + h.connectivityAt );
+
+    if (offsets[0] != 0 || offsets[h.nCells] < 0 || quint64(offsets[h.nCells]) != h.nConnectivity)
+        return false;
+    for (quint64 i = 0; i < h.nCells; i++) {
+        if (offsets[i + 1] < offsets[i])
+            return false;
+    }
+
+    const vtkTypeInt32 nPoints = vtkTypeInt32(h.nPoints);
+    for (quint64 i = 0; i < h.nConnectivity; i++) {
+        if (connectivity[i] < 0 || connectivity[i] >= nPoints)
+            return false;
+    }
+    return true;
+}
+
+
+static bool readHeader( QFile& file, CacheHeader& header ) {
+    return file.read( reinterpret_cast<char*>(&header), sizeof(header) ) == qint64(sizeof(header))
+        && headerIsSane( header, file.size() );
+}
+
+
+/* ------------------------------------------------------------------------------
+ * GeometryCache
+ * ------------------------------------------------------------------------------ */
+
+QString GeometryCache::cachePath( const QString& stlFile ) {
+    QFileInfo info(stlFile);
+    return info.absolutePath() + QStringLiteral("/.geomcache/") + info.fileName() + QStringLiteral(".mesh");
+}
+
+
+QByteArray GeometryCache::contentHash( const QString& fileName ) {
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    if (!hash.addData(&file))
+        return QByteArray();
+
+    return hash.result();
+}
+
+
+void GeometryCache::setEnabled( bool enabled ) {
+    cacheEnabled = enabled;
+}
+
+
+bool GeometryCache::isEnabled() {
+    return cacheEnabled;
+}
+
+
+bool GeometryCache::isValid( const QString& stlFile, double* bounds, QByteArray* hash ) {
+    if (!cacheEnabled)
+        return false;
+
+    const QString cacheFile = cachePath(stlFile);
+    QFile file(cacheFile);
+    CacheHeader header;
+    if (!file.open(QIODevice::ReadOnly) || !readHeader(file, header))
+        return false;
+    file.close();
+
+    if (!sourceMatches(header, stlFile, cacheFile))
+        return false;
+
+    if (bounds)
+        std::memcpy( bounds, header.bounds, sizeof(header.bounds) );
+    if (hash)
+        *hash = QByteArray( header.hash, int(sizeof(header.hash)) );
+
+    return true;
+}
+
+
+vtkSmartPointer<vtkPolyData> GeometryCache::load( const QString& stlFile ) {
+    if (!cacheEnabled)
+        return nullptr;
+
+    const QString cacheFile = cachePath(stlFile);
+    std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>();
+    mapping->file.setFileName(cacheFile);
+
+    CacheHeader header;
+    if (!mapping->file.open(QIODevice::ReadOnly) || !readHeader(mapping->file, header))
+        return nullptr;
+
+    if (!sourceMatches(header, stlFile, cacheFile))
+        return nullptr;
+
+    /* A private mapping, so if anything does write to the arrays it gets its
+     * own copy of the page rather than changing the file
+     */
+    mapping->data = mapping->file.map( 0, mapping->file.size(), QFileDevice::MapPrivateOption );
+    if (!mapping->data || !cellsAreSane(header, mapping->data))
+        return nullptr;
+
+    const vtkIdType nPoints = vtkIdType(header.nPoints);
+
+    vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+    points->SetData( mappedArray<vtkFloatArray>(mapping, header.pointsAt, nPoints, 3) );
+
+    vtkSmartPointer<vtkCellArray> cells = vtkSmartPointer<vtkCellArray>::New();
+    cells->SetData( mappedArray<vtkTypeInt32Array>(mapping, header.offsetsAt, vtkIdType(header.nCells + 1), 1),
+                    mappedArray<vtkTypeInt32Array>(mapping, header.connectivityAt, vtkIdType(header.nConnectivity), 1) );
+
+    vtkSmartPointer<vtkPolyData> polyData = vtkSmartPointer<vtkPolyData>::New();
+    polyData->SetPoints(points);
+    polyData->SetPolys(cells);
+
+    if (header.normalsAt) {
+        vtkSmartPointer<vtkFloatArray> normals = mappedArray<vtkFloatArray>(mapping, header.normalsAt, nPoints, 3);
+        normals->SetName("Normals");
+        polyData->GetPointData()->SetNormals(normals);
+    }
+
+    /* The arrays now hold the mapping, this function's reference is dropped on return */
+    return polyData;
+}
+
+
+/* Write one array at the next aligned position */
+static bool writeSection( QSaveFile& file, const void* data, quint64 bytes, quint64& at ) {
+    at = alignUp( quint64(file.pos()) );
+    static const char zeros[cacheAlignment] = {};
+
+    const qint64 padding = qint64(at) - file.pos();
+    if (padding > 0 && file.write(zeros, padding) != padding)
+        return false;
+
+    return file.write( static_cast<const char*>(data), qint64(bytes) ) == qint64(bytes);
+}
+
+
+/* Get an array as 32 bit ints, copying it only if it isn't already */
+static vtkSmartPointer<vtkTypeInt32Array> asInt32( vtkDataArray* array ) {
+    vtkSmartPointer<vtkTypeInt32Array> out = vtkTypeInt32Array::SafeDownCast(array);
+    if (out)
+        return out;
+
+    out = vtkSmartPointer<vtkTypeInt32Array>::New();
+    out->SetNumberOfValues( array->GetNumberOfValues() );
+    for (vtkIdType i = 0; i < array->GetNumberOfValues(); i++)
+        out->SetValue( i, vtkTypeInt32(array->GetComponent(i, 0)) );
+    return out;
+}
+
+
+/* Get a 3 component array as floats, copying it only if it isn't already */
+static vtkSmartPointer<vtkFloatArray> asFloat( vtkDataArray* array ) {
+    vtkSmartPointer<vtkFloatArray> out = vtkFloatArray::SafeDownCast(array);
+    if (out)
+        return out;
+
+    out = vtkSmartPointer<vtkFloatArray>::New();
+    out->DeepCopy(array);
+    return out;
+}
+
+
+bool GeometryCache::save( const QString& stlFile, vtkPolyData* data, const QByteArray& knownHash ) {
+    if (!cacheEnabled || !data || !data->GetPoints() || !data->GetPolys())
+        return false;
+
+    /* Only polygon meshes are cached, which is all the STL import produces */
+    if (data->GetNumberOfVerts() || data->GetNumberOfLines() || data->GetNumberOfStrips())
+        return false;
+
+    vtkCellArray* polys = data->GetPolys();
+    const quint64 nPoints = quint64(data->GetNumberOfPoints());
+    const quint64 nCells = quint64(polys->GetNumberOfCells());
+    const quint64 nConnectivity = quint64(polys->GetNumberOfConnectivityIds());
+    const quint64 maxIndex = quint64(std::numeric_limits<vtkTypeInt32>::max());
+    if (nPoints == 0 || nCells == 0 || nPoints > maxIndex || nConnectivity > maxIndex)
+        return false;
+
+    /* Record the source before hashing it, so if it changes in between the cache looks out of date */
+    QFileInfo source(stlFile);
+    if (!source.exists())
+        return false;
+
+    CacheHeader header;
+    std::memset( &header, 0, sizeof(header) );
+    std::memcpy( header.magic, cacheMagic, sizeof(cacheMagic) );
+    header.version = cacheVersion;
+    header.byteOrder = cacheByteOrder;
+    header.sourceSize = quint64(source.size());
+    header.sourceTime = source.lastModified().toMSecsSinceEpoch();
+
+    QByteArray hash = knownHash.isEmpty() ? contentHash(stlFile) : knownHash;
+    if (hash.size() != int(sizeof(header.hash)))
+        return false;
+    std::memcpy( header.hash, hash.constData(), sizeof(header.hash) );
+
+    data->GetBounds(header.bounds);
+    header.nPoints = nPoints;
+    header.nCells = nCells;
+    header.nConnectivity = nConnectivity;
+
+    vtkSmartPointer<vtkFloatArray> points = asFloat( data->GetPoints()->GetData() );
+    vtkDataArray* normalData = data->GetPointData()->GetNormals();
+    vtkSmartPointer<vtkFloatArray> normals = normalData ? asFloat(normalData) : nullptr;
+    vtkSmartPointer<vtkTypeInt32Array> offsets = asInt32( polys->GetOffsetsArray() );
+    vtkSmartPointer<vtkTypeInt32Array> connectivity = asInt32( polys->GetConnectivityArray() );
+
+    const QString cacheFile = cachePath(stlFile);
+    if (!QDir().mkpath( QFileInfo(cacheFile).absolutePath() ))
+        return false;
+
+    /* QSaveFile writes to a temporary file and renames it when complete, so a
+     * reader never sees a half written cache
+     */
+    QSaveFile file(cacheFile);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    /* The header is written first to reserve its space, then again once the section offsets are known */
+    bool ok = file.write( reinterpret_cast<const char*>(&header), sizeof(header) ) == qint64(sizeof(header));
+    ok = ok && writeSection( file, points->GetPointer(0), 3 * nPoints * sizeof(float), header.pointsAt );
+    if (normals)
+        ok = ok && writeSection( file, normals->GetPointer(0), 3 * nPoints * sizeof(float), header.normalsAt );
+    ok = ok && writeSection( file, offsets->GetPointer(0), (nCells + 1) * sizeof(vtkTypeInt32), header.offsetsAt );
+    ok = ok && writeSection( file, connectivity->GetPointer(0), nConnectivity * sizeof(vtkTypeInt32), header.connectivityAt );
+    ok = ok && file.seek(0);
+    ok = ok && file.write( reinterpret_cast<const char*>(&header), sizeof(header) ) == qint64(sizeof(header));
+
+    if (!ok) {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
@@ -0,0 +1,81 @@
+/**     @file GeometryCache.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     On-disk cache of processed part geometry.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_GEOMETRYCACHE_H
+#define VIEWER_GEOMETRYCACHE_H
+
+#include <QString>
+#include <QByteArray>
+
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+
+
+/** Saves processed (welded, with normals) part geometry next to the STL file it
+  * came from, so the next time the project is opened the STL doesn't need to be
+  * read and processed again.
+  *
+  * For "parts/bracket.stl" the cache file is "parts/.geomcache/bracket.stl.mesh".
+  * It holds a small header followed by the point, normal and triangle arrays in
+  * exactly the layout VTK uses in memory. Loading maps the file and hands the
+  * mapped arrays straight to VTK, nothing is parsed or copied - the operating
+  * system reads the data from disk as it is used.
+  *
+  * The header records the size, modification time and an MD5 hash of the
+  * contents of the STL file. If the size and time still match the cache is used
+  * straight away. If they don't (e.g. the file was copied) the STL is hashed, and
+  * the cache is only used if the contents are the same. The cell arrays are
+  * checked once when a cache is loaded, so a damaged file is ignored rather than
+  * handed to VTK.
+  *
+  * The cache belongs to the STL file's path, not its contents: two identical
+  * files in different folders each have their own cache file (GeometryStore
+  * shares the loaded geometry between them). Because a size and time match is
+  * trusted without hashing, an STL replaced by a different file with the same
+  * size and modification time (e.g. restored with its times preserved) keeps
+  * using the old cache until the cache file is deleted.
+  *
+  * All functions are safe to call from worker threads.
+  */
+class GeometryCache {
+public:
+    /** Get cached geometry for an STL file
+      * @param stlFile is the original STL file
+      * @return geometry, or nullptr if there is no valid cache for the file
+      */
+    static vtkSmartPointer<vtkPolyData> load( const QString& stlFile );
+
+    /** Save processed geometry for an STL file
+      * @param stlFile is the original STL file
+      * @param data is the processed geometry (float points, triangles)
+      * @param hash is the content hash of the STL file (contentHash()) if the caller
+      *        already has it, so the file isn't read again. Calculated here if empty.
+      * @return true if the cache was written
+      */
+    static bool save( const QString& stlFile, vtkPolyData* data, const QByteArray& hash = QByteArray() );
+
+    /** Check whether there is a valid cache for a file
+      * @param stlFile is the original STL file
+      * @param bounds if not null, receives the geometry bounds (xmin, xmax, ymin, ymax, zmin, zmax)
+      * @param hash if not null, receives the content hash of the STL file
+      */
+    static bool isValid( const QString& stlFile, double* bounds = nullptr, QByteArray* hash = nullptr );
+
+    /** Get the name of the cache file used for an STL file */
+    static QString cachePath( const QString& stlFile );
+
+    /** Calculate the content hash of a file (MD5) */
+    static QByteArray contentHash( const QString& fileName );
+
+    /** Turn the cache on or off (on by default) */
+    static void setEnabled( bool enabled );
+    static bool isEnabled();
+};
+
+#endif
@@ -0,0 +1,139 @@
+/**     @file GeometryStore.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Shared, read-only part geometry, one copy per distinct STL file content.
+  *
+  *     P Evans 2022
+  */
+
+#include "GeometryStore.h"
+#include "GeometryCache.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+
+
+namespace {
+    struct Entry {
+        vtkSmartPointer<vtkPolyData>                data;
+        std::vector<vtkSmartPointer<vtkPolyData>>   levels;     /* Levels of detail, [0] is data */
+    };
+}
+
+static QMutex                       storeMutex;
+static QHash<QByteArray, Entry>     entries;
+static QHash<vtkPolyData*, QByteArray> keys;        /* Reverse lookup for levelsOfDetail() */
+static int                          insertsSincePurge = 0;
+
+/* Unused entries are swept up every this many inserts, rather than on every
+ * insert, so loading a big assembly doesn't scan the whole store for each part
+ */
+static const int purgeInterval = 64;
+
+
+/* Remove entries that only the store is holding on to. The store hands out
+ * references under the mutex, so if the count is down to the store's own
+ * reference(s) no other thread can be using, or about to use, the entry.
+ * Must be called with the mutex locked.
+ */
+static void purgeLocked() {
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        /* One reference held by Entry::data, one by Entry::levels[0] if present */
+        const int own = it->levels.empty() ? 1 : 2;
+        if (it->data->GetReferenceCount() <= own) {
+            keys.remove(it->data.Get());
+            it = entries.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    insertsSincePurge = 0;
+}
+
+
+QByteArray GeometryStore::key( const QString& stlFile, bool* cached ) {
+    QByteArray hash;
+    bool valid = GeometryCache::isValid(stlFile, nullptr, &hash);
+    if (cached)
+        *cached = valid;
+    if (valid)
+        return hash;
+
+    return GeometryCache::contentHash(stlFile);
+}
+
+
+vtkSmartPointer<vtkPolyData> GeometryStore::find( const QByteArray& key ) {
+    if (key.isEmpty())
+        return nullptr;
+
+    QMutexLocker lock(&storeMutex);
+    auto it = entries.constFind(key);
+    return (it == entries.constEnd()) ? nullptr : it->data;
+}
+
+
+vtkSmartPointer<vtkPolyData> GeometryStore::insert( const QByteArray& key, vtkPolyData* data ) {
+    if (key.isEmpty() || !data)
+        return data;
+
+    QMutexLocker lock(&storeMutex);
+    auto it = entries.constFind(key);
+    if (it != entries.constEnd())
+        return it->data;
+
+    if (++insertsSincePurge >= purgeInterval)
+        purgeLocked();
+
+    Entry e;
+    e.data = data;
+    entries.insert(key, e);
+    keys.insert(data, key);
+    return data;
+}
+
+
+std::vector<vtkSmartPointer<vtkPolyData>> GeometryStore::levelsOfDetail( vtkPolyData* data ) {
+    QMutexLocker lock(&storeMutex);
+
+    auto k = keys.constFind(data);
+    if (k != keys.constEnd()) {
+        auto it = entries.constFind(*k);
+        if (it != entries.constEnd() && it->data == data && !it->levels.empty())
+            return it->levels;
+    }
+
+    return std::vector<vtkSmartPointer<vtkPolyData>>(1, data);
+}
+
+
+void GeometryStore::setLevelsOfDetail( const std::vector<vtkSmartPointer<vtkPolyData>>& levels ) {
+    if (levels.empty())
+        return;
+
+    QMutexLocker lock(&storeMutex);
+
+    /* Only geometry that is in the store can have shared levels */
+    auto k = keys.constFind(levels[0].Get());
+    if (k == keys.constEnd())
+        return;
+
+    auto it = entries.find(*k);
+    if (it != entries.end() && it->data == levels[0])
+        it->levels = levels;
+}
+
+
+int GeometryStore::size() {
+    QMutexLocker lock(&storeMutex);
+    return entries.size();
+}
+
+
+void GeometryStore::purge() {
+    QMutexLocker lock(&storeMutex);
+    purgeLocked();
+}
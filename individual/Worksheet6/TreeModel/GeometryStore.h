@@ -0,0 +1,78 @@
+/**     @file GeometryStore.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Shared, read-only part geometry, one copy per distinct STL file content.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_GEOMETRYSTORE_H
+#define VIEWER_GEOMETRYSTORE_H
+
+#include <QString>
+#include <QByteArray>
+
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+
+#include <vector>
+
+
+/** Big assemblies use the same part many times - every M6 bolt or standard
+  * bracket is a separate STL file with exactly the same contents. Rather than
+  * loading and storing each one separately, geometry is looked up here by the
+  * content hash of its file, so every part made from the same file content
+  * shares one vtkPolyData (and one set of levels of detail). The GUI actor, the
+  * VR actor and every repeated instance of the part then reference the same data,
+  * memory grows with the number of distinct files rather than the number of parts.
+  *
+  * Geometry in the store is shared, so it must be treated as read-only - anything
+  * that wants to modify a part's mesh must make its own copy.
+  *
+  * Entries are dropped once nothing outside the store uses them any more.
+  * All functions are thread safe.
+  */
+class GeometryStore {
+public:
+    /** Get the content key for an STL file - the content hash, read from the geometry
+      * cache if there is a valid one, otherwise calculated from the file. A cache
+      * whose STL hasn't changed size or time is trusted without hashing anything.
+      * @param cached if not null, set to true if the key came from a valid cache
+      *        (so GeometryCache::load() will succeed), false if the file was hashed
+      * @return key, empty if the file couldn't be read
+      */
+    static QByteArray key( const QString& stlFile, bool* cached = nullptr );
+
+    /** Look up geometry
+      * @param key is the content key
+      * @return shared geometry, or nullptr if there isn't any for this key
+      */
+    static vtkSmartPointer<vtkPolyData> find( const QByteArray& key );
+
+    /** Add geometry to the store. If another thread has added geometry for the same
+      * key in the meantime, that is kept and returned instead, so all users agree.
+      * @param key is the content key
+      * @param data is the geometry
+      * @return the geometry to use for this key
+      */
+    static vtkSmartPointer<vtkPolyData> insert( const QByteArray& key, vtkPolyData* data );
+
+    /** Get levels of detail already made for some shared geometry
+      * @return list of levels starting with data itself, only contains data if none have been made
+      */
+    static std::vector<vtkSmartPointer<vtkPolyData>> levelsOfDetail( vtkPolyData* data );
+
+    /** Store levels of detail for some shared geometry, so other parts using it don't need to make them
+      * @param levels is the list of levels, levels[0] must be the shared geometry
+      */
+    static void setLevelsOfDetail( const std::vector<vtkSmartPointer<vtkPolyData>>& levels );
+
+    /** Number of distinct geometries in the store */
+    static int size();
+
+    /** Drop entries that are no longer used by any part */
+    static void purge();
+};
+
+#endif
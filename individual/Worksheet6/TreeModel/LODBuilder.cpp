@@ -0,0 +1,54 @@
+/**     @file LODBuilder.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Creates simplified (level of detail) versions of part geometry.
+  *
+  *     P Evans 2022
+  */
+
+#include "LODBuilder.h"
+#include "MeshWeld.h"
+
+#include <vtkQuadricDecimation.h>
+
+
+std::vector<vtkSmartPointer<vtkPolyData>> LODBuilder::build( vtkPolyData* full, int levels, double reduction ) {
+    std::vector<vtkSmartPointer<vtkPolyData>> lods;
+    if (!full)
+        return lods;
+
+    lods.push_back(full);
+
+    for (int i = 0; i < levels; i++) {
+        vtkPolyData* previous = lods.back();
+        const vtkIdType triangles = previous->GetNumberOfPolys();
+        if (triangles < minTriangles)
+            break;
+
+        /* Each decimator is local to this call, so several parts can be
+         * simplified at the same time on different threads
+         */
+        vtkSmartPointer<vtkQuadricDecimation> decimate = vtkSmartPointer<vtkQuadricDecimation>::New();
+        decimate->SetInputData(previous);
+        decimate->SetTargetReduction(reduction);
+        decimate->VolumePreservationOn();       /* Stops thin parts shrinking away */
+        decimate->AttributeErrorMetricOff();    /* Normals are recalculated below */
+        decimate->Update();
+
+        /* Stop if the decimator couldn't make much difference (e.g. a mesh that is
+         * already very coarse) - another level would look the same but cost memory
+         */
+        vtkPolyData* out = decimate->GetOutput();
+        if (out->GetNumberOfPolys() == 0 || out->GetNumberOfPolys() > triangles * 0.9)
+            break;
+
+        vtkSmartPointer<vtkPolyData> level = MeshWeld::weld(out);
+        if (!level)
+            break;
+
+        lods.push_back(level);
+    }
+
+    return lods;
+}
@@ -0,0 +1,47 @@
+/**     @file LODBuilder.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Creates simplified (level of detail) versions of part geometry.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_LODBUILDER_H
+#define VIEWER_LODBUILDER_H
+
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+
+#include <vector>
+
+
+/** A part that is far away only covers a few pixels on screen, drawing all of
+  * its triangles is wasted effort. This class makes a set of simplified copies
+  * of a mesh (levels of detail) that can be drawn instead when the part is small,
+  * see VRLODSelector for how the VR thread chooses between them.
+  *
+  * Each level has a fraction of the triangles of the one before it (half by
+  * default) and is made by decimating the previous level with vtkQuadricDecimation,
+  * so the later (smaller) levels are cheap to make. Levels are then welded and
+  * given new normals (MeshWeld) so they shade the same way as the full mesh.
+  *
+  * This is slow for large parts, so it is intended to be run on a worker thread
+  * after the part has been loaded (see ModelPartLoader). It only reads its input.
+  */
+class LODBuilder {
+public:
+    /** Build levels of detail for a mesh
+      * @param full is the full resolution mesh
+      * @param levels is the maximum number of simplified levels to make
+      * @param reduction is the fraction of triangles removed at each level
+      * @return list of levels, starting with full itself (level 0). Only contains
+      *         full if the mesh is too small to be worth simplifying.
+      */
+    static std::vector<vtkSmartPointer<vtkPolyData>> build( vtkPolyData* full, int levels = 3, double reduction = 0.5 );
+
+    /** Meshes with fewer triangles than this are not simplified */
+    static const vtkIdType minTriangles = 2000;
+};
+
+#endif
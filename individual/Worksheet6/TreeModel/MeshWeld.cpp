@@ -0,0 +1,455 @@
+/**     @file MeshWeld.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Import stage that merges duplicate STL vertices and calculates normals.
+  *
+  *     P Evans 2022
+  */
+
+#include "MeshWeld.h"
+
+#include <vtkPoints.h>
+#include <vtkPointData.h>
+#include <vtkCellArray.h>
+#include <vtkFloatArray.h>
+#include <vtkIdTypeArray.h>
+#include <vtkTypeInt32Array.h>
+#include <vtkSMPTools.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+
+/* Points are split into this many shards, each de-duplicated independently */
+static const int shardBits = 8;
+static const int shards = 1 << shardBits;
+
+/* Number of blocks used when sorting points into shards */
+static const vtkIdType sortBlocks = 256;
+
+
+/* Integer key for a point - two points are merged if their keys are equal */
+struct PointKey {
+    std::int64_t x, y, z;
+
+    bool operator==( const PointKey& o ) const { return x == o.x && y == o.y && z == o.z; }
+};
+
+
+static inline std::int64_t keyComponent( float v, double invTolerance ) {
+    if (invTolerance == 0.) {
+        /* Exact match - use the bit pattern. Adding 0 turns -0 into +0 so they match. */
+        float f = v + 0.f;
+        std::int32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        return bits;
+    }
+    return std::llround( double(v) * invTolerance );
+}
+
+
+static inline PointKey makeKey( const float* p, double invTolerance ) {
+    PointKey k;
+    k.x = keyComponent(p[0], invTolerance);
+    k.y = keyComponent(p[1], invTolerance);
+    k.z = keyComponent(p[2], invTolerance);
+    return k;
+}
+
+
+/* Mix the three components into a well distributed 64 bit hash (splitmix64 finaliser) */
+static inline std::uint64_t mix( std::uint64_t h ) {
+    h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static inline std::uint64_t hashKey( const PointKey& k ) {
+    return mix( std::uint64_t(k.x) + mix( std::uint64_t(k.y) + mix( std::uint64_t(k.z) ) ) );
+}
+
+
+/* Find unique points.
+ *  xyz, n       - input points
+ *  remap        - (output) new id for each input point
+ *  unique       - (output) index of the input point used for each new id
+ */
+static void weldPoints( const float* xyz, vtkIdType n, double tolerance,
+                        std::vector<vtkIdType>& remap, std::vector<vtkIdType>& unique ) {
+
+    const double invTolerance = (tolerance > 0.) ? 1. / tolerance : 0.;
+
+    /* 1. Hash every point */
+    std::vector<std::uint64_t> hash(n);
+    vtkSMPTools::For( 0, n, [&]( vtkIdType first, vtkIdType last ) {
+        for (vtkIdType i = first; i < last; i++)
+            hash[i] = hashKey( makeKey(xyz + 3*i, invTolerance) );
+    } );
+
+    /* 2. Counting sort of point ids into shards (top bits of the hash). Each block
+     *    counts its own points, then the counts are turned into write positions so
+     *    every block can copy its points out at the same time.
+     */
+    const vtkIdType blocks = std::min(sortBlocks, std::max<vtkIdType>(n, 1));
+    const vtkIdType blockLength = (n + blocks - 1) / blocks;
+    std::vector<vtkIdType> counts(blocks * shards, 0);
+
+    vtkSMPTools::For( 0, blocks, 1, [&]( vtkIdType firstBlock, vtkIdType lastBlock ) {
+        for (vtkIdType b = firstBlock; b < lastBlock; b++) {
+            vtkIdType* c = &counts[b * shards];
+            vtkIdType end = std::min(n, (b + 1) * blockLength);
+            for (vtkIdType i = b * blockLength; i < end; i++)
+                c[hash[i] >> (64 - shardBits)]++;
+        }
+    } );
+
+    std::vector<vtkIdType> shardStart(shards + 1, 0);
+    vtkIdType position = 0;
+    for (int s = 0; s < shards; s++) {
+        shardStart[s] = position;
+        for (vtkIdType b = 0; b < blocks; b++) {
+            vtkIdType c = counts[b * shards + s];
+            counts[b * shards + s] = position;
+            position += c;
+        }
+    }
+    shardStart[shards] = position;
+
+    std::vector<vtkIdType> order(n);
+    vtkSMPTools::For( 0, blocks, 1, [&]( vtkIdType firstBlock, vtkIdType lastBlock ) {
+        for (vtkIdType b = firstBlock; b < lastBlock; b++) {
+            vtkIdType* c = &counts[b * shards];
+            vtkIdType end = std::min(n, (b + 1) * blockLength);
+            for (vtkIdType i = b * blockLength; i < end; i++)
+                order[ c[hash[i] >> (64 - shardBits)]++ ] = i;
+        }
+    } );
+
+    /* 3. De-duplicate each shard with an open addressing hash table. Points are
+     *    visited in their original order so the first copy of a point is the one kept.
+     */
+    remap.assign(n, 0);
+    std::vector<std::vector<vtkIdType>> shardUnique(shards);
+
+    vtkSMPTools::For( 0, shards, 1, [&]( vtkIdType firstShard, vtkIdType lastShard ) {
+        std::vector<vtkIdType> table;
+
+        for (vtkIdType s = firstShard; s < lastShard; s++) {
+            const vtkIdType begin = shardStart[s], end = shardStart[s + 1];
+            std::vector<vtkIdType>& u = shardUnique[s];
+
+            size_t size = 16;
+            while (size < size_t(2 * (end - begin)))
+                size <<= 1;
+            table.assign(size, -1);
+
+            for (vtkIdType j = begin; j < end; j++) {
+                const vtkIdType i = order[j];
+                const PointKey key = makeKey(xyz + 3*i, invTolerance);
+                size_t slot = size_t(hash[i]) & (size - 1);
+
+                while (true) {
+                    vtkIdType local = table[slot];
+                    if (local < 0) {
+                        /* New point */
+                        table[slot] = vtkIdType(u.size());
+                        remap[i] = vtkIdType(u.size());
+                        u.push_back(i);
+                        break;
+                    }
+                    if (makeKey(xyz + 3*u[local], invTolerance) == key) {
+                        /* Seen before */
+                        remap[i] = local;
+                        break;
+                    }
+                    slot = (slot + 1) & (size - 1);
+                }
+            }
+        }
+    } );
+
+    /* 4. Number the shards one after another to get final ids */
+    std::vector<vtkIdType> base(shards + 1, 0);
+    for (int s = 0; s < shards; s++)
+        base[s + 1] = base[s] + vtkIdType(shardUnique[s].size());
+
+    unique.resize(base[shards]);
+    vtkSMPTools::For( 0, shards, 1, [&]( vtkIdType firstShard, vtkIdType lastShard ) {
+        for (vtkIdType s = firstShard; s < lastShard; s++) {
+            for (vtkIdType j = shardStart[s]; j < shardStart[s + 1]; j++)
+                remap[order[j]] += base[s];
+            std::copy( shardUnique[s].begin(), shardUnique[s].end(), unique.begin() + base[s] );
+        }
+    } );
+}
+
+
+/* Area weighted point normals for an indexed triangle mesh, split at creases.
+ *  tris         - point ids, 3 per triangle. Renumbered to the split points on output.
+ *  featureAngle - triangles meeting at a sharper angle (degrees) don't share normals
+ *  source       - (output) welded point that each split point is a copy of
+ *  normals      - (output) 3 per split point
+ */
+static void creaseNormals( const float* xyz, vtkIdType nPoints, std::vector<vtkIdType>& tris, double featureAngle,
+                           std::vector<vtkIdType>& source, std::vector<float>& normals ) {
+    const vtkIdType nTris = vtkIdType(tris.size() / 3);
+    const vtkIdType* t = tris.data();
+
+    /* 1. Triangle normals - the cross product's length is twice the triangle area, so
+     *    leaving it un-normalised weights each triangle by its size for free. The
+     *    length is kept for the angle test.
+     */
+    std::vector<float> faceNormals(3 * nTris), faceLengths(nTris);
+    float* fn = faceNormals.data();
+    float* fl = faceLengths.data();
+
+    vtkSMPTools::For( 0, nTris, [xyz, t, fn, fl]( vtkIdType first, vtkIdType last ) {
+        for (vtkIdType f = first; f < last; f++) {
+            const float* a = xyz + 3*t[3*f];
+            const float* b = xyz + 3*t[3*f + 1];
+            const float* c = xyz + 3*t[3*f + 2];
+            float u0 = b[0] - a[0], u1 = b[1] - a[1], u2 = b[2] - a[2];
+            float v0 = c[0] - a[0], v1 = c[1] - a[1], v2 = c[2] - a[2];
+            fn[3*f]     = u1*v2 - u2*v1;
+            fn[3*f + 1] = u2*v0 - u0*v2;
+            fn[3*f + 2] = u0*v1 - u1*v0;
+            fl[f] = std::sqrt( fn[3*f]*fn[3*f] + fn[3*f + 1]*fn[3*f + 1] + fn[3*f + 2]*fn[3*f + 2] );
+        }
+    } );
+
+    /* 2. List the triangle corners at each point (compressed rows), so each point
+     *    can be handled by one thread without any locking
+     */
+    std::vector<vtkIdType> start(nPoints + 1, 0);
+    for (vtkIdType c = 0; c < 3 * nTris; c++)
+        start[t[c] + 1]++;
+    for (vtkIdType p = 0; p < nPoints; p++)
+        start[p + 1] += start[p];
+
+    std::vector<vtkIdType> fill(start.begin(), start.end() - 1);
+    std::vector<vtkIdType> corners(3 * nTris);
+    for (vtkIdType c = 0; c < 3 * nTris; c++)
+        corners[ fill[t[c]]++ ] = c;
+
+    /* 3. Each corner's normal is the sum over the triangles at its point that are
+     *    within the feature angle of the corner's own triangle. On a smooth surface
+     *    every corner sees every triangle, at a crease each side only sees its own.
+     *    Corners that see the same triangles get exactly the same sum (they are added
+     *    in the same order), and share a point - so a point is split into one copy
+     *    per side of the crease.
+     */
+    const double radians = std::min(std::max(featureAngle, 0.), 180.) * 3.14159265358979323846 / 180.;
+    const float cosAngle = float( std::cos(radians) );
+
+    std::vector<float> cornerNormals(3 * 3 * nTris);
+    std::vector<std::int32_t> cornerGroup(3 * nTris);
+    std::vector<vtkIdType> groupStart(nPoints + 1, 0);
+
+    vtkSMPTools::For( 0, nPoints, [&]( vtkIdType first, vtkIdType last ) {
+        for (vtkIdType p = first; p < last; p++) {
+            std::int32_t groups = 0;
+            for (vtkIdType k = start[p]; k < start[p + 1]; k++) {
+                const vtkIdType fk = corners[k] / 3;
+                const float* a = fn + 3*fk;
+
+                float x = 0.f, y = 0.f, z = 0.f;
+                for (vtkIdType j = start[p]; j < start[p + 1]; j++) {
+                    const vtkIdType fj = corners[j] / 3;
+                    const float* b = fn + 3*fj;
+                    if (a[0]*b[0] + a[1]*b[1] + a[2]*b[2] >= cosAngle * fl[fk] * fl[fj]) {
+                        x += b[0]; y += b[1]; z += b[2];
+                    }
+                }
+                float len = std::sqrt(x*x + y*y + z*z);
+                float s = (len > 0.f) ? 1.f / len : 0.f;
+                float* n = &cornerNormals[3*k];
+                n[0] = x * s;
+                n[1] = y * s;
+                n[2] = z * s;
+
+                std::int32_t g = groups;
+                for (vtkIdType i = start[p]; i < k; i++) {
+                    const float* m = &cornerNormals[3*i];
+                    if (m[0] == n[0] && m[1] == n[1] && m[2] == n[2]) {
+                        g = cornerGroup[i];
+                        break;
+                    }
+                }
+                if (g == groups)
+                    groups++;
+                cornerGroup[k] = g;
+            }
+            groupStart[p + 1] = groups;
+        }
+    } );
+
+    /* 4. Number the split points, each point's copies one after another */
+    for (vtkIdType p = 0; p < nPoints; p++)
+        groupStart[p + 1] += groupStart[p];
+
+    const vtkIdType nSplit = groupStart[nPoints];
+    source.resize(nSplit);
+    normals.resize(3 * nSplit);
+
+    vtkSMPTools::For( 0, nPoints, [&]( vtkIdType first, vtkIdType last ) {
+        for (vtkIdType p = first; p < last; p++) {
+            for (vtkIdType k = start[p]; k < start[p + 1]; k++) {
+                const vtkIdType id = groupStart[p] + cornerGroup[k];
+                source[id] = p;
+                std::copy_n( &cornerNormals[3*k], 3, &normals[3*id] );
+                tris[ corners[k] ] = id;
+            }
+        }
+    } );
+}
+
+
+/* Build a triangle cell array from a list of point ids (3 per triangle) */
+template <typename ArrayT>
+static vtkSmartPointer<vtkCellArray> makeCells( const std::vector<vtkIdType>& tris ) {
+    typedef typename ArrayT::ValueType T;
+    const vtkIdType n = vtkIdType(tris.size() / 3);
+
+    vtkSmartPointer<ArrayT> offsets = vtkSmartPointer<ArrayT>::New();
+    vtkSmartPointer<ArrayT> connectivity = vtkSmartPointer<ArrayT>::New();
+    offsets->SetNumberOfValues(n + 1);
+    connectivity->SetNumberOfValues(3 * n);
+
+    T* o = offsets->GetPointer(0);
+    T* c = connectivity->GetPointer(0);
+    const vtkIdType* t = tris.data();
+
+    vtkSMPTools::For( 0, n + 1, [o, c, t, n]( vtkIdType first, vtkIdType last ) {
+        for (vtkIdType f = first; f < last; f++) {
+            o[f] = T(3 * f);
+            if (f < n) {
+                c[3*f]     = T(t[3*f]);
+                c[3*f + 1] = T(t[3*f + 1]);
+                c[3*f + 2] = T(t[3*f + 2]);
+            }
+        }
+    } );
+
+    vtkSmartPointer<vtkCellArray> cells = vtkSmartPointer<vtkCellArray>::New();
+    cells->SetData(offsets, connectivity);
+    return cells;
+}
+
+
+vtkSmartPointer<vtkPolyData> MeshWeld::weld( vtkPolyData* input, double tolerance, bool computeNormals, double featureAngle ) {
+    if (!input || !input->GetPoints() || !input->GetPolys() || input->GetNumberOfPolys() == 0)
+        return nullptr;
+
+    /* 1. Get the points as floats (the STL readers already produce floats, so
+     *    normally this doesn't copy anything)
+     */
+    const vtkIdType nIn = input->GetNumberOfPoints();
+    vtkSmartPointer<vtkFloatArray> inCoords = vtkFloatArray::SafeDownCast( input->GetPoints()->GetData() );
+    if (!inCoords) {
+        inCoords = vtkSmartPointer<vtkFloatArray>::New();
+        inCoords->DeepCopy( input->GetPoints()->GetData() );
+    }
+    const float* xyz = inCoords->GetPointer(0);
+
+    /* 2. Get the triangles as a flat list of point ids, anything with more
+     *    than three sides is split into a fan of triangles
+     */
+    vtkSmartPointer<vtkIdTypeArray> inOffsets = vtkSmartPointer<vtkIdTypeArray>::New();
+    vtkSmartPointer<vtkIdTypeArray> inConnectivity = vtkSmartPointer<vtkIdTypeArray>::New();
+    inOffsets->DeepCopy( input->GetPolys()->GetOffsetsArray() );
+    inConnectivity->DeepCopy( input->GetPolys()->GetConnectivityArray() );
+
+    const vtkIdType nCells = inOffsets->GetNumberOfValues() - 1;
+    const vtkIdType* off = inOffsets->GetPointer(0);
+    const vtkIdType* conn = inConnectivity->GetPointer(0);
+
+    std::vector<vtkIdType> tris;
+    tris.reserve( inConnectivity->GetNumberOfValues() );
+    for (vtkIdType c = 0; c < nCells; c++) {
+        for (vtkIdType k = off[c] + 2; k < off[c + 1]; k++) {
+            tris.push_back(conn[off[c]]);
+            tris.push_back(conn[k - 1]);
+            tris.push_back(conn[k]);
+        }
+    }
+
+    /* 3. Merge points */
+    std::vector<vtkIdType> remap, unique;
+    weldPoints(xyz, nIn, tolerance, remap, unique);
+    const vtkIdType nOut = vtkIdType(unique.size());
+
+    vtkSmartPointer<vtkFloatArray> outCoords = vtkSmartPointer<vtkFloatArray>::New();
+    outCoords->SetNumberOfComponents(3);
+    outCoords->SetNumberOfTuples(nOut);
+    float* outXyz = outCoords->GetPointer(0);
+
+    vtkSMPTools::For( 0, nOut, [&]( vtkIdType first, vtkIdType last ) {
+        for (vtkIdType p = first; p < last; p++)
+            std::memcpy( outXyz + 3*p, xyz + 3*unique[p], 3 * sizeof(float) );
+    } );
+
+    /* 4. Point triangles at the merged points */
+    vtkSMPTools::For( 0, vtkIdType(tris.size()), [&]( vtkIdType first, vtkIdType last ) {
+        for (vtkIdType c = first; c < last; c++)
+            tris[c] = remap[tris[c]];
+    } );
+
+    /* Triangles much smaller than the tolerance collapse to a line or point, remove them */
+    size_t kept = 0;
+    for (size_t f = 0; f < tris.size(); f += 3) {
+        if (tris[f] != tris[f+1] && tris[f+1] != tris[f+2] && tris[f] != tris[f+2]) {
+            tris[kept] = tris[f]; tris[kept+1] = tris[f+1]; tris[kept+2] = tris[f+2];
+            kept += 3;
+        }
+    }
+    tris.resize(kept);
+
+    /* 5. Normals. Points on a crease are split, one copy for each side. */
+    vtkSmartPointer<vtkFloatArray> normals;
+    if (computeNormals) {
+        std::vector<vtkIdType> source;
+        std::vector<float> n;
+        creaseNormals( outXyz, nOut, tris, featureAngle, source, n );
+
+        const vtkIdType nSplit = vtkIdType(source.size());
+        vtkSmartPointer<vtkFloatArray> splitCoords = vtkSmartPointer<vtkFloatArray>::New();
+        splitCoords->SetNumberOfComponents(3);
+        splitCoords->SetNumberOfTuples(nSplit);
+        float* splitXyz = splitCoords->GetPointer(0);
+
+        vtkSMPTools::For( 0, nSplit, [&]( vtkIdType first, vtkIdType last ) {
+            for (vtkIdType p = first; p < last; p++)
+                std::memcpy( splitXyz + 3*p, outXyz + 3*source[p], 3 * sizeof(float) );
+        } );
+        outCoords = splitCoords;
+
+        normals = vtkSmartPointer<vtkFloatArray>::New();
+        normals->SetName("Normals");
+        normals->SetNumberOfComponents(3);
+        normals->SetNumberOfTuples(nSplit);
+        std::copy( n.begin(), n.end(), normals->GetPointer(0) );
+    }
+
+    /* 6. Assemble output */
+    const vtkIdType nPoints = outCoords->GetNumberOfTuples();
+    vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+    points->SetData(outCoords);
+
+    vtkSmartPointer<vtkPolyData> output = vtkSmartPointer<vtkPolyData>::New();
+    output->SetPoints(points);
+    if (nPoints < vtkIdType(std::numeric_limits<vtkTypeInt32>::max()) && vtkIdType(tris.size()) < vtkIdType(std::numeric_limits<vtkTypeInt32>::max()))
+        output->SetPolys( makeCells<vtkTypeInt32Array>(tris) );
+    else
+        output->SetPolys( makeCells<vtkIdTypeArray>(tris) );
+
+    if (normals)
+        output->GetPointData()->SetNormals(normals);
+
+    return output;
+}
@@ -0,0 +1,53 @@
+/**     @file MeshWeld.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Import stage that merges duplicate STL vertices and calculates normals.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_MESHWELD_H
+#define VIEWER_MESHWELD_H
+
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+
+
+/** Turns a "triangle soup" (as read from an STL file, where every triangle has
+  * its own three points) into an indexed mesh where each point is stored once
+  * and shared by all the triangles that use it. A typical STL part has each
+  * point used by about six triangles, so this cuts the number of points - and
+  * the memory and upload time on the graphics card - by roughly six times.
+  *
+  * Duplicate points are found with a parallel hash:
+  *   1. Points are split into shards according to their hash, using a parallel
+  *      counting sort so points keep their original order within each shard.
+  *   2. Each shard is de-duplicated with its own hash table, all shards at once.
+  *      Identical points always have the same hash so they end up in the same shard.
+  *   3. Shards are numbered one after another to give the final point ids.
+  * The result doesn't depend on the number of threads used.
+  *
+  * Per-point normals (the area weighted average of the surrounding triangle
+  * normals) are then calculated so the part can be smooth shaded. Triangles
+  * meeting at more than the feature angle (30 degrees by default, as
+  * vtkPolyDataNormals) aren't averaged together - the points along such a
+  * crease are split, one copy for each side, so the hard edges of CAD parts
+  * stay sharp. All loops are plain scalar loops, split between threads with
+  * vtkSMPTools.
+  */
+class MeshWeld {
+public:
+    /** Weld a triangle mesh and add point normals
+      * @param input is the mesh to weld, only triangles are kept
+      * @param tolerance is the distance within which points are merged, 0 means
+      *        only merge points with exactly the same coordinates (the normal case for STL)
+      * @param computeNormals adds per-point normals to the output if true
+      * @param featureAngle is the angle (degrees) above which an edge is a crease
+      *        and its points are split, 180 smooths everything
+      * @return a new indexed mesh, or nullptr if the input has no triangles
+      */
+    static vtkSmartPointer<vtkPolyData> weld( vtkPolyData* input, double tolerance = 0., bool computeNormals = true, double featureAngle = 30. );
+};
+
+#endif
@@ -8,25 +8,87 @@
   */
 
 #include "ModelPart.h"
+#include "BinarySTLReader.h"
+#include "ASCIISTLReader.h"
+#include "MeshWeld.h"
+#include "GeometryCache.h"
+#include "GeometryStore.h"
+#include "ModelPartPool.h"
 
 
-/* Commented out for now, will be uncommented later when you have
- * installed the VTK library
- */
-//#include <vtkSmartPointer.h>
-//#include <vtkDataSetMapper.h>
+#include <vtkSmartPointer.h>
+#include <vtkPolyDataMapper.h>
+#include <vtkSTLReader.h>
+#include <vtkProperty.h>
+
+#include <QHash>
+#include <QVector>
+
+#include <algorithm>
 
 
 
+/* Interned part names (and source paths). Big assemblies repeat the same names
+ * (every "M6_bolt.stl") thousands of times, each part just stores its name's
+ * position in this table.
+ * Names are never removed, like the tree this is only used from the GUI thread.
+ */
+static QVector<QString>         nameTable = { QString() };
+static QHash<QString, quint32>  nameIds = { { QString(), 0 } };
+
+static quint32 internName( const QString& name ) {
+    auto it = nameIds.constFind(name);
+    if (it != nameIds.constEnd())
+        return it.value();
+
+    quint32 id = nameTable.size();
+    nameTable.append(name);
+    nameIds.insert(name, id);
+    return id;
+}
+
+
 ModelPart::ModelPart(const QList<QVariant>& data, ModelPart* parent )
-    : m_itemData(data), m_parentItem(parent) {
+    : m_parentItem(parent), m_name(0), m_source(0), m_flags(VISIBLE), m_projectNode(0), m_row(0), m_pool(nullptr), m_poolSlot(-1) {
+
+    /* Give the item a default colour (white, so the lighting shows the shape) */
+    m_colour[0] = m_colour[1] = m_colour[2] = 255;
+
+    for (int column = 0; column < data.size(); column++)
+        set(column, data.at(column));
 
-    /* You probably want to give the item a default colour */
+    /* Nothing to sync yet, there are no actors */
+    m_flags &= ~(VISIBILITY_DIRTY | COLOUR_DIRTY);
+
+    /* Start with no transform (identity). The part shares its parent's world
+     * transform until it has a transform or an actor of its own.
+     */
+    m_flags |= TRANSFORM_DIRTY;
 }
 
 
 ModelPart::~ModelPart() {
-    qDeleteAll(m_childItems);
+    /* If a whole pool is being cleared the sweep gets to its parts itself, and
+     * may already have destroyed them - so they are recognised by address and
+     * never touched. Any other child (made with new) is still this part's to free.
+     */
+    const ModelPartPool* clearing = ModelPartPool::clearing();
+    for (ModelPart* child : m_childItems) {
+        if (clearing && clearing->owns(child))
+            continue;
+        destroy(child);
+    }
+}
+
+
+void ModelPart::destroy( ModelPart* part ) {
+    if (!part)
+        return;
+
+    if (part->m_pool)
+        part->m_pool->destroy(part);
+    else
+        delete part;
 }
 
 
@@ -35,7 +97,101 @@ void ModelPart::appendChild( ModelPart* item ) {
      * (it will appear as a sub-branch in the treeview)
      */
     item->m_parentItem = this;
+    item->m_row = m_childItems.size();
     m_childItems.append(item);
+
+    /* New child needs its world transform calculating */
+    item->markTransformDirty();
+    item->markMovedStateDirty();
+}
+
+
+void ModelPart::appendChildren( const QList<ModelPart*>& items ) {
+    /* Grow the list once rather than once per item */
+    m_childItems.reserve(m_childItems.size() + items.size());
+
+    for (ModelPart* item : items) {
+        item->m_parentItem = this;
+        item->m_row = m_childItems.size();
+        m_childItems.append(item);
+
+        /* Only the first of these walks up the tree, after that the
+         * ancestors are already marked
+         */
+        item->markTransformDirty();
+        item->markMovedStateDirty();
+    }
+}
+
+
+void ModelPart::insertChild( int row, ModelPart* item ) {
+    insertChildren( row, QList<ModelPart*>() << item );
+}
+
+
+void ModelPart::insertChildren( int row, const QList<ModelPart*>& items ) {
+    row = qBound(0, row, int(m_childItems.size()));
+
+    /* Splice the new items in, rather than inserting one at a time (which would
+     * shift the rest of the list along once per item)
+     */
+    m_childItems = m_childItems.mid(0, row) + items + m_childItems.mid(row);
+
+    for (ModelPart* item : items) {
+        item->m_parentItem = this;
+        item->markTransformDirty();
+        item->markMovedStateDirty();
+    }
+
+    /* Everything from here down has moved */
+    renumberChildren(row, m_childItems.size());
+}
+
+
+QList<ModelPart*> ModelPart::takeChildren( int row, int count ) {
+    QList<ModelPart*> taken;
+    if (row < 0 || count <= 0 || row + count > m_childItems.size())
+        return taken;
+
+    taken = m_childItems.mid(row, count);
+    m_childItems.erase(m_childItems.begin() + row, m_childItems.begin() + row + count);
+    renumberChildren(row, m_childItems.size());
+
+    for (ModelPart* item : taken) {
+        item->m_parentItem = nullptr;
+        item->m_row = 0;
+    }
+    return taken;
+}
+
+
+void ModelPart::moveChildren( int row, int count, int destination ) {
+    if (row < 0 || count <= 0 || row + count > m_childItems.size())
+        return;
+    if (destination < 0 || destination > m_childItems.size())
+        return;
+    if (destination >= row && destination <= row + count)
+        return;     /* Into itself, or already there */
+
+    /* Rotate the block into place - only the rows between the old and new
+     * positions change, so only those need renumbering
+     */
+    auto first = m_childItems.begin() + row;
+    auto last = first + count;
+    if (destination < row) {
+        std::rotate(m_childItems.begin() + destination, first, last);
+        renumberChildren(destination, row + count);
+    }
+    else {
+        std::rotate(first, last, m_childItems.begin() + destination);
+        renumberChildren(row, destination);
+    }
+}
+
+
+void ModelPart::renumberChildren( int first, int last ) {
+    for (int i = first; i < last; i++)
+        m_childItems[i]->m_row = i;
 }
 
 
@@ -57,7 +213,7 @@ int ModelPart::childCount() const {
 int ModelPart::columnCount() const {
     /* Count number of columns (properties) that this item has.
      */
-    return m_itemData.count();
+    return STORED_COLUMNS + (m_extraData ? m_extraData->size() : 0);
 }
 
 QVariant ModelPart::data(int column) const {
@@ -65,20 +221,52 @@ QVariant ModelPart::data(int column) const {
      *  Note on the QVariant type - it is a generic placeholder type
      *  that can take on the type of most Qt classes. It allows each 
      *  column or property to store data of an arbitrary type.
+     *  The values are kept in their own types and only wrapped up in a QVariant here.
      */
-    if (column < 0 || column >= m_itemData.size())
-        return QVariant();
-    return m_itemData.at(column);
+    switch (column) {
+        case NAME_COLUMN:
+            return nameTable.at(m_name);     /* Shares the interned string, no copy */
+        case VISIBLE_COLUMN:
+            return bool(m_flags & VISIBLE);
+        default:
+            if (m_extraData && column >= STORED_COLUMNS && column < columnCount())
+                return m_extraData->at(column - STORED_COLUMNS);
+            return QVariant();
+    }
 }
 
 
 void ModelPart::set(int column, const QVariant &value) {
     /* Set the data associated with a column of this item 
      */
-    if (column < 0 || column >= m_itemData.size())
-        return;
+    switch (column) {
+        case NAME_COLUMN:
+            setName( value.toString() );
+            break;
+        case VISIBLE_COLUMN:
+            /* Accepts a bool or a string - "false" or "0" means hidden */
+            setVisible( value.toBool() );
+            break;
+        default:
+            if (column < STORED_COLUMNS)
+                return;
+            if (!m_extraData)
+                m_extraData.reset( new QList<QVariant>() );
+            while (m_extraData->size() <= column - STORED_COLUMNS)
+                m_extraData->append( QVariant() );
+            m_extraData->replace(column - STORED_COLUMNS, value);
+            break;
+    }
+}
+
+
+const QString& ModelPart::name() const {
+    return nameTable.at(m_name);
+}
 
-    m_itemData.replace(column, value);
+
+void ModelPart::setName( const QString& name ) {
+    m_name = internName(name);
 }
 
 
@@ -91,96 +279,416 @@ int ModelPart::row() const {
     /* Return the row index of this item, relative to it's parent.
      */
     if (m_parentItem)
-        return m_parentItem->m_childItems.indexOf(const_cast<ModelPart*>(this));
+        return m_row;
     return 0;
 }
 
+void ModelPart::setLocalTransform(const vtkMatrix4x4* m) {
+    /* Most parts are never moved relative to their parent, so the matrix is only
+     * made when one is actually set
+     */
+    if (!m_localTransform)
+        m_localTransform = vtkSmartPointer<vtkMatrix4x4>::New();
+    m_localTransform->DeepCopy(m);
+    markTransformDirty();
+}
+
+
+/* Shared identity matrix, for parts with no transform of their own */
+static vtkMatrix4x4* identityMatrix() {
+    static vtkSmartPointer<vtkMatrix4x4> identity = vtkSmartPointer<vtkMatrix4x4>::New();
+    return identity;
+}
+
+
+vtkMatrix4x4* ModelPart::localTransform() {
+    if (m_localTransform)
+        return m_localTransform;
+    return identityMatrix();
+}
+
+
+vtkMatrix4x4* ModelPart::worldTransform() {
+    /* Folders and other parts with no transform or actor of their own are wherever
+     * their parent is, so only those that differ keep a matrix
+     */
+    for (ModelPart* p = this; p; p = p->m_parentItem) {
+        if (p->m_worldTransform)
+            return p->m_worldTransform;
+    }
+    return identityMatrix();
+}
+
+
+void ModelPart::markTransformDirty() {
+    m_flags |= TRANSFORM_DIRTY;
+
+    /* Let each ancestor know that something below it has changed. Can stop as soon
+     * as an ancestor that already knows is found.
+     */
+    for (ModelPart* p = m_parentItem; p && !(p->m_flags & CHILD_TRANSFORM_DIRTY); p = p->m_parentItem)
+        p->m_flags |= CHILD_TRANSFORM_DIRTY;
+}
+
+
+void ModelPart::updateWorldTransforms(bool parentChanged, QList<ModelPart*>* changedParts) {
+    /* Parents with no matrix of their own pass on their ancestor's (nullptr at the root is identity) */
+    vtkMatrix4x4* parentWorld = m_parentItem ? m_parentItem->worldTransform() : nullptr;
+    updateWorldTransforms(parentWorld, parentChanged, changedParts);
+}
+
+
+void ModelPart::updateWorldTransforms(vtkMatrix4x4* parentWorld, bool parentChanged, QList<ModelPart*>* changedParts) {
+    /* Nothing has changed at or below this part - the whole branch can be skipped */
+    if (!parentChanged && !(m_flags & (TRANSFORM_DIRTY | CHILD_TRANSFORM_DIRTY)))
+        return;
+
+    bool changed = parentChanged || (m_flags & TRANSFORM_DIRTY);
+
+    /* Only parts that are moved relative to their parent, or draw something, need
+     * a matrix - everything else shares its parent's
+     */
+    if (changed && (m_localTransform || actor)) {
+        if (!m_worldTransform)
+            m_worldTransform = vtkSmartPointer<vtkMatrix4x4>::New();
+
+        /* World = parent's world * local. DeepCopy/Multiply4x4 modify the existing matrix
+         * object, so any actor using it as its user matrix will pick up the change.
+         */
+        if (parentWorld && m_localTransform)
+            vtkMatrix4x4::Multiply4x4(parentWorld, m_localTransform, m_worldTransform);
+        else if (parentWorld)
+            m_worldTransform->DeepCopy(parentWorld);
+        else if (m_localTransform)
+            m_worldTransform->DeepCopy(m_localTransform);
+        else
+            m_worldTransform->Identity();
+    }
+
+    /* The VR actor has its own copy of the matrix, it must be sent the new one */
+    if (changed && changedParts && m_vrActor)
+        changedParts->append(this);
+
+    vtkMatrix4x4* world = m_worldTransform ? m_worldTransform.Get() : parentWorld;
+    for (ModelPart* child : m_childItems)
+        child->updateWorldTransforms(world, changed, changedParts);
+
+    m_flags &= ~(TRANSFORM_DIRTY | CHILD_TRANSFORM_DIRTY);
+}
+
+bool ModelPart::transformDirty() const {
+    return m_flags & (TRANSFORM_DIRTY | CHILD_TRANSFORM_DIRTY);
+}
+
 void ModelPart::setColour(const unsigned char R, const unsigned char G, const unsigned char B) {
-    /* This is a placeholder function that you will need to modify if you want to use it */
-    
-    /* As the name suggests ... */
+    if (m_colour[0] == R && m_colour[1] == G && m_colour[2] == B)
+        return;
+
+    /* Only the value is stored here, the actors are updated by the next sync */
+    m_colour[0] = R;
+    m_colour[1] = G;
+    m_colour[2] = B;
+    markStateDirty(COLOUR_DIRTY);
 }
 
 unsigned char ModelPart::getColourR() {
-    /* This is a placeholder function that you will need to modify if you want to use it */
-    
-    /* As the name suggests ... */
-    return 0;   // needs updating
+    return m_colour[0];
 }
 
 unsigned char ModelPart::getColourG() {
-    /* This is a placeholder function that you will need to modify if you want to use it */
-    
-    /* As the name suggests ... */
-    return 0;   // needs updating
+    return m_colour[1];
 }
 
 
 unsigned char ModelPart::getColourB() {
-   /* This is a placeholder function that you will need to modify if you want to use it */
-    
-    /* As the name suggests ... */
-    return 0;   // needs updating
+    return m_colour[2];
 }
 
 
 void ModelPart::setVisible(bool isVisible) {
-    /* This is a placeholder function that you will need to modify if you want to use it */
-    
-    /* As the name suggests ... */
+    if (isVisible == visible())
+        return;
+
+    /* Only the flag is changed here, the actors are updated by the next sync */
+    if (isVisible)
+        m_flags |= VISIBLE;
+    else
+        m_flags &= ~VISIBLE;
+    markStateDirty(VISIBILITY_DIRTY);
 }
 
 bool ModelPart::visible() {
-    /* This is a placeholder function that you will need to modify if you want to use it */
-    
-    /* As the name suggests ... */
-    return false;
+    return m_flags & VISIBLE;
+}
+
+
+void ModelPart::markStateDirty( quint8 flag ) {
+    m_flags |= flag;
+
+    /* Same idea as markTransformDirty() - stop at the first ancestor that already knows */
+    for (ModelPart* p = m_parentItem; p && !(p->m_flags & CHILD_STATE_DIRTY); p = p->m_parentItem)
+        p->m_flags |= CHILD_STATE_DIRTY;
+}
+
+
+void ModelPart::markMovedStateDirty() {
+    /* A branch moved here from elsewhere in the tree (e.g. ModelPartList::moveRows())
+     * may still have visibility or colour changes waiting, which its new ancestors
+     * don't know about - the next sync wouldn't reach them
+     */
+    if (m_flags & (VISIBILITY_DIRTY | COLOUR_DIRTY | CHILD_STATE_DIRTY))
+        markStateDirty(0);
+}
+
+
+bool ModelPart::stateDirty() const {
+    return m_flags & (VISIBILITY_DIRTY | COLOUR_DIRTY);
+}
+
+
+bool ModelPart::childStateDirty() const {
+    return m_flags & CHILD_STATE_DIRTY;
+}
+
+
+void ModelPart::clearChildStateDirty() {
+    m_flags &= ~CHILD_STATE_DIRTY;
+}
+
+
+void ModelPart::applyState() {
+    if (actor) {
+        if (m_flags & VISIBILITY_DIRTY)
+            actor->SetVisibility( visible() );
+        if (m_flags & COLOUR_DIRTY)
+            actor->GetProperty()->SetColor( m_colour[0] / 255., m_colour[1] / 255., m_colour[2] / 255. );
+    }
+
+    m_flags &= ~(VISIBILITY_DIRTY | COLOUR_DIRTY);
 }
 
 void ModelPart::loadSTL( QString fileName ) {
-    /* This is a placeholder function that you will need to modify if you want to use it */
-    
     /* 1. Use the vtkSTLReader class to load the STL file 
      *     https://vtk.org/doc/nightly/html/classvtkSTLReader.html
      */
+    vtkSmartPointer<vtkPolyData> data = readSTL(fileName);
+    if (!data)
+        return;
+
+    /* 2. & 3. Initialise the part's mapper and actor */
+    setGeometry(data);
+
+    /* Remembered so the part can be saved in a project */
+    setSource(fileName);
+}
+
+
+/* Read the triangles from an STL file, as stored (each triangle has its own 3 points) */
+static vtkSmartPointer<vtkPolyData> readTriangles( const QString& fileName ) {
+    /* Most CAD exports are binary, try the fast memory mapped reader first */
+    vtkSmartPointer<vtkPolyData> binary = BinarySTLReader::read(fileName);
+    if (binary)
+        return binary;
+
+    /* Some suppliers only provide ASCII files, these have their own parallel reader */
+    vtkSmartPointer<vtkPolyData> ascii = ASCIISTLReader::read(fileName);
+    if (ascii)
+        return ascii;
+
+    /* Not recognised by either - fall back to VTK's reader */
+    vtkSmartPointer<vtkSTLReader> reader = vtkSmartPointer<vtkSTLReader>::New();
+    reader->SetFileName( fileName.toLocal8Bit().constData() );
+    reader->MergingOff();       /* MeshWeld does this much faster */
+    reader->Update();
+
+    if (reader->GetErrorCode() != 0 || reader->GetOutput()->GetNumberOfPoints() == 0)
+        return nullptr;
+
+    /* Keep the output but not the reader */
+    vtkSmartPointer<vtkPolyData> data = vtkSmartPointer<vtkPolyData>::New();
+    data->ShallowCopy(reader->GetOutput());
+    return data;
+}
+
+
+vtkSmartPointer<vtkPolyData> ModelPart::readSTL( const QString& fileName ) {
+    /* Each call uses its own reader, nothing is shared between calls, so several
+     * files can be read at the same time on different threads.
+     */
+
+    /* If a file with the same contents is already loaded, share its geometry. The
+     * key comes from the file's cache if it has an up to date one, otherwise the
+     * file is hashed - once, the same hash is stored in the new cache below.
+     */
+    bool haveCache = false;
+    const QByteArray key = GeometryStore::key(fileName, &haveCache);
+    vtkSmartPointer<vtkPolyData> shared = GeometryStore::find(key);
+    if (shared)
+        return shared;
+
+    /* If this file has been loaded before its processed mesh is already on disk */
+    if (haveCache) {
+        vtkSmartPointer<vtkPolyData> cached = GeometryCache::load(fileName);
+        if (cached)
+            return GeometryStore::insert(key, cached);
+    }
+
+    vtkSmartPointer<vtkPolyData> triangles = readTriangles(fileName);
+    if (!triangles)
+        return nullptr;
+
+    /* Merge the duplicate points STL files are full of and add normals for smooth shading */
+    vtkSmartPointer<vtkPolyData> welded = MeshWeld::weld(triangles);
+    if (!welded)
+        return GeometryStore::insert(key, triangles);
+
+    /* Save it for next time, a failure here (e.g. read-only folder) just means no cache */
+    GeometryCache::save(fileName, welded, key);
+    return GeometryStore::insert(key, welded);
+}
+
+
+void ModelPart::setGeometry( vtkPolyData* data ) {
+    geometry = data;
+
+    /* New geometry replaces any simplified levels made from the old one */
+    m_levels.assign(1, geometry);
+
+    /* Initialise the part's vtkMapper */
+    vtkSmartPointer<vtkPolyDataMapper> m = vtkSmartPointer<vtkPolyDataMapper>::New();
+    m->SetInputData(geometry);
+    mapper = m;
+
+    /* Initialise the part's vtkActor and link to the mapper. The actor uses the
+     * part's world transform as its user matrix so it follows the tree.
+     */
+    actor = vtkSmartPointer<vtkActor>::New();
+    actor->SetMapper(mapper);
+    if (!m_worldTransform) {
+        m_worldTransform = vtkSmartPointer<vtkMatrix4x4>::New();
+        m_worldTransform->DeepCopy( m_parentItem ? m_parentItem->worldTransform() : identityMatrix() );
+    }
+    actor->SetUserMatrix(m_worldTransform);
+
+    /* Start with the part's current state */
+    actor->SetVisibility( visible() );
+    actor->GetProperty()->SetColor( m_colour[0] / 255., m_colour[1] / 255., m_colour[2] / 255. );
+}
+
+
+bool ModelPart::hasGeometry() const {
+    return geometry != nullptr;
+}
+
+
+void ModelPart::setSource( const QString& path ) {
+    m_source = internName(path);
+}
+
+
+const QString& ModelPart::source() const {
+    return nameTable.at(m_source);
+}
+
+
+void ModelPart::setChildrenPending( bool pending ) {
+    if (pending)
+        m_flags |= CHILDREN_PENDING;
+    else
+        m_flags &= ~CHILDREN_PENDING;
+}
+
+
+bool ModelPart::childrenPending() const {
+    return m_flags & CHILDREN_PENDING;
+}
+
+
+void ModelPart::setProjectNode( quint32 node ) {
+    m_projectNode = node;
+}
+
+
+quint32 ModelPart::projectNode() const {
+    return m_projectNode;
+}
+
+
+void ModelPart::setGeometryRequested( bool requested ) {
+    if (requested)
+        m_flags |= GEOMETRY_REQUESTED;
+    else
+        m_flags &= ~GEOMETRY_REQUESTED;
+}
+
 
-    /* 2. Initialise the part's vtkMapper */
-    
-    /* 3. Initialise the part's vtkActor and link to the mapper */
+bool ModelPart::geometryRequested() const {
+    return m_flags & GEOMETRY_REQUESTED;
 }
 
-//vtkSmartPointer<vtkActor> ModelPart::getActor() {
-    /* This is a placeholder function that you will need to modify if you want to use it */
-    
+
+void ModelPart::setLevelsOfDetail( const std::vector<vtkSmartPointer<vtkPolyData>>& levels ) {
+    if (levels.empty())
+        return;
+
+    m_levels = levels;
+}
+
+
+const std::vector<vtkSmartPointer<vtkPolyData>>& ModelPart::levelsOfDetail() const {
+    return m_levels;
+}
+
+
+vtkSmartPointer<vtkActor> ModelPart::getActor() {
     /* Needs to return a smart pointer to the vtkActor to allow
      * part to be rendered.
      */
-//}
+    return actor;
+}
+
 
-//vtkActor* ModelPart::getNewActor() {
-    /* This is a placeholder function that you will need to modify if you want to use it
-     * 
-     * The default mapper/actor combination can only be used to render the part in 
+vtkSmartPointer<vtkActor> ModelPart::getNewActor() {
+    /* The default mapper/actor combination can only be used to render the part in 
      * the GUI, it CANNOT also be used to render the part in VR. This means you need
      * to create a second mapper/actor combination for use in VR - that is the role
      * of this function. */
-     
-     
-     /* 1. Create new mapper */
-     
-     /* 2. Create new actor and link to mapper */
-     
-     /* 3. Link the vtkProperties of the original actor to the new actor. This means 
-      *    if you change properties of the original part (colour, position, etc), the
-      *    changes will be reflected in the GUI AND VR rendering.
-      *    
-      *    See the vtkActor documentation, particularly the GetProperty() and SetProperty()
-      *    functions.
-      */
-    
-
-    /* The new vtkActor pointer must be returned here */
-//    return nullptr;
-    
-//}
+    if (!actor)
+        return nullptr;
 
+    /* 1. Create new mapper, sharing the same geometry (the data is not copied) */
+    vtkSmartPointer<vtkPolyDataMapper> newMapper = vtkSmartPointer<vtkPolyDataMapper>::New();
+    newMapper->SetInputData(geometry);
+
+    /* 2. Create new actor and link to mapper */
+    vtkSmartPointer<vtkActor> newActor = vtkSmartPointer<vtkActor>::New();
+    newActor->SetMapper(newMapper);
+
+    /* 3. Give the new actor a copy of the vtkProperties of the original actor. They
+     *    are not shared - the VR thread reads its actor's property while rendering, so
+     *    the GUI must not modify it. Colour and visibility changes are passed on to VR
+     *    by ModelPartList::syncState() instead (see VRRenderThread::setActorStates).
+     */
+    vtkSmartPointer<vtkProperty> property = vtkSmartPointer<vtkProperty>::New();
+    property->DeepCopy(actor->GetProperty());
+    newActor->SetProperty(property);
+    newActor->SetVisibility( visible() );
+
+    /* The VR thread takes over this actor's transform, so give it a copy of the
+     * part's current world transform rather than the shared matrix
+     */
+    vtkSmartPointer<vtkMatrix4x4> m = vtkSmartPointer<vtkMatrix4x4>::New();
+    m->DeepCopy(worldTransform());
+    newActor->SetUserMatrix(m);
+
+    /* Remember it, so later changes can be sent to it */
+    m_vrActor = newActor;
+
+    /* Returned as a smart pointer, the part and the caller each hold a reference */
+    return newActor;
+}
+
+
+vtkActor* ModelPart::vrActor() const {
+    return m_vrActor;
+}
@@ -14,18 +14,17 @@
 #include <QList>
 #include <QVariant>
 
-/* VTK headers - will be needed when VTK used in next worksheet,
- * commented out for now
- *
- * Note that there are a few function definitions and variables
- * commented out below - this is because you haven't yet installed
- * the VTK library which is needed.
- */
-//#include <vtkSmartPointer.h>
-//#include <vtkMapper.h>
-//#include <vtkActor.h>
-//#include <vtkSTLReader.h>
-//#include <vtkColor.h>
+/* VTK headers */
+#include <vtkSmartPointer.h>
+#include <vtkMatrix4x4.h>
+#include <vtkMapper.h>
+#include <vtkActor.h>
+#include <vtkPolyData.h>
+
+#include <memory>
+#include <vector>
+
+class ModelPartPool;
 
 class ModelPart {
 public:
@@ -40,11 +39,50 @@ public:
       */
     ~ModelPart();
 
+    /** Free a part and everything below it, however it was allocated (with new,
+      * or by a ModelPartPool). Use this rather than delete.
+      * @param part is the part to free, can be nullptr
+      */
+    static void destroy(ModelPart* part);
+
     /** Add a child to this item.
       * @param item Pointer to child object (must already be allocated using new)
       */
     void appendChild(ModelPart* item);
 
+    /** Add several children to this item in one go (cheaper than calling
+      * appendChild() for each when adding thousands of parts).
+      * @param items are the new children (must already be allocated using new)
+      */
+    void appendChildren(const QList<ModelPart*>& items);
+
+    /** Insert a child at a position, the children after it move down one row
+      * @param row is the position (0 to childCount())
+      * @param item Pointer to child object (must already be allocated using new)
+      */
+    void insertChild(int row, ModelPart* item);
+
+    /** Insert several children at a position, in order
+      * @param row is the position (0 to childCount())
+      * @param items are the new children (must already be allocated using new)
+      */
+    void insertChildren(int row, const QList<ModelPart*>& items);
+
+    /** Remove children without deleting them, the children after them move up
+      * @param row is the first child to remove
+      * @param count is the number of children to remove
+      * @return the removed children, the caller takes ownership
+      */
+    QList<ModelPart*> takeChildren(int row, int count);
+
+    /** Move a block of children to another position under this item
+      * @param row is the first child to move
+      * @param count is the number of children to move
+      * @param destination is the row to move them in front of, counted before the
+      *        move (as QAbstractItemModel::beginMoveRows). Must not be inside the block.
+      */
+    void moveChildren(int row, int count, int destination);
+
     /** Return child at position 'row' below this item
       * @param row is the row number (below this item)
       * @return pointer to the item requested.
@@ -60,7 +98,7 @@ public:
                                      * valid, but 'get' type functions are.
                                      */
 
-    /** Get number of data items (2 - part name and visibility string) in this case.
+    /** Get number of data items (2 - part name and visibility) in this case.
       * @return number of visible data columns
       */
     int columnCount() const;
@@ -69,10 +107,23 @@ public:
       * i.e. either part name of visibility
       * used by Qt when displaying tree
       * @param column is column index
-      * @return the QVariant (represents string)
+      * @return the QVariant (name string, or visible bool)
       */
     QVariant data(int column) const;
 
+    /** Column numbers used by data() and set() */
+    enum Column {
+        NAME_COLUMN = 0,
+        VISIBLE_COLUMN = 1,
+        STORED_COLUMNS          /**< Columns from here on are kept as QVariants */
+    };
+
+    /** Get the part name (column 0) */
+    const QString& name() const;
+
+    /** Set the part name (column 0) */
+    void setName(const QString& name);
+
 
     /** Default function required by Qt to allow setting of part
       * properties within treeview.
@@ -86,7 +137,9 @@ public:
       */
     ModelPart* parentItem();
 
-    /** Get row index of item, relative to parent item
+    /** Get row index of item, relative to parent item. This is stored in the
+      * item (and kept up to date as children are added, removed and moved), so
+      * it doesn't need to search the parent's list.
       * @return row index
       */
     int row() const;
@@ -94,6 +147,8 @@ public:
 
     /** Set colour
       * (0-255 RGB values as ints)
+      * The actors are updated at the next ModelPartList::syncState(), so changing
+      * many parts at once only costs one update.
       */
     void setColour(const unsigned char R, const unsigned char G, const unsigned char B);
 
@@ -102,10 +157,25 @@ public:
     unsigned char getColourB();
 
     /** Set visible flag
+      * The actors are updated at the next ModelPartList::syncState().
       * @param isVisible sets visible/non-visible
       */
     void setVisible(bool isVisible);
 
+    /** Check whether this part's visibility or colour has changed since the last sync */
+    bool stateDirty() const;
+
+    /** Check whether a part below this one has changed visibility or colour since the last sync */
+    bool childStateDirty() const;
+
+    /** Copy visibility and colour to the GUI actor and clear the changed flags.
+      * The VR actor belongs to the VR thread so isn't touched, see vrActor().
+      */
+    void applyState();
+
+    /** Clear the flag saying a part below this one has changed (once they have all been synced) */
+    void clearChildStateDirty();
+
     /** Get visible flag
       * @return visible flag as boolean 
       */
@@ -116,33 +186,175 @@ public:
       */
     void loadSTL(QString fileName);
 
+    /** Read an STL file without creating a part. This doesn't touch any
+      * ModelPart, so it is safe to call from worker threads (see ModelPartLoader).
+      * Files with the same contents share one copy of the geometry (see
+      * GeometryStore), so the result must not be modified.
+      * @param fileName is the file to read
+      * @return the file contents, or nullptr if it could not be read
+      */
+    static vtkSmartPointer<vtkPolyData> readSTL(const QString& fileName);
+
+    /** Use already loaded data as this part's geometry, creates the mapper
+      * and actor needed to render it. Must be called from the GUI thread.
+      * @param data is the part geometry
+      */
+    void setGeometry(vtkPolyData* data);
+
+    /** Check whether the part has geometry yet (parts added lazily don't, until it is needed) */
+    bool hasGeometry() const;
+
+    /** Set the file (STL) or folder this part comes from, so its geometry or
+      * children can be loaded later, when they are needed
+      * @param path is the file or folder name
+      */
+    void setSource(const QString& path);
+
+    /** Get the file or folder this part comes from (empty if none) */
+    const QString& source() const;
+
+    /** Mark that this part has children that haven't been created yet (see
+      * ModelPartList::fetchMore)
+      */
+    void setChildrenPending(bool pending);
+    bool childrenPending() const;
+
+    /** Set the project file node this part was made from (see ProjectFile), so
+      * its children can be created from the file when they are needed
+      * @param node is the node number, 0 if the part isn't from a project
+      */
+    void setProjectNode(quint32 node);
+    quint32 projectNode() const;
+
+    /** Mark that this part's geometry has been asked for, so it is only loaded once */
+    void setGeometryRequested(bool requested);
+    bool geometryRequested() const;
+
+    /** Set this part's levels of detail (simplified copies of the geometry, see
+      * LODBuilder). Must be called from the GUI thread.
+      * @param levels is the list of levels, level 0 should be the full geometry
+      */
+    void setLevelsOfDetail(const std::vector<vtkSmartPointer<vtkPolyData>>& levels);
+
+    /** Get this part's levels of detail
+      * @return list of levels, level 0 is the full geometry. Only contains the full
+      *         geometry until the simplified levels have been built.
+      */
+    const std::vector<vtkSmartPointer<vtkPolyData>>& levelsOfDetail() const;
+
+    /** Set this part's transform relative to its parent (i.e. moving a
+      * sub-assembly moves all of its children with it). Parts are identity
+      * until this is called, they don't store a matrix of their own until then.
+      * @param m is the new local transform, it is copied
+      */
+    void setLocalTransform(const vtkMatrix4x4* m);
+
+    /** Get this part's transform relative to its parent
+      * @return local transform matrix (do not modify, use setLocalTransform). Parts
+      *         without their own transform return a shared identity matrix.
+      */
+    vtkMatrix4x4* localTransform();
+
+    /** Get this part's transform relative to the root of the tree. Only parts
+      * with a local transform or geometry have a matrix of their own, which is
+      * kept for the life of the part (so it can be given to vtkActor::SetUserMatrix()
+      * and the actor will follow any changes). Other parts, e.g. folders, return
+      * their nearest such ancestor's matrix, or a shared identity.
+      * Only valid after updateWorldTransforms() has been called on the root.
+      * @return world transform matrix (do not modify)
+      */
+    vtkMatrix4x4* worldTransform();
+
+    /** Recalculate world transforms of this part and its children. Only
+      * branches that contain a changed local transform are visited.
+      * @param parentChanged should be true if the parent's world transform has changed
+      * @param changedParts if not null receives every part with a VR actor (see
+      *        getNewActor()) whose world transform changed, so it can be sent to VR
+      */
+    void updateWorldTransforms(bool parentChanged = false, QList<ModelPart*>* changedParts = nullptr);
+
+    /** Check whether this part's transform, or that of a part below it, has
+      * changed since the last updateWorldTransforms()
+      */
+    bool transformDirty() const;
+
     /** Return actor
       * @return pointer to default actor for GUI rendering
       */
-    //vtkSmartPointer<vtkActor> getActor();
+    vtkSmartPointer<vtkActor> getActor();
+
+    /** Make a new actor for use in VR. The part keeps a reference to it (see
+      * vrActor()) and the caller gets another, so the actor lives until both
+      * have let go - nothing needs deleting by hand. Once it has been passed to
+      * the VR thread only that thread may modify it.
+      * @return the new actor, nullptr if the part has no geometry
+      */
+    vtkSmartPointer<vtkActor> getNewActor();
 
-    /** Return new actor for use in VR
-      * @return pointer to new actor
+    /** Get the actor made by the last call to getNewActor(), so changes can be
+      * passed on to the VR thread
+      * @return VR actor, nullptr if none has been made
       */
-    //vtkActor* getNewActor();
+    vtkActor* vrActor() const;
 
 private:
     QList<ModelPart*>                           m_childItems;       /**< List (array) of child items */
-    QList<QVariant>                             m_itemData;         /**< List (array of column data for item */
     ModelPart*                                  m_parentItem;       /**< Pointer to parent */
 
-    /* These are some typical properties that I think the part will need, you might
-     * want to add you own.
+    /* Column data is stored as typed values rather than a list of QVariants, a list
+     * costs several allocations per part and a conversion every time the tree is
+     * painted. Names are interned (parts loaded from the same file share one copy of
+     * the string) and the yes/no properties are bits in one byte.
      */
-    bool                                        isVisible;          /**< True/false to indicate if should be visible in model rendering */
+    enum Flag : quint8 {
+        VISIBLE                 = 1 << 0,       /**< Should be shown in renderings */
+        TRANSFORM_DIRTY         = 1 << 1,       /**< Local transform changed since last update */
+        CHILD_TRANSFORM_DIRTY   = 1 << 2,       /**< A descendant's local transform has changed */
+        CHILDREN_PENDING        = 1 << 3,       /**< Children not created yet */
+        GEOMETRY_REQUESTED      = 1 << 4,       /**< Geometry is being loaded from m_source */
+        VISIBILITY_DIRTY        = 1 << 5,       /**< Visible flag changed since last sync */
+        COLOUR_DIRTY            = 1 << 6,       /**< Colour changed since last sync */
+        CHILD_STATE_DIRTY       = 1 << 7        /**< A descendant's visibility or colour has changed */
+    };
+
+    quint32                                     m_name;             /**< Part name, index into the name table */
+    quint32                                     m_source;           /**< File or folder the part is loaded from, index into the name table */
+    quint8                                      m_flags;            /**< Flag bits */
+    unsigned char                               m_colour[3];        /**< User defineable colour (RGB) */
+    quint32                                     m_projectNode;      /**< Node in the open project file, 0 if none */
+    std::unique_ptr<QList<QVariant>>            m_extraData;        /**< Any columns after STORED_COLUMNS, rarely used */
+    int                                         m_row;              /**< Position in parent's m_childItems */
+    ModelPartPool*                              m_pool;             /**< Pool that allocated this part, nullptr if made with new */
+    int                                         m_poolSlot;         /**< Position in the pool */
+
+    friend class ModelPartPool;
+
+    /** Set the stored row of children first to last-1 to their position in the list */
+    void renumberChildren(int first, int last);
+
+    /** updateWorldTransforms() with the parent's world transform already known (nullptr for identity) */
+    void updateWorldTransforms(vtkMatrix4x4* parentWorld, bool parentChanged, QList<ModelPart*>* changedParts);
+
+    /* Transform of this part, relative to parent and relative to tree root */
+    vtkSmartPointer<vtkMatrix4x4>               m_localTransform;   /**< Transform relative to parent, nullptr if identity */
+    vtkSmartPointer<vtkMatrix4x4>               m_worldTransform;   /**< Transform relative to root (parent world * local), nullptr if the same as the parent's */
+
+    /** Flag this part and its ancestors so the next update visits it */
+    void markTransformDirty();
+
+    /** Flag a visibility/colour change, and let the ancestors know so the next sync visits it */
+    void markStateDirty(quint8 flag);
+
+    /** After being given a new parent, let the new ancestors know about any changes still waiting to be synced */
+    void markMovedStateDirty();
 	
-	/* These are vtk properties that will be used to load/render a model of this part,
-	 * commented out for now but will be used later
+	/* These are vtk properties that will be used to load/render a model of this part
 	 */
-	//vtkSmartPointer<vtkSTLReader>               file;               /**< Datafile from which part loaded */
-    //vtkSmartPointer<vtkMapper>                  mapper;             /**< Mapper for rendering */
-    //vtkSmartPointer<vtkActor>                   actor;              /**< Actor for rendering */
-    //vtkColor3<unsigned char>                    colour;             /**< User defineable colour */
+    vtkSmartPointer<vtkPolyData>                geometry;           /**< Part geometry, loaded from file */
+    vtkSmartPointer<vtkMapper>                  mapper;             /**< Mapper for rendering */
+    vtkSmartPointer<vtkActor>                   actor;              /**< Actor for rendering */
+    vtkSmartPointer<vtkActor>                   m_vrActor;          /**< Actor for rendering in VR (only modified by the VR thread once passed to it) */
+    std::vector<vtkSmartPointer<vtkPolyData>>   m_levels;           /**< Levels of detail, [0] is geometry */
 };  
 
 
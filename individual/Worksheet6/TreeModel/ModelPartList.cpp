@@ -10,24 +10,61 @@
 #include "ModelPartList.h"
 #include "ModelPart.h"
 
+#include <QDir>
+#include <QFileInfo>
+#include <QMetaMethod>
+
 ModelPartList::ModelPartList( const QString& data, QObject* parent ) : QAbstractItemModel(parent) {
     /* Have option to specify number of visible properties for each item in tree - the root item
      * acts as the column headers
      */
-    rootItem = new ModelPart( { tr("Part"), tr("Visible?") } );
+    m_headings = { tr("Part"), tr("Visible?") };
+    rootItem = m_pool.create( {} );
+
+    /* Changes are synced when control returns to the event loop, so however many
+     * parts a single action changes there is only one sync
+     */
+    m_syncTimer.setSingleShot(true);
+    m_syncTimer.setInterval(0);
+    connect(&m_syncTimer, &QTimer::timeout, this, &ModelPartList::syncState);
 }
 
 
 
 ModelPartList::~ModelPartList() {
-    delete rootItem;
+    /* Frees the root item and every part below it in one go */
+    m_pool.clear();
+}
+
+
+void ModelPartList::clear() {
+    /* The model transform belongs to the list rather than the parts, keep it */
+    vtkSmartPointer<vtkMatrix4x4> modelTransform = vtkSmartPointer<vtkMatrix4x4>::New();
+    modelTransform->DeepCopy( rootItem->localTransform() );
+
+    beginResetModel();
+    m_pool.clear();
+    rootItem = m_pool.create( {} );
+    rootItem->setLocalTransform( modelTransform );
+    endResetModel();
+
+    m_spatialIndex.clear();
+    m_spatialIndexStale = true;
+
+    /* No part refers to the project any more */
+    m_project.reset();
+}
+
+
+ModelPart* ModelPartList::newPart( const QList<QVariant>& data ) {
+    return m_pool.create(data);
 }
 
 
 int ModelPartList::columnCount( const QModelIndex& parent ) const {
     Q_UNUSED(parent);
 
-    return rootItem->columnCount();
+    return m_headings.size();
 }
 
 
@@ -62,7 +99,7 @@ Qt::ItemFlags ModelPartList::flags( const QModelIndex& index ) const {
 
 QVariant ModelPartList::headerData( int section, Qt::Orientation orientation, int role ) const {
     if( orientation == Qt::Horizontal && role == Qt::DisplayRole )
-        return rootItem->data( section );
+        return m_headings.value( section );
 
     return QVariant();
 }
@@ -113,34 +150,507 @@ int ModelPartList::rowCount( const QModelIndex& parent ) const {
 }
 
 
+bool ModelPartList::hasChildren( const QModelIndex& parent ) const {
+    if (parent.column() > 0)
+        return false;
+
+    ModelPart* part = partOrRoot(parent);
+    return part->childrenPending() || part->childCount() > 0;
+}
+
+
+bool ModelPartList::canFetchMore( const QModelIndex& parent ) const {
+    if (parent.column() > 0)
+        return false;
+
+    return partOrRoot(parent)->childrenPending();
+}
+
+
+void ModelPartList::fetchMore( const QModelIndex& parent ) {
+    fetch(parent, false);
+}
+
+
+void ModelPartList::fetch( const QModelIndex& parent, bool wait ) {
+    QModelIndex parentIndex = parent.isValid() ? parent.sibling(parent.row(), 0) : QModelIndex();
+    ModelPart* parentPart = partOrRoot(parentIndex);
+    if (!parentPart->childrenPending())
+        return;
+
+    if (parentPart->projectNode() != 0 && m_project) {
+        quint32 node = parentPart->projectNode();
+        parentPart->setChildrenPending(false);
+        parentPart->setProjectNode(0);
+        createProjectChildren(parentIndex, parentPart, node);
+        return;
+    }
+
+    /* Listing a folder on a network drive, or with thousands of files, can take a
+     * while - if there is a loader it is done in the background, the children
+     * arrive through addFolderContents()
+     */
+    if (!wait && isSignalConnected(QMetaMethod::fromSignal(&ModelPartList::folderListingNeeded))) {
+        emit folderListingNeeded(parentIndex, parentPart->source());
+        return;
+    }
+
+    QStringList folders, files;
+    listFolder(parentPart->source(), folders, files);
+    addFolderContents(parentIndex, folders, files);
+}
+
+
+void ModelPartList::listFolder( const QString& dirName, QStringList& folders, QStringList& files ) {
+    /* Sub-folders first, then parts, each in name order. Hidden folders (e.g. the
+     * geometry cache) are skipped.
+     */
+    QDir dir(dirName);
+    for (const QFileInfo& info : dir.entryInfoList( QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name ))
+        folders.append( info.absoluteFilePath() );
+    for (const QFileInfo& info : dir.entryInfoList( QStringList() << "*.stl" << "*.STL", QDir::Files, QDir::Name ))
+        files.append( info.absoluteFilePath() );
+}
+
+
+void ModelPartList::addFolderContents( const QModelIndex& parent, const QStringList& folders, const QStringList& files ) {
+    ModelPart* parentPart = partOrRoot(parent);
+
+    /* Already listed, e.g. by fetchAll() while the loader was busy */
+    if (!parentPart->childrenPending())
+        return;
+    parentPart->setChildrenPending(false);
+
+    /* The parts are set up completely before the view hears about them. They start
+     * out shown or hidden as the folder is.
+     */
+    bool visible = parentPart->visible();
+    QList<ModelPart*> parts;
+    parts.reserve(folders.size() + files.size());
+    for (const QString& path : folders) {
+        ModelPart* part = m_pool.create( { QFileInfo(path).fileName(), visible } );
+        part->setSource(path);
+        part->setChildrenPending(true);
+        parts.append(part);
+    }
+    for (const QString& path : files) {
+        ModelPart* part = m_pool.create( { QFileInfo(path).fileName(), visible } );
+        part->setSource(path);
+        parts.append(part);
+    }
+
+    int first = parentPart->childCount();
+    insertParts(parent, parts);
+
+    /* The user is looking at these now, so start loading them - unless they are
+     * hidden, as in createProjectChildren() they are loaded when they are shown
+     * (requestGeometry)
+     */
+    if (!files.isEmpty() && visible) {
+        int firstFile = first + folders.size();
+        for (int row = firstFile; row < first + parts.size(); row++)
+            parentPart->child(row)->setGeometryRequested(true);
+        emit geometryNeeded(parent, firstFile, first + parts.size() - 1);
+    }
+}
+
+
+void ModelPartList::fetchAll( const QModelIndex& parent ) {
+    if (canFetchMore(parent))
+        fetch(parent, true);
+
+    for (int row = 0; row < rowCount(parent); row++) {
+        QModelIndex child = index(row, 0, parent);
+        if (hasChildren(child))
+            fetchAll(child);
+    }
+}
+
+
+QModelIndex ModelPartList::appendFolder( const QModelIndex& parent, const QString& dirName ) {
+    QFileInfo info(dirName);
+
+    ModelPart* part = m_pool.create( { info.fileName(), true } );
+    part->setSource( info.absoluteFilePath() );
+    part->setChildrenPending(true);
+
+    return appendSubtree(parent, part);
+}
+
+
+void ModelPartList::requestGeometry( const QModelIndex& index ) {
+    if (!index.isValid())
+        return;
+
+    ModelPart* part = static_cast<ModelPart*>( index.internalPointer() );
+    if (part->hasGeometry() || part->geometryRequested() || part->source().isEmpty())
+        return;
+
+    /* Folders don't have geometry of their own */
+    if (part->childrenPending() || QFileInfo(part->source()).isDir())
+        return;
+
+    part->setGeometryRequested(true);
+    emit geometryNeeded( parent(index), index.row(), index.row() );
+}
+
+
+bool ModelPartList::saveProject( const QString& fileName ) {
+    /* Replacing the open project's file while it is mapped isn't allowed on every
+     * platform, so finish creating the tree from it and let it go first
+     */
+    if (m_project && QFileInfo(fileName) == QFileInfo(m_project->fileName())) {
+        fetchProject( QModelIndex() );
+        m_project.reset();
+    }
+
+    return ProjectFile::save( fileName, rootItem, m_project.get() );
+}
+
+
+bool ModelPartList::openProject( const QString& fileName ) {
+    std::unique_ptr<ProjectFile> project = ProjectFile::open(fileName);
+    if (!project)
+        return false;
+
+    clear();
+    m_project = std::move(project);
+
+    /* The root node holds the model transform */
+    vtkSmartPointer<vtkMatrix4x4> modelTransform = vtkSmartPointer<vtkMatrix4x4>::New();
+    const double* m = m_project->transform( m_project->node(0)->transform );
+    if (m)
+        modelTransform->DeepCopy(m);
+    rootItem->setLocalTransform( modelTransform );
+
+    createProjectChildren( QModelIndex(), rootItem, 0 );
+    return true;
+}
+
+
+void ModelPartList::createProjectChildren( const QModelIndex& parent, ModelPart* parentPart, quint32 node ) {
+    quint32 first, count;
+    if (!m_project->children(node, first, count))
+        return;
+
+    /* The parts are set up completely before the view hears about them. Branches
+     * below them stay in the file until they are expanded.
+     */
+    QList<ModelPart*> parts;
+    parts.reserve( int(count) );
+    for (quint32 i = first; i < first + count; i++) {
+        const ProjectFile::Node* n = m_project->node(i);
+        ModelPart* part = m_pool.create( { m_project->string(n->name), bool(n->flags & ProjectFile::VISIBLE) } );
+        part->setColour( n->colour[0], n->colour[1], n->colour[2] );
+        if (n->source != ProjectFile::none)
+            part->setSource( m_project->path(n->source) );
+
+        const double* m = m_project->transform(n->transform);
+        if (m) {
+            vtkSmartPointer<vtkMatrix4x4> transform = vtkSmartPointer<vtkMatrix4x4>::New();
+            transform->DeepCopy(m);
+            part->setLocalTransform(transform);
+        }
+
+        if (n->flags & ProjectFile::FOLDER) {
+            part->setChildrenPending(true);
+        }
+        else if (n->childCount > 0) {
+            part->setChildrenPending(true);
+            part->setProjectNode(i);
+        }
+        parts.append(part);
+    }
+
+    int firstRow = parentPart->childCount();
+    insertParts(parent, parts);
+
+    /* Start loading the geometry of the visible parts, one signal for each run of
+     * rows. Hidden parts are loaded when they are shown (requestGeometry).
+     */
+    const quint8 wantedFlags = ProjectFile::GEOMETRY | ProjectFile::VISIBLE;
+    int runStart = -1;
+    for (int k = 0; k <= parts.size(); k++) {
+        bool wanted = k < parts.size() && (m_project->node(first + quint32(k))->flags & wantedFlags) == wantedFlags;
+        if (wanted) {
+            parts[k]->setGeometryRequested(true);
+            if (runStart < 0)
+                runStart = k;
+        }
+        else if (runStart >= 0) {
+            emit geometryNeeded( parent, firstRow + runStart, firstRow + k - 1 );
+            runStart = -1;
+        }
+    }
+}
+
+
+void ModelPartList::fetchProject( const QModelIndex& parent ) {
+    ModelPart* part = partOrRoot(parent);
+    if (part->projectNode() != 0)
+        fetchMore(parent);
+
+    for (int row = 0; row < part->childCount(); row++)
+        fetchProject( index(row, 0, parent) );
+}
+
+
 ModelPart* ModelPartList::getRootItem() {
     return rootItem; 
 }
 
 
 
+ModelPart* ModelPartList::partOrRoot( const QModelIndex& index ) const {
+    if (index.isValid())
+        return static_cast<ModelPart*>(index.internalPointer());
+    return rootItem;
+}
+
+
+void ModelPartList::insertParts( const QModelIndex& parent, const QList<ModelPart*>& parts ) {
+    if (parts.isEmpty())
+        return;
+
+    ModelPart* parentPart = partOrRoot(parent);
+    int first = parentPart->childCount();
+
+    /* Views only need to be told that a block of rows has appeared. The existing
+     * rows haven't moved, so there is no need for layoutChanged (which makes every
+     * view throw away and re-lay-out the whole tree).
+     */
+    beginInsertRows( parent, first, first + parts.size() - 1 );
+    parentPart->appendChildren(parts);
+    endInsertRows();
+
+    m_spatialIndexStale = true;
+}
+
+
 QModelIndex ModelPartList::appendChild(QModelIndex& parent, const QList<QVariant>& data) {      
-    ModelPart* parentPart;
+    QList<QModelIndex> added = appendChildren( parent, QList<QList<QVariant>>() << data );
+    return added.first();
+}
+
+
+QList<QModelIndex> ModelPartList::appendChildren( const QModelIndex& parent, const QList<QList<QVariant>>& data ) {
+    /* The root item isn't shown in the tree, its children are the top level rows
+     * and have an invalid parent index
+     */
+    QModelIndex parentIndex = parent.isValid() ? parent.sibling(parent.row(), 0) : QModelIndex();
+    ModelPart* parentPart = partOrRoot(parentIndex);
+    int first = parentPart->childCount();
+
+    QList<ModelPart*> parts;
+    parts.reserve(data.size());
+    for (const QList<QVariant>& d : data)
+        parts.append( m_pool.create(d) );
+
+    insertParts(parentIndex, parts);
+
+    QList<QModelIndex> indexes;
+    indexes.reserve(parts.size());
+    for (int i = 0; i < parts.size(); i++)
+        indexes.append( createIndex(first + i, 0, parts[i]) );
+    return indexes;
+}
+
+
+QModelIndex ModelPartList::appendSubtree( const QModelIndex& parent, ModelPart* subtree ) {
+    if (!subtree)
+        return QModelIndex();
 
-    if (parent.isValid())
-        parentPart = static_cast<ModelPart*>(parent.internalPointer());
+    QModelIndex parentIndex = parent.isValid() ? parent.sibling(parent.row(), 0) : QModelIndex();
+    int row = partOrRoot(parentIndex)->childCount();
+
+    /* Everything below the top item comes along with it, views discover it when
+     * the new row is expanded
+     */
+    insertParts( parentIndex, QList<ModelPart*>() << subtree );
+    return createIndex(row, 0, subtree);
+}
+
+
+
+bool ModelPartList::removeRows( int row, int count, const QModelIndex& parent ) {
+    ModelPart* parentPart = partOrRoot(parent);
+    if (row < 0 || count <= 0 || row + count > parentPart->childCount())
+        return false;
+
+    beginRemoveRows( parent, row, row + count - 1 );
+    QList<ModelPart*> removed = parentPart->takeChildren(row, count);
+    endRemoveRows();
+
+    for (ModelPart* part : removed)
+        ModelPart::destroy(part);
+    m_spatialIndexStale = true;
+    return true;
+}
+
+
+bool ModelPartList::moveRows( const QModelIndex& sourceParent, int sourceRow, int count,
+                              const QModelIndex& destinationParent, int destinationChild ) {
+    ModelPart* from = partOrRoot(sourceParent);
+    ModelPart* to = partOrRoot(destinationParent);
+
+    if (sourceRow < 0 || count <= 0 || sourceRow + count > from->childCount())
+        return false;
+    if (destinationChild < 0 || destinationChild > to->childCount())
+        return false;
+
+    /* A part can't be moved into its own branch */
+    for (ModelPart* p = to; p; p = p->parentItem()) {
+        if (p->parentItem() == from && p->row() >= sourceRow && p->row() < sourceRow + count)
+            return false;
+    }
+
+    /* Also refuses moves that wouldn't change anything */
+    if (!beginMoveRows( sourceParent, sourceRow, sourceRow + count - 1, destinationParent, destinationChild ))
+        return false;
+
+    if (from == to)
+        from->moveChildren(sourceRow, count, destinationChild);
     else {
-        parentPart = rootItem;
-        parent = createIndex(0, 0, rootItem );
+        QList<ModelPart*> moved = from->takeChildren(sourceRow, count);
+        to->insertChildren(destinationChild, moved);
     }
 
-    beginInsertRows( parent, rowCount(parent), rowCount(parent) ); 
+    endMoveRows();
+    m_spatialIndexStale = true;
+    return true;
+}
 
-    ModelPart* childPart = new ModelPart( data, parentPart );
 
-    parentPart->appendChild(childPart);
+bool ModelPartList::setData( const QModelIndex& index, const QVariant& value, int role ) {
+    if (!index.isValid() || index.column() != ModelPart::VISIBLE_COLUMN || role != Qt::EditRole)
+        return false;
 
-    QModelIndex child = createIndex(0, 0, childPart);
+    static_cast<ModelPart*>( index.internalPointer() )->setVisible( value.toBool() );
+    scheduleSync();
+    return true;
+}
 
-    endInsertRows();
 
-    emit layoutChanged();
+void ModelPartList::setVisible( const QModelIndexList& indexes, bool visible ) {
+    for (const QModelIndex& index : indexes) {
+        if (index.isValid())
+            static_cast<ModelPart*>( index.internalPointer() )->setVisible(visible);
+    }
+    scheduleSync();
+}
+
 
-    return child;
+void ModelPartList::setColour( const QModelIndexList& indexes, unsigned char R, unsigned char G, unsigned char B ) {
+    for (const QModelIndex& index : indexes) {
+        if (index.isValid())
+            static_cast<ModelPart*>( index.internalPointer() )->setColour(R, G, B);
+    }
+    scheduleSync();
+}
+
+
+void ModelPartList::scheduleSync() {
+    if (!m_syncTimer.isActive())
+        m_syncTimer.start();
+}
+
+
+QList<ModelPart*> ModelPartList::syncState() {
+    m_syncTimer.stop();
+
+    QList<ModelPart*> changed;
+    if (rootItem->childStateDirty())
+        syncChildren( QModelIndex(), rootItem, changed );
+
+    if (!changed.isEmpty()) {
+        m_spatialIndexStale = true;
+        emit stateSynced(changed);
+    }
+    return changed;
+}
+
+
+void ModelPartList::syncChildren( const QModelIndex& parent, ModelPart* parentPart, QList<ModelPart*>& changed ) {
+    const int lastColumn = columnCount(parent) - 1;
+    int runStart = -1;
+
+    for (int row = 0; row <= parentPart->childCount(); row++) {
+        ModelPart* part = parentPart->child(row);    /* nullptr past the end, closes the last run */
+
+        /* Rows that changed next to each other are reported to views as one range */
+        if (part && part->stateDirty()) {
+            if (runStart < 0)
+                runStart = row;
+
+            part->applyState();
+            changed.append(part);
+
+            /* A lazily added part that is now visible needs its geometry */
+            if (part->visible() && !part->hasGeometry())
+                requestGeometry( createIndex(row, 0, part) );
+        }
+        else if (runStart >= 0) {
+            emit dataChanged( createIndex(runStart, 0, parentPart->child(runStart)),
+                              createIndex(row - 1, lastColumn, parentPart->child(row - 1)) );
+            runStart = -1;
+        }
+
+        if (part && part->childStateDirty())
+            syncChildren( createIndex(row, 0, part), part, changed );
+    }
+
+    parentPart->clearChildStateDirty();
 }
 
+
+void ModelPartList::setModelTransform( const vtkMatrix4x4* m ) {
+    rootItem->setLocalTransform( m );
+}
+
+
+void ModelPartList::updateTransforms() {
+    /* Moved parts only need their boxes in the spatial index updating, not a rebuild */
+    if (rootItem->transformDirty())
+        m_spatialIndexMoved = true;
+
+    QList<ModelPart*> changed;
+    rootItem->updateWorldTransforms(false, &changed);
+
+    if (!changed.isEmpty())
+        emit transformsUpdated(changed);
+}
+
+
+void ModelPartList::invalidateSpatialIndex() {
+    m_spatialIndexStale = true;
+}
+
+
+const PartBVH& ModelPartList::spatialIndex() {
+    /* Updated on demand rather than after every change - a whole import costs
+     * one rebuild, and a drag of a sub-assembly one refit, at the next pick
+     */
+    updateTransforms();
+    if (m_spatialIndexStale)
+        m_spatialIndex.build(rootItem);
+    else if (m_spatialIndexMoved)
+        m_spatialIndex.refit();
+    m_spatialIndexStale = false;
+    m_spatialIndexMoved = false;
+    return m_spatialIndex;
+}
+
+
+ModelPart* ModelPartList::pick( const double origin[3], const double dir[3], double* distance, double point[3] ) {
+    return spatialIndex().pick(origin, dir, distance, point);
+}
+
+
+QList<ModelPart*> ModelPartList::partsInBox( const double box[6] ) {
+    return spatialIndex().partsInBox(box);
+}
+
+
+ModelPart* ModelPartList::nearestPart( const double p[3], double* distance ) {
+    return spatialIndex().nearestPart(p, distance);
+}
@@ -12,12 +12,19 @@
 
 
 #include "ModelPart.h"
+#include "ModelPartPool.h"
+#include "PartBVH.h"
+#include "ProjectFile.h"
 
 #include <QAbstractItemModel>
 #include <QModelIndex>
 #include <QVariant>
 #include <QString>
+#include <QStringList>
 #include <QList>
+#include <QTimer>
+
+#include <memory>
 
 class ModelPart;
 
@@ -32,10 +39,22 @@ public:
     ModelPartList( const QString& data, QObject* parent = NULL );
 
     /** Destructor
-      *  Frees root item allocated in constructor
+      *  Frees root item allocated in constructor, along with every other part
       */
     ~ModelPartList();
 
+    /** Remove every part from the tree (e.g. when a project is closed). All parts
+      * are freed in one sweep of the part pool rather than branch by branch.
+      */
+    void clear();
+
+    /** Make a new part that isn't in the tree yet, e.g. to build up a branch for
+      * appendSubtree(). It comes from the tree's part pool, so must be freed
+      * with ModelPart::destroy() if it isn't added to the tree.
+      * @param data is the part's column data (part name and visible string)
+      */
+    ModelPart* newPart( const QList<QVariant>& data );
+
     /** Return column count
       * @param parent is not used
       * @return number of columns in the tree view - "Part" and "Visible", i.e. 2 in this case
@@ -86,18 +105,271 @@ public:
       */
     int rowCount( const QModelIndex& parent ) const;
 
+    /** Check whether an item has children. Items added with appendFolder() say
+      * yes before their children have been created, so the view shows an
+      * expand arrow (standard Qt function).
+      */
+    bool hasChildren( const QModelIndex& parent = QModelIndex() ) const override;
+
+    /** Check whether an item has children that haven't been created yet
+      * (standard Qt function, used by views when an item is expanded)
+      */
+    bool canFetchMore( const QModelIndex& parent ) const override;
+
+    /** Create an item's children, i.e. list the folder it was made from or read
+      * them from the open project. Folders become items that are fetched in the
+      * same way when they are expanded, STL files become parts without geometry -
+      * geometryNeeded is emitted for the visible ones so it can be loaded. If
+      * anything is connected to folderListingNeeded (i.e. a ModelPartLoader) the
+      * folder is listed there, in the background (standard Qt function)
+      */
+    void fetchMore( const QModelIndex& parent ) override;
+
+    /** List a folder's sub-folders and STL files, each in name order. Doesn't use
+      * the tree, so can be called from any thread.
+      * @param dirName is the folder
+      * @param folders receives the sub-folders (absolute paths)
+      * @param files receives the STL files (absolute paths)
+      */
+    static void listFolder( const QString& dirName, QStringList& folders, QStringList& files );
+
+    /** Create an item's children from a listing of its folder (see listFolder()
+      * and folderListingNeeded). Does nothing if they have been created already.
+      * @param parent is the item
+      * @param folders, files are the folder's contents, from listFolder()
+      */
+    void addFolderContents( const QModelIndex& parent, const QStringList& folders, const QStringList& files );
+
+    /** Create every item that hasn't been created yet below an item, e.g. before
+      * the whole model is sent to VR. This can take a long time for a big assembly.
+      * @param parent is the top of the branch, the tree root if invalid
+      */
+    void fetchAll( const QModelIndex& parent = QModelIndex() );
+
+    /** Add a folder of STL files to the tree without reading it. Its contents
+      * (and the contents of any sub-folders) are listed when the item is first
+      * expanded, and each part's geometry is only loaded once it has been listed,
+      * so opening a huge assembly is instant and only the parts that are looked
+      * at cost anything.
+      * @param parent is the item to add to, the tree root if invalid
+      * @param dirName is the folder
+      * @return index of the new item
+      */
+    QModelIndex appendFolder( const QModelIndex& parent, const QString& dirName );
+
+    /** Ask for a part's geometry to be loaded (emits geometryNeeded), e.g. when
+      * a lazily added part is made visible. Does nothing if the part already has
+      * geometry, has been asked for before or has no source file.
+      */
+    void requestGeometry( const QModelIndex& index );
+
+    /** Save the whole tree as a project file (see ProjectFile). Branches that
+      * haven't been expanded since the project was opened are copied from the
+      * open project without creating their parts - unless the open project is
+      * the file being replaced, then they are all created first.
+      * @param fileName is the file to write
+      * @return false if the file couldn't be written
+      */
+    bool saveProject( const QString& fileName );
+
+    /** Replace the tree with a project file. The file is mapped and only the
+      * top level parts are created, the rest are created from the file as the
+      * tree is expanded (fetchMore) and geometry is loaded as parts are created
+      * (geometryNeeded), so opening a project takes about the same time however
+      * big it is.
+      * @param fileName is the file to open
+      * @return false if it isn't a project file, the tree is left as it was
+      */
+    bool openProject( const QString& fileName );
+
     /** Get a pointer to the root item of the tree
       * @return the root item pointer
       */
     ModelPart* getRootItem();
 
-    /**
+    /** Add a new item to the end of an item's children
+      * @param parent is the item to add to, the tree root if invalid
+      * @param data is the new item's column data (part name and visible string)
+      * @return index of the new item
       */
     QModelIndex appendChild( QModelIndex& parent, const QList<QVariant>& data );
 
+    /** Add several new items to the end of an item's children. Views are told
+      * about all of them in one go, so this is much faster than calling
+      * appendChild() for each item when importing a large assembly.
+      * @param parent is the item to add to, the tree root if invalid
+      * @param data is the column data for each new item
+      * @return indexes of the new items, in the same order as data
+      */
+    QList<QModelIndex> appendChildren( const QModelIndex& parent, const QList<QList<QVariant>>& data );
+
+    /** Add a whole branch of the tree under an item. The branch is built first
+      * without the model (e.g. with ModelPart::appendChild(), which doesn't notify
+      * any views), then added here with a single notification however many parts
+      * it contains.
+      * @param parent is the item to add to, the tree root if invalid
+      * @param subtree is the top item of the branch, made with newPart() (or new).
+      *        The model takes ownership of it.
+      * @return index of the top item of the branch
+      */
+    QModelIndex appendSubtree( const QModelIndex& parent, ModelPart* subtree );
+
+    /** Remove items from the tree and delete them (standard Qt function)
+      * @param row is the first item to remove
+      * @param count is the number of items to remove
+      * @param parent is the item they are removed from, the tree root if invalid
+      * @return false if the rows don't exist
+      */
+    bool removeRows( int row, int count, const QModelIndex& parent = QModelIndex() ) override;
+
+    /** Move items, within one parent or to a different one (standard Qt function)
+      * @param sourceParent is the item they are moved from, the tree root if invalid
+      * @param sourceRow is the first item to move
+      * @param count is the number of items to move
+      * @param destinationParent is the item they are moved to
+      * @param destinationChild is the row they are moved in front of
+      * @return false if the move isn't possible (e.g. an item moved inside itself)
+      */
+    bool moveRows( const QModelIndex& sourceParent, int sourceRow, int count,
+                   const QModelIndex& destinationParent, int destinationChild ) override;
+
+    /** Set the transform of the whole model, e.g. to re-orient it. This is a
+      * single matrix change on the root item, all parts follow it at the
+      * next updateTransforms().
+      * @param m is the new transform, it is copied
+      */
+    void setModelTransform( const vtkMatrix4x4* m );
+
+    /** Recalculate world transforms of any parts (and their children) whose
+      * transform has changed since the last call. Emits transformsUpdated with
+      * the parts whose VR actors need moving.
+      */
+    void updateTransforms();
+
+    /** Edit an item (standard Qt function). Only the visible column can be set,
+      * the change reaches the actors at the next sync.
+      */
+    bool setData( const QModelIndex& index, const QVariant& value, int role = Qt::EditRole ) override;
+
+    /** Show or hide many parts at once, e.g. a whole selection. Costs one view
+      * update and one VR update however many parts there are.
+      */
+    void setVisible( const QModelIndexList& indexes, bool visible );
+
+    /** Set the colour of many parts at once */
+    void setColour( const QModelIndexList& indexes, unsigned char R, unsigned char G, unsigned char B );
+
+    /** Arrange for syncState() to run once control returns to the event loop. Call
+      * after changing parts directly (ModelPart::setVisible() etc), as many times
+      * as you like - any number of calls before the sync give one sync.
+      */
+    void scheduleSync();
+
+    /** Push visibility/colour changes made since the last sync to the GUI actors
+      * and tell views which rows changed, as a few ranges of rows rather than one
+      * notification per part. Only branches containing a change are visited.
+      * Emits stateSynced with the changed parts, so they can be sent to VR.
+      * @return the parts that changed
+      */
+    QList<ModelPart*> syncState();
+
+    /** Find the first visible part a ray hits, e.g. the part under the mouse or
+      * in front of a VR controller. Uses a spatial index (see PartBVH) which is
+      * rebuilt here if the tree has changed since it was last used, or refitted
+      * if parts have only moved.
+      * @param origin is the start of the ray, in world coordinates
+      * @param dir is the ray direction
+      * @param distance if not null receives the distance to the hit, in multiples of dir
+      * @param point if not null receives the position of the hit
+      * @return the part, nullptr if nothing is hit
+      */
+    ModelPart* pick( const double origin[3], const double dir[3], double* distance = nullptr, double point[3] = nullptr );
+
+    /** Find the visible parts whose bounds overlap a box
+      * @param box is the box (xmin, xmax, ymin, ymax, zmin, zmax)
+      */
+    QList<ModelPart*> partsInBox( const double box[6] );
+
+    /** Find the visible part nearest a point (distance to its bounding box)
+      * @param p is the point
+      * @param distance if not null receives the distance
+      * @return the part, nullptr if there are no visible parts
+      */
+    ModelPart* nearestPart( const double p[3], double* distance = nullptr );
+
+    /** Tell the list that part geometry has changed outside of it (e.g.
+      * ModelPart::setGeometry()), so the spatial index is rebuilt before the next
+      * pick. Adding, removing, moving, hiding and transforming parts through the
+      * list does this already.
+      */
+    void invalidateSpatialIndex();
+
+signals:
+    /** Sent by syncState(). The receiver should pass each part's visibility and
+      * colour on to its VR actor (ModelPart::vrActor()) in one go, e.g. with
+      * VRRenderThread::setActorStates().
+      * @param parts are the parts that changed
+      */
+    void stateSynced( const QList<ModelPart*>& parts );
+
+    /** Sent by updateTransforms(). The receiver should pass each part's world
+      * transform on to its VR actor (ModelPart::vrActor()) in one go, e.g. with
+      * VRRenderThread::setActorTransforms().
+      * @param parts are the parts with a VR actor whose world transform changed
+      */
+    void transformsUpdated( const QList<ModelPart*>& parts );
+
+    /** Parts that were added without geometry need it loading from their source
+      * file (see ModelPartLoader, which loads them in the background)
+      * @param parent is the parent of the parts
+      * @param first, last are the rows of the parts
+      */
+    void geometryNeeded( const QModelIndex& parent, int first, int last );
+
+    /** A folder's contents are needed (fetchMore). The receiver should list it with
+      * listFolder(), off the GUI thread, and pass the result to addFolderContents().
+      * May be sent again for the same folder until it has been listed.
+      * @param parent is the folder's item
+      * @param dirName is the folder
+      */
+    void folderListingNeeded( const QModelIndex& parent, const QString& dirName );
+
 
 private:
+    /** Get the part an index refers to, the root item if the index is invalid */
+    ModelPart* partOrRoot( const QModelIndex& index ) const;
+
+    /** Add already allocated parts to the end of an item's children, with one
+      * row insertion notification for the whole list
+      */
+    void insertParts( const QModelIndex& parent, const QList<ModelPart*>& parts );
+
+    /** Create an item's children, see fetchMore()
+      * @param wait is true to list a folder here and now, rather than asking for it
+      *        to be listed in the background
+      */
+    void fetch( const QModelIndex& parent, bool wait );
+
+    /** Create a part's children from a node of the open project, see fetchMore() */
+    void createProjectChildren( const QModelIndex& parent, ModelPart* parentPart, quint32 node );
+
+    /** Create every part below an item that still comes from the open project */
+    void fetchProject( const QModelIndex& parent );
+
+    /** Sync the children of one part (and their branches), see syncState() */
+    void syncChildren( const QModelIndex& parent, ModelPart* parentPart, QList<ModelPart*>& changed );
+
+    /** Rebuild the spatial index if the tree has changed since it was built, or refit it if parts have only moved */
+    const PartBVH& spatialIndex();
+
+    ModelPartPool m_pool;   /**< Memory for the parts, declared first so it outlives rootItem */
+    QStringList m_headings; /**< Column headings ("Part" and "Visible?") */
+    QTimer m_syncTimer;     /**< Runs syncState() once after a burst of changes */
     ModelPart *rootItem;    /**< This is a pointer to the item at the base of the tree */
+    PartBVH m_spatialIndex; /**< Visible parts by position, for picking */
+    bool m_spatialIndexStale = true;    /**< Tree has changed since m_spatialIndex was built */
+    bool m_spatialIndexMoved = false;   /**< Parts have moved since m_spatialIndex was built or refitted */
+    std::unique_ptr<ProjectFile> m_project; /**< Project the tree was opened from, kept mapped while parts still refer to it */
 };
 #endif
 
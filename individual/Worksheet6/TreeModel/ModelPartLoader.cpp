@@ -0,0 +1,383 @@
+/**     @file ModelPartLoader.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Loads STL files in the background and adds them to the tree as they finish.
+  *
+  *     P Evans 2022
+  */
+
+#include "ModelPartLoader.h"
+#include "ModelPartList.h"
+#include "ModelPart.h"
+#include "LODBuilder.h"
+#include "BVH.h"
+#include "GeometryStore.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QThread>
+
+#include <algorithm>
+
+
+ModelPartLoader::ModelPartLoader( ModelPartList* model, QObject* parent )
+    : QObject(parent), m_model(model) {
+
+    m_cancelled = std::make_shared<std::atomic<bool>>(false);
+    m_job = 0;
+    m_total = 0;
+    m_done = 0;
+    m_buildLODs = true;
+    m_nextRequest = 0;
+
+    /* Levels of detail are a nice-to-have, use half the cores so loading isn't slowed down much */
+    m_lodPool.setMaxThreadCount( std::max(1, QThread::idealThreadCount() / 2) );
+
+    /* Results are added to the tree in batches, at most 20 times per second. Adding
+     * each part the instant it arrives would mean thousands of tree updates for a
+     * large assembly.
+     */
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(50);
+    connect(&m_flushTimer, &QTimer::timeout, this, &ModelPartLoader::flushResults);
+
+    /* Parts added to the tree lazily get their geometry when the tree asks for it,
+     * and folders are listed here rather than on the GUI thread
+     */
+    connect(m_model, &ModelPartList::geometryNeeded, this, &ModelPartLoader::loadGeometry);
+    connect(m_model, &ModelPartList::folderListingNeeded, this, &ModelPartLoader::listFolder);
+}
+
+
+ModelPartLoader::~ModelPartLoader() {
+    /* Workers use this object, so they must all stop before it is destroyed */
+    cancel();
+    m_lodPool.clear();
+    m_pool.waitForDone();
+    m_lodPool.waitForDone();
+}
+
+
+void ModelPartLoader::loadDirectory( const QString& dirName, const QModelIndex& parent ) {
+    QDir dir(dirName);
+    QStringList fileNames;
+
+    for (const QFileInfo& info : dir.entryInfoList( QStringList() << "*.stl" << "*.STL", QDir::Files, QDir::Name ))
+        fileNames.append(info.absoluteFilePath());
+
+    loadFiles(fileNames, parent);
+}
+
+
+void ModelPartLoader::loadFiles( const QStringList& fileNames, const QModelIndex& parent ) {
+    cancel();
+
+    /* Start a new job - each job has its own cancel flag so cancelling this
+     * one can't affect tasks belonging to a later one
+     */
+    m_job++;
+    m_cancelled = std::make_shared<std::atomic<bool>>(false);
+    m_parent = parent;
+    m_total = fileNames.size();
+    m_done = 0;
+
+    if (m_total == 0) {
+        emit finished(false);
+        return;
+    }
+
+    emit progress(0, m_total);
+
+    std::shared_ptr<std::atomic<bool>> cancelled = m_cancelled;
+    int job = m_job;
+
+    for (const QString& fileName : fileNames) {
+        m_pool.start( [this, cancelled, job, fileName]() {
+            /* Runs on a worker thread - must not touch the tree or any ModelPart */
+            if (*cancelled)
+                return;
+
+            Result r;
+            r.job = job;
+            r.request = -1;
+            r.fileName = fileName;
+            r.data = ModelPart::readSTL(fileName);
+
+            /* Build the picking tree here too, in parallel and off the GUI thread,
+             * so neither the GUI nor the VR thread has to build it at the first pick
+             */
+            MeshBVH::attach(r.data);
+
+            if (*cancelled)
+                return;
+
+            fileRead(r);
+        } );
+    }
+}
+
+
+void ModelPartLoader::cancel() {
+    const bool loading = isLoading();
+    if (!loading && m_geometryRequests.isEmpty() && m_listingRequests.isEmpty())
+        return;
+
+    /* Stop tasks that haven't started yet, any that are running will see the
+     * flag and throw their result away. Later geometry and listing requests get
+     * a fresh flag, they have nothing to do with this cancel.
+     */
+    *m_cancelled = true;
+    m_cancelled = std::make_shared<std::atomic<bool>>(false);
+    m_pool.clear();
+
+    /* Clearing the pool also dropped any geometry requests that hadn't started,
+     * let the tree ask for those parts again
+     */
+    for (const QPersistentModelIndex& target : m_geometryRequests) {
+        if (target.isValid())
+            static_cast<ModelPart*>( target.internalPointer() )->setGeometryRequested(false);
+    }
+    m_geometryRequests.clear();
+    m_listingRequests.clear();
+
+    m_job++;
+    m_total = 0;
+    m_done = 0;
+
+    QMutexLocker locker(&m_resultMutex);
+    m_results.clear();
+    locker.unlock();
+
+    /* Only a load of files reports progress, so only that has anything to finish */
+    if (loading)
+        emit finished(true);
+}
+
+
+bool ModelPartLoader::isLoading() const {
+    return m_done < m_total;
+}
+
+
+void ModelPartLoader::setMaxThreads( int n ) {
+    m_pool.setMaxThreadCount(n);
+}
+
+
+void ModelPartLoader::setBuildLevelsOfDetail( bool build ) {
+    m_buildLODs = build;
+}
+
+
+void ModelPartLoader::loadGeometry( const QModelIndex& parent, int first, int last ) {
+    for (int row = first; row <= last; row++) {
+        QModelIndex index = m_model->index(row, 0, parent);
+        if (!index.isValid())
+            continue;
+
+        ModelPart* part = static_cast<ModelPart*>( index.internalPointer() );
+        if (part->hasGeometry() || part->source().isEmpty())
+            continue;
+
+        int request = m_nextRequest++;
+        m_geometryRequests.insert( request, QPersistentModelIndex(index) );
+        QString fileName = part->source();
+        std::shared_ptr<std::atomic<bool>> cancelled = m_cancelled;
+
+        m_pool.start( [this, cancelled, request, fileName]() {
+            /* Runs on a worker thread - must not touch the tree or any ModelPart */
+            if (*cancelled)
+                return;
+
+            Result r;
+            r.job = -1;
+            r.request = request;
+            r.fileName = fileName;
+            r.data = ModelPart::readSTL(fileName);
+            MeshBVH::attach(r.data);
+
+            if (*cancelled)
+                return;
+
+            fileRead(r);
+        } );
+    }
+}
+
+
+void ModelPartLoader::listFolder( const QModelIndex& parent, const QString& dirName ) {
+    /* Views may ask again while the folder is still being listed */
+    for (const QPersistentModelIndex& target : m_listingRequests) {
+        if (target == parent)
+            return;
+    }
+
+    int request = m_nextRequest++;
+    m_listingRequests.insert( request, QPersistentModelIndex(parent) );
+    bool isRoot = !parent.isValid();
+    std::shared_ptr<std::atomic<bool>> cancelled = m_cancelled;
+
+    m_pool.start( [this, cancelled, request, isRoot, dirName]() {
+        /* Runs on a worker thread - only the file system is touched */
+        if (*cancelled)
+            return;
+
+        QStringList folders, files;
+        ModelPartList::listFolder(dirName, folders, files);
+
+        QMetaObject::invokeMethod( this, [this, request, isRoot, folders, files]() {
+            /* The folder may have been removed, or the request cancelled, meanwhile */
+            auto it = m_listingRequests.find(request);
+            if (it == m_listingRequests.end())
+                return;
+            QPersistentModelIndex target = *it;
+            m_listingRequests.erase(it);
+
+            if (isRoot || target.isValid())
+                m_model->addFolderContents(target, folders, files);
+        }, Qt::QueuedConnection );
+    } );
+}
+
+
+void ModelPartLoader::fileRead( const Result& result ) {
+    /* Runs on a worker thread. Store the result and make sure the GUI thread
+     * will come and collect it.
+     */
+    QMutexLocker locker(&m_resultMutex);
+    m_results.append(result);
+    bool first = (m_results.size() == 1);
+    locker.unlock();
+
+    if (first) {
+        QMetaObject::invokeMethod( this, [this]() {
+            if (!m_flushTimer.isActive())
+                m_flushTimer.start();
+        }, Qt::QueuedConnection );
+    }
+}
+
+
+void ModelPartLoader::flushResults() {
+    QMutexLocker locker(&m_resultMutex);
+    QList<Result> results;
+    results.swap(m_results);
+    locker.unlock();
+
+    /* Everything that arrived since the last flush is added to the tree in one
+     * go, so views get one update per batch rather than one per file
+     */
+    QList<QList<QVariant>> rows;
+    QList<vtkSmartPointer<vtkPolyData>> geometry;
+
+    for (const Result& r : results) {
+        /* Geometry for a part that is already in the tree (it may have been
+         * removed while it was loading)
+         */
+        if (r.job < 0) {
+            QPersistentModelIndex target = m_geometryRequests.take(r.request);
+            if (!r.data) {
+                /* Let the tree ask again, e.g. once the file has been fixed */
+                if (target.isValid())
+                    static_cast<ModelPart*>( target.internalPointer() )->setGeometryRequested(false);
+                emit loadFailed(r.fileName);
+            }
+            else if (target.isValid()) {
+                ModelPart* part = static_cast<ModelPart*>( target.internalPointer() );
+                part->setGeometry(r.data);
+                m_model->invalidateSpatialIndex();
+                emit partLoaded(target);
+
+                if (m_buildLODs)
+                    buildLevelsOfDetail(target, r.data);
+            }
+            continue;
+        }
+
+        /* Result from a cancelled load */
+        if (r.job != m_job)
+            continue;
+
+        m_done++;
+
+        if (!r.data) {
+            emit loadFailed(r.fileName);
+            continue;
+        }
+
+        rows.append( { QFileInfo(r.fileName).fileName(), QString("true") } );
+        geometry.append(r.data);
+    }
+
+    QList<QModelIndex> indexes = m_model->appendChildren( m_parent, rows );
+
+    for (int i = 0; i < indexes.size(); i++) {
+        ModelPart* part = static_cast<ModelPart*>( indexes[i].internalPointer() );
+        part->setGeometry(geometry[i]);
+
+        emit partLoaded(indexes[i]);
+
+        if (m_buildLODs)
+            buildLevelsOfDetail(indexes[i], geometry[i]);
+    }
+
+    if (m_total > 0) {
+        emit progress(m_done, m_total);
+
+        if (m_done == m_total)
+            emit finished(false);
+    }
+}
+
+
+void ModelPartLoader::buildLevelsOfDetail( const QModelIndex& index, vtkPolyData* data ) {
+    /* Parts made from the same file contents share geometry, so another part may
+     * already have levels of detail for it...
+     */
+    std::vector<vtkSmartPointer<vtkPolyData>> existing = GeometryStore::levelsOfDetail(data);
+    if (existing.size() > 1) {
+        applyLevelsOfDetail(index, existing);
+        return;
+    }
+
+    /* ...or they may be being made right now, in which case just wait for them */
+    auto waiting = m_lodWaiting.find(data);
+    if (waiting != m_lodWaiting.end()) {
+        waiting->append(QPersistentModelIndex(index));
+        return;
+    }
+    m_lodWaiting.insert( data, QList<QPersistentModelIndex>() << QPersistentModelIndex(index) );
+
+    vtkSmartPointer<vtkPolyData> full(data);
+
+    m_lodPool.start( [this, full]() {
+        /* Runs on a worker thread, only reads the geometry (which nothing modifies once loaded) */
+        std::vector<vtkSmartPointer<vtkPolyData>> levels = LODBuilder::build(full);
+
+        QMetaObject::invokeMethod( this, [this, full, levels]() {
+            QList<QPersistentModelIndex> targets = m_lodWaiting.take(full.Get());
+            if (levels.size() < 2)
+                return;
+
+            GeometryStore::setLevelsOfDetail(levels);
+            for (const QPersistentModelIndex& target : targets)
+                applyLevelsOfDetail(target, levels);
+        }, Qt::QueuedConnection );
+    } );
+}
+
+
+void ModelPartLoader::applyLevelsOfDetail( const QModelIndex& index, const std::vector<vtkSmartPointer<vtkPolyData>>& levels ) {
+    /* The part may have been removed, or given new geometry, while the levels were being made */
+    if (!index.isValid())
+        return;
+
+    ModelPart* part = static_cast<ModelPart*>( index.internalPointer() );
+    if (part->levelsOfDetail().empty() || part->levelsOfDetail()[0] != levels[0])
+        return;
+
+    part->setLevelsOfDetail(levels);
+    emit levelsOfDetailReady(index);
+}
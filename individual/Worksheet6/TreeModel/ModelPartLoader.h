@@ -0,0 +1,177 @@
+/**     @file ModelPartLoader.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Loads STL files in the background and adds them to the tree as they finish.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_MODELPARTLOADER_H
+#define VIEWER_MODELPARTLOADER_H
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <QPersistentModelIndex>
+#include <QMutex>
+#include <QList>
+#include <QTimer>
+#include <QHash>
+
+#include <vtkSmartPointer.h>
+#include <vtkPolyData.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class ModelPartList;
+
+
+/** Loads a set of STL files on a pool of worker threads.
+  *
+  * Reading a large STL file can take a long time, if it is done on the GUI
+  * thread the whole program freezes until it has finished. This class reads
+  * each file in a separate task on a QThreadPool (one thread per CPU core by
+  * default), so the GUI stays responsive and files are read in parallel.
+  *
+  * Only the file reading happens on the worker threads. Finished parts are
+  * collected and added to the ModelPartList on the GUI thread a batch at a
+  * time, so the tree fills up while the rest are still loading.
+  *
+  * Once a part is in the tree its levels of detail (LODBuilder) are made on a
+  * second, smaller pool so they never hold up the loading of other files.
+  */
+class ModelPartLoader : public QObject {
+    Q_OBJECT
+public:
+    /** Constructor
+      * @param model is the tree that loaded parts will be added to
+      * @param parent is the Qt parent object
+      */
+    ModelPartLoader( ModelPartList* model, QObject* parent = nullptr );
+
+    /** Destructor
+      * Cancels any load in progress and waits for the worker threads to stop
+      */
+    ~ModelPartLoader();
+
+    /** Load every STL file in a folder
+      * @param dirName is the folder to load
+      * @param parent is the tree item that the parts will be added under (root if invalid)
+      */
+    void loadDirectory( const QString& dirName, const QModelIndex& parent = QModelIndex() );
+
+    /** Load a list of STL files. Any load already in progress is cancelled.
+      * @param fileNames is the list of files to load
+      * @param parent is the tree item that the parts will be added under (root if invalid)
+      */
+    void loadFiles( const QStringList& fileNames, const QModelIndex& parent = QModelIndex() );
+
+    /** Stop loading. Files that have not started yet are skipped, files being
+      * read finish but are not added to the tree. Also drops geometry and folder
+      * listing requests (see loadGeometry() and listFolder()), even when no files
+      * are being loaded. finished() is only sent if files were being loaded.
+      */
+    void cancel();
+
+    /** Check if a load is in progress */
+    bool isLoading() const;
+
+    /** Set maximum number of files read at the same time (default is number of cores) */
+    void setMaxThreads( int n );
+
+    /** Turn building of levels of detail on or off (on by default) */
+    void setBuildLevelsOfDetail( bool build );
+
+    /** Load geometry for parts that are already in the tree but were added
+      * without it (see ModelPartList::appendFolder). Connected to the model's
+      * geometryNeeded signal, so this happens automatically as folders are
+      * expanded. Parts are updated in place, no new parts are made. cancel()
+      * drops requests that haven't started, the tree can then ask again.
+      * @param parent is the parent of the parts
+      * @param first, last are the rows of the parts
+      */
+    void loadGeometry( const QModelIndex& parent, int first, int last );
+
+    /** List a folder in the tree that has been expanded, in the background, and
+      * give the listing to the tree (ModelPartList::addFolderContents). Connected
+      * to the model's folderListingNeeded signal. cancel() drops listings that
+      * haven't started, the tree then asks again the next time the folder is expanded.
+      * @param parent is the folder's item
+      * @param dirName is the folder
+      */
+    void listFolder( const QModelIndex& parent, const QString& dirName );
+
+signals:
+    /** Emitted as files are finished
+      * @param done is the number of files finished so far
+      * @param total is the number of files being loaded
+      */
+    void progress( int done, int total );
+
+    /** Emitted for each part added to the tree */
+    void partLoaded( const QModelIndex& index );
+
+    /** Emitted if a file could not be read */
+    void loadFailed( const QString& fileName );
+
+    /** Emitted when all files have been loaded or the load was cancelled */
+    void finished( bool cancelled );
+
+    /** Emitted when a part's levels of detail have been built and stored in the
+      * part, e.g. so they can be passed on to the VR thread
+      */
+    void levelsOfDetailReady( const QModelIndex& index );
+
+private:
+    /** A file that has been read by a worker but not yet added to the tree */
+    struct Result {
+        int                                     job;        /**< Load that the file belongs to */
+        int                                     request;    /**< Key in m_geometryRequests if the geometry is for an existing part, otherwise -1 */
+        QString                                 fileName;   /**< File that was read */
+        vtkSmartPointer<vtkPolyData>            data;       /**< Contents, nullptr if the read failed */
+    };
+
+    /** Called by worker threads when a file has been read */
+    void fileRead( const Result& result );
+
+    /** Add waiting results to the tree (GUI thread) */
+    void flushResults();
+
+    /** Start building levels of detail for a part that has just been added */
+    void buildLevelsOfDetail( const QModelIndex& index, vtkPolyData* data );
+
+    /** Give finished levels of detail to a part (GUI thread) */
+    void applyLevelsOfDetail( const QModelIndex& index, const std::vector<vtkSmartPointer<vtkPolyData>>& levels );
+
+    ModelPartList*                              m_model;        /**< Tree to add parts to */
+    QThreadPool                                 m_pool;         /**< Worker threads */
+    QThreadPool                                 m_lodPool;      /**< Worker threads for levels of detail */
+    bool                                        m_buildLODs;    /**< Build levels of detail for new parts */
+    QPersistentModelIndex                       m_parent;       /**< Where in the tree the parts go */
+    std::shared_ptr<std::atomic<bool>>          m_cancelled;    /**< Cancel flag shared with the tasks started since the last cancel() */
+    int                                         m_job;          /**< Id of current load, results from older loads are ignored */
+    int                                         m_total;        /**< Number of files in current load */
+    int                                         m_done;         /**< Number of files finished in current load */
+
+    QMutex                                      m_resultMutex;  /**< Protects m_results */
+    QList<Result>                               m_results;      /**< Results waiting to be added to the tree */
+    QTimer                                      m_flushTimer;   /**< Batches up results so the tree isn't updated for every file */
+
+    /** Parts waiting for geometry (loadGeometry), by request number. Persistent
+      * indexes are kept here on the GUI thread, workers only see the number.
+      */
+    QHash<int, QPersistentModelIndex>           m_geometryRequests;
+    int                                         m_nextRequest;  /**< Number for the next geometry or listing request */
+
+    /** Folders being listed (listFolder), by request number, kept on the GUI thread as for geometry */
+    QHash<int, QPersistentModelIndex>           m_listingRequests;
+
+    /** Parts waiting for levels of detail, by (shared) geometry. Only one set is made for each geometry. */
+    QHash<vtkPolyData*, QList<QPersistentModelIndex>>  m_lodWaiting;
+};
+
+#endif
@@ -0,0 +1,134 @@
+/**     @file ModelPartPool.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Block allocator for the parts in a ModelPartList tree.
+  *
+  *     P Evans 2022
+  */
+
+#include "ModelPartPool.h"
+#include "ModelPart.h"
+
+#include <algorithm>
+#include <functional>
+#include <new>
+
+
+/* Blocks come from new unsigned char[], which is aligned for any standard type */
+static_assert( alignof(ModelPart) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "ModelPart needs over-aligned storage" );
+
+/* Distance between parts in a block, keeping each one aligned */
+static const size_t stride = (sizeof(ModelPart) + alignof(ModelPart) - 1) / alignof(ModelPart) * alignof(ModelPart);
+
+/* Pool whose clear() is running (GUI thread only, like the pools) */
+static const ModelPartPool* clearingPool = nullptr;
+
+
+ModelPartPool::ModelPartPool( int blockSize )
+    : m_blockSize(blockSize > 0 ? blockSize : 1024), m_used(0), m_size(0) {
+}
+
+
+ModelPartPool::~ModelPartPool() {
+    clear();
+}
+
+
+ModelPart* ModelPartPool::slot( int index ) const {
+    unsigned char* block = m_blocks[index / m_blockSize].get();
+    return reinterpret_cast<ModelPart*>( block + (index % m_blockSize) * stride );
+}
+
+
+ModelPart* ModelPartPool::create( const QList<QVariant>& data ) {
+    int index;
+    if (!m_free.empty()) {
+        /* Reuse the most recently freed slot, it is the most likely to still be in cache */
+        index = m_free.back();
+        m_free.pop_back();
+    }
+    else {
+        if (m_used == int(m_blocks.size()) * m_blockSize)
+            m_blocks.emplace_back( new unsigned char[m_blockSize * stride] );
+        index = m_used++;
+    }
+
+    ModelPart* part = new (slot(index)) ModelPart(data);
+    part->m_pool = this;
+    part->m_poolSlot = index;
+
+    if (int(m_live.size()) <= index)
+        m_live.resize(m_blocks.size() * m_blockSize, 0);
+    m_live[index] = 1;
+    m_size++;
+    return part;
+}
+
+
+void ModelPartPool::destroy( ModelPart* part ) {
+    if (!part || part->m_pool != this)
+        return;
+
+    int index = part->m_poolSlot;
+    if (!m_live[index])
+        return;
+
+    /* Marked as gone first, so nothing below this part can try to destroy it again */
+    m_live[index] = 0;
+    part->~ModelPart();
+
+    m_free.push_back(index);
+    m_size--;
+}
+
+
+void ModelPartPool::clear() {
+    /* One pass through memory in order rather than a walk down every branch of
+     * the tree. Parts still run their destructors (they hold references to VTK
+     * objects), but don't destroy their children - the sweep gets to them.
+     */
+    m_sortedBlocks.clear();
+    for (const auto& block : m_blocks)
+        m_sortedBlocks.push_back(block.get());
+    std::sort( m_sortedBlocks.begin(), m_sortedBlocks.end(), std::less<const unsigned char*>() );
+
+    const ModelPartPool* outer = clearingPool;
+    clearingPool = this;
+    for (int i = 0; i < m_used; i++) {
+        if (m_live[i]) {
+            m_live[i] = 0;
+            slot(i)->~ModelPart();
+        }
+    }
+    clearingPool = outer;
+
+    m_sortedBlocks.clear();
+    m_blocks.clear();
+    m_live.clear();
+    m_free.clear();
+    m_used = 0;
+    m_size = 0;
+}
+
+
+int ModelPartPool::size() const {
+    return m_size;
+}
+
+
+const ModelPartPool* ModelPartPool::clearing() {
+    return clearingPool;
+}
+
+
+bool ModelPartPool::owns( const ModelPart* part ) const {
+    /* Last block starting at or before the part, then check the part is inside it */
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(part);
+    std::less<const unsigned char*> before;
+    auto it = std::upper_bound( m_sortedBlocks.begin(), m_sortedBlocks.end(), p, before );
+    if (it == m_sortedBlocks.begin())
+        return false;
+    --it;
+    return before( p, *it + m_blockSize * stride );
+}
@@ -0,0 +1,92 @@
+/**     @file ModelPartPool.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Block allocator for the parts in a ModelPartList tree.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_MODELPARTPOOL_H
+#define VIEWER_MODELPARTPOOL_H
+
+#include <QList>
+#include <QVariant>
+
+#include <memory>
+#include <vector>
+
+class ModelPart;
+
+
+/** A large assembly has hundreds of thousands of parts. Allocating each one
+  * separately with new is slow, scatters the parts all over memory (so walking
+  * the tree keeps missing the cache) and closing the project means deleting
+  * them one at a time, branch by branch.
+  *
+  * The pool allocates parts in blocks of contiguous memory instead - parts
+  * created one after another (e.g. the children of one assembly) sit next to
+  * each other. Destroyed parts leave a gap that the next new part fills.
+  * clear() destroys every part in one sweep through the blocks, in memory
+  * order, then frees the blocks.
+  *
+  * Parts made by the pool must be freed with ModelPart::destroy() (or by
+  * destroying their parent), never with delete. Parts made with new can still
+  * be added to a pooled tree, they are deleted as normal.
+  *
+  * GUI thread only, like the tree itself.
+  */
+class ModelPartPool {
+public:
+    /** Constructor
+      * @param blockSize is the number of parts allocated in each block
+      */
+    ModelPartPool( int blockSize = 1024 );
+
+    /** Destructor, destroys any parts that are left */
+    ~ModelPartPool();
+
+    ModelPartPool( const ModelPartPool& ) = delete;
+    ModelPartPool& operator=( const ModelPartPool& ) = delete;
+
+    /** Make a new part
+      * @param data is the part's column data (see ModelPart constructor)
+      * @return the new part, it has no parent
+      */
+    ModelPart* create( const QList<QVariant>& data );
+
+    /** Destroy a part made by this pool, along with its children */
+    void destroy( ModelPart* part );
+
+    /** Destroy every part made by this pool and free all memory */
+    void clear();
+
+    /** Number of parts that currently exist */
+    int size() const;
+
+    /** Get the pool whose clear() is running, nullptr if none. Parts destroyed
+      * by the sweep (or deleted by a part the sweep destroys) leave that pool's
+      * children to the sweep, which may already have destroyed them.
+      */
+    static const ModelPartPool* clearing();
+
+    /** Check, while clear() is running, whether a part's memory belongs to this
+      * pool. Only the address is compared, so it is safe on a part that has
+      * already been destroyed.
+      */
+    bool owns( const ModelPart* part ) const;
+
+private:
+    /** Get the memory for a slot number */
+    ModelPart* slot( int index ) const;
+
+    int                                         m_blockSize;    /**< Parts per block */
+    std::vector<std::unique_ptr<unsigned char[]>> m_blocks;     /**< Part memory */
+    std::vector<unsigned char>                  m_live;         /**< 1 for each slot holding a part */
+    std::vector<int>                            m_free;         /**< Empty slots below m_used */
+    int                                         m_used;         /**< Slots handed out so far (live or free) */
+    int                                         m_size;         /**< Live parts */
+    std::vector<const unsigned char*>           m_sortedBlocks; /**< Block addresses in order, filled by clear() for owns() */
+};
+
+#endif
@@ -0,0 +1,107 @@
+/**     @file PartBVH.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Spatial index over the parts in a ModelPart tree.
+  *
+  *     P Evans 2022
+  */
+
+#include "PartBVH.h"
+#include "ModelPart.h"
+
+#include <vtkMatrix4x4.h>
+
+#include <algorithm>
+#include <limits>
+
+
+void PartBVH::build( ModelPart* root ) {
+    std::vector<SceneBVH::Item> items;
+    m_parts.clear();
+    m_placed.clear();
+    if (root)
+        collect(root, items);
+    m_scene.build(items);
+}
+
+
+void PartBVH::refit() {
+    /* World transforms are updated in place, so their modified times show which parts have moved */
+    bool moved = false;
+    for (size_t i = 0; i < m_parts.size(); i++) {
+        vtkMatrix4x4* m = m_parts[i]->worldTransform();
+        if (m->GetMTime() != m_placed[i]) {
+            m_scene.setTransform( int(i), m->GetData() );
+            m_placed[i] = m->GetMTime();
+            moved = true;
+        }
+    }
+    if (moved)
+        m_scene.refit();
+}
+
+
+void PartBVH::clear() {
+    m_parts.clear();
+    m_placed.clear();
+    m_scene.build( {} );
+}
+
+
+void PartBVH::collect( ModelPart* part, std::vector<SceneBVH::Item>& items ) {
+    /* A hidden assembly hides everything in it */
+    if (!part->visible())
+        return;
+
+    if (part->hasGeometry()) {
+        /* Picking always uses the full geometry, not a simplified level */
+        SceneBVH::Item item;
+        item.mesh = MeshBVH::attach( part->levelsOfDetail()[0] );
+        if (item.mesh) {
+            std::copy_n( part->worldTransform()->GetData(), 16, item.toWorld );
+            items.push_back(item);
+            m_parts.push_back(part);
+            m_placed.push_back( part->worldTransform()->GetMTime() );
+        }
+    }
+
+    for (int i = 0; i < part->childCount(); i++)
+        collect( part->child(i), items );
+}
+
+
+ModelPart* PartBVH::pick( const double origin[3], const double dir[3], double* distance, double point[3] ) const {
+    SceneBVH::Hit hit;
+    if (!m_scene.pick( origin, dir, std::numeric_limits<double>::max(), hit ))
+        return nullptr;
+
+    if (distance)
+        *distance = hit.t;
+    if (point)
+        std::copy_n(hit.point, 3, point);
+    return m_parts[hit.item];
+}
+
+
+QList<ModelPart*> PartBVH::partsInBox( const double box[6] ) const {
+    std::vector<int> items;
+    m_scene.query(box, items);
+
+    QList<ModelPart*> parts;
+    parts.reserve( int(items.size()) );
+    for (int i : items)
+        parts.append( m_parts[i] );
+    return parts;
+}
+
+
+ModelPart* PartBVH::nearestPart( const double p[3], double* distance ) const {
+    int item = m_scene.nearest( p, std::numeric_limits<double>::max(), distance );
+    return item < 0 ? nullptr : m_parts[item];
+}
+
+
+int PartBVH::size() const {
+    return int(m_parts.size());
+}
@@ -0,0 +1,87 @@
+/**     @file PartBVH.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Spatial index over the parts in a ModelPart tree.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_PARTBVH_H
+#define VIEWER_PARTBVH_H
+
+#include "BVH.h"
+
+#include <QList>
+
+#include <vector>
+
+class ModelPart;
+
+
+/** Finds parts by position - the part under a ray (mouse or controller), the
+  * parts inside a box (e.g. a selection box) or the part nearest a point -
+  * without testing every part, see BVH.h.
+  *
+  * Only parts that are visible and have geometry are included. The index is a
+  * snapshot: after parts are added, removed or hidden it needs building again,
+  * after parts have only moved refit() is enough (ModelPartList does this for
+  * you, see ModelPartList::pick()).
+  *
+  * GUI thread only, like the tree itself.
+  */
+class PartBVH {
+public:
+    /** Build the index for a tree. World transforms must be up to date (see
+      * ModelPartList::updateTransforms()). Meshes that don't have a triangle tree
+      * yet get one now, ModelPartLoader normally builds them while loading.
+      * @param root is the top of the tree
+      */
+    void build( ModelPart* root );
+
+    /** Update the index after parts have moved. Only the parts whose world
+      * transform has changed since the index was built (or last refitted) are
+      * placed again, and the tree's boxes are adjusted rather than rebuilt. World
+      * transforms must be up to date.
+      */
+    void refit();
+
+    /** Empty the index */
+    void clear();
+
+    /** Find the first part a ray hits
+      * @param origin is the start of the ray
+      * @param dir is the ray direction
+      * @param distance if not null receives the distance to the hit, in multiples of dir
+      * @param point if not null receives the position of the hit
+      * @return the part, nullptr if the ray misses everything
+      */
+    ModelPart* pick( const double origin[3], const double dir[3], double* distance = nullptr, double point[3] = nullptr ) const;
+
+    /** Find parts whose bounds overlap a box
+      * @param box is the box (xmin, xmax, ymin, ymax, zmin, zmax)
+      * @return the parts
+      */
+    QList<ModelPart*> partsInBox( const double box[6] ) const;
+
+    /** Find the part nearest to a point. Distance is measured to each part's
+      * bounding box, so it is 0 for a point inside the box.
+      * @param p is the point
+      * @param distance if not null receives the distance
+      * @return the part, nullptr if the index is empty
+      */
+    ModelPart* nearestPart( const double p[3], double* distance = nullptr ) const;
+
+    /** Number of parts in the index */
+    int size() const;
+
+private:
+    /** Add a part and its children to the item list (recursive) */
+    void collect( ModelPart* part, std::vector<SceneBVH::Item>& items );
+
+    SceneBVH                                    m_scene;
+    std::vector<ModelPart*>                     m_parts;        /**< Part for each scene item */
+    std::vector<vtkMTimeType>                   m_placed;       /**< Time of each part's world transform when it was placed */
+};
+
+#endif
@@ -0,0 +1,341 @@
+/**     @file ProjectFile.cpp
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Binary project file, memory mapped when it is opened.
+  *
+  *     P Evans 2022
+  */
+
+#include "ProjectFile.h"
+#include "ModelPart.h"
+
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QByteArray>
+#include <QHash>
+
+#include <vtkMatrix4x4.h>
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+
+/* Project file layout. Every table starts on an 8 byte boundary so the mapped
+ * records can be read in place.
+ *
+ *   ProjectHeader
+ *   Node    nodes[nodeCount]               (node 0 is the root)
+ *   double  transforms[16 * transformCount]
+ *   char    strings[stringsSize]           (each a quint32 length then UTF-8, padded to 4 bytes)
+ */
+struct ProjectHeader {
+    char    magic[8];
+    quint32 version;
+    quint32 byteOrder;          /* Written as 0x01020304, files from a machine with different endianness are rejected */
+    quint32 nodeCount;
+    quint32 transformCount;
+    quint64 nodesAt;
+    quint64 transformsAt;
+    quint64 stringsAt;
+    quint64 stringsSize;
+};
+static_assert( std::is_trivially_copyable<ProjectHeader>::value, "ProjectHeader is written directly to disk" );
+static_assert( sizeof(ProjectHeader) % 8 == 0, "Tables following the header must stay aligned" );
+static_assert( sizeof(ProjectFile::Node) == 32, "Node records are written directly to disk" );
+
+static const char    projectMagic[8]  = { 'E', 'E', 'P', 'R', 'O', 'J', 0, 0 };
+static const quint32 projectVersion   = 1;
+static const quint32 projectByteOrder = 0x01020304;
+
+
+/* Check a header is from this version, is self consistent and fits in a file of the given size */
+static bool headerIsSane( const ProjectHeader& h, quint64 fileSize ) {
+    if (std::memcmp(h.magic, projectMagic, sizeof(projectMagic)) != 0 || h.version != projectVersion || h.byteOrder != projectByteOrder)
+        return false;
+
+    /* There is always a root */
+    if (h.nodeCount == 0)
+        return false;
+
+    auto fits = [fileSize]( quint64 at, quint64 bytes ) {
+        return at % 8 == 0 && at >= sizeof(ProjectHeader) && at <= fileSize && bytes <= fileSize - at;
+    };
+
+    return fits( h.nodesAt, quint64(h.nodeCount) * sizeof(ProjectFile::Node) )
+        && fits( h.transformsAt, quint64(h.transformCount) * 16 * sizeof(double) )
+        && fits( h.stringsAt, h.stringsSize );
+}
+
+
+static bool isIdentity( const double* m ) {
+    for (int i = 0; i < 16; i++) {
+        if (m[i] != ((i % 5 == 0) ? 1. : 0.))
+            return false;
+    }
+    return true;
+}
+
+
+/* ------------------------------------------------------------------------------
+ * Writing
+ * ------------------------------------------------------------------------------ */
+namespace {
+    /* Strings are written once however many nodes use them (e.g. every part loaded
+     * from the same folder has the same name), nodes refer to them by offset
+     */
+    class StringTable {
+    public:
+        quint32 add( const QString& s ) {
+            auto it = m_offsets.constFind(s);
+            if (it != m_offsets.constEnd())
+                return *it;
+
+            QByteArray utf8 = s.toUtf8();
+            quint32 offset = quint32(m_data.size());
+            quint32 length = quint32(utf8.size());
+            m_data.append( reinterpret_cast<const char*>(&length), sizeof(length) );
+            m_data.append( utf8 );
+            m_data.append( QByteArray((4 - m_data.size() % 4) % 4, '\0') );
+
+            m_offsets.insert(s, offset);
+            return offset;
+        }
+
+        const QByteArray& data() const {
+            return m_data;
+        }
+
+    private:
+        QByteArray                  m_data;
+        QHash<QString, quint32>     m_offsets;
+    };
+
+    /* A node waiting to be written - either a part, or (if part is null) a node of
+     * the project the tree was opened from, for branches that haven't been created
+     */
+    struct PendingNode {
+        ModelPart*  part;
+        quint32     node;
+    };
+}
+
+
+bool ProjectFile::save( const QString& fileName, ModelPart* root, const ProjectFile* project ) {
+    if (!root)
+        return false;
+
+    QDir dir = QFileInfo(fileName).absoluteDir();
+    StringTable strings;
+    std::vector<Node> nodes;
+    std::vector<double> transforms;
+
+    auto addPath = [&]( const QString& path ) {
+        return path.isEmpty() ? none : strings.add( dir.relativeFilePath(path) );
+    };
+    auto addTransform = [&]( const double* m ) {
+        if (!m || isIdentity(m))
+            return none;
+        transforms.insert( transforms.end(), m, m + 16 );
+        return quint32(transforms.size() / 16 - 1);
+    };
+
+    /* Breadth first, so each node's children are added to the queue - and so
+     * numbered - one after another
+     */
+    std::vector<PendingNode> queue;
+    queue.push_back( { root, 0 } );
+
+    for (size_t i = 0; i < queue.size(); i++) {
+        const PendingNode pending = queue[i];
+        Node n = {};
+        n.firstChild = quint32(queue.size());
+
+        if (pending.part) {
+            ModelPart* part = pending.part;
+            n.name = strings.add( part->name() );
+            n.source = addPath( part->source() );
+            n.transform = addTransform( part->localTransform()->GetData() );
+            n.colour[0] = part->getColourR();
+            n.colour[1] = part->getColourG();
+            n.colour[2] = part->getColourB();
+            if (part->visible())
+                n.flags |= VISIBLE;
+            /* Parts that haven't asked for their geometry (e.g. hidden ones) are
+             * checked on disk, a listed folder has a source but no geometry
+             */
+            if (n.source != none && (part->hasGeometry() || part->geometryRequested()
+                    || (!part->childrenPending() && !QFileInfo(part->source()).isDir())))
+                n.flags |= GEOMETRY;
+
+            quint32 first, count;
+            if (!part->childrenPending()) {
+                for (int row = 0; row < part->childCount(); row++)
+                    queue.push_back( { part->child(row), 0 } );
+            }
+            else if (part->projectNode() != 0 && project) {
+                if (project->children(part->projectNode(), first, count)) {
+                    for (quint32 c = 0; c < count; c++)
+                        queue.push_back( { nullptr, first + c } );
+                }
+            }
+            else {
+                /* A folder that hasn't been listed yet, it is listed when the project is opened and it is expanded */
+                n.flags |= FOLDER;
+            }
+        }
+        else {
+            const Node* from = project->node(pending.node);
+            n.name = strings.add( project->string(from->name) );
+            n.source = (from->source == none) ? none : addPath( project->path(from->source) );
+            n.transform = addTransform( project->transform(from->transform) );
+            n.flags = from->flags;
+            std::copy_n( from->colour, 3, n.colour );
+
+            quint32 first, count;
+            if (project->children(pending.node, first, count)) {
+                for (quint32 c = 0; c < count; c++)
+                    queue.push_back( { nullptr, first + c } );
+            }
+        }
+
+        n.childCount = quint32(queue.size()) - n.firstChild;
+        if (n.childCount == 0)
+            n.firstChild = 0;
+        nodes.push_back(n);
+    }
+
+    ProjectHeader header = {};
+    std::memcpy( header.magic, projectMagic, sizeof(projectMagic) );
+    header.version = projectVersion;
+    header.byteOrder = projectByteOrder;
+    header.nodeCount = quint32(nodes.size());
+    header.transformCount = quint32(transforms.size() / 16);
+    header.nodesAt = sizeof(ProjectHeader);
+    header.transformsAt = header.nodesAt + nodes.size() * sizeof(Node);
+    header.stringsAt = header.transformsAt + transforms.size() * sizeof(double);
+    header.stringsSize = quint64(strings.data().size());
+
+    /* Written to a temporary file that replaces the old one only once it is complete */
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    file.write( reinterpret_cast<const char*>(&header), sizeof(header) );
+    file.write( reinterpret_cast<const char*>(nodes.data()), qint64(nodes.size() * sizeof(Node)) );
+    file.write( reinterpret_cast<const char*>(transforms.data()), qint64(transforms.size() * sizeof(double)) );
+    file.write( strings.data() );
+
+    /* Fails if any of the writes did */
+    return file.commit();
+}
+
+
+/* ------------------------------------------------------------------------------
+ * Reading
+ * ------------------------------------------------------------------------------ */
+
+ProjectFile::ProjectFile()
+    : m_data(nullptr), m_size(0), m_nodeCount(0), m_transformCount(0),
+      m_nodes(nullptr), m_transforms(nullptr), m_stringsAt(0), m_stringsSize(0) {
+}
+
+
+ProjectFile::~ProjectFile() {
+    if (m_data)
+        m_file.unmap( const_cast<uchar*>(m_data) );
+}
+
+
+std::unique_ptr<ProjectFile> ProjectFile::open( const QString& fileName ) {
+    std::unique_ptr<ProjectFile> project( new ProjectFile() );
+    project->m_file.setFileName(fileName);
+    if (!project->m_file.open(QIODevice::ReadOnly))
+        return nullptr;
+
+    qint64 size = project->m_file.size();
+    if (size < qint64(sizeof(ProjectHeader)))
+        return nullptr;
+
+    /* The file stays mapped for as long as the project is open, the operating
+     * system only reads the pages that are used
+     */
+    project->m_data = project->m_file.map(0, size);
+    if (!project->m_data)
+        return nullptr;
+    project->m_size = quint64(size);
+
+    ProjectHeader header;
+    std::memcpy( &header, project->m_data, sizeof(header) );
+    if (!headerIsSane(header, project->m_size))
+        return nullptr;
+
+    project->m_nodeCount = header.nodeCount;
+    project->m_transformCount = header.transformCount;
+    project->m_nodes = reinterpret_cast<const Node*>( project->m_data + header.nodesAt );
+    project->m_transforms = reinterpret_cast<const double*>( project->m_data + header.transformsAt );
+    project->m_stringsAt = header.stringsAt;
+    project->m_stringsSize = header.stringsSize;
+    project->m_dir = QFileInfo(fileName).absoluteDir();
+
+    return project;
+}
+
+
+quint32 ProjectFile::nodeCount() const {
+    return m_nodeCount;
+}
+
+
+const ProjectFile::Node* ProjectFile::node( quint32 i ) const {
+    return (i < m_nodeCount) ? m_nodes + i : nullptr;
+}
+
+
+bool ProjectFile::children( quint32 i, quint32& first, quint32& count ) const {
+    const Node* n = node(i);
+    if (!n || n->childCount == 0)
+        return false;
+
+    /* Only the header was checked when the file was opened, nodes are checked as they are used */
+    if (n->firstChild <= i || n->firstChild >= m_nodeCount || n->childCount > m_nodeCount - n->firstChild)
+        return false;
+
+    first = n->firstChild;
+    count = n->childCount;
+    return true;
+}
+
+
+const double* ProjectFile::transform( quint32 i ) const {
+    return (i < m_transformCount) ? m_transforms + 16 * quint64(i) : nullptr;
+}
+
+
+QString ProjectFile::string( quint32 offset ) const {
+    if (m_stringsSize < sizeof(quint32) || offset > m_stringsSize - sizeof(quint32))
+        return QString();
+
+    const uchar* at = m_data + m_stringsAt + offset;
+    quint32 length;
+    std::memcpy( &length, at, sizeof(length) );
+    if (length > m_stringsSize - offset - sizeof(quint32))
+        return QString();
+
+    return QString::fromUtf8( reinterpret_cast<const char*>(at + sizeof(quint32)), int(length) );
+}
+
+
+QString ProjectFile::path( quint32 offset ) const {
+    QString name = string(offset);
+    if (name.isEmpty())
+        return name;
+    return QDir::cleanPath( m_dir.absoluteFilePath(name) );
+}
+
+
+QString ProjectFile::fileName() const {
+    return m_file.fileName();
+}
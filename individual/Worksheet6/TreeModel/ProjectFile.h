@@ -0,0 +1,127 @@
+/**     @file ProjectFile.h
+  *
+  *     EEEE2076 - Software Engineering & VR Project
+  *
+  *     Binary project file, memory mapped when it is opened.
+  *
+  *     P Evans 2022
+  */
+
+#ifndef VIEWER_PROJECTFILE_H
+#define VIEWER_PROJECTFILE_H
+
+#include <QString>
+#include <QFile>
+#include <QDir>
+
+#include <memory>
+
+class ModelPart;
+
+
+/** Saves a whole ModelPartList tree - the hierarchy, each part's name,
+  * visibility, colour and transform, and the STL file its geometry comes
+  * from - in a single file.
+  *
+  * The file is laid out to be used straight from a memory mapping: a header,
+  * then a table of fixed size node records, a table of transforms and a table
+  * of strings. Nodes refer to each other, and to transforms and strings, by
+  * position rather than by pointer. Node 0 is the root of the tree, and each
+  * node's children are stored next to each other (the tree is written breadth
+  * first), so a node only needs the position of its first child and a count.
+  *
+  * Opening a project maps the file and checks the header, nothing else is read.
+  * ModelPartList creates parts from the nodes as the tree is expanded, so only
+  * the pages of the file holding nodes that are actually looked at are read from
+  * disk. Geometry is found from each part's STL file name as it is for any other
+  * part (see GeometryStore and GeometryCache), so it is only loaded once its
+  * part has been created. If its STL file has a cache and hasn't changed size
+  * or time since, that is only a read of the cache header and a mapping of the
+  * cache. Otherwise the STL is hashed, and read too if there is no cache that
+  * matches the hash.
+  *
+  * File names are stored relative to the project file where possible, so a
+  * project can be moved together with its parts.
+  */
+class ProjectFile {
+public:
+    /** A part in the file */
+    struct Node {
+        quint32 name;           /**< Part name, offset into the string table */
+        quint32 source;         /**< STL file or folder the part comes from, offset into the string table, or none */
+        quint32 firstChild;     /**< Node number of the first child */
+        quint32 childCount;     /**< Number of children, stored one after another from firstChild */
+        quint32 transform;      /**< Transform relative to the parent, index into the transform table, or none if identity */
+        quint8  flags;          /**< NodeFlag bits */
+        quint8  colour[3];      /**< RGB */
+        quint32 reserved[2];    /**< Written as zero */
+    };
+
+    /** Bits in Node::flags */
+    enum NodeFlag : quint8 {
+        VISIBLE     = 1 << 0,   /**< Shown in renderings */
+        GEOMETRY    = 1 << 1,   /**< Geometry is loaded from source (an STL file) */
+        FOLDER      = 1 << 2    /**< Children haven't been listed, they are read from the source folder when needed */
+    };
+
+    /** Value of a string or transform reference that isn't set */
+    static constexpr quint32 none = 0xFFFFFFFF;
+
+    /** Map a project file
+      * @param fileName is the file to open
+      * @return the project, or nullptr if the file can't be opened or isn't a project file
+      */
+    static std::unique_ptr<ProjectFile> open( const QString& fileName );
+
+    /** Write a tree to a project file. The file is written in full and then
+      * replaces any existing file, so a failed save leaves the old one intact.
+      * @param fileName is the file to write
+      * @param root is the tree root
+      * @param project is the project the tree was opened from, if any. Parts
+      *        whose children haven't been created yet have them copied from it.
+      * @return true if the file was written
+      */
+    static bool save( const QString& fileName, ModelPart* root, const ProjectFile* project = nullptr );
+
+    ~ProjectFile();
+
+    /** Get the number of nodes (including the root, node 0) */
+    quint32 nodeCount() const;
+
+    /** Get a node, nullptr if there is no such node */
+    const Node* node( quint32 i ) const;
+
+    /** Get the children of a node. Checks the range is in the file and that the
+      * children are stored after their parent (so a damaged file can't make a loop).
+      * @return false if the node has no children or the range is invalid
+      */
+    bool children( quint32 i, quint32& first, quint32& count ) const;
+
+    /** Get a transform (16 values, row major as vtkMatrix4x4), nullptr if there is no such transform */
+    const double* transform( quint32 i ) const;
+
+    /** Get a string from the string table, empty if the offset is invalid */
+    QString string( quint32 offset ) const;
+
+    /** Get a file name from the string table, made absolute */
+    QString path( quint32 offset ) const;
+
+    /** Get the name of the project file */
+    QString fileName() const;
+
+private:
+    ProjectFile();
+
+    QFile                                       m_file;             /**< Kept open while mapped */
+    const uchar*                                m_data;             /**< Mapping of the whole file */
+    quint64                                     m_size;             /**< File size */
+    QDir                                        m_dir;              /**< Folder holding the file, relative names are resolved against it */
+    quint32                                     m_nodeCount;
+    quint32                                     m_transformCount;
+    const Node*                                 m_nodes;            /**< Node table, in the mapping */
+    const double*                               m_transforms;       /**< Transform table, in the mapping */
+    quint64                                     m_stringsAt;        /**< Offset of the string table */
+    quint64                                     m_stringsSize;      /**< Size of the string table in bytes */
+};
+
+#endif